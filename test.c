@@ -1,6 +1,1446 @@
 #define VDB_MULTITHREADED
-#include "vdb.h"
+/* small enough for test_server_backpressure to reach */
+#define VDB_SERVER_MAX_BACKLOG 16384
+#define VDB_SERVER_NO_MAIN
+#include "vdb_server.c"
+#include "vdb_coord.h"
+#include "vdb_ingest.h"
+#include "vdb_shm.h"
 #include <stdio.h>
+#include <sys/wait.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+/* Every distance overflows to infinity; every slot must still be filled. */
+static void test_nndescent_infinite(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 50; i++) {
+    float v = (float)i * 2e19f;
+    vdb_add_vector(db, &v, NULL, NULL);
+  }
+
+  vdb_graph* graph = vdb_knn_graph_nndescent(db, 5, 10);
+  CHECK(graph != NULL);
+  if (graph) {
+    for (size_t i = 0; i < graph->count * graph->k; i++)
+      CHECK(graph->neighbors[i].index < 50);
+  }
+
+  vdb_free_graph(graph);
+  vdb_destroy(db);
+}
+
+/* The exact graph lists the same neighbors as vdb_search minus the row
+ * itself, and NN-descent finds most of them. */
+static void test_knn_graph(void) {
+  const size_t n = 200, k = 8;
+  vdb_metric metrics[2] = {VDB_METRIC_EUCLIDEAN, VDB_METRIC_COSINE};
+  uint64_t seed = 19;
+
+  for (size_t m = 0; m < 2; m++) {
+    vdb_database* db = vdb_create(6, metrics[m]);
+    for (size_t i = 0; i < n; i++) {
+      float v[6];
+      for (size_t d = 0; d < 6; d++)
+        v[d] = (float)(vdb_random(&seed) % 1000) / 500.0f - 1.0f;
+      vdb_add_vector(db, v, NULL, NULL);
+    }
+
+    vdb_graph* exact = vdb_knn_graph(db, k);
+    vdb_graph* approx = vdb_knn_graph_nndescent(db, k, 20);
+    CHECK(exact && exact->count == n && exact->k == k);
+    CHECK(approx && approx->count == n && approx->k == k);
+    size_t found = 0;
+    for (size_t i = 0; exact && approx && i < n; i++) {
+      vdb_result_set* expected = vdb_search(db, db->vectors[i].data, k + 1);
+      const vdb_result* row = exact->neighbors + i * k;
+      size_t j = 0;
+      for (size_t r = 0; expected && r < expected->count && j < k; r++) {
+        if (expected->results[r].index == i)
+          continue;
+        CHECK(row[j].index == expected->results[r].index);
+        CHECK(fabsf(row[j].distance - expected->results[r].distance) <
+              1e-5f);
+        j++;
+      }
+      CHECK(j == k);
+      vdb_free_result_set(expected);
+
+      for (size_t a = 0; a < k; a++) {
+        for (size_t e = 0; e < k; e++)
+          found += approx->neighbors[i * k + a].index == row[e].index;
+      }
+    }
+    CHECK(found >= n * k * 9 / 10);
+    vdb_free_graph(exact);
+    vdb_free_graph(approx);
+    vdb_destroy(db);
+  }
+}
+
+static int join_collect(size_t index, const vdb_result* results,
+                        size_t count, void* user) {
+  const vdb_database* b = (const vdb_database*)user;
+  float query[4];
+  for (int d = 0; d < 4; d++)
+    query[d] = (float)index + (float)d;
+  vdb_result_set* expected = vdb_search(b, query, count);
+  CHECK(expected && expected->count == count);
+  for (size_t i = 0; expected && i < count; i++)
+    CHECK(results[i].distance == expected->results[i].distance);
+  vdb_free_result_set(expected);
+  return 0;
+}
+
+/* Joins must agree with vdb_search and refuse mismatched metrics. */
+static void test_join(void) {
+  vdb_database* a = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  vdb_database* b = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  vdb_database* c = vdb_create(4, VDB_METRIC_COSINE);
+  for (int i = 0; i < 40; i++) {
+    float v[4];
+    for (int d = 0; d < 4; d++)
+      v[d] = (float)i + (float)d;
+    vdb_add_vector(a, v, NULL, NULL);
+    v[0] += 0.5f;
+    vdb_add_vector(b, v, NULL, NULL);
+    vdb_add_vector(c, v, NULL, NULL);
+  }
+
+  CHECK(vdb_join(a, b, 3, join_collect, b) == VDB_OK);
+  CHECK(vdb_join(a, c, 3, join_collect, c) == VDB_ERROR_INVALID_DIMENSIONS);
+
+  vdb_destroy(a);
+  vdb_destroy(b);
+  vdb_destroy(c);
+}
+
+/* A snapshot that cannot be applied must fail without hanging and leave
+ * the stream positioned at the next frame. */
+static void test_repl_snapshot_errors(void) {
+  vdb_database* leader = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  vdb_cdc_enable(leader, 16, VDB_CDC_OVERWRITE);
+  float v[4] = {1, 2, 3, 4};
+  vdb_add_vector(leader, v, "a", NULL);
+  vdb_add_vector(leader, v, "b", NULL);
+
+  FILE* stream = tmpfile();
+  uint64_t position;
+  CHECK(vdb_repl_snapshot(leader, stream, &position) == VDB_OK);
+  CHECK(vdb_repl_ship(leader, stream, &position, 16) == VDB_OK);
+
+  /* The follower's own change ring is full and unacknowledged. */
+  vdb_database* busy = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  vdb_cdc_enable(busy, 2, VDB_CDC_REJECT);
+  vdb_add_vector(busy, v, "x", NULL);
+  vdb_add_vector(busy, v, "y", NULL);
+  vdb_replica replica;
+  memset(&replica, 0, sizeof(replica));
+  rewind(stream);
+  CHECK(vdb_repl_apply(busy, stream, &replica) == VDB_ERROR_BUSY);
+  CHECK(vdb_count(busy) == 2);
+  CHECK(vdb_repl_apply(busy, stream, &replica) == VDB_OK); /* heartbeat */
+
+  vdb_database* narrow = vdb_create(3, VDB_METRIC_EUCLIDEAN);
+  memset(&replica, 0, sizeof(replica));
+  rewind(stream);
+  CHECK(vdb_repl_apply(narrow, stream, &replica) ==
+        VDB_ERROR_INVALID_DIMENSIONS);
+  CHECK(vdb_repl_apply(narrow, stream, &replica) == VDB_OK);
+
+  fclose(stream);
+  vdb_destroy(leader);
+  vdb_destroy(busy);
+  vdb_destroy(narrow);
+}
+
+/* Ships the leader's pending changes and applies every frame. */
+static void replicate(vdb_database* leader, vdb_database* follower,
+                      vdb_replica* replica, uint64_t* position) {
+  FILE* stream = tmpfile();
+  CHECK(vdb_repl_ship(leader, stream, position, 1000) == VDB_OK);
+  rewind(stream);
+  vdb_error err;
+  while ((err = vdb_repl_apply(follower, stream, replica)) == VDB_OK)
+    ;
+  CHECK(err == VDB_ERROR_IO && feof(stream));
+  fclose(stream);
+}
+
+static int same_rows(const vdb_database* a, const vdb_database* b) {
+  if (a->count != b->count)
+    return 0;
+  for (size_t i = 0; i < a->count; i++) {
+    const char* x = a->vectors[i].id;
+    const char* y = b->vectors[i].id;
+    if (memcmp(a->vectors[i].data, b->vectors[i].data,
+               a->dimensions * sizeof(float)) != 0)
+      return 0;
+    if ((x || y) && (!x || !y || strcmp(x, y) != 0))
+      return 0;
+  }
+  float q[4] = {0.5f, -1, 2, 0};
+  vdb_result_set* ra = vdb_search(a, q, 5);
+  vdb_result_set* rb = vdb_search(b, q, 5);
+  int same = ra && rb && ra->count == rb->count;
+  for (size_t i = 0; same && i < ra->count; i++)
+    same = ra->results[i].index == rb->results[i].index &&
+           ra->results[i].distance == rb->results[i].distance;
+  vdb_free_result_set(ra);
+  vdb_free_result_set(rb);
+  return same;
+}
+
+/* A follower replays snapshots, adds, removes and updates in order. */
+static void test_repl_round_trip(void) {
+  uint64_t seed = 3;
+  float v[4];
+  char id[16];
+  vdb_database* leader = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  vdb_database* follower = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  vdb_cdc_enable(leader, 8, VDB_CDC_OVERWRITE);
+  for (int i = 0; i < 20; i++) {
+    for (int d = 0; d < 4; d++)
+      v[d] = (float)(vdb_random(&seed) % 100);
+    snprintf(id, sizeof(id), "r%d", i);
+    vdb_add_vector(leader, v, i % 5 ? id : NULL, NULL);
+  }
+
+  vdb_replica replica;
+  memset(&replica, 0, sizeof(replica));
+  uint64_t position;
+  FILE* stream = tmpfile();
+  CHECK(vdb_repl_snapshot(leader, stream, &position) == VDB_OK);
+  rewind(stream);
+  CHECK(vdb_repl_apply(follower, stream, &replica) == VDB_OK);
+  fclose(stream);
+  CHECK(same_rows(leader, follower));
+  CHECK(vdb_add_vector(follower, v, NULL, NULL) == VDB_ERROR_READ_ONLY);
+
+  vdb_add_vector(leader, v, "new", NULL);
+  vdb_remove_vector(leader, 3);
+  v[0] = -7;
+  vdb_update_vector(leader, 5, v);
+  vdb_remove_vector(leader, 0);
+  replicate(leader, follower, &replica, &position);
+  CHECK(same_rows(leader, follower));
+  CHECK(vdb_repl_lag(&replica) == 0 && replica.applied == position);
+
+  /* more changes than the ring holds: the leader sends a snapshot */
+  for (int i = 0; i < 12; i++) {
+    v[1] = (float)i;
+    vdb_add_vector(leader, v, NULL, NULL);
+  }
+  vdb_remove_vector(leader, 1);
+  replicate(leader, follower, &replica, &position);
+  CHECK(same_rows(leader, follower));
+  CHECK(vdb_repl_lag(&replica) == 0 && replica.applied == position);
+
+  vdb_destroy(leader);
+  vdb_destroy(follower);
+}
+
+/* A merged duplicate reports the row it merged into. */
+static void test_add_index(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  float a[2] = {1.0f, 0.0f}, b[2] = {0.0f, 1.0f};
+  size_t index = SIZE_MAX;
+  vdb_set_dedup(db, VDB_DEDUP_MERGE, 0.01f);
+  CHECK(vdb_add_vector_ex(db, a, "a", NULL, &index) == VDB_OK && index == 0);
+  CHECK(vdb_add_vector_ex(db, b, "b", NULL, &index) == VDB_OK && index == 1);
+  CHECK(vdb_add_vector_ex(db, a, "c", NULL, &index) == VDB_OK && index == 0);
+  CHECK(vdb_count(db) == 2);
+  vdb_destroy(db);
+}
+
+#ifdef VDB_MULTITHREADED
+typedef struct {
+  vdb_database* db;
+  float query;
+  vdb_priority priority;
+  vdb_result_set* results;
+  int incomplete;
+} sched_search;
+
+static void* run_sched_search(void* arg) {
+  sched_search* search = (sched_search*)arg;
+  vdb_search_options options = {0, NULL, search->priority};
+  search->results =
+      vdb_search_ex(search->db, &search->query, 5, &options,
+                    &search->incomplete);
+  return NULL;
+}
+
+static void* run_knn_graph(void* arg) {
+  return vdb_knn_graph((vdb_database*)arg, 3);
+}
+
+static int join_ignore(size_t index, const vdb_result* results, size_t count,
+                       void* user) {
+  (void)index;
+  (void)results;
+  (void)count;
+  (void)user;
+  return 0;
+}
+
+/* Waits until a scheduler counter reaches value. */
+static void wait_sched(vdb_database* db, const size_t* counter,
+                       size_t value) {
+  struct timespec pause = {0, 1000000};
+  for (;;) {
+    pthread_mutex_lock(&db->scheduler.mutex);
+    size_t now = *counter;
+    pthread_mutex_unlock(&db->scheduler.mutex);
+    if (now == value)
+      return;
+    nanosleep(&pause, NULL);
+  }
+}
+
+static int same_results(const vdb_database* db, float query,
+                        const vdb_result_set* results) {
+  vdb_result_set* expected = vdb_search(db, &query, 5);
+  int same = expected && results && results->count == expected->count;
+  for (size_t i = 0; same && i < results->count; i++)
+    same = results->results[i].index == expected->results[i].index;
+  vdb_free_result_set(expected);
+  return same;
+}
+
+/* A queued search gives up at its deadline, measured on the same clock,
+ * while another interactive search holds the only slot. */
+static void test_admission_deadline(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 10; i++) {
+    float v = (float)i;
+    vdb_add_vector(db, &v, NULL, NULL);
+  }
+  vdb_set_concurrency(db, 1, 0);
+
+  /* a writer keeps the admitted search from finishing */
+  sched_search held = {db, 3.2f, VDB_PRIORITY_INTERACTIVE, NULL, 0};
+  pthread_t thread;
+  pthread_rwlock_wrlock(&db->lock);
+  pthread_create(&thread, NULL, run_sched_search, &held);
+  wait_sched(db, &db->scheduler.running[VDB_PRIORITY_INTERACTIVE], 1);
+
+  vdb_search_options options = {30, NULL, VDB_PRIORITY_INTERACTIVE};
+  float query = 0.0f;
+  int incomplete = 0;
+  uint64_t start = vdb_now_ms();
+  CHECK(vdb_search_ex(db, &query, 5, &options, &incomplete) == NULL);
+  CHECK(incomplete == 1 && vdb_now_ms() - start >= 29);
+  pthread_rwlock_unlock(&db->lock);
+  pthread_join(thread, NULL);
+
+  CHECK(!held.incomplete && same_results(db, held.query, held.results));
+  vdb_stats stats;
+  CHECK(vdb_get_stats(db, &stats) == VDB_OK);
+  CHECK(stats.admitted[VDB_PRIORITY_INTERACTIVE] == 1);
+  CHECK(stats.timed_out[VDB_PRIORITY_INTERACTIVE] == 1);
+  CHECK(stats.max_queue_us[VDB_PRIORITY_INTERACTIVE] >= 29000);
+  CHECK(stats.running[VDB_PRIORITY_INTERACTIVE] == 0);
+  vdb_free_result_set(held.results);
+  vdb_destroy(db);
+}
+
+/* A running batch search hands its slot to a queued interactive one at the
+ * next check point, then finishes with the same results. */
+static void test_admission_yield(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 4 * VDB_CHECK_INTERVAL; i++) {
+    float v = (float)i;
+    vdb_add_vector(db, &v, NULL, NULL);
+  }
+  vdb_set_concurrency(db, 1, 0);
+
+  sched_search batch = {db, 3000.3f, VDB_PRIORITY_BATCH, NULL, 0};
+  sched_search interactive = {db, 7.2f, VDB_PRIORITY_INTERACTIVE, NULL, 0};
+  pthread_t threads[2];
+  pthread_rwlock_wrlock(&db->lock);
+  pthread_create(&threads[0], NULL, run_sched_search, &batch);
+  wait_sched(db, &db->scheduler.running[VDB_PRIORITY_BATCH], 1);
+  pthread_create(&threads[1], NULL, run_sched_search, &interactive);
+  wait_sched(db, &db->scheduler.waiting[VDB_PRIORITY_INTERACTIVE], 1);
+  pthread_rwlock_unlock(&db->lock);
+  pthread_join(threads[0], NULL);
+  pthread_join(threads[1], NULL);
+
+  CHECK(!batch.incomplete && same_results(db, batch.query, batch.results));
+  CHECK(!interactive.incomplete &&
+        same_results(db, interactive.query, interactive.results));
+  vdb_stats stats;
+  CHECK(vdb_get_stats(db, &stats) == VDB_OK);
+  CHECK(stats.yields >= 1);
+  CHECK(stats.admitted[VDB_PRIORITY_BATCH] == 1 + stats.yields);
+  CHECK(stats.admitted[VDB_PRIORITY_INTERACTIVE] == 1);
+  CHECK(stats.running[VDB_PRIORITY_BATCH] == 0);
+  CHECK(stats.waiting[VDB_PRIORITY_INTERACTIVE] == 0);
+  vdb_free_result_set(batch.results);
+  vdb_free_result_set(interactive.results);
+  vdb_destroy(db);
+}
+
+/* Bulk operations hold a batch slot for their whole run. */
+static void test_admission_bulk(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  vdb_database* other = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 50; i++) {
+    float v[2] = {(float)i, (float)(i % 7)};
+    vdb_add_vector(db, v, NULL, NULL);
+    vdb_add_vector(other, v, NULL, NULL);
+  }
+  vdb_set_concurrency(db, 1, 0);
+
+  pthread_t thread;
+  void* graph = NULL;
+  pthread_rwlock_wrlock(&db->lock);
+  pthread_create(&thread, NULL, run_knn_graph, db);
+  wait_sched(db, &db->scheduler.running[VDB_PRIORITY_BATCH], 1);
+  vdb_search_options options = {20, NULL, VDB_PRIORITY_INTERACTIVE};
+  float query[2] = {0.0f, 0.0f};
+  int incomplete = 0;
+  CHECK(vdb_search_ex(db, query, 5, &options, &incomplete) == NULL);
+  CHECK(incomplete == 1);
+  pthread_rwlock_unlock(&db->lock);
+  pthread_join(thread, &graph);
+  CHECK(graph != NULL);
+  vdb_free_graph((vdb_graph*)graph);
+
+  vdb_free_result_set(vdb_search_batch(db, query, 1, 3));
+  vdb_free_kmeans_result(vdb_kmeans(db, 2, 5));
+  CHECK(vdb_join(db, other, 2, join_ignore, NULL) == VDB_OK);
+  vdb_stats stats;
+  CHECK(vdb_get_stats(db, &stats) == VDB_OK);
+  CHECK(stats.admitted[VDB_PRIORITY_BATCH] == 4);
+  CHECK(stats.timed_out[VDB_PRIORITY_INTERACTIVE] == 1);
+  CHECK(stats.running[VDB_PRIORITY_BATCH] == 0);
+  CHECK(vdb_get_stats(other, &stats) == VDB_OK);
+  CHECK(stats.admitted[VDB_PRIORITY_BATCH] == 1);
+  vdb_destroy(db);
+  vdb_destroy(other);
+}
+#endif
+
+static void count_match(uint64_t watch, size_t index, float distance,
+                        void* user) {
+  (void)index;
+  (void)distance;
+  ((size_t*)user)[watch - 1]++;
+}
+
+/* Pivot pruning on cosine watches must not drop any match. */
+static void test_watch_cosine(void) {
+  enum { DIMS = 8, WATCHES = 24, ROWS = 400 };
+  vdb_database* db = vdb_create(DIMS, VDB_METRIC_COSINE);
+  float queries[WATCHES][DIMS], rows[ROWS][DIMS];
+  size_t matched[WATCHES] = {0}, expected[WATCHES] = {0};
+  uint64_t state = 7;
+
+  for (size_t i = 0; i < WATCHES; i++) {
+    for (size_t d = 0; d < DIMS; d++)
+      queries[i][d] = (float)(vdb_random(&state) % 1000) / 500.0f - 1.0f;
+    vdb_watch(db, queries[i], 0.05f + 0.02f * (float)i, count_match, matched,
+              NULL);
+  }
+  for (size_t r = 0; r < ROWS; r++) {
+    for (size_t d = 0; d < DIMS; d++)
+      rows[r][d] = (float)(vdb_random(&state) % 1000) / 500.0f - 1.0f;
+    CHECK(vdb_add_vector(db, rows[r], NULL, NULL) == VDB_OK);
+    for (size_t i = 0; i < WATCHES; i++) {
+      float distance = vdb_compute_distance(queries[i], rows[r], DIMS,
+                                            VDB_METRIC_COSINE);
+      if (distance <= 0.05f + 0.02f * (float)i)
+        expected[i]++;
+    }
+  }
+  for (size_t i = 0; i < WATCHES; i++)
+    CHECK(matched[i] == expected[i]);
+  vdb_destroy(db);
+}
+
+/* MaxSim search matches the sum of per-token minimum distances. */
+static void test_doc_search(void) {
+  vdb_doc_database* db = vdb_doc_create(2, VDB_METRIC_EUCLIDEAN);
+  float near[4] = {0.0f, 0.0f, 5.0f, 5.0f};
+  float far[6] = {3.0f, 4.0f, 6.0f, 8.0f, 9.0f, 12.0f};
+  float query[4] = {0.0f, 0.0f, 5.0f, 5.0f};
+  CHECK(vdb_doc_add(db, far, 3, "far", NULL) == VDB_OK);
+  CHECK(vdb_doc_add(db, near, 2, "near", NULL) == VDB_OK);
+
+  vdb_result_set* results = vdb_doc_search(db, query, 2, 2);
+  CHECK(results && results->count == 2);
+  if (results && results->count == 2) {
+    CHECK(results->results[0].index == 1 &&
+          results->results[0].distance == 0.0f);
+    /* (0, 0) and (5, 5) are both closest to (3, 4) */
+    float expected = 5.0f + sqrtf(5.0f);
+    CHECK(results->results[1].index == 0 &&
+          fabsf(results->results[1].distance - expected) < 1e-4f);
+  }
+  vdb_free_result_set(results);
+  vdb_doc_destroy(db);
+}
+
+/* With every token as a candidate, reranking is exact MaxSim search. */
+static void test_doc_search_rerank(void) {
+  vdb_doc_database* db = vdb_doc_create(4, VDB_METRIC_COSINE);
+  uint64_t seed = 11;
+  float tokens[8 * 4], query[3 * 4];
+  for (size_t doc = 0; doc < 60; doc++) {
+    size_t count = 1 + doc % 8;
+    for (size_t i = 0; i < count * 4; i++)
+      tokens[i] = (float)(vdb_random(&seed) % 1000) / 500.0f - 1.0f;
+    vdb_doc_add(db, tokens, count, NULL, NULL);
+  }
+  for (size_t i = 0; i < 3 * 4; i++)
+    query[i] = (float)(vdb_random(&seed) % 1000) / 500.0f - 1.0f;
+
+  vdb_result_set* exact = vdb_doc_search(db, query, 3, 10);
+  vdb_result_set* all = vdb_doc_search_rerank(db, query, 3, 10, 1000);
+  vdb_result_set* few = vdb_doc_search_rerank(db, query, 3, 10, 2);
+  CHECK(exact && all && few && exact->count == 10 && all->count == 10);
+  if (exact && all && few) {
+    for (size_t i = 0; i < 10; i++)
+      CHECK(all->results[i].index == exact->results[i].index);
+    /* the nearest token of each query token is a candidate */
+    CHECK(few->count >= 1 && few->count <= 6);
+    CHECK(few->results[0].distance >= exact->results[0].distance);
+  }
+  vdb_free_result_set(exact);
+  vdb_free_result_set(all);
+  vdb_free_result_set(few);
+  vdb_doc_destroy(db);
+}
+
+static uint64_t parity_key(size_t index, const char* id, void* metadata,
+                           void* user) {
+  (void)id;
+  (void)metadata;
+  (void)user;
+  return index % 2;
+}
+
+/* Oversized group limits are clamped instead of overflowing the buffer. */
+static void test_grouped_limits(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 5; i++) {
+    float v = (float)i;
+    vdb_add_vector(db, &v, NULL, NULL);
+  }
+  float query = 0.0f;
+  vdb_group_result_set* results =
+      vdb_search_grouped(db, &query, parity_key, NULL, SIZE_MAX, SIZE_MAX);
+  CHECK(results && results->count == 2);
+  if (results && results->count == 2) {
+    CHECK(results->groups[0].key == 0 && results->groups[0].count == 3);
+    CHECK(results->groups[1].key == 1 && results->groups[1].count == 2);
+  }
+  vdb_free_group_result_set(results);
+  vdb_destroy(db);
+}
+
+/* Opening a segment that is not yet sized fails instead of faulting. */
+static void test_shm_short_segment(void) {
+  const char* name = "/vdb_test_short";
+  vdb_shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  int data_fd = shm_open("/vdb_test_short.data", O_RDWR | O_CREAT, 0600);
+  CHECK(fd >= 0 && data_fd >= 0);
+  CHECK(vdb_shm_open(name) == NULL);
+  close(fd);
+  close(data_fd);
+  vdb_shm_unlink(name);
+
+  vdb_shm* shm = vdb_shm_create(name, 2, VDB_METRIC_EUCLIDEAN);
+  vdb_shm* other = vdb_shm_open(name);
+  float v[2] = {1.0f, 2.0f};
+  CHECK(shm && other);
+  if (shm && other) {
+    CHECK(vdb_shm_add(shm, v, "v", NULL) == VDB_OK);
+    CHECK(vdb_shm_count(other) == 1);
+  }
+  vdb_shm_close(other);
+  vdb_shm_close(shm);
+  vdb_shm_unlink(name);
+}
+
+/* Mutations the change log cannot carry are refused while it records. */
+static void test_cdc_unsupported(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  float v[2] = {1.0f, 2.0f};
+  uint32_t index = 3;
+  float value = 0.5f;
+
+  CHECK(vdb_cdc_enable(db, 8, VDB_CDC_OVERWRITE) == VDB_OK);
+  CHECK(vdb_add_field(db, "title", 2, VDB_METRIC_COSINE) ==
+        VDB_ERROR_UNSUPPORTED);
+  CHECK(vdb_add_vector_sparse(db, v, &index, &value, 1, NULL, NULL) ==
+        VDB_ERROR_UNSUPPORTED);
+  CHECK(vdb_count(db) == 0 && vdb_cdc_position(db) == 0);
+  CHECK(vdb_add_vector_sparse(db, v, NULL, NULL, 0, NULL, NULL) == VDB_OK);
+  CHECK(vdb_cdc_position(db) == 1);
+
+  CHECK(vdb_cdc_enable(db, 0, VDB_CDC_OVERWRITE) == VDB_OK);
+  CHECK(vdb_add_field(db, "title", 2, VDB_METRIC_COSINE) == VDB_OK);
+  CHECK(vdb_cdc_enable(db, 8, VDB_CDC_OVERWRITE) == VDB_ERROR_UNSUPPORTED);
+  vdb_destroy(db);
+}
+
+/* A file with bytes after its last row is refused, not copied. */
+static void test_merge_trailing_bytes(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  float v[2] = {1.0f, 2.0f};
+  vdb_add_vector(db, v, "a", NULL);
+  vdb_add_vector(db, v, "b", NULL);
+  vdb_save(db, "merge_a.vdb");
+  vdb_save(db, "merge_b.vdb");
+  vdb_destroy(db);
+
+  const char* inputs[2] = {"merge_a.vdb", "merge_b.vdb"};
+  size_t rows = 0;
+  CHECK(vdb_merge_files("merge_out.vdb", inputs, 2, VDB_MERGE_KEEP_ALL, &rows,
+                        NULL) == VDB_OK &&
+        rows == 4);
+
+  FILE* f = fopen("merge_b.vdb", "ab");
+  fputc('x', f);
+  fclose(f);
+  CHECK(vdb_merge_files("merge_out.vdb", inputs, 2, VDB_MERGE_KEEP_ALL, &rows,
+                        NULL) == VDB_ERROR_IO);
+  remove("merge_a.vdb");
+  remove("merge_b.vdb");
+  remove("merge_out.vdb");
+}
+
+/* Merging into one of the inputs works, and a failed merge leaves the
+ * output as it was. */
+static void test_merge_in_place(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  vdb_database* wide = vdb_create(3, VDB_METRIC_EUCLIDEAN);
+  float v[3] = {1.0f, 2.0f, 3.0f};
+  vdb_add_vector(db, v, "a", NULL);
+  vdb_add_vector(db, v, "b", NULL);
+  vdb_add_vector(wide, v, "c", NULL);
+  vdb_save(db, "merge_a.vdb");
+  vdb_save(wide, "merge_wide.vdb");
+  vdb_destroy(db);
+  vdb_destroy(wide);
+
+  const char* inputs[2] = {"merge_a.vdb", "merge_a.vdb"};
+  size_t rows = 0, dropped = 0;
+  CHECK(vdb_merge_files("merge_a.vdb", inputs, 2, VDB_MERGE_KEEP_ALL, &rows,
+                        NULL) == VDB_OK &&
+        rows == 4);
+  CHECK(vdb_merge_files("merge_a.vdb", inputs, 2, VDB_MERGE_KEEP_LAST, &rows,
+                        &dropped) == VDB_OK &&
+        rows == 2 && dropped == 6);
+
+  inputs[1] = "merge_wide.vdb";
+  CHECK(vdb_merge_files("merge_a.vdb", inputs, 2, VDB_MERGE_KEEP_ALL, &rows,
+                        NULL) == VDB_ERROR_INVALID_DIMENSIONS);
+  db = vdb_load("merge_a.vdb");
+  CHECK(db && vdb_count(db) == 2);
+  vdb_destroy(db);
+  FILE* f = fopen("merge_a.vdb.tmp", "rb");
+  CHECK(f == NULL);
+  if (f)
+    fclose(f);
+  remove("merge_a.vdb");
+  remove("merge_wide.vdb");
+}
+
+/* Cosine k-means++ seeding ignores magnitude: after one seed on an axis,
+ * every row on that axis has weight 0, so the second seed is on the other
+ * one whatever the magnitudes. */
+static void test_kmeans_cosine_seed(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_COSINE);
+  for (int i = 0; i < 20; i++) {
+    float v[2] = {(float)(1 << (i % 10)), 0.0f};
+    vdb_add_vector(db, v, NULL, NULL);
+  }
+  float w[2] = {0.0f, 1.0f};
+  vdb_add_vector(db, w, NULL, NULL);
+
+  for (uint64_t seed = 1; seed <= 8; seed++) {
+    vdb_kmeans_result* result =
+        vdb_kmeans_ex(db, 2, 0, VDB_KMEANS_PLUSPLUS, 0, seed);
+    CHECK(result != NULL);
+    if (!result)
+      continue;
+    const float* c = result->centroids;
+    CHECK((c[0] > 0.99f && c[3] > 0.99f) || (c[1] > 0.99f && c[2] > 0.99f));
+    vdb_free_kmeans_result(result);
+  }
+  vdb_destroy(db);
+}
+
+/* A sparse record is never merged away with its entries. */
+static void test_sparse_duplicate(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  float v[2] = {1.0f, 2.0f};
+  uint32_t index = 5;
+  float value = 1.0f;
+  int meta = 0;
+
+  vdb_set_dedup(db, VDB_DEDUP_MERGE, 0.01f);
+  CHECK(vdb_add_vector_sparse(db, v, &index, &value, 1, "a", NULL) ==
+        VDB_OK);
+  uint64_t version = db->version;
+  CHECK(vdb_add_vector_sparse(db, v, &index, &value, 1, "b", &meta) ==
+        VDB_ERROR_DUPLICATE);
+  CHECK(vdb_count(db) == 1 && db->version == version);
+  CHECK(db->vectors[0].metadata == NULL);
+  CHECK(vdb_add_vector_sparse(db, v, NULL, NULL, 0, "c", &meta) == VDB_OK);
+  CHECK(vdb_count(db) == 1 && db->vectors[0].metadata == &meta);
+  vdb_destroy(db);
+}
+
+#define SPARSE_ROWS 40
+#define SPARSE_DIMS 16
+
+/* Query . row over the dense mirror of every sparse row. */
+static float sparse_dot(float (*sparse)[SPARSE_DIMS], size_t row,
+                        const uint32_t* indices, const float* values,
+                        size_t nnz, int* shared) {
+  float dot = 0.0f;
+  *shared = 0;
+  for (size_t i = 0; i < nnz; i++) {
+    if (sparse[row][indices[i]] != 0.0f) {
+      dot += values[i] * sparse[row][indices[i]];
+      *shared = 1;
+    }
+  }
+  return dot;
+}
+
+static void check_sparse_search(vdb_database* db,
+                                float (*sparse)[SPARSE_DIMS], size_t n) {
+  uint32_t indices[3] = {1, 6, 11};
+  float values[3] = {0.5f, -1.0f, 2.0f};
+  size_t expected = 0;
+  for (size_t row = 0; row < n; row++) {
+    int shared;
+    sparse_dot(sparse, row, indices, values, 3, &shared);
+    expected += (size_t)shared;
+  }
+
+  vdb_result_set* results =
+      vdb_search_sparse(db, indices, values, 3, SPARSE_ROWS);
+  CHECK(results && results->count == expected);
+  for (size_t i = 0; results && i < results->count; i++) {
+    int shared;
+    const vdb_result* r = &results->results[i];
+    float dot = sparse_dot(sparse, r->index, indices, values, 3, &shared);
+    CHECK(shared && fabsf(r->distance + dot) < 1e-5f);
+    if (i > 0)
+      CHECK(r->distance >= results->results[i - 1].distance);
+  }
+  vdb_free_result_set(results);
+}
+
+/* Term-at-a-time scores equal a brute-force dot product, before and after
+ * rows are removed or have their dense vector replaced. */
+static void test_sparse_search(void) {
+  vdb_database* db = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  static float sparse[SPARSE_ROWS][SPARSE_DIMS];
+  uint64_t seed = 13;
+  memset(sparse, 0, sizeof(sparse));
+
+  for (size_t row = 0; row < SPARSE_ROWS; row++) {
+    float v[4];
+    uint32_t indices[SPARSE_DIMS];
+    float values[SPARSE_DIMS];
+    size_t nnz = 0;
+    for (size_t d = 0; d < 4; d++)
+      v[d] = (float)(vdb_random(&seed) % 1000) / 500.0f - 1.0f;
+    for (uint32_t d = 0; d < SPARSE_DIMS; d++) {
+      if (vdb_random(&seed) % 4 != 0)
+        continue;
+      indices[nnz] = d;
+      values[nnz] = (float)(vdb_random(&seed) % 100 + 1) / 50.0f;
+      sparse[row][d] = values[nnz];
+      nnz++;
+    }
+    CHECK(vdb_add_vector_sparse(db, v, indices, values, nnz, NULL, NULL) ==
+          VDB_OK);
+  }
+  check_sparse_search(db, sparse, SPARSE_ROWS);
+
+  size_t removed[3] = {0, 17, SPARSE_ROWS - 3};
+  size_t n = SPARSE_ROWS;
+  for (size_t i = 0; i < 3; i++) {
+    CHECK(vdb_remove_vector(db, removed[i]) == VDB_OK);
+    memmove(sparse[removed[i]], sparse[removed[i] + 1],
+            (n - removed[i] - 1) * sizeof(sparse[0]));
+    n--;
+  }
+  float moved[4] = {9.0f, 9.0f, 9.0f, 9.0f};
+  CHECK(vdb_update_vector(db, 5, moved) == VDB_OK);
+  check_sparse_search(db, sparse, n);
+  vdb_destroy(db);
+}
+
+/* Hybrid search ranks rows by the documented weighted and RRF scores. */
+static void test_hybrid_search(void) {
+  vdb_database* db = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  static float sparse[SPARSE_ROWS][SPARSE_DIMS];
+  static float rows[SPARSE_ROWS][4];
+  uint64_t seed = 17;
+  memset(sparse, 0, sizeof(sparse));
+
+  for (size_t row = 0; row < SPARSE_ROWS; row++) {
+    uint32_t index = (uint32_t)(row % SPARSE_DIMS);
+    float value = (float)(vdb_random(&seed) % 100 + 1) / 50.0f;
+    for (size_t d = 0; d < 4; d++)
+      rows[row][d] = (float)(vdb_random(&seed) % 1000) / 500.0f - 1.0f;
+    sparse[row][index] = value;
+    vdb_add_vector_sparse(db, rows[row], &index, &value, 1, NULL, NULL);
+  }
+
+  float query[4] = {0.1f, -0.2f, 0.3f, 0.0f};
+  uint32_t indices[3] = {2, 3, 9};
+  float values[3] = {1.0f, 0.5f, 2.0f};
+  float alpha = 0.7f;
+  float expected[SPARSE_ROWS];
+
+  for (size_t row = 0; row < SPARSE_ROWS; row++) {
+    int shared;
+    float dot = sparse_dot(sparse, row, indices, values, 3, &shared);
+    float distance =
+        vdb_compute_distance(query, rows[row], 4, VDB_METRIC_EUCLIDEAN);
+    expected[row] = -alpha * distance + (1.0f - alpha) * dot;
+  }
+  vdb_result_set* results = vdb_search_hybrid(
+      db, query, indices, values, 3, 10, VDB_FUSION_WEIGHTED, alpha);
+  CHECK(results && results->count == 10);
+  for (size_t i = 0; results && i < results->count; i++) {
+    const vdb_result* r = &results->results[i];
+    size_t better = 0;
+    for (size_t row = 0; row < SPARSE_ROWS; row++)
+      better += expected[row] > expected[r->index] + 1e-5f;
+    CHECK(fabsf(r->distance + expected[r->index]) < 1e-4f && better <= i);
+  }
+  vdb_free_result_set(results);
+
+  /* fewer rows than VDB_RRF_DEPTH, so both lists are complete rankings */
+  vdb_result_set* dense = vdb_search(db, query, SPARSE_ROWS);
+  vdb_result_set* terms =
+      vdb_search_sparse(db, indices, values, 3, SPARSE_ROWS);
+  memset(expected, 0, sizeof(expected));
+  for (size_t r = 0; dense && r < dense->count; r++)
+    expected[dense->results[r].index] += alpha / (float)(VDB_RRF_K + r + 1);
+  for (size_t r = 0; terms && r < terms->count; r++)
+    expected[terms->results[r].index] +=
+        (1.0f - alpha) / (float)(VDB_RRF_K + r + 1);
+  vdb_free_result_set(dense);
+  vdb_free_result_set(terms);
+
+  results = vdb_search_hybrid(db, query, indices, values, 3, 10,
+                              VDB_FUSION_RRF, alpha);
+  CHECK(results && results->count == 10);
+  for (size_t i = 0; results && i < results->count; i++) {
+    const vdb_result* r = &results->results[i];
+    size_t better = 0;
+    for (size_t row = 0; row < SPARSE_ROWS; row++)
+      better += expected[row] > expected[r->index] + 1e-7f;
+    CHECK(fabsf(r->distance + expected[r->index]) < 1e-6f && better <= i);
+  }
+  vdb_free_result_set(results);
+  vdb_destroy(db);
+}
+
+/* Batch inserts reject duplicates of stored rows and of earlier rows in
+ * the same batch, and report where every vector went. */
+static void test_dedup_batch(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  float first[2] = {1.0f, 1.0f};
+  vdb_set_dedup(db, VDB_DEDUP_REJECT, 0.0f);
+  CHECK(vdb_add_vector(db, first, "first", NULL) == VDB_OK);
+  CHECK(vdb_add_vector(db, first, "again", NULL) == VDB_ERROR_DUPLICATE);
+
+  float batch[8] = {1.0f, 1.0f, 2.0f, 2.0f, 2.0f, 2.0f, 3.0f, 3.0f};
+  size_t indices[4];
+  CHECK(vdb_add_vectors(db, batch, 4, NULL, NULL, indices) ==
+        VDB_ERROR_DUPLICATE);
+  CHECK(indices[0] == SIZE_MAX && indices[1] == 1 &&
+        indices[2] == SIZE_MAX && indices[3] == 2);
+  CHECK(vdb_count(db) == 3);
+
+  float near[2] = {3.0f, 3.05f};
+  vdb_set_dedup(db, VDB_DEDUP_MERGE, 0.1f);
+  CHECK(vdb_add_vectors(db, near, 1, NULL, NULL, indices) == VDB_OK);
+  CHECK(indices[0] == 2 && vdb_count(db) == 3);
+  vdb_destroy(db);
+}
+
+/* lambda = 1 ranks by relevance alone; a lower lambda trades the near
+ * duplicate of the best hit for a more distant but different row. */
+static void test_mmr(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  float rows[6] = {1.0f, 0.0f, 1.01f, 0.0f, 0.0f, 1.2f};
+  vdb_add_vectors(db, rows, 3, NULL, NULL, NULL);
+  float query[2] = {0.0f, 0.0f};
+
+  vdb_result_set* plain = vdb_search_mmr(db, query, 2, 3, 1.0f);
+  CHECK(plain && plain->count == 2);
+  if (plain && plain->count == 2)
+    CHECK(plain->results[0].index == 0 && plain->results[1].index == 1);
+  vdb_free_result_set(plain);
+
+  vdb_result_set* diverse = vdb_search_mmr(db, query, 2, 3, 0.5f);
+  CHECK(diverse && diverse->count == 2);
+  if (diverse && diverse->count == 2)
+    CHECK(diverse->results[0].index == 0 && diverse->results[1].index == 2);
+  vdb_free_result_set(diverse);
+  vdb_destroy(db);
+}
+
+/* Field searches only see records that have the field, and removal keeps
+ * every field column aligned with the rows. */
+static void test_fields(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  CHECK(vdb_add_field(db, "title", 2, VDB_METRIC_EUCLIDEAN) == VDB_OK);
+  CHECK(vdb_add_field(db, "title", 2, VDB_METRIC_EUCLIDEAN) ==
+        VDB_ERROR_DUPLICATE);
+
+  float primary = 0.0f;
+  float titles[6] = {0.0f, 0.0f, 5.0f, 5.0f, 1.0f, 1.0f};
+  for (int i = 0; i < 3; i++) {
+    vdb_field_value value = {"title", titles + 2 * i};
+    CHECK(vdb_add_vector_fields(db, &primary, &value, 1, NULL, NULL) ==
+          VDB_OK);
+  }
+  CHECK(vdb_add_vector(db, &primary, NULL, NULL) == VDB_OK);
+
+  float* out = NULL;
+  CHECK(vdb_get_field_vector(db, 3, "title", &out) == VDB_ERROR_NOT_FOUND);
+  vdb_result_set* results = vdb_search_field(db, "title", titles + 4, 10);
+  CHECK(results && results->count == 3);
+  if (results && results->count == 3)
+    CHECK(results->results[0].index == 2 && results->results[1].index == 0 &&
+          results->results[2].index == 1);
+  vdb_free_result_set(results);
+
+  CHECK(vdb_remove_vector(db, 0) == VDB_OK);
+  CHECK(vdb_get_field_vector(db, 0, "title", &out) == VDB_OK &&
+        out[0] == 5.0f);
+  CHECK(vdb_get_field_vector(db, 2, "title", &out) == VDB_ERROR_NOT_FOUND);
+  CHECK(vdb_set_field_vector(db, 2, "title", titles) == VDB_OK);
+  CHECK(vdb_get_field_vector(db, 2, "title", &out) == VDB_OK &&
+        out[0] == 0.0f);
+  vdb_destroy(db);
+}
+
+/* Pages continue where the previous one stopped; a modified database
+ * makes the cursor stale and an idle one expires. */
+static void test_cursor(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  for (int i = 9; i >= 0; i--) {
+    float v = (float)i;
+    vdb_add_vector(db, &v, NULL, NULL);
+  }
+  float query = 0.0f;
+  vdb_search_cursor* cursor = vdb_search_open(db, &query, 0, 0);
+  vdb_result_set* page = NULL;
+  float expected = 0.0f;
+  size_t pages = 0;
+  while (vdb_search_next(cursor, 4, &page) == VDB_OK && page) {
+    for (size_t i = 0; i < page->count; i++, expected += 1.0f)
+      CHECK(page->results[i].distance == expected);
+    vdb_free_result_set(page);
+    pages++;
+  }
+  CHECK(pages == 3 && expected == 10.0f);
+  vdb_search_close(cursor);
+
+  cursor = vdb_search_open(db, &query, 0, 0);
+  vdb_add_vector(db, &query, NULL, NULL);
+  CHECK(vdb_search_next(cursor, 4, &page) == VDB_ERROR_STALE);
+  vdb_search_close(cursor);
+
+  cursor = vdb_search_open(db, &query, 0, 1);
+  struct timespec pause = {0, 5000000};
+  nanosleep(&pause, NULL);
+  CHECK(vdb_search_next(cursor, 4, &page) == VDB_ERROR_EXPIRED);
+  vdb_search_close(cursor);
+  vdb_destroy(db);
+}
+
+/* A cancelled search stops at the first check point and says so. */
+static void test_search_cancel(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 3 * VDB_CHECK_INTERVAL; i++) {
+    float v = (float)i;
+    vdb_add_vector(db, &v, NULL, NULL);
+  }
+  float query = (float)(3 * VDB_CHECK_INTERVAL - 1);
+  volatile int cancel = 0;
+  vdb_search_options options = {0, &cancel, VDB_PRIORITY_INTERACTIVE};
+  int incomplete = -1;
+
+  vdb_result_set* results = vdb_search_ex(db, &query, 1, &options, &incomplete);
+  CHECK(results && incomplete == 0 && results->results[0].distance == 0.0f);
+  vdb_free_result_set(results);
+
+  cancel = 1;
+  results = vdb_search_ex(db, &query, 1, &options, &incomplete);
+  CHECK(results && incomplete == 1 && results->results[0].distance > 0.0f);
+  vdb_free_result_set(results);
+  vdb_destroy(db);
+}
+
+/* Records come out in order with their operation, row and id; overwrite
+ * mode reports a reader that fell behind, reject mode pushes back. */
+static void test_cdc(void) {
+  vdb_database* db = vdb_create(1, VDB_METRIC_EUCLIDEAN);
+  float v = 1.0f;
+  CHECK(vdb_cdc_enable(db, 4, VDB_CDC_OVERWRITE) == VDB_OK);
+  vdb_add_vector(db, &v, "a", NULL);
+  vdb_add_vector(db, &v, "b", NULL);
+  vdb_remove_vector(db, 0);
+
+  vdb_cdc_batch* batch = NULL;
+  CHECK(vdb_cdc_read(db, 0, 10, &batch) == VDB_OK && batch->count == 3);
+  if (batch && batch->count == 3) {
+    vdb_cdc_record* r = batch->records;
+    CHECK(r[0].op == VDB_CDC_ADD && r[0].index == 0 &&
+          strcmp(r[0].id, "a") == 0 && r[0].data[0] == 1.0f);
+    CHECK(r[1].op == VDB_CDC_ADD && r[1].index == 1);
+    CHECK(r[2].op == VDB_CDC_REMOVE && r[2].index == 0 && !r[2].data);
+    CHECK(batch->next_seq == 3);
+  }
+  vdb_cdc_free_batch(batch);
+
+  for (int i = 0; i < 3; i++)
+    vdb_add_vector(db, &v, NULL, NULL);
+  CHECK(vdb_cdc_read(db, 0, 10, &batch) == VDB_ERROR_OVERFLOW);
+
+  CHECK(vdb_cdc_enable(db, 2, VDB_CDC_REJECT) == VDB_OK);
+  CHECK(vdb_add_vector(db, &v, NULL, NULL) == VDB_OK);
+  CHECK(vdb_add_vector(db, &v, NULL, NULL) == VDB_OK);
+  CHECK(vdb_add_vector(db, &v, NULL, NULL) == VDB_ERROR_BUSY);
+  CHECK(vdb_cdc_ack(db, vdb_cdc_position(db)) == VDB_OK);
+  CHECK(vdb_add_vector(db, &v, NULL, NULL) == VDB_OK);
+  vdb_destroy(db);
+}
+
+/* Rows keep file order, ids may be strings or numbers, and malformed or
+ * wrongly sized rows are skipped and counted. */
+static void test_ingest(void) {
+  FILE* f = fopen("ingest.jsonl", "w");
+  fputs("{\"id\": \"a\", \"embedding\": [1, 2.5]}\n"
+        "{\"embedding\": [-3e0, 4], \"id\": 7, \"extra\": {\"x\": 1}}\n"
+        "{\"id\": \"bad\", \"embedding\": [1]}\n"
+        "not json\n",
+        f);
+  fclose(f);
+  f = fopen("ingest.csv", "w");
+  fputs("id,x,y\n\"q\",0.5,-1\nr,1e1,2\n", f);
+  fclose(f);
+
+  vdb_ingest_options options;
+  vdb_ingest_defaults(&options);
+  vdb_ingest_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  CHECK(vdb_ingest_dimensions("ingest.jsonl", &options) == 2);
+  CHECK(vdb_ingest_file(db, "ingest.jsonl", &options, &stats) == VDB_OK);
+  CHECK(stats.rows == 2 && stats.skipped == 2 && vdb_count(db) == 2);
+  if (vdb_count(db) == 2) {
+    CHECK(strcmp(db->vectors[0].id, "a") == 0 &&
+          db->vectors[0].data[1] == 2.5f);
+    CHECK(strcmp(db->vectors[1].id, "7") == 0 &&
+          db->vectors[1].data[0] == -3.0f);
+  }
+
+  options.format = VDB_INGEST_CSV;
+  options.csv_header = 1;
+  CHECK(vdb_ingest_file(db, "ingest.csv", &options, &stats) == VDB_OK);
+  CHECK(stats.rows == 2 && stats.skipped == 0 && vdb_count(db) == 4);
+  if (vdb_count(db) == 4) {
+    CHECK(strcmp(db->vectors[2].id, "q") == 0 &&
+          db->vectors[2].data[1] == -1.0f);
+    CHECK(strcmp(db->vectors[3].id, "r") == 0 &&
+          db->vectors[3].data[0] == 10.0f);
+  }
+
+  /* rejected duplicates are reported apart from the rows stored */
+  vdb_set_dedup(db, VDB_DEDUP_REJECT, 0.0f);
+  f = fopen("ingest.csv", "w");
+  fputs("id,x,y\ns,0.5,-1\nt,5,5\nu,5,5\n", f);
+  fclose(f);
+  CHECK(vdb_ingest_file(db, "ingest.csv", &options, &stats) == VDB_OK);
+  CHECK(stats.rows == 1 && stats.duplicates == 2 && vdb_count(db) == 5);
+  CHECK(vdb_ingest_file(db, "missing.csv", &options, &stats) ==
+        VDB_ERROR_IO);
+  CHECK(stats.rows == 0 && stats.duplicates == 0);
+  vdb_destroy(db);
+  remove("ingest.jsonl");
+  remove("ingest.csv");
+}
+
+static int stop_after(const vdb_result* result, void* user) {
+  size_t* left = (size_t*)user;
+  (void)result;
+  return --*left == 0;
+}
+
+/* Streams return the full search's order and go stale on modification. */
+static void test_result_stream(void) {
+  uint64_t seed = 11;
+  float v[4], q[4] = {1, -1, 0.5f, 2};
+  vdb_database* db = vdb_create(4, VDB_METRIC_COSINE);
+  for (int i = 0; i < 500; i++) {
+    for (int d = 0; d < 4; d++)
+      v[d] = (float)(vdb_random(&seed) % 1000) / 500.0f - 1.0f;
+    if (i % 50 == 0)
+      v[0] = v[1] = v[2] = v[3] = 0;
+    vdb_add_vector(db, v, NULL, NULL);
+  }
+
+  size_t ks[] = {0, 1, 37, 500, 1000};
+  for (size_t t = 0; t < sizeof(ks) / sizeof(ks[0]); t++) {
+    vdb_result_set* expected = vdb_search(db, q, ks[t] ? ks[t] : 500);
+    vdb_result_stream* stream = vdb_search_stream(db, q, ks[t]);
+    vdb_result r;
+    size_t n = 0;
+    while (stream && vdb_stream_next(stream, &r) == VDB_OK) {
+      CHECK(n < expected->count && r.distance == expected->results[n].distance);
+      n++;
+    }
+    CHECK(stream && n == expected->count);
+    CHECK(vdb_stream_next(stream, &r) == VDB_ERROR_NOT_FOUND);
+    vdb_stream_close(stream);
+    vdb_free_result_set(expected);
+  }
+
+  size_t left = 5;
+  CHECK(vdb_search_each(db, q, 0, stop_after, &left) == VDB_OK && left == 0);
+
+  vdb_result_stream* stream = vdb_search_stream(db, q, 0);
+  vdb_result r;
+  CHECK(vdb_stream_next(stream, &r) == VDB_OK);
+  vdb_add_vector(db, q, NULL, NULL);
+  CHECK(vdb_stream_next(stream, &r) == VDB_ERROR_STALE);
+  vdb_stream_close(stream);
+  vdb_destroy(db);
+
+  vdb_database* empty = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+  stream = vdb_search_stream(empty, q, 5);
+  CHECK(stream && vdb_stream_next(stream, &r) == VDB_ERROR_NOT_FOUND);
+  vdb_stream_close(stream);
+  vdb_destroy(empty);
+}
+
+static void send_search(int fd, uint64_t request_id, const float* query,
+                        uint32_t dimensions, uint32_t k) {
+  vdb_wire_search req;
+  req.k = k;
+  req.dimensions = dimensions;
+  struct iovec parts[2] = {{&req, sizeof(req)},
+                           {(void*)query, dimensions * sizeof(float)}};
+  vdb_proto_send(fd, VDB_OP_SEARCH, request_id, parts, 2);
+}
+
+static vdb_conn* serve_socketpair(vdb_server* server, vdb_database* db,
+                                  int* client) {
+  int fds[2];
+  memset(server, 0, sizeof(*server));
+  server->db = db;
+  if (server_init(server) != 0 ||
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return NULL;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  *client = fds[1];
+  return add_conn(server, fds[0], 0);
+}
+
+/* Pipelined requests are answered in order. Consecutive searches share one
+ * batch call, and an add or remove ends the run. */
+static void test_server_pipeline(void) {
+  vdb_server server;
+  memset(&server, 0, sizeof(server));
+  server.db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 5; i++) {
+    float v[2] = {(float)i, 0};
+    vdb_add_vector(server.db, v, NULL, NULL);
+  }
+  int listener = listen_unix("server.sock");
+  CHECK(server_init(&server) == 0 && listener >= 0 &&
+        add_conn(&server, listener, 1));
+  int client = vdb_client_connect("unix:server.sock");
+  CHECK(client >= 0);
+
+  float origin[2] = {0, 0}, added[2] = {2.4f, 1}, wide[3] = {0, 0, 0};
+  uint64_t removed = 5;
+  vdb_wire_add add;
+  add.dimensions = 2;
+  add.id_len = 1;
+  struct iovec add_parts[3] = {
+      {&add, sizeof(add)}, {added, sizeof(added)}, {(void*)"n", 1}};
+  struct iovec remove_part = {&removed, sizeof(removed)};
+  send_search(client, 1, origin, 2, 1);
+  send_search(client, 2, origin, 2, 3);
+  vdb_proto_send(client, VDB_OP_ADD, 3, add_parts, 3);
+  send_search(client, 4, added, 2, 2);
+  vdb_proto_send(client, VDB_OP_REMOVE, 5, &remove_part, 1);
+  send_search(client, 6, wide, 3, 2);
+  send_search(client, 7, added, 2, 2);
+
+  for (int spins = 0; server.searches < 4 && spins < 100; spins++)
+    server_poll(&server, 100);
+  CHECK(server.batches == 3 && server.searches == 4);
+
+  /* per reply: status, result count and nearest (or stored) index */
+  int32_t codes[7] = {VDB_OK, VDB_OK, VDB_OK, VDB_OK,
+                      VDB_OK, VDB_ERROR_INVALID_DIMENSIONS, VDB_OK};
+  size_t counts[7] = {1, 3, 0, 2, 0, 0, 2};
+  uint64_t nearest[7] = {0, 0, 5, 5, 0, 0, 2};
+  for (uint64_t id = 1; id <= 7; id++) {
+    vdb_msg_header header;
+    void* payload;
+    int ok = vdb_proto_recv(client, &header, &payload) == 0;
+    CHECK(ok);
+    if (!ok)
+      break;
+    CHECK(header.request_id == id && header.code == codes[id - 1]);
+    if (id == 3) {
+      uint64_t index = 0;
+      CHECK(header.length == sizeof(index));
+      memcpy(&index, payload, sizeof(index));
+      CHECK(index == nearest[id - 1]);
+    } else if (counts[id - 1] > 0) {
+      vdb_result_set* rs = vdb_proto_decode_results(payload, header.length);
+      CHECK(rs && rs->count == counts[id - 1] &&
+            rs->results[0].index == nearest[id - 1]);
+      if (rs && id == 4)
+        CHECK(rs->results[0].id && strcmp(rs->results[0].id, "n") == 0);
+      vdb_free_result_set(rs);
+    }
+    VDB_FREE(payload);
+  }
+
+  server_free(&server);
+  close(client);
+  unlink("server.sock");
+}
+
+/* A client that does not read its replies stops being read from until the
+ * backlog drains, and then gets every reply in order. */
+static void test_server_backpressure(void) {
+  vdb_database* db = vdb_create(2, VDB_METRIC_EUCLIDEAN);
+  for (int i = 0; i < 100; i++) {
+    float v[2] = {(float)i, 1};
+    vdb_add_vector(db, v, NULL, NULL);
+  }
+  vdb_server server;
+  int client;
+  vdb_conn* conn = serve_socketpair(&server, db, &client);
+  CHECK(conn != NULL);
+  if (!conn)
+    return;
+  int sndbuf = 4096;
+  setsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  float query[2] = {0, 0};
+  for (uint64_t id = 1; id <= 100; id++)
+    send_search(client, id, query, 2, 100);
+  read_conn(&server, conn);
+  run_pending(&server);
+  CHECK(conn->out_len - conn->out_pos > VDB_SERVER_MAX_BACKLOG);
+  CHECK(conn->events == EPOLLOUT);
+
+  send_search(client, 101, query, 2, 100);
+  read_conn(&server, conn);
+  CHECK(server.npending == 0);
+
+  size_t reply = sizeof(vdb_msg_header) + sizeof(vdb_wire_results) +
+                 100 * sizeof(vdb_wire_result);
+  size_t total = 101 * reply, len = 0;
+  char* buf = (char*)malloc(total);
+  for (int spins = 0; len < total && spins < 100000; spins++) {
+    flush_out(&server, conn);
+    read_conn(&server, conn);
+    run_pending(&server);
+    ssize_t n = recv(client, buf + len, total - len, MSG_DONTWAIT);
+    if (n > 0)
+      len += (size_t)n;
+  }
+  CHECK(len == total && conn->events == EPOLLIN);
+  for (size_t i = 0; len == total && i < 101; i++) {
+    vdb_msg_header header;
+    memcpy(&header, buf + i * reply, sizeof(header));
+    CHECK(header.request_id == i + 1 && header.code == VDB_OK);
+  }
+
+  free(buf);
+  server_free(&server);
+  close(client);
+}
+
+/* Serves an empty database on a Unix socket from a child process, which
+ * exits when the test does. */
+static pid_t spawn_shard(const char* path) {
+  int listener = listen_unix(path);
+  pid_t parent = getpid();
+  pid_t pid = listener >= 0 ? fork() : -1;
+  if (pid == 0) {
+    vdb_server server;
+    memset(&server, 0, sizeof(server));
+    server.db = vdb_create(4, VDB_METRIC_EUCLIDEAN);
+    if (server_init(&server) != 0 || !add_conn(&server, listener, 1))
+      _exit(1);
+    while (getppid() == parent)
+      server_poll(&server, 100);
+    _exit(0);
+  }
+  if (listener >= 0)
+    close(listener);
+  return pid;
+}
+
+/* The k nearest over the shard mirrors, with global indices. */
+static size_t coord_expected(vdb_database** mirrors, size_t nshards,
+                             const float* query, size_t k,
+                             vdb_result* out) {
+  size_t n = 0;
+  for (size_t s = 0; s < nshards; s++) {
+    vdb_result_set* rs = vdb_search(mirrors[s], query, k);
+    for (size_t i = 0; rs && i < rs->count; i++) {
+      size_t pos = n++;
+      while (pos > 0 && out[pos - 1].distance > rs->results[i].distance) {
+        out[pos] = out[pos - 1];
+        pos--;
+      }
+      out[pos] = rs->results[i];
+      out[pos].index = rs->results[i].index * nshards + s;
+    }
+    vdb_free_result_set(rs);
+  }
+  return n < k ? n : k;
+}
+
+static int coord_matches(vdb_coord* coord, vdb_database** mirrors,
+                         const float* query, size_t k, int* partial) {
+  vdb_result expected[40];
+  size_t n = coord_expected(mirrors, 2, query, k, expected);
+  vdb_result_set* rs = vdb_coord_search(coord, query, k, partial);
+  int same = rs && rs->count == n;
+  for (size_t i = 0; same && i < n; i++)
+    same = rs->results[i].index == expected[i].index &&
+           rs->results[i].distance == expected[i].distance;
+  vdb_free_result_set(rs);
+  return same;
+}
+
+/* Two shards of two replicas: adds are routed by id hash and merged
+ * results use global indices. A silent replica is hedged around, and a
+ * silent shard makes the result partial. */
+static void test_coord(void) {
+  const char* paths[4] = {"a0.sock", "a1.sock", "b0.sock", "b1.sock"};
+  const char* addresses[4] = {"unix:a0.sock", "unix:a1.sock", "unix:b0.sock",
+                              "unix:b1.sock"};
+  pid_t pids[4];
+  for (int i = 0; i < 4; i++)
+    pids[i] = spawn_shard(paths[i]);
+  int silent = listen_unix("silent.sock");
+
+  vdb_database* mirrors[2] = {vdb_create(4, VDB_METRIC_EUCLIDEAN),
+                              vdb_create(4, VDB_METRIC_EUCLIDEAN)};
+  vdb_coord* coord = vdb_coord_create(addresses, 2, 2);
+  CHECK(coord && coord->dimensions == 4);
+  if (!coord)
+    goto done;
+
+  uint64_t seed = 17;
+  float v[4];
+  char id[16];
+  for (int i = 0; i < 40; i++) {
+    for (int d = 0; d < 4; d++)
+      v[d] = (float)(vdb_random(&seed) % 1000) / 100.0f;
+    snprintf(id, sizeof(id), "doc%d", i);
+    size_t s = vdb_coord_shard(coord, id);
+    size_t index = SIZE_MAX;
+    int partial = 1;
+    CHECK(vdb_coord_add(coord, v, id, &index, &partial) == VDB_OK);
+    CHECK(!partial && index == vdb_count(mirrors[s]) * 2 + s);
+    vdb_add_vector(mirrors[s], v, id, NULL);
+  }
+  CHECK(vdb_count(mirrors[0]) > 0 && vdb_count(mirrors[1]) > 0);
+
+  float q[4] = {5, 5, 5, 5};
+  int partial = 1;
+  CHECK(coord_matches(coord, mirrors, q, 10, &partial) && !partial);
+  int removed = 0;
+  CHECK(vdb_coord_remove(coord, 3, &removed) == VDB_OK && !removed);
+  vdb_remove_vector(mirrors[1], 1);
+  CHECK(coord_matches(coord, mirrors, q, 20, &partial) && !partial);
+  CHECK(coord->hedges == 0 && coord->partials == 0);
+  vdb_coord_destroy(coord);
+
+  /* shard 1 asks its silent replica first */
+  const char* hedged[4] = {"unix:a0.sock", "unix:silent.sock",
+                           "unix:silent.sock", "unix:b1.sock"};
+  coord = vdb_coord_create(hedged, 2, 2);
+  CHECK(coord != NULL);
+  if (coord) {
+    vdb_coord_set_timeouts(coord, 10, 500);
+    CHECK(coord_matches(coord, mirrors, q, 10, &partial) && !partial);
+    CHECK(coord->hedges >= 1 && coord->partials == 0);
+    vdb_coord_destroy(coord);
+  }
+
+  /* shard 1 never answers */
+  const char* lost[2] = {"unix:a0.sock", "unix:silent.sock"};
+  coord = vdb_coord_create(lost, 2, 1);
+  CHECK(coord != NULL);
+  if (coord) {
+    vdb_coord_set_timeouts(coord, 0, 100);
+    vdb_result_set* rs = vdb_coord_search(coord, q, 5, &partial);
+    vdb_result_set* local = vdb_search(mirrors[0], q, 5);
+    CHECK(partial && coord->partials == 1 && rs && local &&
+          rs->count == local->count);
+    for (size_t i = 0; rs && local && i < rs->count; i++)
+      CHECK(rs->results[i].index == local->results[i].index * 2);
+    vdb_free_result_set(rs);
+    vdb_free_result_set(local);
+    vdb_coord_destroy(coord);
+  }
+
+done:
+  for (int i = 0; i < 4; i++) {
+    if (pids[i] > 0) {
+      kill(pids[i], SIGKILL);
+      waitpid(pids[i], NULL, 0);
+    }
+    unlink(paths[i]);
+  }
+  close(silent);
+  unlink("silent.sock");
+  vdb_destroy(mirrors[0]);
+  vdb_destroy(mirrors[1]);
+}
+
+/* A peer that hung up must yield an error, not SIGPIPE. */
+static void test_proto_closed_peer(void) {
+  int fds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  close(fds[1]);
+  char byte = 0;
+  struct iovec part = {&byte, 1};
+  CHECK(vdb_proto_send(fds[0], 0, 1, &part, 1) == -1);
+  close(fds[0]);
+}
 
 int main(void) {
   vdb_database* db = vdb_create(128, VDB_METRIC_COSINE);
@@ -54,5 +1494,46 @@ int main(void) {
     vdb_destroy(loaded);
   }
 
+  test_nndescent_infinite();
+  test_knn_graph();
+  test_join();
+  test_repl_snapshot_errors();
+  test_repl_round_trip();
+  test_proto_closed_peer();
+  test_server_pipeline();
+  test_server_backpressure();
+  test_coord();
+  test_add_index();
+  test_watch_cosine();
+  test_doc_search();
+  test_doc_search_rerank();
+  test_grouped_limits();
+  test_shm_short_segment();
+  test_cdc_unsupported();
+  test_merge_trailing_bytes();
+  test_merge_in_place();
+  test_kmeans_cosine_seed();
+  test_sparse_duplicate();
+  test_sparse_search();
+  test_hybrid_search();
+  test_dedup_batch();
+  test_mmr();
+  test_fields();
+  test_cursor();
+  test_search_cancel();
+  test_cdc();
+  test_ingest();
+  test_result_stream();
+#ifdef VDB_MULTITHREADED
+  test_admission_deadline();
+  test_admission_yield();
+  test_admission_bulk();
+#endif
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
   return 0;
 }
@@ -0,0 +1,287 @@
+#define VDB_MULTITHREADED
+#include <cstdlib>
+
+static std::size_t mallocs = 0;
+
+static void* counting_malloc(std::size_t size) {
+  mallocs++;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, std::size_t size) {
+  mallocs++;
+  return realloc(ptr, size);
+}
+
+#define VDB_MALLOC counting_malloc
+#define VDB_REALLOC counting_realloc
+#include "vdb.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <latch>
+#include <ranges>
+#include <thread>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static std::vector<float> random_rows(std::size_t n, std::size_t dims,
+                                      uint64_t seed) {
+  std::vector<float> rows(n * dims);
+  for (float& x : rows)
+    x = (float)(vdb_random(&seed) % 2000) / 1000.0f - 1.0f;
+  return rows;
+}
+
+/* search, search_into and the untyped base agree with the C API. */
+template <class Metric>
+static void test_wrapper(vdb_metric metric) {
+  const std::size_t dims = 8, n = 200;
+  std::vector<float> rows = random_rows(n, dims, 1);
+  vdb::basic_database<Metric> db(dims);
+  db.add_batch(rows);
+  CHECK(db.size() == n && db.metric() == metric);
+
+  std::vector<float> query = random_rows(1, dims, 2);
+  vdb::results owned = db.search(query, 5);
+  std::vector<vdb::result> buf(5), base_buf(5);
+  std::span<vdb::result> typed = db.search_into(query, buf);
+  const vdb::database& base = db;
+  std::span<vdb::result> untyped = base.search_into(query, base_buf);
+  vdb_result_set* expected = vdb_search(db.get(), query.data(), 5);
+
+  CHECK(owned.size() == 5 && typed.size() == 5 && untyped.size() == 5);
+  std::size_t i = 0;
+  for (const vdb::result& r : owned) {
+    CHECK(r.index == expected->results[i].index);
+    CHECK(typed[i].index == r.index && untyped[i].index == r.index);
+    CHECK(std::fabs(typed[i].distance - r.distance) < 1e-5f);
+    i++;
+  }
+  vdb_free_result_set(expected);
+
+  float d = vdb::distance<Metric, float>(
+      std::span<const float>(rows.data(), dims),
+      std::span<const float>(rows.data() + dims, dims));
+  CHECK(std::fabs(d - vdb_compute_distance(rows.data(), rows.data() + dims,
+                                           dims, metric)) < 1e-5f);
+
+  vdb::database moved = std::move(db);
+  CHECK(moved.size() == n && db.get() == nullptr);
+  try {
+    moved.add(std::span<const float>(rows.data(), dims - 1));
+    CHECK(!"mismatched dimensions accepted");
+  } catch (const vdb::error& e) {
+    CHECK(e.code() == VDB_ERROR_INVALID_DIMENSIONS);
+  }
+}
+
+/* The fused cosine scan matches the C distances, zero rows included, and
+ * vdb::distance accepts other element types. */
+static void test_cosine_scan(void) {
+  const std::size_t dims = 5, n = 300;
+  std::vector<float> rows = random_rows(n, dims, 4);
+  std::fill(rows.begin() + 7 * dims, rows.begin() + 8 * dims, 0.0f);
+  vdb::cosine_database db(dims);
+  db.add_batch(rows);
+
+  std::vector<float> query = random_rows(1, dims, 8);
+  std::vector<vdb::result> buf(n);
+  std::span<vdb::result> hits = db.search_into(query, buf);
+  CHECK(hits.size() == n);
+  for (const vdb::result& r : hits) {
+    float expected = vdb_compute_distance(
+        query.data(), rows.data() + r.index * dims, dims, VDB_METRIC_COSINE);
+    CHECK(std::fabs(r.distance - expected) < 1e-6f);
+  }
+
+  int a[3] = {1, 2, 2}, b[3] = {2, 4, 4};
+  float angle = vdb::distance<vdb::cosine, int>(a, b);
+  float length = vdb::distance<vdb::euclidean, int>(a, b);
+  CHECK(std::fabs(angle) < 1e-6f && length == 3.0f);
+}
+
+/* pmr results match the owning ones; one query mallocs nothing. */
+static void test_pmr(void) {
+  const std::size_t dims = 16, n = 1000;
+  std::vector<float> rows = random_rows(n, dims, 3);
+  vdb::database db(dims, VDB_METRIC_COSINE);
+  db.add_batch(rows);
+  std::span<const float> query(rows.data(), dims);
+  std::span<const float> queries(rows.data(), 4 * dims);
+  static char buffer[1 << 18];
+
+  for (int rep = 0; rep < 2; rep++) {
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer),
+                                              std::pmr::null_memory_resource());
+    std::size_t before = mallocs;
+    vdb::result_vector hits = db.search(query, 10, &arena);
+    vdb::result_vector all = db.search(query, n + 5, &arena);
+    CHECK(mallocs == before);
+    CHECK(hits.size() == 10 && all.size() == n && hits[0].index == 0);
+
+    vdb::result_vector batch = db.search_batch(queries, 10, &arena);
+    vdb::results owned = db.search_batch(queries, 10);
+    CHECK(batch.size() == 40 && owned.size() == 40);
+    std::size_t i = 0;
+    for (const vdb::result& r : owned) {
+      CHECK(batch[i].index == r.index && batch[i].distance == r.distance);
+      i++;
+    }
+    for (std::size_t q = 0; q < 4; q++)
+      CHECK(batch[q * 10].index == q);
+  }
+
+  std::pmr::monotonic_buffer_resource arena;
+  vdb::database empty(dims, VDB_METRIC_COSINE);
+  CHECK(empty.search(query, 3, &arena).empty());
+  CHECK(empty.search_batch(queries, 3, &arena).empty());
+}
+
+struct detached_task {
+  struct promise_type {
+    detached_task get_return_object() {
+      return {};
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() {
+    }
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+static std::atomic<int> async_mismatches{0};
+
+static detached_task await_search(const vdb::database& db,
+                                  std::vector<float> query, std::size_t k,
+                                  std::latch& done) {
+  vdb::result_vector hits = co_await db.search_async(query, k);
+  vdb::results expected = db.search(query, k);
+  if (hits.size() != expected.size())
+    async_mismatches++;
+  std::size_t i = 0;
+  for (const vdb::result& r : expected) {
+    if (i < hits.size() && hits[i].index != r.index)
+      async_mismatches++;
+    i++;
+  }
+  done.count_down();
+}
+
+static detached_task await_bad_query(const vdb::database& db,
+                                     std::latch& done) {
+  try {
+    std::vector<float> query(3);
+    co_await db.search_async(query, 4);
+    async_mismatches++;
+  } catch (const vdb::error& e) {
+    if (e.code() != VDB_ERROR_INVALID_DIMENSIONS)
+      async_mismatches++;
+  }
+  done.count_down();
+}
+
+/* Concurrent awaits are batched and still match the blocking search. */
+static void test_search_async(void) {
+  const std::size_t dims = 16, n = 5000;
+  const int count = 200;
+  std::vector<float> rows = random_rows(n, dims, 5);
+  vdb::database db(dims, VDB_METRIC_EUCLIDEAN);
+  db.add_batch(rows);
+
+  std::latch done(count + 1);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back([&, t] {
+      for (int i = t; i < count; i += 4)
+        await_search(db, random_rows(1, dims, 100 + i), 1 + i % 20, done);
+    });
+  await_bad_query(db, done);
+  for (std::thread& t : threads)
+    t.join();
+  done.wait();
+  CHECK(async_mismatches == 0);
+  CHECK(db.batcher().batches() > 0);
+  CHECK(db.batcher().batches() <= (uint64_t)count);
+
+  vdb::database empty(dims, VDB_METRIC_COSINE);
+  std::latch ready(2);
+  await_search(empty, random_rows(1, dims, 6), 5, ready);
+  await_search(db, random_rows(1, dims, 7), 0, ready);
+  ready.wait();
+  CHECK(async_mismatches == 0);
+}
+
+/* search_stream is an input range that throws once the data changes. */
+static void test_search_stream(void) {
+  static_assert(std::ranges::input_range<vdb::result_stream>);
+  const std::size_t dims = 8, n = 1000;
+  std::vector<float> rows = random_rows(n, dims, 9);
+  vdb::database db(dims, VDB_METRIC_DOT_PRODUCT);
+  db.add_batch(rows);
+  std::span<const float> query(rows.data(), dims);
+  vdb::results expected = db.search(query, n);
+
+  std::size_t i = 0;
+  for (const vdb::result& r : db.search_stream(query)) {
+    CHECK(i < expected.size() && r.distance == expected[i].distance);
+    i++;
+  }
+  CHECK(i == n);
+
+  i = 0;
+  for (const vdb::result& r : db.search_stream(query, 50) |
+                                  std::views::take(7)) {
+    CHECK(r.distance == expected[i].distance);
+    i++;
+  }
+  CHECK(i == 7);
+
+  vdb::result_stream stream = db.search_stream(query);
+  auto it = stream.begin();
+  ++it;
+  db.add(query);
+  try {
+    ++it;
+    CHECK(!"stale stream kept iterating");
+  } catch (const vdb::error& e) {
+    CHECK(e.code() == VDB_ERROR_STALE);
+  }
+
+  vdb::database empty(dims, VDB_METRIC_COSINE);
+  vdb::result_stream none = empty.search_stream(query);
+  CHECK(none.begin() == none.end());
+}
+
+int main() {
+  test_wrapper<vdb::cosine>(VDB_METRIC_COSINE);
+  test_wrapper<vdb::euclidean>(VDB_METRIC_EUCLIDEAN);
+  test_wrapper<vdb::dot_product>(VDB_METRIC_DOT_PRODUCT);
+  test_cosine_scan();
+  test_pmr();
+  test_search_async();
+  test_search_stream();
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
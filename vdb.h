@@ -20,9 +20,12 @@
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
+#include <time.h>
 
 #ifdef VDB_MULTITHREADED
+#include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
 #endif
 
 #ifndef VDB_MALLOC
@@ -37,6 +40,26 @@
 #define VDB_REALLOC realloc
 #endif
 
+#ifndef VDB_MAX_THREADS
+#define VDB_MAX_THREADS 64
+#endif
+
+#ifndef VDB_TILE
+#define VDB_TILE 64
+#endif
+
+#ifndef VDB_CHECK_INTERVAL
+#define VDB_CHECK_INTERVAL 1024
+#endif
+
+#ifndef VDB_WATCH_PIVOTS
+#define VDB_WATCH_PIVOTS 8
+#endif
+
+#ifndef VDB_CURSOR_MAX_RESULTS
+#define VDB_CURSOR_MAX_RESULTS 10000
+#endif
+
 typedef enum {
   VDB_OK = 0,
   VDB_ERROR_NULL_POINTER = -1,
@@ -44,7 +67,15 @@ typedef enum {
   VDB_ERROR_OUT_OF_MEMORY = -3,
   VDB_ERROR_NOT_FOUND = -4,
   VDB_ERROR_INVALID_INDEX = -5,
-  VDB_ERROR_THREAD_FAILURE = -6
+  VDB_ERROR_THREAD_FAILURE = -6,
+  VDB_ERROR_DUPLICATE = -7,
+  VDB_ERROR_EXPIRED = -8,
+  VDB_ERROR_STALE = -9,
+  VDB_ERROR_OVERFLOW = -10,
+  VDB_ERROR_BUSY = -11,
+  VDB_ERROR_UNSUPPORTED = -12,
+  VDB_ERROR_IO = -13,
+  VDB_ERROR_READ_ONLY = -14
 } vdb_error;
 
 typedef enum {
@@ -53,23 +84,184 @@ typedef enum {
   VDB_METRIC_DOT_PRODUCT = 2
 } vdb_metric;
 
+typedef enum {
+  VDB_DEDUP_NONE = 0,
+  VDB_DEDUP_REJECT = 1,
+  VDB_DEDUP_MERGE = 2
+} vdb_dedup_mode;
+
+typedef enum { VDB_FUSION_WEIGHTED = 0, VDB_FUSION_RRF = 1 } vdb_fusion;
+
+typedef enum {
+  VDB_PRIORITY_INTERACTIVE = 0,
+  VDB_PRIORITY_BATCH = 1
+} vdb_priority;
+
+#define VDB_PRIORITY_CLASSES 2
+
 typedef struct {
   float* data;
   char* id;
   void* metadata;
 } vdb_vector;
 
+typedef struct {
+  size_t* rows;
+  float* values;
+  size_t count;
+  size_t capacity;
+} vdb_posting_list;
+
+typedef struct {
+  char* name;
+  size_t dimensions;
+  vdb_metric metric;
+  float* data; /* one row per record, valid where present[row] is set */
+  float* norms;
+  unsigned char* present;
+  size_t capacity;
+} vdb_field;
+
+typedef struct {
+  const char* name;
+  const float* data;
+} vdb_field_value;
+
+typedef struct {
+  const char* field; /* NULL queries the primary vector */
+  const float* query;
+  float weight;
+} vdb_field_query;
+
+typedef enum {
+  VDB_CDC_OVERWRITE = 0, /* drop the oldest records when full */
+  VDB_CDC_REJECT = 1     /* fail mutations with VDB_ERROR_BUSY when full */
+} vdb_cdc_mode;
+
+typedef enum {
+  VDB_CDC_ADD = 0,
+  VDB_CDC_REMOVE = 1,
+  VDB_CDC_UPDATE = 2
+} vdb_cdc_op;
+
+typedef struct {
+  uint64_t seq;
+  vdb_cdc_op op;
+  size_t index;
+  float* data; /* NULL for VDB_CDC_REMOVE */
+  char* id;
+} vdb_cdc_record;
+
+typedef struct {
+  vdb_cdc_record* records;
+  size_t count;
+  size_t dimensions;
+  uint64_t next_seq; /* where the next vdb_cdc_read should start */
+  float* data;
+} vdb_cdc_batch;
+
+typedef void (*vdb_watch_callback)(uint64_t watch, size_t index,
+                                   float distance, void* user);
+
+typedef struct {
+  uint64_t id;
+  float* query;
+  float norm;
+  float radius;
+  float pivot_dist[VDB_WATCH_PIVOTS]; /* distance to each pivot */
+  vdb_watch_callback callback;
+  void* user;
+} vdb_standing_query;
+
+typedef struct {
+  uint64_t watch;
+  size_t index;
+  float distance;
+  vdb_watch_callback callback;
+  void* user;
+} vdb_watch_match;
+
+typedef struct {
+  size_t max_concurrent; /* 0 means unlimited */
+  size_t max_batch;      /* 0 means unlimited */
+  size_t running[VDB_PRIORITY_CLASSES];
+  size_t waiting[VDB_PRIORITY_CLASSES];
+  uint64_t admitted[VDB_PRIORITY_CLASSES];
+  uint64_t timed_out[VDB_PRIORITY_CLASSES];
+  uint64_t queue_us[VDB_PRIORITY_CLASSES];
+  uint64_t max_queue_us[VDB_PRIORITY_CLASSES];
+  uint64_t yields;
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+} vdb_scheduler;
+
 typedef struct {
   vdb_vector* vectors;
   size_t count;
   size_t capacity;
   size_t dimensions;
   vdb_metric metric;
+  vdb_dedup_mode dedup_mode;
+  float dedup_threshold;
+  size_t* dedup_table;
+  size_t dedup_capacity;
+  int dedup_stale;
+  size_t* sparse_rows; /* CSR row offsets, NULL until a sparse row exists */
+  size_t sparse_row_capacity;
+  uint32_t* sparse_indices;
+  float* sparse_values;
+  size_t sparse_nnz;
+  size_t sparse_capacity;
+  vdb_posting_list* postings; /* inverted index, one list per dimension */
+  size_t posting_dims;
+  vdb_field* fields;
+  size_t field_count;
+  uint64_t version; /* bumped by every mutation */
+  vdb_standing_query* watches;
+  size_t watch_count;
+  size_t watch_capacity;
+  uint64_t next_watch;
+  float* watch_pivots; /* VDB_WATCH_PIVOTS rows, unit length for cosine */
+  size_t watch_npivots;
+  vdb_cdc_record* cdc_ring; /* record seq lives in slot seq % capacity */
+  float* cdc_data;
+  size_t cdc_capacity;
+  vdb_cdc_mode cdc_mode;
+  uint64_t cdc_head; /* next sequence number */
+  uint64_t cdc_tail; /* oldest retained record */
+  uint64_t cdc_acked;
+  int read_only; /* set on replication followers */
+  vdb_scheduler scheduler;
 #ifdef VDB_MULTITHREADED
   pthread_rwlock_t lock;
 #endif
 } vdb_database;
 
+typedef struct {
+  size_t offset; /* first token in vdb_doc_database.tokens */
+  size_t count;
+  char* id;
+  void* metadata;
+} vdb_document;
+
+typedef struct {
+  float* tokens;
+  float* token_norms;
+  size_t* token_docs;
+  size_t token_count;
+  size_t token_capacity;
+  vdb_document* documents;
+  size_t count;
+  size_t capacity;
+  size_t dimensions;
+  vdb_metric metric;
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_t lock;
+#endif
+} vdb_doc_database;
+
 typedef struct {
   size_t index;
   float distance;
@@ -82,6 +274,92 @@ typedef struct {
   size_t count;
 } vdb_result_set;
 
+typedef struct {
+  uint64_t timeout_ms;        /* 0 means no deadline */
+  const volatile int* cancel; /* stop when *cancel becomes non-zero */
+  vdb_priority priority;
+} vdb_search_options;
+
+typedef struct {
+  size_t count;
+  size_t dimensions;
+  uint64_t version;
+  size_t running[VDB_PRIORITY_CLASSES];
+  size_t waiting[VDB_PRIORITY_CLASSES];
+  uint64_t admitted[VDB_PRIORITY_CLASSES];
+  uint64_t timed_out[VDB_PRIORITY_CLASSES];
+  uint64_t queue_us[VDB_PRIORITY_CLASSES]; /* total time spent queued */
+  uint64_t max_queue_us[VDB_PRIORITY_CLASSES];
+  uint64_t yields; /* batch searches that gave way to interactive ones */
+} vdb_stats;
+
+typedef struct {
+  const vdb_database* db;
+  vdb_result* heap; /* min-heap of the results not yet returned */
+  size_t size;
+  uint64_t version;
+  uint64_t ttl_ms;
+  uint64_t expires_ms;
+} vdb_search_cursor;
+
+typedef struct {
+  float distance;
+  size_t index;
+} vdb_stream_entry;
+
+typedef struct {
+  const vdb_database* db;
+  vdb_stream_entry* entries; /* entries[0, next) have been returned */
+  size_t count;
+  size_t limit;
+  size_t next;
+  size_t sorted_end; /* entries[next, sorted_end) are already in order */
+  size_t* bounds;    /* partition boundaries, count at the bottom */
+  size_t nbounds;
+  size_t bounds_capacity;
+  uint64_t rng;
+  uint64_t version;
+} vdb_result_stream;
+
+typedef int (*vdb_result_fn)(const vdb_result* result, void* user);
+
+typedef uint64_t (*vdb_group_key_fn)(size_t index, const char* id,
+                                     void* metadata, void* user);
+
+typedef struct {
+  uint64_t key;
+  vdb_result* results;
+  size_t count;
+} vdb_group;
+
+typedef struct {
+  vdb_group* groups;
+  size_t count;
+} vdb_group_result_set;
+
+typedef struct {
+  vdb_result* neighbors; /* row i starts at neighbors[i * k] */
+  size_t count;
+  size_t k;
+} vdb_graph;
+
+typedef enum { VDB_KMEANS_PLUSPLUS = 0, VDB_KMEANS_RANDOM = 1 } vdb_kmeans_init;
+
+typedef struct {
+  float* centroids; /* nclusters * dimensions */
+  size_t* assignments;
+  size_t nclusters;
+  size_t dimensions;
+  size_t count;
+  size_t iterations;
+  float total_distance;
+} vdb_kmeans_result;
+
+typedef void (*vdb_worker_fn)(void* arg, size_t worker, size_t nworkers);
+
+typedef int (*vdb_join_callback)(size_t index, const vdb_result* results,
+                                 size_t count, void* user);
+
 #ifdef VDB_MULTITHREADED
 typedef struct {
   const float* query;
@@ -91,7 +369,95 @@ typedef struct {
   size_t end_idx;
   size_t k;
 } vdb_search_thread_args;
+
+typedef struct {
+  vdb_worker_fn fn;
+  void* arg;
+  size_t worker;
+  size_t nworkers;
+} vdb_worker_args;
+#endif
+
+typedef struct {
+  const vdb_database* db;
+  const float* norms;
+  vdb_result* heaps;
+  size_t* sizes;
+  size_t k;
+  size_t nblocks;
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_t* block_locks;
+#endif
+} vdb_knn_thread_args;
+
+typedef struct {
+  const vdb_database* a;
+  const vdb_database* b;
+  const float* a_norms;
+  const float* b_norms;
+  size_t k;
+  size_t nblocks;
+  vdb_join_callback callback;
+  void* user;
+  int stop;
+  int failed;
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_t callback_lock;
 #endif
+} vdb_join_thread_args;
+
+typedef struct {
+  const vdb_database* db;
+  const float* norms;
+  const float* centroids;
+  const float* centroid_norms;
+  size_t nclusters;
+  size_t* assignments;
+  float* distances;
+  size_t changed[VDB_MAX_THREADS];
+  size_t seed_index;
+  float* seed_weights;
+} vdb_kmeans_thread_args;
+
+typedef struct {
+  const vdb_database* db;
+  const float* data;
+  size_t count;
+  size_t* matches;
+} vdb_dedup_thread_args;
+
+typedef struct {
+  const vdb_database* db;
+  const float* norms;
+  const float* queries;
+  const float* query_norms;
+  size_t nqueries;
+  size_t k;
+  vdb_result* heaps; /* k slots per query */
+  size_t* sizes;
+} vdb_batch_thread_args;
+
+typedef struct {
+  const vdb_doc_database* db;
+  const float* query;
+  const float* query_norms;
+  size_t nquery;
+  const size_t* docs; /* NULL scores every document */
+  size_t ndocs;
+  size_t k;
+  vdb_result* heaps;
+  size_t sizes[VDB_MAX_THREADS];
+  int failed[VDB_MAX_THREADS];
+} vdb_maxsim_thread_args;
+
+typedef struct {
+  const vdb_doc_database* db;
+  const float* query;
+  size_t nquery;
+  size_t ncandidates;
+  vdb_result* heaps; /* ncandidates slots per query per worker */
+  size_t* sizes;     /* nquery per worker */
+} vdb_candidate_thread_args;
 
 static inline float vdb_dot_product(const float* a, const float* b,
                                     size_t dims) {
@@ -150,6 +516,190 @@ static inline float vdb_compute_distance(const float* a, const float* b,
   }
 }
 
+static inline float vdb_compute_distance_normed(const float* a, const float* b,
+                                                float norm_a, float norm_b,
+                                                size_t dims,
+                                                vdb_metric metric) {
+  switch (metric) {
+  case VDB_METRIC_COSINE:
+    if (norm_a == 0.0f || norm_b == 0.0f)
+      return 1.0f;
+    return 1.0f - vdb_dot_product(a, b, dims) / (norm_a * norm_b);
+  case VDB_METRIC_EUCLIDEAN:
+    return vdb_euclidean_distance(a, b, dims);
+  case VDB_METRIC_DOT_PRODUCT:
+    return -vdb_dot_product(a, b, dims);
+  default:
+    return 0.0f;
+  }
+}
+
+static inline float* vdb_compute_norms(const vdb_database* db) {
+  size_t n = db->count ? db->count : 1;
+  float* norms = (float*)VDB_MALLOC(n * sizeof(float));
+  if (!norms)
+    return NULL;
+
+  for (size_t i = 0; i < db->count; i++) {
+    norms[i] = db->metric == VDB_METRIC_COSINE
+                   ? vdb_magnitude(db->vectors[i].data, db->dimensions)
+                   : 0.0f;
+  }
+
+  return norms;
+}
+
+/* Distances between rows [a_start, a_end) of a and [b_start, b_end) of b,
+ * written row-major into out. The b tile is reused across every a row, so
+ * it stays cache resident for VDB_TILE-sized ranges. */
+static inline void vdb_distance_tile(const vdb_database* a,
+                                     const float* a_norms, size_t a_start,
+                                     size_t a_end, const vdb_database* b,
+                                     const float* b_norms, size_t b_start,
+                                     size_t b_end, float* out) {
+  size_t cols = b_end - b_start;
+
+  for (size_t i = a_start; i < a_end; i++) {
+    const float* va = a->vectors[i].data;
+    float* row = out + (i - a_start) * cols;
+    for (size_t j = b_start; j < b_end; j++) {
+      row[j - b_start] = vdb_compute_distance_normed(
+          va, b->vectors[j].data, a_norms[i], b_norms[j], b->dimensions,
+          b->metric);
+    }
+  }
+}
+
+static inline void vdb_heap_push(vdb_result* heap, size_t* size, size_t k,
+                                 size_t index, float distance) {
+  size_t pos;
+
+  if (*size < k) {
+    pos = (*size)++;
+    while (pos > 0) {
+      size_t parent = (pos - 1) / 2;
+      if (heap[parent].distance >= distance)
+        break;
+      heap[pos] = heap[parent];
+      pos = parent;
+    }
+  } else {
+    if (k == 0 || distance >= heap[0].distance)
+      return;
+    pos = 0;
+    for (;;) {
+      size_t child = 2 * pos + 1;
+      if (child >= k)
+        break;
+      if (child + 1 < k && heap[child + 1].distance > heap[child].distance)
+        child++;
+      if (heap[child].distance <= distance)
+        break;
+      heap[pos] = heap[child];
+      pos = child;
+    }
+  }
+
+  heap[pos].index = index;
+  heap[pos].distance = distance;
+  heap[pos].id = NULL;
+  heap[pos].metadata = NULL;
+}
+
+static inline uint64_t vdb_random(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/* Monotonic time where POSIX provides it, so deadlines and TTLs survive
+ * wall-clock adjustments; plain C11 builds fall back to the wall clock. */
+static inline uint64_t vdb_now_us(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+  timespec_get(&ts, TIME_UTC);
+#endif
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static inline uint64_t vdb_now_ms(void) {
+  return vdb_now_us() / 1000;
+}
+
+static inline int vdb_cancelled(const volatile int* flag) {
+  if (!flag)
+    return 0;
+#if defined(__GNUC__) || defined(__clang__)
+  return __atomic_load_n(flag, __ATOMIC_RELAXED) != 0;
+#else
+  return *flag != 0;
+#endif
+}
+
+static inline size_t vdb_thread_count(void) {
+#if defined(VDB_MULTITHREADED) && defined(VDB_THREADS)
+  return VDB_THREADS < VDB_MAX_THREADS ? VDB_THREADS : VDB_MAX_THREADS;
+#elif defined(VDB_MULTITHREADED)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  if ((size_t)n > VDB_MAX_THREADS)
+    return VDB_MAX_THREADS;
+  return (size_t)n;
+#else
+  return 1;
+#endif
+}
+
+#ifdef VDB_MULTITHREADED
+static inline void* vdb_worker_main(void* arg) {
+  vdb_worker_args* w = (vdb_worker_args*)arg;
+  w->fn(w->arg, w->worker, w->nworkers);
+  return NULL;
+}
+#endif
+
+/* Runs fn(arg, worker, nworkers) for every worker and waits for all of them.
+ * Workers that cannot be spawned run on the calling thread instead, so the
+ * callback only has to partition its work by worker number. */
+static inline void vdb_run_workers(vdb_worker_fn fn, void* arg,
+                                   size_t nworkers) {
+#ifdef VDB_MULTITHREADED
+  if (nworkers > VDB_MAX_THREADS)
+    nworkers = VDB_MAX_THREADS;
+  if (nworkers > 1) {
+    pthread_t threads[VDB_MAX_THREADS];
+    vdb_worker_args args[VDB_MAX_THREADS];
+    int started[VDB_MAX_THREADS];
+
+    for (size_t i = 1; i < nworkers; i++) {
+      args[i].fn = fn;
+      args[i].arg = arg;
+      args[i].worker = i;
+      args[i].nworkers = nworkers;
+      started[i] =
+          pthread_create(&threads[i], NULL, vdb_worker_main, &args[i]) == 0;
+    }
+
+    fn(arg, 0, nworkers);
+
+    for (size_t i = 1; i < nworkers; i++) {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        fn(arg, i, nworkers);
+    }
+    return;
+  }
+#else
+  (void)nworkers;
+#endif
+  fn(arg, 0, 1);
+}
+
 static inline vdb_database* vdb_create(size_t dimensions, vdb_metric metric) {
   if (dimensions == 0)
     return NULL;
@@ -163,79 +713,1190 @@ static inline vdb_database* vdb_create(size_t dimensions, vdb_metric metric) {
   db->capacity = 0;
   db->dimensions = dimensions;
   db->metric = metric;
+  db->dedup_mode = VDB_DEDUP_NONE;
+  db->dedup_threshold = 0.0f;
+  db->dedup_table = NULL;
+  db->dedup_capacity = 0;
+  db->dedup_stale = 1;
+  db->sparse_rows = NULL;
+  db->sparse_row_capacity = 0;
+  db->sparse_indices = NULL;
+  db->sparse_values = NULL;
+  db->sparse_nnz = 0;
+  db->sparse_capacity = 0;
+  db->postings = NULL;
+  db->posting_dims = 0;
+  db->fields = NULL;
+  db->field_count = 0;
+  db->version = 0;
+  db->watches = NULL;
+  db->watch_count = 0;
+  db->watch_capacity = 0;
+  db->next_watch = 0;
+  db->watch_pivots = NULL;
+  db->watch_npivots = 0;
+  db->cdc_ring = NULL;
+  db->cdc_data = NULL;
+  db->cdc_capacity = 0;
+  db->cdc_mode = VDB_CDC_OVERWRITE;
+  db->cdc_head = 0;
+  db->cdc_tail = 0;
+  db->cdc_acked = 0;
+  db->read_only = 0;
+  memset(&db->scheduler, 0, sizeof(db->scheduler));
 
 #ifdef VDB_MULTITHREADED
   if (pthread_rwlock_init(&db->lock, NULL) != 0) {
     VDB_FREE(db);
     return NULL;
   }
+  if (pthread_mutex_init(&db->scheduler.mutex, NULL) != 0) {
+    pthread_rwlock_destroy(&db->lock);
+    VDB_FREE(db);
+    return NULL;
+  }
+  pthread_condattr_t cond_attr;
+  int cond_failed = pthread_condattr_init(&cond_attr) != 0;
+  if (!cond_failed) {
+#ifdef CLOCK_MONOTONIC
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+#endif
+    cond_failed = pthread_cond_init(&db->scheduler.cond, &cond_attr) != 0;
+    pthread_condattr_destroy(&cond_attr);
+  }
+  if (cond_failed) {
+    pthread_mutex_destroy(&db->scheduler.mutex);
+    pthread_rwlock_destroy(&db->lock);
+    VDB_FREE(db);
+    return NULL;
+  }
 #endif
 
   return db;
 }
 
-static inline vdb_error vdb_add_vector(vdb_database* db, const float* data,
-                                       const char* id, void* metadata) {
-  if (!db || !data)
-    return VDB_ERROR_NULL_POINTER;
-
-#ifdef VDB_MULTITHREADED
-  pthread_rwlock_wrlock(&db->lock);
-#endif
+static inline uint64_t vdb_hash_vector(const float* data, size_t dims) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  const unsigned char* bytes = (const unsigned char*)data;
 
-  if (db->count >= db->capacity) {
-    size_t new_capacity = db->capacity == 0 ? 16 : db->capacity * 2;
-    vdb_vector* new_vectors = (vdb_vector*)VDB_REALLOC(
-        db->vectors, new_capacity * sizeof(vdb_vector));
-    if (!new_vectors) {
-#ifdef VDB_MULTITHREADED
-      pthread_rwlock_unlock(&db->lock);
-#endif
-      return VDB_ERROR_OUT_OF_MEMORY;
-    }
-    db->vectors = new_vectors;
-    db->capacity = new_capacity;
+  for (size_t i = 0; i < dims * sizeof(float); i++) {
+    h ^= bytes[i];
+    h *= 0x100000001B3ULL;
   }
 
-  vdb_vector* vec = &db->vectors[db->count];
+  return h;
+}
 
-  vec->data = (float*)VDB_MALLOC(db->dimensions * sizeof(float));
-  if (!vec->data) {
-#ifdef VDB_MULTITHREADED
-    pthread_rwlock_unlock(&db->lock);
-#endif
-    return VDB_ERROR_OUT_OF_MEMORY;
+static inline size_t vdb_dedup_lookup(const vdb_database* db,
+                                      const float* data) {
+  size_t mask = db->dedup_capacity - 1;
+  size_t slot = (size_t)vdb_hash_vector(data, db->dimensions) & mask;
+
+  while (db->dedup_table[slot] != SIZE_MAX) {
+    size_t index = db->dedup_table[slot];
+    if (memcmp(db->vectors[index].data, data,
+               db->dimensions * sizeof(float)) == 0)
+      return index;
+    slot = (slot + 1) & mask;
   }
 
-  memcpy(vec->data, data, db->dimensions * sizeof(float));
+  return SIZE_MAX;
+}
 
-  if (id) {
-    size_t id_len = strlen(id);
-    vec->id = (char*)VDB_MALLOC(id_len + 1);
-    if (!vec->id) {
-      VDB_FREE(vec->data);
-#ifdef VDB_MULTITHREADED
-      pthread_rwlock_unlock(&db->lock);
-#endif
+static inline void vdb_dedup_insert(vdb_database* db, size_t index) {
+  size_t mask = db->dedup_capacity - 1;
+  size_t slot =
+      (size_t)vdb_hash_vector(db->vectors[index].data, db->dimensions) & mask;
+
+  while (db->dedup_table[slot] != SIZE_MAX)
+    slot = (slot + 1) & mask;
+  db->dedup_table[slot] = index;
+}
+
+/* The exact-duplicate table maps vector bytes to indices. Removal shifts
+ * indices, so it is rebuilt here on first use after any removal or once it
+ * is half full. */
+static inline vdb_error vdb_dedup_prepare(vdb_database* db) {
+  if (!db->dedup_stale && (db->count + 1) * 2 <= db->dedup_capacity)
+    return VDB_OK;
+
+  size_t capacity = 64;
+  while (capacity < (db->count + 1) * 4)
+    capacity *= 2;
+
+  if (capacity != db->dedup_capacity) {
+    size_t* table = (size_t*)VDB_MALLOC(capacity * sizeof(size_t));
+    if (!table)
       return VDB_ERROR_OUT_OF_MEMORY;
-    }
-    memcpy(vec->id, id, id_len + 1);
-  } else {
-    vec->id = NULL;
+    VDB_FREE(db->dedup_table);
+    db->dedup_table = table;
+    db->dedup_capacity = capacity;
   }
 
-  vec->metadata = metadata;
-  db->count++;
-
-#ifdef VDB_MULTITHREADED
-  pthread_rwlock_unlock(&db->lock);
-#endif
+  memset(db->dedup_table, 0xFF, capacity * sizeof(size_t));
+  for (size_t i = 0; i < db->count; i++)
+    vdb_dedup_insert(db, i);
+  db->dedup_stale = 0;
 
   return VDB_OK;
 }
 
-static inline int vdb_result_compare(const void* a, const void* b) {
-  const vdb_result* ra = (const vdb_result*)a;
+static inline size_t vdb_dedup_scan(const vdb_database* db, const float* data,
+                                    size_t start, size_t end) {
+  for (size_t i = start; i < end; i++) {
+    float d = vdb_compute_distance(data, db->vectors[i].data, db->dimensions,
+                                   db->metric);
+    if (d <= db->dedup_threshold)
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+static inline size_t vdb_dedup_find(const vdb_database* db, const float* data,
+                                    size_t start) {
+  size_t match = vdb_dedup_lookup(db, data);
+  if (match == SIZE_MAX && db->dedup_threshold > 0.0f)
+    match = vdb_dedup_scan(db, data, start, db->count);
+  return match;
+}
+
+static inline vdb_error vdb_set_dedup(vdb_database* db, vdb_dedup_mode mode,
+                                      float threshold) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  db->dedup_mode = mode;
+  db->dedup_threshold = threshold;
+  db->dedup_stale = 1;
+  if (mode == VDB_DEDUP_NONE) {
+    VDB_FREE(db->dedup_table);
+    db->dedup_table = NULL;
+    db->dedup_capacity = 0;
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_sparse_reserve_rows(vdb_database* db,
+                                                size_t rows) {
+  if (rows + 1 <= db->sparse_row_capacity)
+    return VDB_OK;
+
+  size_t capacity =
+      db->sparse_row_capacity == 0 ? 16 : db->sparse_row_capacity * 2;
+  while (capacity < rows + 1)
+    capacity *= 2;
+
+  size_t* offsets =
+      (size_t*)VDB_REALLOC(db->sparse_rows, capacity * sizeof(size_t));
+  if (!offsets)
+    return VDB_ERROR_OUT_OF_MEMORY;
+
+  if (!db->sparse_rows)
+    memset(offsets, 0, (db->count + 1) * sizeof(size_t));
+  db->sparse_rows = offsets;
+  db->sparse_row_capacity = capacity;
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_posting_reserve(vdb_posting_list* list) {
+  if (list->count >= list->capacity) {
+    size_t capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+    size_t* rows =
+        (size_t*)VDB_REALLOC(list->rows, capacity * sizeof(size_t));
+    if (!rows)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    list->rows = rows;
+    float* values =
+        (float*)VDB_REALLOC(list->values, capacity * sizeof(float));
+    if (!values)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    list->values = values;
+    list->capacity = capacity;
+  }
+  return VDB_OK;
+}
+
+/* Makes room for one more row with the nnz entries in indices, so that
+ * vdb_sparse_attach_unlocked cannot fail once the row is inserted. */
+static inline vdb_error vdb_sparse_reserve_unlocked(vdb_database* db,
+                                                    const uint32_t* indices,
+                                                    size_t nnz) {
+  vdb_error err = vdb_sparse_reserve_rows(db, db->count + 1);
+  if (err != VDB_OK)
+    return err;
+
+  uint32_t max_dim = 0;
+
+  for (size_t i = 0; i < nnz; i++) {
+    if (indices[i] > max_dim)
+      max_dim = indices[i];
+  }
+
+  if (nnz > 0 && (size_t)max_dim + 1 > db->posting_dims) {
+    size_t dims = db->posting_dims == 0 ? 1024 : db->posting_dims;
+    while (dims < (size_t)max_dim + 1)
+      dims *= 2;
+    vdb_posting_list* postings = (vdb_posting_list*)VDB_REALLOC(
+        db->postings, dims * sizeof(vdb_posting_list));
+    if (!postings)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    memset(postings + db->posting_dims, 0,
+           (dims - db->posting_dims) * sizeof(vdb_posting_list));
+    db->postings = postings;
+    db->posting_dims = dims;
+  }
+
+  if (db->sparse_nnz + nnz > db->sparse_capacity) {
+    size_t capacity = db->sparse_capacity == 0 ? 256 : db->sparse_capacity;
+    while (capacity < db->sparse_nnz + nnz)
+      capacity *= 2;
+    uint32_t* new_indices = (uint32_t*)VDB_REALLOC(
+        db->sparse_indices, capacity * sizeof(uint32_t));
+    if (!new_indices)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    db->sparse_indices = new_indices;
+    float* new_values =
+        (float*)VDB_REALLOC(db->sparse_values, capacity * sizeof(float));
+    if (!new_values)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    db->sparse_values = new_values;
+    db->sparse_capacity = capacity;
+  }
+
+  for (size_t i = 0; i < nnz && err == VDB_OK; i++)
+    err = vdb_posting_reserve(&db->postings[indices[i]]);
+  return err;
+}
+
+/* Gives the last row, which must still be empty, the entries (indices[i],
+ * values[i]), in space set aside by vdb_sparse_reserve_unlocked. Rows are
+ * appended in index order, so posting lists stay sorted by row without any
+ * extra work. */
+static inline void vdb_sparse_attach_unlocked(vdb_database* db,
+                                              const uint32_t* indices,
+                                              const float* values,
+                                              size_t nnz) {
+  size_t row = db->count - 1;
+
+  for (size_t i = 0; i < nnz; i++) {
+    vdb_posting_list* list = &db->postings[indices[i]];
+    list->rows[list->count] = row;
+    list->values[list->count] = values[i];
+    list->count++;
+  }
+
+  if (nnz > 0) {
+    memcpy(db->sparse_indices + db->sparse_nnz, indices,
+           nnz * sizeof(uint32_t));
+    memcpy(db->sparse_values + db->sparse_nnz, values, nnz * sizeof(float));
+  }
+  db->sparse_nnz += nnz;
+  db->sparse_rows[row + 1] = db->sparse_nnz;
+}
+
+static inline void vdb_sparse_remove_unlocked(vdb_database* db, size_t index) {
+  size_t start = db->sparse_rows[index];
+  size_t end = db->sparse_rows[index + 1];
+  size_t len = end - start;
+
+  for (size_t d = 0; d < db->posting_dims; d++) {
+    vdb_posting_list* list = &db->postings[d];
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+      if (list->rows[i] == index)
+        continue;
+      list->rows[kept] = list->rows[i] > index ? list->rows[i] - 1
+                                               : list->rows[i];
+      list->values[kept] = list->values[i];
+      kept++;
+    }
+    list->count = kept;
+  }
+
+  memmove(db->sparse_indices + start, db->sparse_indices + end,
+          (db->sparse_nnz - end) * sizeof(uint32_t));
+  memmove(db->sparse_values + start, db->sparse_values + end,
+          (db->sparse_nnz - end) * sizeof(float));
+  db->sparse_nnz -= len;
+
+  for (size_t r = index + 1; r < db->count; r++)
+    db->sparse_rows[r] = db->sparse_rows[r + 1] - len;
+}
+
+static inline vdb_field* vdb_find_field(const vdb_database* db,
+                                        const char* name) {
+  for (size_t f = 0; f < db->field_count; f++) {
+    if (strcmp(db->fields[f].name, name) == 0)
+      return &db->fields[f];
+  }
+  return NULL;
+}
+
+static inline vdb_error vdb_field_reserve(vdb_field* field, size_t rows) {
+  if (rows <= field->capacity)
+    return VDB_OK;
+
+  size_t capacity = field->capacity == 0 ? 16 : field->capacity * 2;
+  while (capacity < rows)
+    capacity *= 2;
+
+  float* data = (float*)VDB_REALLOC(
+      field->data, capacity * field->dimensions * sizeof(float));
+  if (!data)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  field->data = data;
+
+  float* norms = (float*)VDB_REALLOC(field->norms, capacity * sizeof(float));
+  if (!norms)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  field->norms = norms;
+
+  unsigned char* present =
+      (unsigned char*)VDB_REALLOC(field->present, capacity);
+  if (!present)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  memset(present + field->capacity, 0, capacity - field->capacity);
+  field->present = present;
+
+  field->capacity = capacity;
+  return VDB_OK;
+}
+
+static inline void vdb_field_store(vdb_field* field, size_t row,
+                                   const float* data) {
+  memcpy(field->data + row * field->dimensions, data,
+         field->dimensions * sizeof(float));
+  field->norms[row] = vdb_magnitude(data, field->dimensions);
+  field->present[row] = 1;
+}
+
+static inline void vdb_field_remove_row(vdb_field* field, size_t row,
+                                        size_t count) {
+  size_t tail = count - row - 1;
+  memmove(field->data + row * field->dimensions,
+          field->data + (row + 1) * field->dimensions,
+          tail * field->dimensions * sizeof(float));
+  memmove(field->norms + row, field->norms + row + 1, tail * sizeof(float));
+  memmove(field->present + row, field->present + row + 1, tail);
+  field->present[count - 1] = 0;
+}
+
+/* Declares an additional named vector field. Every record gets a slot for
+ * it, empty until vdb_set_field_vector fills it; ids and metadata stay
+ * shared with the primary vector. */
+static inline vdb_error vdb_add_field(vdb_database* db, const char* name,
+                                      size_t dimensions, vdb_metric metric) {
+  if (!db || !name)
+    return VDB_ERROR_NULL_POINTER;
+  if (dimensions == 0)
+    return VDB_ERROR_INVALID_DIMENSIONS;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  vdb_error err = VDB_OK;
+  vdb_field* fields = NULL;
+  char* name_copy = NULL;
+
+  if (db->cdc_ring) {
+    err = VDB_ERROR_UNSUPPORTED; /* field vectors are not recorded */
+  } else if (vdb_find_field(db, name)) {
+    err = VDB_ERROR_DUPLICATE;
+  } else {
+    fields = (vdb_field*)VDB_REALLOC(
+        db->fields, (db->field_count + 1) * sizeof(vdb_field));
+    name_copy = (char*)VDB_MALLOC(strlen(name) + 1);
+    if (fields)
+      db->fields = fields;
+    if (!fields || !name_copy)
+      err = VDB_ERROR_OUT_OF_MEMORY;
+  }
+
+  if (err == VDB_OK) {
+    vdb_field* field = &db->fields[db->field_count];
+    memcpy(name_copy, name, strlen(name) + 1);
+    field->name = name_copy;
+    field->dimensions = dimensions;
+    field->metric = metric;
+    field->data = NULL;
+    field->norms = NULL;
+    field->present = NULL;
+    field->capacity = 0;
+    err = vdb_field_reserve(field, db->count > 0 ? db->count : 1);
+    if (err == VDB_OK) {
+      db->field_count++;
+    } else {
+      VDB_FREE(field->data);
+      VDB_FREE(field->norms);
+      VDB_FREE(field->present);
+      VDB_FREE(name_copy);
+    }
+  } else {
+    VDB_FREE(name_copy);
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return err;
+}
+
+static inline vdb_error vdb_reserve(vdb_database* db, size_t needed) {
+  if (needed <= db->capacity)
+    return VDB_OK;
+
+  size_t new_capacity = db->capacity == 0 ? 16 : db->capacity * 2;
+  while (new_capacity < needed)
+    new_capacity *= 2;
+
+  vdb_vector* new_vectors = (vdb_vector*)VDB_REALLOC(
+      db->vectors, new_capacity * sizeof(vdb_vector));
+  if (!new_vectors)
+    return VDB_ERROR_OUT_OF_MEMORY;
+
+  db->vectors = new_vectors;
+  db->capacity = new_capacity;
+  return VDB_OK;
+}
+
+static inline char* vdb_copy_string(const char* s) {
+  if (!s)
+    return NULL;
+  size_t len = strlen(s);
+  char* copy = (char*)VDB_MALLOC(len + 1);
+  if (copy)
+    memcpy(copy, s, len + 1);
+  return copy;
+}
+
+/* Fails with VDB_ERROR_BUSY when, in VDB_CDC_REJECT mode, n more records
+ * would overwrite ones not yet acknowledged. */
+static inline vdb_error vdb_cdc_reserve(const vdb_database* db, size_t n) {
+  if (!db->cdc_ring || db->cdc_mode != VDB_CDC_REJECT)
+    return VDB_OK;
+
+  uint64_t floor = db->cdc_acked > db->cdc_tail ? db->cdc_acked : db->cdc_tail;
+  if (db->cdc_head - floor + n > db->cdc_capacity)
+    return VDB_ERROR_BUSY;
+  return VDB_OK;
+}
+
+/* Appends a record, taking ownership of id. A record that cannot be stored
+ * drops the whole backlog so readers see VDB_ERROR_OVERFLOW rather than a
+ * gap. */
+static inline void vdb_cdc_log_unlocked(vdb_database* db, vdb_cdc_op op,
+                                        size_t index, const float* data,
+                                        char* id, int id_failed) {
+  if (!db->cdc_ring) {
+    VDB_FREE(id);
+    return;
+  }
+
+  if (db->cdc_head - db->cdc_tail == db->cdc_capacity) {
+    VDB_FREE(db->cdc_ring[db->cdc_tail % db->cdc_capacity].id);
+    db->cdc_tail++;
+  }
+
+  uint64_t seq = db->cdc_head++;
+  size_t slot = seq % db->cdc_capacity;
+  vdb_cdc_record* record = &db->cdc_ring[slot];
+
+  record->seq = seq;
+  record->op = op;
+  record->index = index;
+  record->id = id;
+  if (data) {
+    record->data = db->cdc_data + slot * db->dimensions;
+    memcpy(record->data, data, db->dimensions * sizeof(float));
+  } else {
+    record->data = NULL;
+  }
+
+  if (id_failed) {
+    while (db->cdc_tail < db->cdc_head) {
+      VDB_FREE(db->cdc_ring[db->cdc_tail % db->cdc_capacity].id);
+      db->cdc_tail++;
+    }
+  }
+}
+
+static inline void vdb_cdc_log_row_unlocked(vdb_database* db,
+                                            vdb_cdc_op op, size_t index) {
+  if (!db->cdc_ring)
+    return;
+  const char* id = db->vectors[index].id;
+  char* copy = vdb_copy_string(id);
+  vdb_cdc_log_unlocked(db, op, index, db->vectors[index].data, copy,
+                       id && !copy);
+}
+
+static inline void vdb_cdc_free_ring(vdb_database* db) {
+  for (uint64_t seq = db->cdc_tail; seq < db->cdc_head; seq++)
+    VDB_FREE(db->cdc_ring[seq % db->cdc_capacity].id);
+  VDB_FREE(db->cdc_ring);
+  VDB_FREE(db->cdc_data);
+  db->cdc_ring = NULL;
+  db->cdc_data = NULL;
+  db->cdc_capacity = 0;
+}
+
+/* Starts recording mutations into a ring of capacity records, or stops
+ * when capacity is 0. Sequence numbers keep increasing across restarts.
+ * Field vectors and sparse entries are not recorded, so databases that
+ * hold either get VDB_ERROR_UNSUPPORTED, and so do later attempts to add
+ * them while recording. */
+static inline vdb_error vdb_cdc_enable(vdb_database* db, size_t capacity,
+                                       vdb_cdc_mode mode) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_cdc_record* ring = NULL;
+  float* data = NULL;
+  if (capacity > 0) {
+    ring = (vdb_cdc_record*)VDB_MALLOC(capacity * sizeof(vdb_cdc_record));
+    data = (float*)VDB_MALLOC(capacity * db->dimensions * sizeof(float));
+    if (!ring || !data) {
+      VDB_FREE(ring);
+      VDB_FREE(data);
+      return VDB_ERROR_OUT_OF_MEMORY;
+    }
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  /* records carry only the dense vector and id */
+  if (ring && (db->field_count > 0 || db->sparse_nnz > 0)) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock(&db->lock);
+#endif
+    VDB_FREE(ring);
+    VDB_FREE(data);
+    return VDB_ERROR_UNSUPPORTED;
+  }
+
+  vdb_cdc_free_ring(db);
+  db->cdc_ring = ring;
+  db->cdc_data = data;
+  db->cdc_capacity = capacity;
+  db->cdc_mode = mode;
+  db->cdc_tail = db->cdc_head;
+  db->cdc_acked = db->cdc_head;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return VDB_OK;
+}
+
+/* Sequence number the next mutation will get. */
+static inline uint64_t vdb_cdc_position(const vdb_database* db) {
+  if (!db)
+    return 0;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+  uint64_t head = db->cdc_head;
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return head;
+}
+
+/* Marks every record before seq as consumed, freeing its slot for reuse in
+ * VDB_CDC_REJECT mode. With several consumers, acknowledge the lowest
+ * position among them. */
+static inline vdb_error vdb_cdc_ack(vdb_database* db, uint64_t seq) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+  if (seq > db->cdc_head)
+    seq = db->cdc_head;
+  if (seq > db->cdc_acked)
+    db->cdc_acked = seq;
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return VDB_OK;
+}
+
+static inline void vdb_cdc_free_batch(vdb_cdc_batch* batch) {
+  if (!batch)
+    return;
+  for (size_t i = 0; i < batch->count; i++)
+    VDB_FREE(batch->records[i].id);
+  VDB_FREE(batch->records);
+  VDB_FREE(batch->data);
+  VDB_FREE(batch);
+}
+
+/* Copies up to max records starting at sequence number from into *out.
+ * Returns VDB_ERROR_OVERFLOW when records after from have already been
+ * overwritten; the consumer must then resynchronise from a snapshot and
+ * continue at vdb_cdc_position. */
+static inline vdb_error vdb_cdc_read(const vdb_database* db, uint64_t from,
+                                     size_t max, vdb_cdc_batch** out) {
+  if (!db || !out)
+    return VDB_ERROR_NULL_POINTER;
+
+  *out = NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  vdb_error err = VDB_OK;
+  vdb_cdc_batch* batch = NULL;
+
+  if (from < db->cdc_tail) {
+    err = VDB_ERROR_OVERFLOW;
+  } else {
+    if (from > db->cdc_head)
+      from = db->cdc_head;
+    size_t count = (size_t)(db->cdc_head - from);
+    if (count > max)
+      count = max;
+
+    batch = (vdb_cdc_batch*)VDB_MALLOC(sizeof(vdb_cdc_batch));
+    vdb_cdc_record* records =
+        (vdb_cdc_record*)VDB_MALLOC((count ? count : 1) *
+                                    sizeof(vdb_cdc_record));
+    float* data = (float*)VDB_MALLOC((count ? count : 1) * db->dimensions *
+                                     sizeof(float));
+
+    if (batch && records && data) {
+      batch->records = records;
+      batch->data = data;
+      batch->count = 0;
+      batch->dimensions = db->dimensions;
+      for (size_t i = 0; i < count && err == VDB_OK; i++) {
+        const vdb_cdc_record* src =
+            &db->cdc_ring[(from + i) % db->cdc_capacity];
+        records[i] = *src;
+        if (src->data) {
+          records[i].data = data + i * db->dimensions;
+          memcpy(records[i].data, src->data, db->dimensions * sizeof(float));
+        }
+        records[i].id = vdb_copy_string(src->id);
+        if (src->id && !records[i].id)
+          err = VDB_ERROR_OUT_OF_MEMORY;
+        else
+          batch->count++;
+      }
+      batch->next_seq = from + batch->count;
+    } else {
+      VDB_FREE(batch);
+      VDB_FREE(records);
+      VDB_FREE(data);
+      batch = NULL;
+      err = VDB_ERROR_OUT_OF_MEMORY;
+    }
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (err != VDB_OK) {
+    vdb_cdc_free_batch(batch);
+    return err;
+  }
+
+  *out = batch;
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_insert_unlocked(vdb_database* db,
+                                            const float* data, const char* id,
+                                            void* metadata) {
+  vdb_error err = vdb_cdc_reserve(db, 1);
+  if (err == VDB_OK)
+    err = vdb_reserve(db, db->count + 1);
+  if (err == VDB_OK && db->sparse_rows)
+    err = vdb_sparse_reserve_rows(db, db->count + 1);
+  for (size_t f = 0; f < db->field_count && err == VDB_OK; f++)
+    err = vdb_field_reserve(&db->fields[f], db->count + 1);
+  if (err != VDB_OK)
+    return err;
+
+  vdb_vector* vec = &db->vectors[db->count];
+
+  vec->data = (float*)VDB_MALLOC(db->dimensions * sizeof(float));
+  if (!vec->data)
+    return VDB_ERROR_OUT_OF_MEMORY;
+
+  memcpy(vec->data, data, db->dimensions * sizeof(float));
+
+  if (id) {
+    size_t id_len = strlen(id);
+    vec->id = (char*)VDB_MALLOC(id_len + 1);
+    if (!vec->id) {
+      VDB_FREE(vec->data);
+      return VDB_ERROR_OUT_OF_MEMORY;
+    }
+    memcpy(vec->id, id, id_len + 1);
+  } else {
+    vec->id = NULL;
+  }
+
+  vec->metadata = metadata;
+  db->count++;
+  db->version++;
+
+  if (db->sparse_rows)
+    db->sparse_rows[db->count] = db->sparse_rows[db->count - 1];
+  for (size_t f = 0; f < db->field_count; f++)
+    db->fields[f].present[db->count - 1] = 0;
+
+  if (db->dedup_mode != VDB_DEDUP_NONE && !db->dedup_stale) {
+    if (db->count * 2 <= db->dedup_capacity)
+      vdb_dedup_insert(db, db->count - 1);
+    else
+      db->dedup_stale = 1;
+  }
+
+  vdb_cdc_log_row_unlocked(db, VDB_CDC_ADD, db->count - 1);
+  return VDB_OK;
+}
+
+/* Resolves a duplicate of the record at index: rejected, or merged by
+ * handing the existing record the incoming metadata. */
+static inline vdb_error vdb_dedup_resolve(vdb_database* db, size_t index,
+                                          void* metadata) {
+  if (db->dedup_mode == VDB_DEDUP_REJECT)
+    return VDB_ERROR_DUPLICATE;
+  if (metadata) {
+    db->vectors[index].metadata = metadata;
+    db->version++;
+  }
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_add_unlocked(vdb_database* db, const float* data,
+                                         const char* id, void* metadata,
+                                         size_t* out_index) {
+  if (db->read_only)
+    return VDB_ERROR_READ_ONLY;
+
+  if (db->dedup_mode != VDB_DEDUP_NONE) {
+    vdb_error err = vdb_dedup_prepare(db);
+    if (err != VDB_OK)
+      return err;
+    size_t match = vdb_dedup_find(db, data, 0);
+    if (match != SIZE_MAX) {
+      *out_index = match;
+      return vdb_dedup_resolve(db, match, metadata);
+    }
+  }
+
+  *out_index = db->count;
+  return vdb_insert_unlocked(db, data, id, metadata);
+}
+
+/* Distance from v to a pivot in the space where pivots prune. For cosine
+ * that is the euclidean distance between v / norm and the unit pivot,
+ * sqrt(2 * cosine distance). */
+static inline float vdb_watch_pivot_distance(const vdb_database* db,
+                                             const float* v, float norm,
+                                             const float* pivot) {
+  if (db->metric != VDB_METRIC_COSINE)
+    return vdb_euclidean_distance(v, pivot, db->dimensions);
+  float similarity =
+      norm > 0.0f ? vdb_dot_product(v, pivot, db->dimensions) / norm : 0.0f;
+  return sqrtf(fmaxf(0.0f, 2.0f - 2.0f * similarity));
+}
+
+static inline vdb_error vdb_watch(vdb_database* db, const float* query,
+                                  float radius, vdb_watch_callback callback,
+                                  void* user, uint64_t* out_watch) {
+  if (!db || !query || !callback)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  vdb_error err = VDB_OK;
+  float* copy = (float*)VDB_MALLOC(db->dimensions * sizeof(float));
+
+  if (!copy)
+    err = VDB_ERROR_OUT_OF_MEMORY;
+
+  if (err == VDB_OK && db->watch_count == db->watch_capacity) {
+    size_t capacity = db->watch_capacity == 0 ? 16 : db->watch_capacity * 2;
+    vdb_standing_query* watches = (vdb_standing_query*)VDB_REALLOC(
+        db->watches, capacity * sizeof(vdb_standing_query));
+    if (watches) {
+      db->watches = watches;
+      db->watch_capacity = capacity;
+    } else {
+      err = VDB_ERROR_OUT_OF_MEMORY;
+    }
+  }
+
+  if (err == VDB_OK && db->metric != VDB_METRIC_DOT_PRODUCT &&
+      !db->watch_pivots) {
+    db->watch_pivots = (float*)VDB_MALLOC(VDB_WATCH_PIVOTS * db->dimensions *
+                                          sizeof(float));
+    if (!db->watch_pivots)
+      err = VDB_ERROR_OUT_OF_MEMORY;
+  }
+
+  if (err != VDB_OK) {
+    VDB_FREE(copy);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock(&db->lock);
+#endif
+    return err;
+  }
+
+  memcpy(copy, query, db->dimensions * sizeof(float));
+
+  vdb_standing_query* w = &db->watches[db->watch_count++];
+  w->id = ++db->next_watch;
+  w->query = copy;
+  w->norm = vdb_magnitude(copy, db->dimensions);
+  w->radius = radius;
+  w->callback = callback;
+  w->user = user;
+
+  /* the first queries double as pivots; existing queries get a column for
+   * each new pivot */
+  if (db->watch_pivots && db->watch_npivots < VDB_WATCH_PIVOTS &&
+      (db->metric != VDB_METRIC_COSINE || w->norm > 0.0f)) {
+    float* pivot = db->watch_pivots + db->watch_npivots * db->dimensions;
+    for (size_t d = 0; d < db->dimensions; d++)
+      pivot[d] = db->metric == VDB_METRIC_COSINE ? copy[d] / w->norm : copy[d];
+    for (size_t i = 0; i + 1 < db->watch_count; i++)
+      db->watches[i].pivot_dist[db->watch_npivots] = vdb_watch_pivot_distance(
+          db, db->watches[i].query, db->watches[i].norm, pivot);
+    db->watch_npivots++;
+  }
+  for (size_t p = 0; p < db->watch_npivots; p++)
+    w->pivot_dist[p] = vdb_watch_pivot_distance(
+        db, copy, w->norm, db->watch_pivots + p * db->dimensions);
+
+  if (out_watch)
+    *out_watch = w->id;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_unwatch(vdb_database* db, uint64_t watch) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  vdb_error err = VDB_ERROR_NOT_FOUND;
+  for (size_t i = 0; i < db->watch_count; i++) {
+    if (db->watches[i].id == watch) {
+      VDB_FREE(db->watches[i].query);
+      db->watches[i] = db->watches[--db->watch_count];
+      err = VDB_OK;
+      break;
+    }
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return err;
+}
+
+/* Matches rows [start, end) against the standing queries. A query is
+ * skipped without computing its distance when, for some pivot p,
+ * |d(x, p) - d(q, p)| exceeds its radius (triangle inequality). Cosine
+ * distances are compared on unit vectors, where a radius r becomes
+ * sqrt(2 * r); zero vectors and dot-product databases are never pruned.
+ * Returns the matches for vdb_watch_notify to deliver once the lock is
+ * released. If some could not be recorded, an *err that is still VDB_OK
+ * becomes VDB_ERROR_OUT_OF_MEMORY. */
+static inline vdb_watch_match* vdb_watch_match_unlocked(
+    const vdb_database* db, size_t start, size_t end, size_t* out_count,
+    vdb_error* err) {
+  vdb_watch_match* matches = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  float pivot_dist[VDB_WATCH_PIVOTS];
+
+  *out_count = 0;
+  if (db->watch_count == 0)
+    return NULL;
+
+  for (size_t row = start; row < end; row++) {
+    const float* v = db->vectors[row].data;
+    float norm = db->metric == VDB_METRIC_COSINE
+                     ? vdb_magnitude(v, db->dimensions)
+                     : 0.0f;
+
+    int cosine = db->metric == VDB_METRIC_COSINE;
+    size_t npivots = cosine && norm == 0.0f ? 0 : db->watch_npivots;
+
+    for (size_t p = 0; p < npivots; p++)
+      pivot_dist[p] = vdb_watch_pivot_distance(
+          db, v, norm, db->watch_pivots + p * db->dimensions);
+
+    for (size_t i = 0; i < db->watch_count; i++) {
+      const vdb_standing_query* w = &db->watches[i];
+      float radius = cosine ? sqrtf(2.0f * fmaxf(w->radius, 0.0f)) : w->radius;
+      float slack = radius * 1e-4f + (cosine ? 1e-3f : 1e-6f);
+      size_t limit = cosine && w->norm == 0.0f ? 0 : npivots;
+      size_t p = 0;
+
+      while (p < limit &&
+             fabsf(pivot_dist[p] - w->pivot_dist[p]) <= radius + slack)
+        p++;
+      if (p < limit)
+        continue;
+
+      float distance = vdb_compute_distance_normed(
+          w->query, v, w->norm, norm, db->dimensions, db->metric);
+      if (distance > w->radius)
+        continue;
+
+      if (count == capacity) {
+        size_t new_capacity = capacity == 0 ? 16 : capacity * 2;
+        vdb_watch_match* grown = (vdb_watch_match*)VDB_REALLOC(
+            matches, new_capacity * sizeof(vdb_watch_match));
+        if (!grown) {
+          if (*err == VDB_OK)
+            *err = VDB_ERROR_OUT_OF_MEMORY;
+          break;
+        }
+        matches = grown;
+        capacity = new_capacity;
+      }
+      matches[count].watch = w->id;
+      matches[count].index = row;
+      matches[count].distance = distance;
+      matches[count].callback = w->callback;
+      matches[count].user = w->user;
+      count++;
+    }
+  }
+
+  *out_count = count;
+  return matches;
+}
+
+static inline void vdb_watch_notify(vdb_watch_match* matches, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    matches[i].callback(matches[i].watch, matches[i].index,
+                        matches[i].distance, matches[i].user);
+  VDB_FREE(matches);
+}
+
+/* Like vdb_add_vector, and sets *out_index to the record the vector was
+ * stored in: the new row, or the existing one a duplicate merged into. */
+static inline vdb_error vdb_add_vector_ex(vdb_database* db, const float* data,
+                                          const char* id, void* metadata,
+                                          size_t* out_index) {
+  if (!db || !data)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  size_t index = 0;
+  size_t count = db->count;
+  size_t nmatches;
+  vdb_error err = vdb_add_unlocked(db, data, id, metadata, &index);
+  if (err == VDB_OK && out_index)
+    *out_index = index;
+  vdb_watch_match* matches =
+      vdb_watch_match_unlocked(db, count, db->count, &nmatches, &err);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  vdb_watch_notify(matches, nmatches);
+  return err;
+}
+
+static inline vdb_error vdb_add_vector(vdb_database* db, const float* data,
+                                       const char* id, void* metadata) {
+  return vdb_add_vector_ex(db, data, id, metadata, NULL);
+}
+
+/* Adds a record with a dense vector and a sparse vector of nnz (index,
+ * value) pairs with unique indices. A record with entries that duplicates
+ * an existing one fails with VDB_ERROR_DUPLICATE in either dedup mode;
+ * one without entries merges as vdb_add_vector does. */
+static inline vdb_error vdb_add_vector_sparse(vdb_database* db,
+                                              const float* data,
+                                              const uint32_t* indices,
+                                              const float* values, size_t nnz,
+                                              const char* id, void* metadata) {
+  if (!db || !data || (nnz > 0 && (!indices || !values)))
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  /* a record with no entries is an ordinary add, so only that is logged;
+   * one with entries cannot merge into a duplicate without losing them */
+  size_t index;
+  size_t count = db->count;
+  vdb_error err = db->cdc_ring && nnz > 0 ? VDB_ERROR_UNSUPPORTED : VDB_OK;
+  if (err == VDB_OK && nnz > 0 && db->dedup_mode != VDB_DEDUP_NONE) {
+    err = vdb_dedup_prepare(db);
+    if (err == VDB_OK && vdb_dedup_find(db, data, 0) != SIZE_MAX)
+      err = VDB_ERROR_DUPLICATE;
+  }
+  if (err == VDB_OK)
+    err = vdb_sparse_reserve_unlocked(db, indices, nnz);
+  if (err == VDB_OK)
+    err = vdb_add_unlocked(db, data, id, metadata, &index);
+  if (err == VDB_OK && db->count > count)
+    vdb_sparse_attach_unlocked(db, indices, values, nnz);
+  size_t nmatches;
+  vdb_watch_match* matches =
+      vdb_watch_match_unlocked(db, count, db->count, &nmatches, &err);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  vdb_watch_notify(matches, nmatches);
+  return err;
+}
+
+static inline void vdb_dedup_worker(void* arg, size_t worker,
+                                    size_t nworkers) {
+  vdb_dedup_thread_args* args = (vdb_dedup_thread_args*)arg;
+  const vdb_database* db = args->db;
+  size_t start = args->count * worker / nworkers;
+  size_t end = args->count * (worker + 1) / nworkers;
+
+  for (size_t i = start; i < end; i++)
+    args->matches[i] = vdb_dedup_find(db, args->data + i * db->dimensions, 0);
+}
+
+/* Inserts count vectors stored back to back in data. ids and metadata may
+ * be NULL. With deduplication enabled, incoming vectors are checked against
+ * the existing records in parallel, then against earlier vectors of the
+ * same batch. out_indices, if given, receives the index each vector was
+ * stored at or merged into, or SIZE_MAX if it was rejected; the call then
+ * returns VDB_ERROR_DUPLICATE after inserting everything else. */
+static inline vdb_error vdb_add_vectors(vdb_database* db, const float* data,
+                                        size_t count, const char* const* ids,
+                                        void* const* metadata,
+                                        size_t* out_indices) {
+  if (!db || !data)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  size_t base = db->count;
+  size_t* matches = NULL;
+  vdb_error err = db->read_only ? VDB_ERROR_READ_ONLY
+                                : vdb_cdc_reserve(db, count);
+  if (err == VDB_OK)
+    err = vdb_reserve(db, db->count + count);
+
+  if (err == VDB_OK && db->dedup_mode != VDB_DEDUP_NONE) {
+    err = vdb_dedup_prepare(db);
+    matches = (size_t*)VDB_MALLOC((count ? count : 1) * sizeof(size_t));
+    if (err == VDB_OK && !matches)
+      err = VDB_ERROR_OUT_OF_MEMORY;
+
+    if (err == VDB_OK) {
+      vdb_dedup_thread_args args;
+      args.db = db;
+      args.data = data;
+      args.count = count;
+      args.matches = matches;
+
+      size_t nworkers = vdb_thread_count();
+      if (nworkers > count)
+        nworkers = count ? count : 1;
+      vdb_run_workers(vdb_dedup_worker, &args, nworkers);
+    }
+  }
+
+  int rejected = 0;
+
+  for (size_t i = 0; i < count && err == VDB_OK; i++) {
+    const float* vec = data + i * db->dimensions;
+    void* meta = metadata ? metadata[i] : NULL;
+    size_t match = SIZE_MAX;
+
+    if (matches) {
+      err = vdb_dedup_prepare(db);
+      if (err != VDB_OK)
+        break;
+      match = matches[i];
+      if (match == SIZE_MAX)
+        match = vdb_dedup_lookup(db, vec);
+      if (match == SIZE_MAX && db->dedup_threshold > 0.0f)
+        match = vdb_dedup_scan(db, vec, base, db->count);
+    }
+
+    if (match != SIZE_MAX) {
+      if (vdb_dedup_resolve(db, match, meta) != VDB_OK) {
+        rejected = 1;
+        match = SIZE_MAX;
+      }
+    } else {
+      err = vdb_insert_unlocked(db, vec, ids ? ids[i] : NULL, meta);
+      match = db->count - 1;
+    }
+
+    if (out_indices && err == VDB_OK)
+      out_indices[i] = match;
+  }
+
+  VDB_FREE(matches);
+
+  size_t nwatched;
+  vdb_watch_match* watched =
+      vdb_watch_match_unlocked(db, base, db->count, &nwatched, &err);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  vdb_watch_notify(watched, nwatched);
+
+  if (err == VDB_OK && rejected)
+    return VDB_ERROR_DUPLICATE;
+  return err;
+}
+
+static inline int vdb_result_compare(const void* a, const void* b) {
+  const vdb_result* ra = (const vdb_result*)a;
   const vdb_result* rb = (const vdb_result*)b;
   if (ra->distance < rb->distance)
     return -1;
@@ -244,108 +1905,3598 @@ static inline int vdb_result_compare(const void* a, const void* b) {
   return 0;
 }
 
-static inline vdb_result_set* vdb_search(const vdb_database* db,
-                                         const float* query, size_t k) {
-  if (!db || !query || k == 0)
+static inline vdb_result_set* vdb_search(const vdb_database* db,
+                                         const float* query, size_t k) {
+  if (!db || !query || k == 0)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (db->count == 0) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  if (k > db->count)
+    k = db->count;
+
+  vdb_result* all_results =
+      (vdb_result*)VDB_MALLOC(db->count * sizeof(vdb_result));
+  if (!all_results) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  for (size_t i = 0; i < db->count; i++) {
+    all_results[i].index = i;
+    all_results[i].distance = vdb_compute_distance(query, db->vectors[i].data,
+                                                   db->dimensions, db->metric);
+    all_results[i].id = db->vectors[i].id;
+    all_results[i].metadata = db->vectors[i].metadata;
+  }
+
+  qsort(all_results, db->count, sizeof(vdb_result), vdb_result_compare);
+
+  vdb_result_set* result_set =
+      (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+  if (!result_set) {
+    VDB_FREE(all_results);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  result_set->results = (vdb_result*)VDB_MALLOC(k * sizeof(vdb_result));
+  if (!result_set->results) {
+    VDB_FREE(all_results);
+    VDB_FREE(result_set);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  memcpy(result_set->results, all_results, k * sizeof(vdb_result));
+  result_set->count = k;
+
+  VDB_FREE(all_results);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return result_set;
+}
+
+static inline size_t vdb_topk_unlocked(const vdb_database* db,
+                                       const float* query, size_t k,
+                                       vdb_result* out) {
+  size_t size = 0;
+  float query_norm = db->metric == VDB_METRIC_COSINE
+                         ? vdb_magnitude(query, db->dimensions)
+                         : 0.0f;
+
+  for (size_t i = 0; i < db->count; i++) {
+    const float* v = db->vectors[i].data;
+    float norm = db->metric == VDB_METRIC_COSINE
+                     ? vdb_magnitude(v, db->dimensions)
+                     : 0.0f;
+    vdb_heap_push(out, &size, k, i,
+                  vdb_compute_distance_normed(query, v, query_norm, norm,
+                                              db->dimensions, db->metric));
+  }
+
+  qsort(out, size, sizeof(vdb_result), vdb_result_compare);
+  for (size_t i = 0; i < size; i++) {
+    out[i].id = db->vectors[out[i].index].id;
+    out[i].metadata = db->vectors[out[i].index].metadata;
+  }
+
+  return size;
+}
+
+/* vdb_search without allocating: the nearest min(k, count) rows are written
+ * to out, which must hold k results, nearest first. Returns how many were
+ * written. Ids and metadata point into the database. */
+static inline size_t vdb_search_into(const vdb_database* db,
+                                     const float* query, size_t k,
+                                     vdb_result* out) {
+  if (!db || !query || !out || k == 0)
+    return 0;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  size_t count = vdb_topk_unlocked(db, query, k, out);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return count;
+}
+
+/* Maximal marginal relevance: from the fetch_k nearest candidates, greedily
+ * picks k maximising lambda * sim(query, c) - (1 - lambda) * max sim(c, s)
+ * over already selected s, with sim = -distance. Each candidate's maximum
+ * similarity to the selection is cached and updated once per pick, so only
+ * O(k * fetch_k) pairwise distances are evaluated. */
+static inline vdb_result_set* vdb_search_mmr(const vdb_database* db,
+                                             const float* query, size_t k,
+                                             size_t fetch_k, float lambda) {
+  if (!db || !query || k == 0)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (db->count == 0) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  if (fetch_k < k)
+    fetch_k = k;
+  if (fetch_k > db->count)
+    fetch_k = db->count;
+
+  vdb_result* candidates =
+      (vdb_result*)VDB_MALLOC(fetch_k * sizeof(vdb_result));
+  float* redundancy = (float*)VDB_MALLOC(fetch_k * sizeof(float));
+  float* norms = (float*)VDB_MALLOC(fetch_k * sizeof(float));
+  vdb_result_set* result_set =
+      (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+  vdb_result* results = (vdb_result*)VDB_MALLOC(
+      (k < fetch_k ? k : fetch_k) * sizeof(vdb_result));
+
+  if (!candidates || !redundancy || !norms || !result_set || !results) {
+    VDB_FREE(candidates);
+    VDB_FREE(redundancy);
+    VDB_FREE(norms);
+    VDB_FREE(result_set);
+    VDB_FREE(results);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  size_t remaining = vdb_topk_unlocked(db, query, fetch_k, candidates);
+  size_t selected = 0;
+
+  for (size_t i = 0; i < remaining; i++) {
+    redundancy[i] = -INFINITY;
+    norms[i] = db->metric == VDB_METRIC_COSINE
+                   ? vdb_magnitude(db->vectors[candidates[i].index].data,
+                                   db->dimensions)
+                   : 0.0f;
+  }
+
+  while (selected < k && remaining > 0) {
+    size_t best = 0;
+    float best_score = -INFINITY;
+    for (size_t i = 0; i < remaining; i++) {
+      float score = -lambda * candidates[i].distance;
+      if (selected > 0)
+        score -= (1.0f - lambda) * redundancy[i];
+      if (score > best_score) {
+        best_score = score;
+        best = i;
+      }
+    }
+
+    results[selected++] = candidates[best];
+
+    /* Swap the pick out of the candidate window, keeping its norm and
+     * cached redundancy aligned with the candidate that replaces it. */
+    const float* picked = db->vectors[candidates[best].index].data;
+    float picked_norm = norms[best];
+    remaining--;
+    candidates[best] = candidates[remaining];
+    redundancy[best] = redundancy[remaining];
+    norms[best] = norms[remaining];
+
+    for (size_t i = 0; i < remaining; i++) {
+      float sim = -vdb_compute_distance_normed(
+          db->vectors[candidates[i].index].data, picked, norms[i],
+          picked_norm, db->dimensions, db->metric);
+      if (sim > redundancy[i])
+        redundancy[i] = sim;
+    }
+  }
+
+  result_set->results = results;
+  result_set->count = selected;
+
+  VDB_FREE(candidates);
+  VDB_FREE(redundancy);
+  VDB_FREE(norms);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return result_set;
+}
+
+#ifndef VDB_RRF_K
+#define VDB_RRF_K 60
+#endif
+
+#ifndef VDB_RRF_DEPTH
+#define VDB_RRF_DEPTH 100
+#endif
+
+/* Accumulates query . row for every row sharing a dimension with the query
+ * by walking the posting lists term at a time. scores, reached and touched
+ * hold one entry per row, with scores and reached zeroed; touched receives
+ * the rows that were reached and their count is returned. */
+static inline size_t vdb_sparse_scores_unlocked(const vdb_database* db,
+                                                const uint32_t* indices,
+                                                const float* values,
+                                                size_t nnz, float* scores,
+                                                unsigned char* reached,
+                                                size_t* touched) {
+  size_t ntouched = 0;
+
+  for (size_t i = 0; i < nnz; i++) {
+    if (indices[i] >= db->posting_dims)
+      continue;
+    const vdb_posting_list* list = &db->postings[indices[i]];
+    for (size_t p = 0; p < list->count; p++) {
+      size_t row = list->rows[p];
+      if (!reached[row]) {
+        reached[row] = 1;
+        touched[ntouched++] = row;
+      }
+      scores[row] += values[i] * list->values[p];
+    }
+  }
+
+  return ntouched;
+}
+
+static inline vdb_result_set* vdb_result_set_from_heap(const vdb_database* db,
+                                                       vdb_result* heap,
+                                                       size_t size) {
+  vdb_result_set* result_set =
+      (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+  if (!result_set) {
+    VDB_FREE(heap);
+    return NULL;
+  }
+
+  qsort(heap, size, sizeof(vdb_result), vdb_result_compare);
+  for (size_t i = 0; i < size; i++) {
+    heap[i].id = db->vectors[heap[i].index].id;
+    heap[i].metadata = db->vectors[heap[i].index].metadata;
+  }
+
+  result_set->results = heap;
+  result_set->count = size;
+  return result_set;
+}
+
+static inline int vdb_sched_can_run(const vdb_scheduler* sched,
+                                    vdb_priority priority) {
+  size_t running = sched->running[VDB_PRIORITY_INTERACTIVE] +
+                   sched->running[VDB_PRIORITY_BATCH];
+
+  if (sched->max_concurrent && running >= sched->max_concurrent)
+    return 0;
+  if (priority == VDB_PRIORITY_BATCH) {
+    if (sched->waiting[VDB_PRIORITY_INTERACTIVE])
+      return 0;
+    if (sched->max_batch &&
+        sched->running[VDB_PRIORITY_BATCH] >= sched->max_batch)
+      return 0;
+  }
+  return 1;
+}
+
+/* Waits for a search slot. Interactive searches only wait for a free slot;
+ * batch searches also wait while any interactive search is queued. Returns
+ * 0 if the deadline (in vdb_now_ms time, 0 for none) passed first. */
+static inline int vdb_sched_admit(vdb_scheduler* sched, vdb_priority priority,
+                                  uint64_t deadline) {
+  int admitted = 1;
+
+#ifdef VDB_MULTITHREADED
+  uint64_t start = vdb_now_us();
+
+  pthread_mutex_lock(&sched->mutex);
+  sched->waiting[priority]++;
+  while (!vdb_sched_can_run(sched, priority)) {
+    if (!deadline) {
+      pthread_cond_wait(&sched->cond, &sched->mutex);
+      continue;
+    }
+    struct timespec ts;
+    ts.tv_sec = (time_t)(deadline / 1000);
+    ts.tv_nsec = (long)(deadline % 1000) * 1000000;
+    if (pthread_cond_timedwait(&sched->cond, &sched->mutex, &ts) ==
+        ETIMEDOUT) {
+      admitted = vdb_sched_can_run(sched, priority);
+      break;
+    }
+  }
+  sched->waiting[priority]--;
+
+  uint64_t waited = vdb_now_us() - start;
+  sched->queue_us[priority] += waited;
+  if (waited > sched->max_queue_us[priority])
+    sched->max_queue_us[priority] = waited;
+  if (admitted) {
+    sched->running[priority]++;
+    sched->admitted[priority]++;
+  } else {
+    sched->timed_out[priority]++;
+  }
+  pthread_mutex_unlock(&sched->mutex);
+
+  /* a dequeued interactive search may unblock batch waiters */
+  if (priority == VDB_PRIORITY_INTERACTIVE)
+    pthread_cond_broadcast(&sched->cond);
+#else
+  (void)deadline;
+  sched->running[priority]++;
+  sched->admitted[priority]++;
+#endif
+
+  return admitted;
+}
+
+static inline void vdb_sched_release(vdb_scheduler* sched,
+                                     vdb_priority priority) {
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_lock(&sched->mutex);
+  sched->running[priority]--;
+  pthread_mutex_unlock(&sched->mutex);
+  pthread_cond_broadcast(&sched->cond);
+#else
+  sched->running[priority]--;
+#endif
+}
+
+static inline int vdb_sched_should_yield(vdb_scheduler* sched) {
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_lock(&sched->mutex);
+  int yield = sched->waiting[VDB_PRIORITY_INTERACTIVE] > 0;
+  if (yield)
+    sched->yields++;
+  pthread_mutex_unlock(&sched->mutex);
+  return yield;
+#else
+  (void)sched;
+  return 0;
+#endif
+}
+
+/* Bulk operations take one batch slot for their whole run and never yield
+ * it, so they wait without a deadline. */
+static inline void vdb_sched_admit_bulk(const vdb_database* db) {
+  vdb_sched_admit((vdb_scheduler*)&db->scheduler, VDB_PRIORITY_BATCH, 0);
+}
+
+static inline void vdb_sched_release_bulk(const vdb_database* db) {
+  vdb_sched_release((vdb_scheduler*)&db->scheduler, VDB_PRIORITY_BATCH);
+}
+
+/* Limits how many vdb_search_ex calls and bulk operations (batch search,
+ * k-NN graphs, k-means, joins) run at once (max_concurrent) and how many of
+ * those may be batch work (max_batch). 0 means unlimited. Every other
+ * search, including vdb_search, runs unthrottled. Callers that need the
+ * limits to hold must issue their single searches through vdb_search_ex. */
+static inline vdb_error vdb_set_concurrency(vdb_database* db,
+                                            size_t max_concurrent,
+                                            size_t max_batch) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_lock(&db->scheduler.mutex);
+#endif
+  db->scheduler.max_concurrent = max_concurrent;
+  db->scheduler.max_batch = max_batch;
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_unlock(&db->scheduler.mutex);
+  pthread_cond_broadcast(&db->scheduler.cond);
+#endif
+
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_get_stats(const vdb_database* db,
+                                      vdb_stats* out) {
+  if (!db || !out)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_scheduler* sched = (vdb_scheduler*)&db->scheduler;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+  out->count = db->count;
+  out->dimensions = db->dimensions;
+  out->version = db->version;
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+  pthread_mutex_lock(&sched->mutex);
+#endif
+  for (int p = 0; p < VDB_PRIORITY_CLASSES; p++) {
+    out->running[p] = sched->running[p];
+    out->waiting[p] = sched->waiting[p];
+    out->admitted[p] = sched->admitted[p];
+    out->timed_out[p] = sched->timed_out[p];
+    out->queue_us[p] = sched->queue_us[p];
+    out->max_queue_us[p] = sched->max_queue_us[p];
+  }
+  out->yields = sched->yields;
+#ifdef VDB_MULTITHREADED
+  pthread_mutex_unlock(&sched->mutex);
+#endif
+
+  return VDB_OK;
+}
+
+/* k-NN search that checks the deadline and cancellation flag every
+ * VDB_CHECK_INTERVAL vectors. When either trips, the scan stops and the best
+ * results among the vectors scanned so far are returned with *incomplete set
+ * to 1. The search first waits for a slot of its priority class (see
+ * vdb_set_concurrency); a batch search gives up its slot at check points
+ * while interactive searches are queued, and rescans if the database changed
+ * in the meantime. */
+static inline vdb_result_set* vdb_search_ex(const vdb_database* db,
+                                            const float* query, size_t k,
+                                            const vdb_search_options* options,
+                                            int* incomplete) {
+  if (incomplete)
+    *incomplete = 0;
+  if (!db || !query || k == 0)
+    return NULL;
+
+  uint64_t deadline = 0;
+  const volatile int* cancel = NULL;
+  vdb_priority priority = VDB_PRIORITY_INTERACTIVE;
+  if (options) {
+    if (options->timeout_ms)
+      deadline = vdb_now_ms() + options->timeout_ms;
+    cancel = options->cancel;
+    if (options->priority == VDB_PRIORITY_BATCH)
+      priority = VDB_PRIORITY_BATCH;
+  }
+
+  vdb_scheduler* sched = (vdb_scheduler*)&db->scheduler;
+  if (!vdb_sched_admit(sched, priority, deadline)) {
+    if (incomplete)
+      *incomplete = 1;
+    return NULL;
+  }
+  int admitted = 1;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  vdb_result_set* result_set = NULL;
+
+  if (db->count > 0) {
+    if (k > db->count)
+      k = db->count;
+
+    vdb_result* heap = (vdb_result*)VDB_MALLOC(k * sizeof(vdb_result));
+    if (heap) {
+      size_t size = 0;
+      int stopped = 0;
+      uint64_t version = db->version;
+      float query_norm = vdb_magnitude(query, db->dimensions);
+
+      for (size_t i = 0; i < db->count; i++) {
+        if (i % VDB_CHECK_INTERVAL == 0 && i > 0) {
+          if (vdb_cancelled(cancel) ||
+              (deadline && vdb_now_ms() >= deadline)) {
+            stopped = 1;
+            break;
+          }
+          if (priority == VDB_PRIORITY_BATCH &&
+              vdb_sched_should_yield(sched)) {
+#ifdef VDB_MULTITHREADED
+            pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+            vdb_sched_release(sched, priority);
+            admitted = vdb_sched_admit(sched, priority, deadline);
+#ifdef VDB_MULTITHREADED
+            pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+            if (db->version != version) {
+              /* rows may have moved, so the heap is void */
+              size = 0;
+              version = db->version;
+              if (k > db->count)
+                k = db->count;
+              i = 0;
+            }
+            if (!admitted || db->count == 0) {
+              stopped = 1;
+              break;
+            }
+          }
+        }
+        const float* v = db->vectors[i].data;
+        float norm = db->metric == VDB_METRIC_COSINE
+                         ? vdb_magnitude(v, db->dimensions)
+                         : 0.0f;
+        vdb_heap_push(heap, &size, k, i,
+                      vdb_compute_distance_normed(query, v, query_norm, norm,
+                                                  db->dimensions, db->metric));
+      }
+
+      result_set = vdb_result_set_from_heap(db, heap, size);
+      if (result_set && incomplete)
+        *incomplete = stopped;
+    }
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (admitted)
+    vdb_sched_release(sched, priority);
+
+  return result_set;
+}
+
+/* Top-k rows by sparse dot product with the query, reported as distance
+ * -score. Rows sharing no dimension with the query are never returned. */
+static inline vdb_result_set* vdb_search_sparse(const vdb_database* db,
+                                                const uint32_t* indices,
+                                                const float* values,
+                                                size_t nnz, size_t k) {
+  if (!db || !indices || !values || k == 0)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  vdb_result_set* result_set = NULL;
+  size_t n = db->count + 1;
+  float* scores = (float*)VDB_MALLOC(n * sizeof(float));
+  unsigned char* reached = (unsigned char*)VDB_MALLOC(n);
+  size_t* touched = (size_t*)VDB_MALLOC(n * sizeof(size_t));
+  vdb_result* heap = (vdb_result*)VDB_MALLOC(k * sizeof(vdb_result));
+
+  if (scores && reached && touched && heap) {
+    memset(scores, 0, n * sizeof(float));
+    memset(reached, 0, n);
+    size_t ntouched = vdb_sparse_scores_unlocked(db, indices, values, nnz,
+                                                 scores, reached, touched);
+    size_t size = 0;
+    for (size_t i = 0; i < ntouched; i++)
+      vdb_heap_push(heap, &size, k, touched[i], -scores[touched[i]]);
+
+    if (size > 0) {
+      result_set = vdb_result_set_from_heap(db, heap, size);
+      heap = NULL;
+    }
+  }
+
+  VDB_FREE(scores);
+  VDB_FREE(reached);
+  VDB_FREE(touched);
+  VDB_FREE(heap);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return result_set;
+}
+
+/* Fuses dense and sparse relevance in one call. VDB_FUSION_WEIGHTED ranks
+ * every row by alpha * -distance + (1 - alpha) * sparse score.
+ * VDB_FUSION_RRF takes the VDB_RRF_DEPTH best rows of each list and ranks
+ * them by alpha / (VDB_RRF_K + dense rank) + (1 - alpha) / (VDB_RRF_K +
+ * sparse rank). Either way the reported distance is the negated fused
+ * score. */
+static inline vdb_result_set* vdb_search_hybrid(
+    const vdb_database* db, const float* query, const uint32_t* indices,
+    const float* values, size_t nnz, size_t k, vdb_fusion fusion,
+    float alpha) {
+  if (!db || !query || (nnz > 0 && (!indices || !values)) || k == 0)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (db->count == 0) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  size_t n = db->count;
+  size_t depth = VDB_RRF_DEPTH < n ? VDB_RRF_DEPTH : n;
+  if (depth < k)
+    depth = k < n ? k : n;
+
+  vdb_result_set* result_set = NULL;
+  float* scores = (float*)VDB_MALLOC(n * sizeof(float));
+  unsigned char* reached = (unsigned char*)VDB_MALLOC(n);
+  size_t* touched = (size_t*)VDB_MALLOC(n * sizeof(size_t));
+  vdb_result* heap = (vdb_result*)VDB_MALLOC(k * sizeof(vdb_result));
+  vdb_result* dense =
+      fusion == VDB_FUSION_RRF
+          ? (vdb_result*)VDB_MALLOC(depth * sizeof(vdb_result))
+          : NULL;
+  float* fused = fusion == VDB_FUSION_RRF
+                     ? (float*)VDB_MALLOC(n * sizeof(float))
+                     : NULL;
+
+  int ok = scores && reached && touched && heap;
+  if (fusion == VDB_FUSION_RRF)
+    ok = ok && dense && fused;
+
+  if (ok) {
+    memset(scores, 0, n * sizeof(float));
+    memset(reached, 0, n);
+    size_t ntouched = vdb_sparse_scores_unlocked(db, indices, values, nnz,
+                                                 scores, reached, touched);
+    size_t size = 0;
+
+    if (fusion == VDB_FUSION_RRF) {
+      memset(fused, 0, n * sizeof(float));
+      size_t ndense = vdb_topk_unlocked(db, query, depth, dense);
+      for (size_t r = 0; r < ndense; r++)
+        fused[dense[r].index] += alpha / (float)(VDB_RRF_K + r + 1);
+
+      /* Reuse the dense buffer as the sparse top-depth heap. */
+      size_t nsparse = 0;
+      for (size_t i = 0; i < ntouched; i++)
+        vdb_heap_push(dense, &nsparse, depth, touched[i],
+                      -scores[touched[i]]);
+      qsort(dense, nsparse, sizeof(vdb_result), vdb_result_compare);
+      for (size_t r = 0; r < nsparse; r++)
+        fused[dense[r].index] += (1.0f - alpha) / (float)(VDB_RRF_K + r + 1);
+
+      for (size_t i = 0; i < n; i++) {
+        if (fused[i] > 0.0f)
+          vdb_heap_push(heap, &size, k, i, -fused[i]);
+      }
+    } else {
+      float query_norm = vdb_magnitude(query, db->dimensions);
+      for (size_t i = 0; i < n; i++) {
+        const float* v = db->vectors[i].data;
+        float norm = db->metric == VDB_METRIC_COSINE
+                         ? vdb_magnitude(v, db->dimensions)
+                         : 0.0f;
+        float distance = vdb_compute_distance_normed(
+            query, v, query_norm, norm, db->dimensions, db->metric);
+        float score = -alpha * distance + (1.0f - alpha) * scores[i];
+        vdb_heap_push(heap, &size, k, i, -score);
+      }
+    }
+
+    if (size > 0) {
+      result_set = vdb_result_set_from_heap(db, heap, size);
+      heap = NULL;
+    }
+  }
+
+  VDB_FREE(scores);
+  VDB_FREE(reached);
+  VDB_FREE(touched);
+  VDB_FREE(heap);
+  VDB_FREE(dense);
+  VDB_FREE(fused);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return result_set;
+}
+
+/* Adds a record with its primary vector and any number of named field
+ * vectors. Fields not listed stay empty for this record. */
+static inline vdb_error vdb_add_vector_fields(vdb_database* db,
+                                              const float* data,
+                                              const vdb_field_value* values,
+                                              size_t nvalues, const char* id,
+                                              void* metadata) {
+  if (!db || !data || (nvalues > 0 && !values))
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  vdb_error err = VDB_OK;
+  for (size_t i = 0; i < nvalues && err == VDB_OK; i++) {
+    if (!values[i].name || !values[i].data)
+      err = VDB_ERROR_NULL_POINTER;
+    else if (!vdb_find_field(db, values[i].name))
+      err = VDB_ERROR_NOT_FOUND;
+  }
+
+  size_t count = db->count;
+  size_t index;
+  if (err == VDB_OK)
+    err = vdb_add_unlocked(db, data, id, metadata, &index);
+  if (err == VDB_OK && db->count > count) {
+    for (size_t i = 0; i < nvalues; i++)
+      vdb_field_store(vdb_find_field(db, values[i].name), index,
+                      values[i].data);
+  }
+  size_t nmatches;
+  vdb_watch_match* matches =
+      vdb_watch_match_unlocked(db, count, db->count, &nmatches, &err);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  vdb_watch_notify(matches, nmatches);
+  return err;
+}
+
+static inline vdb_error vdb_set_field_vector(vdb_database* db, size_t index,
+                                             const char* name,
+                                             const float* data) {
+  if (!db || !name || !data)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  vdb_error err = VDB_OK;
+  vdb_field* field = vdb_find_field(db, name);
+  if (!field)
+    err = VDB_ERROR_NOT_FOUND;
+  else if (index >= db->count)
+    err = VDB_ERROR_INVALID_INDEX;
+  else
+    vdb_field_store(field, index, data);
+
+  if (err == VDB_OK)
+    db->version++;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return err;
+}
+
+static inline vdb_error vdb_get_field_vector(const vdb_database* db,
+                                             size_t index, const char* name,
+                                             float** out_data) {
+  if (!db || !name || !out_data)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  vdb_error err = VDB_OK;
+  vdb_field* field = vdb_find_field(db, name);
+  if (index >= db->count)
+    err = VDB_ERROR_INVALID_INDEX;
+  else if (!field || !field->present[index])
+    err = VDB_ERROR_NOT_FOUND;
+  else
+    *out_data = field->data + index * field->dimensions;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return err;
+}
+
+/* Scores every record against several fields in a single pass. A record's
+ * distance is the weighted sum of its per-field distances, and records
+ * missing any queried field are skipped. */
+static inline vdb_result_set* vdb_search_multi(const vdb_database* db,
+                                               const vdb_field_query* queries,
+                                               size_t nqueries, size_t k) {
+  if (!db || !queries || nqueries == 0 || k == 0)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  const vdb_field** fields =
+      (const vdb_field**)VDB_MALLOC(nqueries * sizeof(vdb_field*));
+  float* query_norms = (float*)VDB_MALLOC(nqueries * sizeof(float));
+  vdb_result* heap = (vdb_result*)VDB_MALLOC(k * sizeof(vdb_result));
+  int ok = fields && query_norms && heap;
+
+  for (size_t q = 0; q < nqueries && ok; q++) {
+    fields[q] = NULL;
+    if (!queries[q].query) {
+      ok = 0;
+    } else if (queries[q].field) {
+      fields[q] = vdb_find_field(db, queries[q].field);
+      ok = fields[q] != NULL;
+    }
+    if (ok) {
+      size_t dims = fields[q] ? fields[q]->dimensions : db->dimensions;
+      query_norms[q] = vdb_magnitude(queries[q].query, dims);
+    }
+  }
+
+  vdb_result_set* result_set = NULL;
+  size_t size = 0;
+
+  if (ok) {
+    for (size_t i = 0; i < db->count; i++) {
+      float total = 0.0f;
+      size_t q = 0;
+      for (; q < nqueries; q++) {
+        const vdb_field* field = fields[q];
+        float d;
+        if (field) {
+          if (!field->present[i])
+            break;
+          d = vdb_compute_distance_normed(
+              queries[q].query, field->data + i * field->dimensions,
+              query_norms[q], field->norms[i], field->dimensions,
+              field->metric);
+        } else {
+          d = vdb_compute_distance(queries[q].query, db->vectors[i].data,
+                                   db->dimensions, db->metric);
+        }
+        total += queries[q].weight * d;
+      }
+      if (q == nqueries)
+        vdb_heap_push(heap, &size, k, i, total);
+    }
+
+    if (size > 0) {
+      result_set = vdb_result_set_from_heap(db, heap, size);
+      heap = NULL;
+    }
+  }
+
+  VDB_FREE((void*)fields);
+  VDB_FREE(query_norms);
+  VDB_FREE(heap);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return result_set;
+}
+
+static inline vdb_result_set* vdb_search_field(const vdb_database* db,
+                                               const char* name,
+                                               const float* query, size_t k) {
+  vdb_field_query q;
+  q.field = name;
+  q.query = query;
+  q.weight = 1.0f;
+  return vdb_search_multi(db, &q, 1, k);
+}
+
+typedef struct {
+  uint64_t key;
+  float best;
+  size_t slot; /* output group, SIZE_MAX when not selected */
+  int used;
+} vdb_group_entry;
+
+static inline size_t vdb_group_slot(const vdb_group_entry* table, size_t mask,
+                                    uint64_t key) {
+  size_t slot = (size_t)(key * 0x9E3779B97F4A7C15ULL >> 17) & mask;
+  while (table[slot].used && table[slot].key != key)
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+/* Groups by the part of the id before the separator user points to, e.g.
+ * "doc42#chunk3" with '#' groups every chunk of doc42 together. */
+static inline uint64_t vdb_group_by_id_prefix(size_t index, const char* id,
+                                              void* metadata, void* user) {
+  (void)index;
+  (void)metadata;
+  char separator = user ? *(const char*)user : '#';
+  uint64_t h = 0xCBF29CE484222325ULL;
+
+  for (const char* c = id; c && *c && *c != separator; c++) {
+    h ^= (unsigned char)*c;
+    h *= 0x100000001B3ULL;
+  }
+
+  return h;
+}
+
+/* Returns the `groups` groups with the closest hits, each with up to
+ * per_group hits, ordered by their best hit. The first pass records every
+ * row's distance and key and finds each group's best hit. The second pass
+ * fills bounded per-group heaps for the selected groups only, so memory
+ * stays O(count + distinct keys) and the result is exact. */
+static inline vdb_group_result_set* vdb_search_grouped(
+    const vdb_database* db, const float* query, vdb_group_key_fn group_key,
+    void* user, size_t groups, size_t per_group) {
+  if (!db || !query || !group_key || groups == 0 || per_group == 0)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (db->count == 0) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  /* there are at most n groups and n hits per group */
+  size_t n = db->count;
+  if (groups > n)
+    groups = n;
+  if (per_group > n)
+    per_group = n;
+  if (per_group > SIZE_MAX / sizeof(vdb_result) / groups) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  size_t capacity = 16;
+  while (capacity < n * 2)
+    capacity *= 2;
+  size_t mask = capacity - 1;
+
+  float* distances = (float*)VDB_MALLOC(n * sizeof(float));
+  uint64_t* keys = (uint64_t*)VDB_MALLOC(n * sizeof(uint64_t));
+  vdb_group_entry* table =
+      (vdb_group_entry*)VDB_MALLOC(capacity * sizeof(vdb_group_entry));
+  vdb_result* top = (vdb_result*)VDB_MALLOC(groups * sizeof(vdb_result));
+  vdb_result* hits =
+      (vdb_result*)VDB_MALLOC(groups * per_group * sizeof(vdb_result));
+  size_t* hit_counts = (size_t*)VDB_MALLOC(groups * sizeof(size_t));
+  vdb_group_result_set* result_set =
+      (vdb_group_result_set*)VDB_MALLOC(sizeof(vdb_group_result_set));
+  vdb_group* out = (vdb_group*)VDB_MALLOC(groups * sizeof(vdb_group));
+
+  if (!distances || !keys || !table || !top || !hits || !hit_counts ||
+      !result_set || !out) {
+    VDB_FREE(distances);
+    VDB_FREE(keys);
+    VDB_FREE(table);
+    VDB_FREE(top);
+    VDB_FREE(hits);
+    VDB_FREE(hit_counts);
+    VDB_FREE(result_set);
+    VDB_FREE(out);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  memset(table, 0, capacity * sizeof(vdb_group_entry));
+  float query_norm = vdb_magnitude(query, db->dimensions);
+
+  for (size_t i = 0; i < n; i++) {
+    const vdb_vector* v = &db->vectors[i];
+    float norm = db->metric == VDB_METRIC_COSINE
+                     ? vdb_magnitude(v->data, db->dimensions)
+                     : 0.0f;
+    distances[i] = vdb_compute_distance_normed(query, v->data, query_norm,
+                                               norm, db->dimensions,
+                                               db->metric);
+    keys[i] = group_key(i, v->id, v->metadata, user);
+
+    vdb_group_entry* e = &table[vdb_group_slot(table, mask, keys[i])];
+    if (!e->used) {
+      e->used = 1;
+      e->key = keys[i];
+      e->best = distances[i];
+    } else if (distances[i] < e->best) {
+      e->best = distances[i];
+    }
+  }
+
+  size_t ntop = 0;
+  for (size_t slot = 0; slot < capacity; slot++) {
+    if (table[slot].used) {
+      table[slot].slot = SIZE_MAX;
+      vdb_heap_push(top, &ntop, groups, slot, table[slot].best);
+    }
+  }
+  qsort(top, ntop, sizeof(vdb_result), vdb_result_compare);
+  for (size_t g = 0; g < ntop; g++) {
+    table[top[g].index].slot = g;
+    hit_counts[g] = 0;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    size_t g = table[vdb_group_slot(table, mask, keys[i])].slot;
+    if (g != SIZE_MAX)
+      vdb_heap_push(hits + g * per_group, &hit_counts[g], per_group, i,
+                    distances[i]);
+  }
+
+  for (size_t g = 0; g < ntop; g++) {
+    vdb_result* group_hits = hits + g * per_group;
+    qsort(group_hits, hit_counts[g], sizeof(vdb_result), vdb_result_compare);
+    for (size_t h = 0; h < hit_counts[g]; h++) {
+      group_hits[h].id = db->vectors[group_hits[h].index].id;
+      group_hits[h].metadata = db->vectors[group_hits[h].index].metadata;
+    }
+    out[g].key = table[top[g].index].key;
+    out[g].results = group_hits;
+    out[g].count = hit_counts[g];
+  }
+
+  result_set->groups = out;
+  result_set->count = ntop;
+
+  VDB_FREE(distances);
+  VDB_FREE(keys);
+  VDB_FREE(table);
+  VDB_FREE(top);
+  VDB_FREE(hit_counts);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return result_set;
+}
+
+static inline void vdb_free_group_result_set(vdb_group_result_set* result_set) {
+  if (!result_set)
+    return;
+  if (result_set->groups) {
+    if (result_set->count > 0)
+      VDB_FREE(result_set->groups[0].results);
+    VDB_FREE(result_set->groups);
+  }
+  VDB_FREE(result_set);
+}
+
+static inline void vdb_min_heap_sift_down(vdb_result* heap, size_t size,
+                                          size_t pos) {
+  vdb_result item = heap[pos];
+
+  for (;;) {
+    size_t child = 2 * pos + 1;
+    if (child >= size)
+      break;
+    if (child + 1 < size && heap[child + 1].distance < heap[child].distance)
+      child++;
+    if (heap[child].distance >= item.distance)
+      break;
+    heap[pos] = heap[child];
+    pos = child;
+  }
+
+  heap[pos] = item;
+}
+
+/* Opens a cursor over the max_results nearest vectors (0 means
+ * VDB_CURSOR_MAX_RESULTS). The scan runs once; pages are then popped from a
+ * min-heap in O(page * log max_results), so later pages cost nothing like
+ * a new vdb_search. The cursor expires after ttl_ms without use (0 never
+ * expires) and goes stale once the database is modified. It must be closed
+ * before the database is destroyed. */
+static inline vdb_search_cursor* vdb_search_open(const vdb_database* db,
+                                                 const float* query,
+                                                 size_t max_results,
+                                                 uint64_t ttl_ms) {
+  if (!db || !query)
+    return NULL;
+
+  if (max_results == 0)
+    max_results = VDB_CURSOR_MAX_RESULTS;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  size_t cap = max_results < db->count ? max_results : db->count;
+  vdb_search_cursor* cursor =
+      (vdb_search_cursor*)VDB_MALLOC(sizeof(vdb_search_cursor));
+  vdb_result* heap = (vdb_result*)VDB_MALLOC((cap ? cap : 1) *
+                                             sizeof(vdb_result));
+
+  if (!cursor || !heap) {
+    VDB_FREE(cursor);
+    VDB_FREE(heap);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  size_t size = 0;
+  float query_norm = vdb_magnitude(query, db->dimensions);
+  for (size_t i = 0; i < db->count; i++) {
+    const float* v = db->vectors[i].data;
+    float norm = db->metric == VDB_METRIC_COSINE
+                     ? vdb_magnitude(v, db->dimensions)
+                     : 0.0f;
+    vdb_heap_push(heap, &size, cap, i,
+                  vdb_compute_distance_normed(query, v, query_norm, norm,
+                                              db->dimensions, db->metric));
+  }
+
+  for (size_t i = size / 2; i-- > 0;)
+    vdb_min_heap_sift_down(heap, size, i);
+
+  cursor->db = db;
+  cursor->heap = heap;
+  cursor->size = size;
+  cursor->version = db->version;
+  cursor->ttl_ms = ttl_ms;
+  cursor->expires_ms = ttl_ms ? vdb_now_ms() + ttl_ms : 0;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return cursor;
+}
+
+/* Returns the next page of up to n results in *out, or NULL once the cursor
+ * is exhausted. */
+static inline vdb_error vdb_search_next(vdb_search_cursor* cursor, size_t n,
+                                        vdb_result_set** out) {
+  if (!cursor || !out)
+    return VDB_ERROR_NULL_POINTER;
+
+  *out = NULL;
+
+  uint64_t now = cursor->ttl_ms ? vdb_now_ms() : 0;
+  if (cursor->ttl_ms && now > cursor->expires_ms)
+    return VDB_ERROR_EXPIRED;
+
+  const vdb_database* db = cursor->db;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (cursor->version != db->version) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return VDB_ERROR_STALE;
+  }
+
+  if (n > cursor->size)
+    n = cursor->size;
+
+  vdb_error err = VDB_OK;
+
+  if (n > 0) {
+    vdb_result_set* result_set =
+        (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+    vdb_result* results = (vdb_result*)VDB_MALLOC(n * sizeof(vdb_result));
+
+    if (result_set && results) {
+      for (size_t i = 0; i < n; i++) {
+        results[i] = cursor->heap[0];
+        results[i].id = db->vectors[results[i].index].id;
+        results[i].metadata = db->vectors[results[i].index].metadata;
+        cursor->heap[0] = cursor->heap[--cursor->size];
+        vdb_min_heap_sift_down(cursor->heap, cursor->size, 0);
+      }
+      result_set->results = results;
+      result_set->count = n;
+      *out = result_set;
+    } else {
+      VDB_FREE(result_set);
+      VDB_FREE(results);
+      err = VDB_ERROR_OUT_OF_MEMORY;
+    }
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (cursor->ttl_ms)
+    cursor->expires_ms = now + cursor->ttl_ms;
+
+  return err;
+}
+
+static inline void vdb_search_close(vdb_search_cursor* cursor) {
+  if (!cursor)
+    return;
+  VDB_FREE(cursor->heap);
+  VDB_FREE(cursor);
+}
+
+/* Opens a stream over the k nearest vectors (0 means all of them), returned
+ * nearest first by incremental quickselect: each vdb_stream_next partitions
+ * only the range that holds the next result, so the first r results cost
+ * O(count + r log r) expected time whatever k is. The stream keeps one
+ * 16-byte entry per vector and copies no results. NaN distances sort last.
+ * Like a cursor, it goes stale once the database is modified and must be
+ * closed before the database is destroyed. */
+static inline vdb_result_stream* vdb_search_stream(const vdb_database* db,
+                                                   const float* query,
+                                                   size_t k) {
+  if (!db || !query)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  size_t count = db->count;
+  vdb_result_stream* stream =
+      (vdb_result_stream*)VDB_MALLOC(sizeof(vdb_result_stream));
+  vdb_stream_entry* entries = (vdb_stream_entry*)VDB_MALLOC(
+      (count ? count : 1) * sizeof(vdb_stream_entry));
+  size_t* bounds = (size_t*)VDB_MALLOC(16 * sizeof(size_t));
+
+  if (!stream || !entries || !bounds) {
+    VDB_FREE(stream);
+    VDB_FREE(entries);
+    VDB_FREE(bounds);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return NULL;
+  }
+
+  float query_norm = db->metric == VDB_METRIC_COSINE
+                         ? vdb_magnitude(query, db->dimensions)
+                         : 0.0f;
+  for (size_t i = 0; i < count; i++) {
+    const float* v = db->vectors[i].data;
+    float norm = db->metric == VDB_METRIC_COSINE
+                     ? vdb_magnitude(v, db->dimensions)
+                     : 0.0f;
+    float distance = vdb_compute_distance_normed(query, v, query_norm, norm,
+                                                 db->dimensions, db->metric);
+    entries[i].distance = isnan(distance) ? INFINITY : distance;
+    entries[i].index = i;
+  }
+
+  stream->db = db;
+  stream->entries = entries;
+  stream->count = count;
+  stream->limit = k == 0 || k > count ? count : k;
+  stream->next = 0;
+  stream->sorted_end = 0;
+  stream->bounds = bounds;
+  stream->bounds[0] = count;
+  stream->nbounds = 1;
+  stream->bounds_capacity = 16;
+  stream->rng = 0x76646230ULL ^ count;
+  stream->version = db->version;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return stream;
+}
+
+/* Three-way partition of entries[lo, hi) around a random pivot: afterwards
+ * [lo, *lt) is nearer, [*lt, *gt) ties with it and [*gt, hi) is farther. */
+static inline void vdb_stream_partition(vdb_result_stream* stream, size_t lo,
+                                        size_t hi, size_t* lt, size_t* gt) {
+  vdb_stream_entry* e = stream->entries;
+  float pivot = e[lo + vdb_random(&stream->rng) % (hi - lo)].distance;
+  size_t i = lo;
+  size_t l = lo;
+  size_t g = hi;
+
+  while (i < g) {
+    vdb_stream_entry tmp = e[i];
+    if (tmp.distance < pivot) {
+      e[i++] = e[l];
+      e[l++] = tmp;
+    } else if (tmp.distance > pivot) {
+      e[i] = e[--g];
+      e[g] = tmp;
+    } else {
+      i++;
+    }
+  }
+
+  *lt = l;
+  *gt = g;
+}
+
+/* Writes the next result to *out. Returns VDB_ERROR_NOT_FOUND after the
+ * last one and VDB_ERROR_STALE once the database has been modified. */
+static inline vdb_error vdb_stream_next(vdb_result_stream* stream,
+                                        vdb_result* out) {
+  if (!stream || !out)
+    return VDB_ERROR_NULL_POINTER;
+  if (stream->next >= stream->limit)
+    return VDB_ERROR_NOT_FOUND;
+
+  const vdb_database* db = stream->db;
+  vdb_error err = VDB_OK;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (stream->version != db->version)
+    err = VDB_ERROR_STALE;
+
+  /* The bounds decrease towards the top of the stack, so the top one ends
+   * the smallest range that still holds the next result. Split that range
+   * until the next result starts a run of ties at next. */
+  while (err == VDB_OK && stream->next >= stream->sorted_end) {
+    while (stream->bounds[stream->nbounds - 1] <= stream->next)
+      stream->nbounds--;
+
+    if (stream->nbounds + 2 > stream->bounds_capacity) {
+      size_t capacity = stream->bounds_capacity * 2;
+      size_t* bounds = (size_t*)VDB_REALLOC(stream->bounds,
+                                            capacity * sizeof(size_t));
+      if (!bounds) {
+        err = VDB_ERROR_OUT_OF_MEMORY;
+        break;
+      }
+      stream->bounds = bounds;
+      stream->bounds_capacity = capacity;
+    }
+
+    size_t hi = stream->bounds[stream->nbounds - 1];
+    size_t lt;
+    size_t gt;
+    vdb_stream_partition(stream, stream->next, hi, &lt, &gt);
+    if (gt < hi)
+      stream->bounds[stream->nbounds++] = gt;
+    if (lt == stream->next)
+      stream->sorted_end = gt;
+    else
+      stream->bounds[stream->nbounds++] = lt;
+  }
+
+  if (err == VDB_OK) {
+    vdb_stream_entry entry = stream->entries[stream->next++];
+    out->index = entry.index;
+    out->distance = entry.distance;
+    out->id = db->vectors[entry.index].id;
+    out->metadata = db->vectors[entry.index].metadata;
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return err;
+}
+
+static inline void vdb_stream_close(vdb_result_stream* stream) {
+  if (!stream)
+    return;
+  VDB_FREE(stream->entries);
+  VDB_FREE(stream->bounds);
+  VDB_FREE(stream);
+}
+
+/* Calls fn with the k nearest vectors (0 means all), nearest first, until fn
+ * returns non-zero. No lock is held while fn runs, so fn may search the
+ * database; modifying it ends the walk with VDB_ERROR_STALE. */
+static inline vdb_error vdb_search_each(const vdb_database* db,
+                                        const float* query, size_t k,
+                                        vdb_result_fn fn, void* user) {
+  if (!db || !query || !fn)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_result_stream* stream = vdb_search_stream(db, query, k);
+  if (!stream)
+    return VDB_ERROR_OUT_OF_MEMORY;
+
+  vdb_result result;
+  vdb_error err;
+  while ((err = vdb_stream_next(stream, &result)) == VDB_OK) {
+    if (fn(&result, user))
+      break;
+  }
+
+  vdb_stream_close(stream);
+  return err == VDB_ERROR_NOT_FOUND ? VDB_OK : err;
+}
+
+static inline void vdb_batch_worker(void* arg, size_t worker,
+                                    size_t nworkers) {
+  vdb_batch_thread_args* args = (vdb_batch_thread_args*)arg;
+  const vdb_database* db = args->db;
+  size_t start = args->nqueries * worker / nworkers;
+  size_t end = args->nqueries * (worker + 1) / nworkers;
+
+  /* each tile of stored vectors is scored against every query of this
+   * worker while it is still in cache */
+  for (size_t t = 0; t < db->count; t += VDB_TILE) {
+    size_t t_end = t + VDB_TILE < db->count ? t + VDB_TILE : db->count;
+    for (size_t q = start; q < end; q++) {
+      const float* query = args->queries + q * db->dimensions;
+      vdb_result* heap = args->heaps + q * args->k;
+      for (size_t i = t; i < t_end; i++) {
+        vdb_heap_push(heap, &args->sizes[q], args->k, i,
+                      vdb_compute_distance_normed(
+                          query, db->vectors[i].data, args->query_norms[q],
+                          args->norms[i], db->dimensions, db->metric));
+      }
+    }
+  }
+}
+
+/* The scan behind vdb_search_batch, on caller buffers: norms holds count
+ * floats, query_norms and sizes nqueries entries, and heaps nqueries * k
+ * results. k must be in [1, count]. The caller holds the read lock. */
+static inline void vdb_search_batch_unlocked(const vdb_database* db,
+                                             const float* queries,
+                                             size_t nqueries, size_t k,
+                                             float* norms, float* query_norms,
+                                             size_t* sizes,
+                                             vdb_result* heaps) {
+  vdb_batch_thread_args args;
+  args.db = db;
+  args.norms = norms;
+  args.queries = queries;
+  args.query_norms = query_norms;
+  args.nqueries = nqueries;
+  args.k = k;
+  args.heaps = heaps;
+  args.sizes = sizes;
+
+  for (size_t i = 0; i < db->count; i++) {
+    norms[i] = db->metric == VDB_METRIC_COSINE
+                   ? vdb_magnitude(db->vectors[i].data, db->dimensions)
+                   : 0.0f;
+  }
+  for (size_t q = 0; q < nqueries; q++) {
+    query_norms[q] =
+        db->metric == VDB_METRIC_COSINE
+            ? vdb_magnitude(queries + q * db->dimensions, db->dimensions)
+            : 0.0f;
+    sizes[q] = 0;
+  }
+
+  size_t nworkers = vdb_thread_count();
+  if (nworkers > nqueries)
+    nworkers = nqueries;
+  vdb_run_workers(vdb_batch_worker, &args, nworkers);
+
+  for (size_t q = 0; q < nqueries; q++) {
+    vdb_result* row = heaps + q * k;
+    qsort(row, k, sizeof(vdb_result), vdb_result_compare);
+    for (size_t i = 0; i < k; i++) {
+      row[i].id = db->vectors[row[i].index].id;
+      row[i].metadata = db->vectors[row[i].index].metadata;
+    }
+  }
+}
+
+/* Answers nqueries queries stored back to back in one pass over the
+ * database. Row q of the result is results[q * n] through
+ * results[(q + 1) * n - 1], sorted by distance, where n = min(k, count) =
+ * result_set->count / nqueries. */
+static inline vdb_result_set* vdb_search_batch(const vdb_database* db,
+                                               const float* queries,
+                                               size_t nqueries, size_t k) {
+  if (!db || !queries || nqueries == 0 || k == 0)
+    return NULL;
+
+  vdb_sched_admit_bulk(db);
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  vdb_result_set* result_set = NULL;
+
+  if (db->count > 0) {
+    if (k > db->count)
+      k = db->count;
+
+    float* norms = (float*)VDB_MALLOC(db->count * sizeof(float));
+    float* query_norms = (float*)VDB_MALLOC(nqueries * sizeof(float));
+    size_t* sizes = (size_t*)VDB_MALLOC(nqueries * sizeof(size_t));
+    vdb_result* heaps =
+        (vdb_result*)VDB_MALLOC(nqueries * k * sizeof(vdb_result));
+    result_set = (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+
+    if (norms && query_norms && sizes && heaps && result_set) {
+      vdb_search_batch_unlocked(db, queries, nqueries, k, norms, query_norms,
+                                sizes, heaps);
+      result_set->results = heaps;
+      result_set->count = nqueries * k;
+      heaps = NULL;
+    } else {
+      VDB_FREE(result_set);
+      result_set = NULL;
+    }
+
+    VDB_FREE(norms);
+    VDB_FREE(query_norms);
+    VDB_FREE(sizes);
+    VDB_FREE(heaps);
+  }
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+  vdb_sched_release_bulk(db);
+
+  return result_set;
+}
+
+static inline void vdb_knn_push_tile(vdb_knn_thread_args* args,
+                                     const float* tile, size_t rows_start,
+                                     size_t rows_end, size_t cols_start,
+                                     size_t cols_end, int transpose) {
+  size_t cols = transpose ? rows_end - rows_start : cols_end - cols_start;
+
+  for (size_t i = rows_start; i < rows_end; i++) {
+    vdb_result* heap = args->heaps + i * args->k;
+    for (size_t j = cols_start; j < cols_end; j++) {
+      if (i == j)
+        continue;
+      float d = transpose ? tile[(j - cols_start) * cols + (i - rows_start)]
+                          : tile[(i - rows_start) * cols + (j - cols_start)];
+      vdb_heap_push(heap, &args->sizes[i], args->k, j, d);
+    }
+  }
+}
+
+static inline void vdb_knn_worker(void* arg, size_t worker, size_t nworkers) {
+  vdb_knn_thread_args* args = (vdb_knn_thread_args*)arg;
+  const vdb_database* db = args->db;
+  float tile[VDB_TILE * VDB_TILE];
+  size_t pair = 0;
+
+  /* Each unordered pair of blocks is evaluated once and its distances are
+   * pushed into the heaps of both blocks. */
+  for (size_t bi = 0; bi < args->nblocks; bi++) {
+    for (size_t bj = bi; bj < args->nblocks; bj++, pair++) {
+      if (pair % nworkers != worker)
+        continue;
+
+      size_t i0 = bi * VDB_TILE;
+      size_t i1 = i0 + VDB_TILE < db->count ? i0 + VDB_TILE : db->count;
+      size_t j0 = bj * VDB_TILE;
+      size_t j1 = j0 + VDB_TILE < db->count ? j0 + VDB_TILE : db->count;
+
+      vdb_distance_tile(db, args->norms, i0, i1, db, args->norms, j0, j1,
+                        tile);
+
+#ifdef VDB_MULTITHREADED
+      pthread_mutex_lock(&args->block_locks[bi]);
+#endif
+      vdb_knn_push_tile(args, tile, i0, i1, j0, j1, 0);
+#ifdef VDB_MULTITHREADED
+      pthread_mutex_unlock(&args->block_locks[bi]);
+#endif
+
+      if (bi == bj)
+        continue;
+
+#ifdef VDB_MULTITHREADED
+      pthread_mutex_lock(&args->block_locks[bj]);
+#endif
+      vdb_knn_push_tile(args, tile, j0, j1, i0, i1, 1);
+#ifdef VDB_MULTITHREADED
+      pthread_mutex_unlock(&args->block_locks[bj]);
+#endif
+    }
+  }
+}
+
+static inline void vdb_knn_finish(const vdb_database* db,
+                                  vdb_graph* graph) {
+  for (size_t i = 0; i < graph->count; i++) {
+    vdb_result* row = graph->neighbors + i * graph->k;
+    qsort(row, graph->k, sizeof(vdb_result), vdb_result_compare);
+    for (size_t j = 0; j < graph->k; j++) {
+      row[j].id = db->vectors[row[j].index].id;
+      row[j].metadata = db->vectors[row[j].index].metadata;
+    }
+  }
+}
+
+static inline vdb_graph* vdb_graph_alloc(size_t count, size_t k) {
+  vdb_graph* graph = (vdb_graph*)VDB_MALLOC(sizeof(vdb_graph));
+  if (!graph)
+    return NULL;
+
+  graph->neighbors = (vdb_result*)VDB_MALLOC(count * k * sizeof(vdb_result));
+  if (!graph->neighbors) {
+    VDB_FREE(graph);
+    return NULL;
+  }
+
+  graph->count = count;
+  graph->k = k;
+  return graph;
+}
+
+static inline vdb_graph* vdb_knn_graph(const vdb_database* db, size_t k) {
+  if (!db || k == 0)
+    return NULL;
+
+  vdb_sched_admit_bulk(db);
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (db->count < 2) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    vdb_sched_release_bulk(db);
+    return NULL;
+  }
+
+  if (k > db->count - 1)
+    k = db->count - 1;
+
+  vdb_knn_thread_args args;
+  args.db = db;
+  args.k = k;
+  args.nblocks = (db->count + VDB_TILE - 1) / VDB_TILE;
+  args.norms = vdb_compute_norms(db);
+  args.sizes = (size_t*)VDB_MALLOC(db->count * sizeof(size_t));
+  vdb_graph* graph = vdb_graph_alloc(db->count, k);
+#ifdef VDB_MULTITHREADED
+  args.block_locks =
+      (pthread_mutex_t*)VDB_MALLOC(args.nblocks * sizeof(pthread_mutex_t));
+#endif
+
+  int ok = args.norms && args.sizes && graph;
+#ifdef VDB_MULTITHREADED
+  ok = ok && args.block_locks;
+#endif
+
+  if (ok) {
+    args.heaps = graph->neighbors;
+    memset(args.sizes, 0, db->count * sizeof(size_t));
+#ifdef VDB_MULTITHREADED
+    for (size_t b = 0; b < args.nblocks; b++)
+      pthread_mutex_init(&args.block_locks[b], NULL);
+#endif
+
+    size_t pairs = args.nblocks * (args.nblocks + 1) / 2;
+    size_t nworkers = vdb_thread_count();
+    vdb_run_workers(vdb_knn_worker, &args,
+                    nworkers < pairs ? nworkers : pairs);
+    vdb_knn_finish(db, graph);
+
+#ifdef VDB_MULTITHREADED
+    for (size_t b = 0; b < args.nblocks; b++)
+      pthread_mutex_destroy(&args.block_locks[b]);
+#endif
+  } else if (graph) {
+    VDB_FREE(graph->neighbors);
+    VDB_FREE(graph);
+    graph = NULL;
+  }
+
+#ifdef VDB_MULTITHREADED
+  VDB_FREE(args.block_locks);
+#endif
+  VDB_FREE(args.sizes);
+  VDB_FREE((float*)args.norms);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+  vdb_sched_release_bulk(db);
+
+  return graph;
+}
+
+static inline void vdb_join_worker(void* arg, size_t worker, size_t nworkers) {
+  vdb_join_thread_args* args = (vdb_join_thread_args*)arg;
+  const vdb_database* a = args->a;
+  const vdb_database* b = args->b;
+  size_t k = args->k;
+
+  float* tile = (float*)VDB_MALLOC(VDB_TILE * VDB_TILE * sizeof(float));
+  vdb_result* heaps =
+      (vdb_result*)VDB_MALLOC(VDB_TILE * k * sizeof(vdb_result));
+  if (!tile || !heaps) {
+    VDB_FREE(tile);
+    VDB_FREE(heaps);
+#ifdef VDB_MULTITHREADED
+    pthread_mutex_lock(&args->callback_lock);
+#endif
+    args->failed = 1;
+#ifdef VDB_MULTITHREADED
+    pthread_mutex_unlock(&args->callback_lock);
+#endif
+    return;
+  }
+
+  int stop = 0;
+  for (size_t block = worker; block < args->nblocks && !stop;
+       block += nworkers) {
+    size_t i0 = block * VDB_TILE;
+    size_t i1 = i0 + VDB_TILE < a->count ? i0 + VDB_TILE : a->count;
+    size_t sizes[VDB_TILE] = {0};
+
+    for (size_t j0 = 0; j0 < b->count; j0 += VDB_TILE) {
+      size_t j1 = j0 + VDB_TILE < b->count ? j0 + VDB_TILE : b->count;
+      vdb_distance_tile(a, args->a_norms, i0, i1, b, args->b_norms, j0, j1,
+                        tile);
+      for (size_t i = i0; i < i1; i++) {
+        const float* row = tile + (i - i0) * (j1 - j0);
+        for (size_t j = j0; j < j1; j++) {
+          vdb_heap_push(heaps + (i - i0) * k, &sizes[i - i0], k, j,
+                        row[j - j0]);
+        }
+      }
+    }
+
+    for (size_t i = i0; i < i1; i++) {
+      vdb_result* heap = heaps + (i - i0) * k;
+      qsort(heap, sizes[i - i0], sizeof(vdb_result), vdb_result_compare);
+      for (size_t j = 0; j < sizes[i - i0]; j++) {
+        heap[j].id = b->vectors[heap[j].index].id;
+        heap[j].metadata = b->vectors[heap[j].index].metadata;
+      }
+    }
+
+#ifdef VDB_MULTITHREADED
+    pthread_mutex_lock(&args->callback_lock);
+#endif
+    for (size_t i = i0; i < i1 && !args->stop; i++) {
+      if (args->callback(i, heaps + (i - i0) * k, sizes[i - i0], args->user))
+        args->stop = 1;
+    }
+    stop = args->stop;
+#ifdef VDB_MULTITHREADED
+    pthread_mutex_unlock(&args->callback_lock);
+#endif
+  }
+
+  VDB_FREE(tile);
+  VDB_FREE(heaps);
+}
+
+/* Streams the k nearest vectors of b for every vector of a to callback.
+ * Both databases must share dimensions and metric. Rows are delivered in
+ * blocks of VDB_TILE in no particular block order; calls are serialized, so
+ * the callback needs no locking of its own, but it must not modify either
+ * database. Returning non-zero stops the join. */
+static inline vdb_error vdb_join(const vdb_database* a, const vdb_database* b,
+                                 size_t k, vdb_join_callback callback,
+                                 void* user) {
+  if (!a || !b || !callback)
+    return VDB_ERROR_NULL_POINTER;
+  if (a->dimensions != b->dimensions || a->metric != b->metric)
+    return VDB_ERROR_INVALID_DIMENSIONS;
+  if (k == 0)
+    return VDB_OK;
+
+  /* slots are taken in address order, like the locks, so that two joins
+   * over the same pair cannot each hold the slot the other waits for */
+  const vdb_database* first = a < b ? a : b;
+  const vdb_database* second = a < b ? b : a;
+  vdb_sched_admit_bulk(first);
+  if (second != first)
+    vdb_sched_admit_bulk(second);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&first->lock);
+  if (second != first)
+    pthread_rwlock_rdlock((pthread_rwlock_t*)&second->lock);
+#endif
+
+  vdb_error err = VDB_OK;
+
+  if (a->count > 0 && b->count > 0) {
+    vdb_join_thread_args args;
+    args.a = a;
+    args.b = b;
+    args.k = k < b->count ? k : b->count;
+    args.nblocks = (a->count + VDB_TILE - 1) / VDB_TILE;
+    args.callback = callback;
+    args.user = user;
+    args.stop = 0;
+    args.failed = 0;
+    args.a_norms = vdb_compute_norms(a);
+    args.b_norms = vdb_compute_norms(b);
+
+    if (args.a_norms && args.b_norms) {
+#ifdef VDB_MULTITHREADED
+      pthread_mutex_init(&args.callback_lock, NULL);
+#endif
+      size_t nworkers = vdb_thread_count();
+      vdb_run_workers(vdb_join_worker, &args,
+                      nworkers < args.nblocks ? nworkers : args.nblocks);
+#ifdef VDB_MULTITHREADED
+      pthread_mutex_destroy(&args.callback_lock);
+#endif
+      if (args.failed)
+        err = VDB_ERROR_OUT_OF_MEMORY;
+    } else {
+      err = VDB_ERROR_OUT_OF_MEMORY;
+    }
+
+    VDB_FREE((float*)args.a_norms);
+    VDB_FREE((float*)args.b_norms);
+  }
+
+#ifdef VDB_MULTITHREADED
+  if (second != first)
+    pthread_rwlock_unlock((pthread_rwlock_t*)&second->lock);
+  pthread_rwlock_unlock((pthread_rwlock_t*)&first->lock);
+#endif
+  if (second != first)
+    vdb_sched_release_bulk(second);
+  vdb_sched_release_bulk(first);
+
+  return err;
+}
+
+static inline int vdb_nndescent_insert(vdb_result* row, unsigned char* fresh,
+                                       size_t k, size_t index,
+                                       float distance) {
+  /* An empty slot takes any candidate, even one at infinite distance. */
+  if (row[k - 1].index != SIZE_MAX && !(distance < row[k - 1].distance))
+    return 0;
+
+  for (size_t i = 0; i < k; i++) {
+    if (row[i].index == index)
+      return 0;
+  }
+
+  size_t pos = k - 1;
+  while (pos > 0 && (row[pos - 1].index == SIZE_MAX ||
+                     row[pos - 1].distance > distance)) {
+    row[pos] = row[pos - 1];
+    fresh[pos] = fresh[pos - 1];
+    pos--;
+  }
+
+  row[pos].index = index;
+  row[pos].distance = distance;
+  fresh[pos] = 1;
+  return 1;
+}
+
+static inline void vdb_nndescent_sample(size_t* list, size_t* size, size_t cap,
+                                        size_t value, uint64_t* rng) {
+  if (*size < cap) {
+    list[(*size)++] = value;
+  } else {
+    size_t slot = (size_t)(vdb_random(rng) % cap);
+    list[slot] = value;
+  }
+}
+
+/* Approximate graph via NN-descent: neighbors of neighbors are joined
+ * locally until fewer than 0.1% of the edges change per iteration. Each
+ * iteration evaluates O(n * k^2) distances instead of O(n^2). */
+static inline vdb_graph* vdb_knn_graph_nndescent(const vdb_database* db,
+                                                     size_t k,
+                                                     size_t max_iters) {
+  if (!db || k == 0)
+    return NULL;
+
+  vdb_sched_admit_bulk(db);
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (db->count < 2) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    vdb_sched_release_bulk(db);
+    return NULL;
+  }
+
+  size_t n = db->count;
+  if (k > n - 1)
+    k = n - 1;
+
+  vdb_graph* graph = vdb_graph_alloc(n, k);
+  float* norms = vdb_compute_norms(db);
+  unsigned char* fresh = (unsigned char*)VDB_MALLOC(n * k);
+  size_t* new_lists = (size_t*)VDB_MALLOC(2 * n * k * sizeof(size_t));
+  size_t* old_lists = (size_t*)VDB_MALLOC(2 * n * k * sizeof(size_t));
+  size_t* new_sizes = (size_t*)VDB_MALLOC(n * sizeof(size_t));
+  size_t* old_sizes = (size_t*)VDB_MALLOC(n * sizeof(size_t));
+
+  if (!graph || !norms || !fresh || !new_lists || !old_lists || !new_sizes ||
+      !old_sizes) {
+    if (graph) {
+      VDB_FREE(graph->neighbors);
+      VDB_FREE(graph);
+    }
+    VDB_FREE(norms);
+    VDB_FREE(fresh);
+    VDB_FREE(new_lists);
+    VDB_FREE(old_lists);
+    VDB_FREE(new_sizes);
+    VDB_FREE(old_sizes);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    vdb_sched_release_bulk(db);
+    return NULL;
+  }
+
+  uint64_t rng = 0x76646230ULL ^ n;
+  size_t cap = 2 * k;
+  memset(fresh, 0, n * k);
+
+  for (size_t i = 0; i < n; i++) {
+    vdb_result* row = graph->neighbors + i * k;
+    for (size_t j = 0; j < k; j++) {
+      row[j].index = SIZE_MAX;
+      row[j].distance = INFINITY;
+    }
+    for (size_t j = 0; j < k; j++) {
+      size_t candidate = (size_t)(vdb_random(&rng) % (n - 1));
+      if (candidate >= i)
+        candidate++;
+      float d = vdb_compute_distance_normed(
+          db->vectors[i].data, db->vectors[candidate].data, norms[i],
+          norms[candidate], db->dimensions, db->metric);
+      vdb_nndescent_insert(row, fresh + i * k, k, candidate, d);
+    }
+  }
+
+  /* Random initialisation can leave slots empty when the same candidate is
+   * drawn twice; fill them deterministically. */
+  for (size_t i = 0; i < n; i++) {
+    vdb_result* row = graph->neighbors + i * k;
+    for (size_t c = 0; row[k - 1].index == SIZE_MAX && c < n; c++) {
+      if (c == i)
+        continue;
+      float d = vdb_compute_distance_normed(
+          db->vectors[i].data, db->vectors[c].data, norms[i], norms[c],
+          db->dimensions, db->metric);
+      vdb_nndescent_insert(row, fresh + i * k, k, c, d);
+    }
+  }
+
+  for (size_t iter = 0; iter < max_iters; iter++) {
+    memset(new_sizes, 0, n * sizeof(size_t));
+    memset(old_sizes, 0, n * sizeof(size_t));
+
+    for (size_t i = 0; i < n; i++) {
+      vdb_result* row = graph->neighbors + i * k;
+      for (size_t j = 0; j < k; j++) {
+        size_t u = row[j].index;
+        if (u == SIZE_MAX)
+          continue;
+        if (fresh[i * k + j]) {
+          fresh[i * k + j] = 0;
+          vdb_nndescent_sample(new_lists + i * cap, &new_sizes[i], cap, u,
+                               &rng);
+          vdb_nndescent_sample(new_lists + u * cap, &new_sizes[u], cap, i,
+                               &rng);
+        } else {
+          vdb_nndescent_sample(old_lists + i * cap, &old_sizes[i], cap, u,
+                               &rng);
+          vdb_nndescent_sample(old_lists + u * cap, &old_sizes[u], cap, i,
+                               &rng);
+        }
+      }
+    }
+
+    size_t updates = 0;
+    for (size_t v = 0; v < n; v++) {
+      const size_t* nl = new_lists + v * cap;
+      const size_t* ol = old_lists + v * cap;
+      for (size_t a = 0; a < new_sizes[v]; a++) {
+        size_t u1 = nl[a];
+        for (size_t b = a + 1; b < new_sizes[v] + old_sizes[v]; b++) {
+          size_t u2 = b < new_sizes[v] ? nl[b] : ol[b - new_sizes[v]];
+          if (u1 == u2)
+            continue;
+          float d = vdb_compute_distance_normed(
+              db->vectors[u1].data, db->vectors[u2].data, norms[u1],
+              norms[u2], db->dimensions, db->metric);
+          updates += vdb_nndescent_insert(graph->neighbors + u1 * k,
+                                          fresh + u1 * k, k, u2, d);
+          updates += vdb_nndescent_insert(graph->neighbors + u2 * k,
+                                          fresh + u2 * k, k, u1, d);
+        }
+      }
+    }
+
+    if (updates * 1000 <= n * k)
+      break;
+  }
+
+  vdb_knn_finish(db, graph);
+
+  VDB_FREE(norms);
+  VDB_FREE(fresh);
+  VDB_FREE(new_lists);
+  VDB_FREE(old_lists);
+  VDB_FREE(new_sizes);
+  VDB_FREE(old_sizes);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+  vdb_sched_release_bulk(db);
+
+  return graph;
+}
+
+static inline void vdb_free_graph(vdb_graph* graph) {
+  if (!graph)
+    return;
+  if (graph->neighbors) {
+    VDB_FREE(graph->neighbors);
+  }
+  VDB_FREE(graph);
+}
+
+static inline void vdb_kmeans_assign_worker(void* arg, size_t worker,
+                                            size_t nworkers) {
+  vdb_kmeans_thread_args* args = (vdb_kmeans_thread_args*)arg;
+  const vdb_database* db = args->db;
+  size_t start = db->count * worker / nworkers;
+  size_t end = db->count * (worker + 1) / nworkers;
+  size_t changed = 0;
+
+  for (size_t i = start; i < end; i++) {
+    size_t best = 0;
+    float best_distance = INFINITY;
+    for (size_t c = 0; c < args->nclusters; c++) {
+      float d = vdb_compute_distance_normed(
+          db->vectors[i].data, args->centroids + c * db->dimensions,
+          args->norms[i], args->centroid_norms[c], db->dimensions,
+          db->metric);
+      if (d < best_distance) {
+        best_distance = d;
+        best = c;
+      }
+    }
+    if (args->assignments[i] != best) {
+      args->assignments[i] = best;
+      changed++;
+    }
+    args->distances[i] = best_distance;
+  }
+
+  args->changed[worker] = changed;
+}
+
+static inline void vdb_kmeans_seed_worker(void* arg, size_t worker,
+                                          size_t nworkers) {
+  vdb_kmeans_thread_args* args = (vdb_kmeans_thread_args*)arg;
+  const vdb_database* db = args->db;
+  const float* seed = db->vectors[args->seed_index].data;
+  float seed_norm = args->norms[args->seed_index];
+  size_t start = db->count * worker / nworkers;
+  size_t end = db->count * (worker + 1) / nworkers;
+
+  /* weighted by the distance the assignment step uses; dot-product
+   * distances can be negative, which count as no distance */
+  for (size_t i = start; i < end; i++) {
+    float d = vdb_compute_distance_normed(db->vectors[i].data, seed,
+                                          args->norms[i], seed_norm,
+                                          db->dimensions, db->metric);
+    float weight = d > 0.0f ? d * d : 0.0f;
+    if (weight < args->seed_weights[i])
+      args->seed_weights[i] = weight;
+  }
+}
+
+static inline void vdb_kmeans_set_centroid(const vdb_database* db,
+                                           float* centroid, float* norm,
+                                           const float* data) {
+  memcpy(centroid, data, db->dimensions * sizeof(float));
+  *norm = vdb_magnitude(centroid, db->dimensions);
+}
+
+static inline void vdb_kmeans_normalize(const vdb_database* db,
+                                        float* centroid, float* norm) {
+  *norm = vdb_magnitude(centroid, db->dimensions);
+  if (db->metric == VDB_METRIC_COSINE && *norm > 0.0f) {
+    for (size_t d = 0; d < db->dimensions; d++)
+      centroid[d] /= *norm;
+    *norm = 1.0f;
+  }
+}
+
+static inline void vdb_kmeans_seed(vdb_kmeans_thread_args* args,
+                                   float* centroids, float* centroid_norms,
+                                   vdb_kmeans_init init, uint64_t* rng,
+                                   size_t nworkers) {
+  const vdb_database* db = args->db;
+  size_t n = db->count;
+  size_t first = (size_t)(vdb_random(rng) % n);
+
+  vdb_kmeans_set_centroid(db, centroids, &centroid_norms[0],
+                          db->vectors[first].data);
+
+  if (init == VDB_KMEANS_RANDOM) {
+    /* Partial Fisher-Yates over a virtual permutation: swapped slots are
+     * remembered in assignments, which is rewritten by the first pass. */
+    for (size_t i = 0; i < n; i++)
+      args->assignments[i] = i;
+    args->assignments[first] = 0;
+    args->assignments[0] = first;
+    for (size_t c = 1; c < args->nclusters; c++) {
+      size_t j = c + (size_t)(vdb_random(rng) % (n - c));
+      size_t tmp = args->assignments[c];
+      args->assignments[c] = args->assignments[j];
+      args->assignments[j] = tmp;
+      vdb_kmeans_set_centroid(db, centroids + c * db->dimensions,
+                              &centroid_norms[c],
+                              db->vectors[args->assignments[c]].data);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    args->seed_weights[i] = INFINITY;
+  args->seed_index = first;
+
+  for (size_t c = 1; c < args->nclusters; c++) {
+    vdb_run_workers(vdb_kmeans_seed_worker, args, nworkers);
+
+    double total = 0.0;
+    for (size_t i = 0; i < n; i++)
+      total += args->seed_weights[i];
+
+    size_t pick = (size_t)(vdb_random(rng) % n);
+    if (total > 0.0) {
+      double target = (double)(vdb_random(rng) >> 11) / 9007199254740992.0 *
+                      total;
+      for (size_t i = 0; i < n; i++) {
+        target -= args->seed_weights[i];
+        if (target <= 0.0 && args->seed_weights[i] > 0.0f) {
+          pick = i;
+          break;
+        }
+      }
+    }
+
+    args->seed_index = pick;
+    vdb_kmeans_set_centroid(db, centroids + c * db->dimensions,
+                            &centroid_norms[c], db->vectors[pick].data);
+  }
+}
+
+/* Lloyd iterations when batch_size is 0, otherwise mini-batch k-means with
+ * per-centroid learning rates. Cosine databases get unit-length
+ * (spherical) centroids. Assignment passes run on worker threads. */
+static inline vdb_kmeans_result* vdb_kmeans_ex(const vdb_database* db,
+                                               size_t nclusters, size_t iters,
+                                               vdb_kmeans_init init,
+                                               size_t batch_size,
+                                               uint64_t seed) {
+  if (!db || nclusters == 0)
+    return NULL;
+
+  vdb_sched_admit_bulk(db);
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (db->count < nclusters) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    vdb_sched_release_bulk(db);
+    return NULL;
+  }
+
+  size_t n = db->count;
+  size_t dims = db->dimensions;
+  vdb_kmeans_result* result =
+      (vdb_kmeans_result*)VDB_MALLOC(sizeof(vdb_kmeans_result));
+  float* centroids = (float*)VDB_MALLOC(nclusters * dims * sizeof(float));
+  float* centroid_norms = (float*)VDB_MALLOC(nclusters * sizeof(float));
+  size_t* assignments = (size_t*)VDB_MALLOC(n * sizeof(size_t));
+  float* distances = (float*)VDB_MALLOC(n * sizeof(float));
+  size_t* counts = (size_t*)VDB_MALLOC(nclusters * sizeof(size_t));
+  float* norms = vdb_compute_norms(db);
+  float* seed_weights = init == VDB_KMEANS_PLUSPLUS
+                            ? (float*)VDB_MALLOC(n * sizeof(float))
+                            : NULL;
+
+  if (!result || !centroids || !centroid_norms || !assignments ||
+      !distances || !counts || !norms ||
+      (init == VDB_KMEANS_PLUSPLUS && !seed_weights)) {
+    VDB_FREE(result);
+    VDB_FREE(centroids);
+    VDB_FREE(centroid_norms);
+    VDB_FREE(assignments);
+    VDB_FREE(distances);
+    VDB_FREE(counts);
+    VDB_FREE(norms);
+    VDB_FREE(seed_weights);
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    vdb_sched_release_bulk(db);
+    return NULL;
+  }
+
+  uint64_t rng = seed;
+  size_t nworkers = vdb_thread_count();
+  if (nworkers > n)
+    nworkers = n;
+
+  vdb_kmeans_thread_args args;
+  args.db = db;
+  args.norms = norms;
+  args.centroids = centroids;
+  args.centroid_norms = centroid_norms;
+  args.nclusters = nclusters;
+  args.assignments = assignments;
+  args.distances = distances;
+  args.seed_weights = seed_weights;
+
+  vdb_kmeans_seed(&args, centroids, centroid_norms, init, &rng, nworkers);
+  for (size_t c = 0; c < nclusters; c++)
+    vdb_kmeans_normalize(db, centroids + c * dims, &centroid_norms[c]);
+  for (size_t i = 0; i < n; i++)
+    assignments[i] = SIZE_MAX;
+
+  size_t iter = 0;
+
+  if (batch_size > 0) {
+    memset(counts, 0, nclusters * sizeof(size_t));
+    for (; iter < iters; iter++) {
+      for (size_t b = 0; b < batch_size; b++) {
+        size_t i = (size_t)(vdb_random(&rng) % n);
+        const float* v = db->vectors[i].data;
+        size_t best = 0;
+        float best_distance = INFINITY;
+        for (size_t c = 0; c < nclusters; c++) {
+          float d = vdb_compute_distance_normed(v, centroids + c * dims,
+                                                norms[i], centroid_norms[c],
+                                                dims, db->metric);
+          if (d < best_distance) {
+            best_distance = d;
+            best = c;
+          }
+        }
+
+        float* centroid = centroids + best * dims;
+        float eta = 1.0f / (float)++counts[best];
+        for (size_t d = 0; d < dims; d++)
+          centroid[d] += eta * (v[d] - centroid[d]);
+        vdb_kmeans_normalize(db, centroid, &centroid_norms[best]);
+      }
+    }
+    vdb_run_workers(vdb_kmeans_assign_worker, &args, nworkers);
+  } else {
+    for (; iter < iters; iter++) {
+      vdb_run_workers(vdb_kmeans_assign_worker, &args, nworkers);
+
+      size_t changed = 0;
+      for (size_t w = 0; w < nworkers; w++)
+        changed += args.changed[w];
+      if (changed == 0)
+        break;
+
+      memset(centroids, 0, nclusters * dims * sizeof(float));
+      memset(counts, 0, nclusters * sizeof(size_t));
+      for (size_t i = 0; i < n; i++) {
+        float* centroid = centroids + assignments[i] * dims;
+        const float* v = db->vectors[i].data;
+        for (size_t d = 0; d < dims; d++)
+          centroid[d] += v[d];
+        counts[assignments[i]]++;
+      }
+
+      for (size_t c = 0; c < nclusters; c++) {
+        float* centroid = centroids + c * dims;
+        if (counts[c] == 0) {
+          size_t i = (size_t)(vdb_random(&rng) % n);
+          memcpy(centroid, db->vectors[i].data, dims * sizeof(float));
+        } else {
+          for (size_t d = 0; d < dims; d++)
+            centroid[d] /= (float)counts[c];
+        }
+        vdb_kmeans_normalize(db, centroid, &centroid_norms[c]);
+      }
+    }
+
+    if (iter == iters)
+      vdb_run_workers(vdb_kmeans_assign_worker, &args, nworkers);
+  }
+
+  double total = 0.0;
+  for (size_t i = 0; i < n; i++)
+    total += distances[i];
+
+  result->centroids = centroids;
+  result->assignments = assignments;
+  result->nclusters = nclusters;
+  result->dimensions = dims;
+  result->count = n;
+  result->iterations = iter;
+  result->total_distance = (float)total;
+
+  VDB_FREE(centroid_norms);
+  VDB_FREE(distances);
+  VDB_FREE(counts);
+  VDB_FREE(norms);
+  VDB_FREE(seed_weights);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+  vdb_sched_release_bulk(db);
+
+  return result;
+}
+
+static inline vdb_kmeans_result* vdb_kmeans(const vdb_database* db,
+                                            size_t nclusters, size_t iters) {
+  return vdb_kmeans_ex(db, nclusters, iters, VDB_KMEANS_PLUSPLUS, 0,
+                       0x6B6D65616E73ULL);
+}
+
+static inline void vdb_free_kmeans_result(vdb_kmeans_result* result) {
+  if (!result)
+    return;
+  VDB_FREE(result->centroids);
+  VDB_FREE(result->assignments);
+  VDB_FREE(result);
+}
+
+static inline vdb_error vdb_get_vector(const vdb_database* db, size_t index,
+                                       float** out_data, char** out_id,
+                                       void** out_metadata) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  if (index >= db->count) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return VDB_ERROR_INVALID_INDEX;
+  }
+
+  if (out_data)
+    *out_data = db->vectors[index].data;
+  if (out_id)
+    *out_id = db->vectors[index].id;
+  if (out_metadata)
+    *out_metadata = db->vectors[index].metadata;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_remove_unlocked(vdb_database* db, size_t index) {
+  if (index >= db->count)
+    return VDB_ERROR_INVALID_INDEX;
+
+  vdb_error err = vdb_cdc_reserve(db, 1);
+  if (err != VDB_OK)
+    return err;
+
+  VDB_FREE(db->vectors[index].data);
+  /* the change record takes over the id */
+  vdb_cdc_log_unlocked(db, VDB_CDC_REMOVE, index, NULL,
+                       db->vectors[index].id, 0);
+
+  if (db->sparse_rows)
+    vdb_sparse_remove_unlocked(db, index);
+  for (size_t f = 0; f < db->field_count; f++)
+    vdb_field_remove_row(&db->fields[f], index, db->count);
+
+  if (index < db->count - 1) {
+    memmove(&db->vectors[index], &db->vectors[index + 1],
+            (db->count - index - 1) * sizeof(vdb_vector));
+  }
+
+  db->count--;
+  db->dedup_stale = 1;
+  db->version++;
+
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_remove_vector(vdb_database* db, size_t index) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  vdb_error err = db->read_only ? VDB_ERROR_READ_ONLY
+                                : vdb_remove_unlocked(db, index);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return err;
+}
+
+static inline vdb_error vdb_update_unlocked(vdb_database* db, size_t index,
+                                           const float* data) {
+  if (index >= db->count)
+    return VDB_ERROR_INVALID_INDEX;
+
+  vdb_error err = vdb_cdc_reserve(db, 1);
+  if (err != VDB_OK)
+    return err;
+
+  memcpy(db->vectors[index].data, data, db->dimensions * sizeof(float));
+  db->dedup_stale = 1;
+  db->version++;
+  vdb_cdc_log_row_unlocked(db, VDB_CDC_UPDATE, index);
+  return VDB_OK;
+}
+
+/* Replaces the vector stored at index, keeping its id, metadata, sparse
+ * row and field vectors. */
+static inline vdb_error vdb_update_vector(vdb_database* db, size_t index,
+                                          const float* data) {
+  if (!db || !data)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  vdb_error err = db->read_only ? VDB_ERROR_READ_ONLY
+                                : vdb_update_unlocked(db, index, data);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return err;
+}
+
+static inline void vdb_free_result_set(vdb_result_set* result_set) {
+  if (!result_set)
+    return;
+  if (result_set->results) {
+    VDB_FREE(result_set->results);
+  }
+  VDB_FREE(result_set);
+}
+
+static inline void vdb_destroy(vdb_database* db) {
+  if (!db)
+    return;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+
+  for (size_t i = 0; i < db->count; i++) {
+    VDB_FREE(db->vectors[i].data);
+    if (db->vectors[i].id) {
+      VDB_FREE(db->vectors[i].id);
+    }
+  }
+
+  if (db->vectors) {
+    VDB_FREE(db->vectors);
+  }
+
+  VDB_FREE(db->dedup_table);
+  VDB_FREE(db->sparse_rows);
+  VDB_FREE(db->sparse_indices);
+  VDB_FREE(db->sparse_values);
+  for (size_t d = 0; d < db->posting_dims; d++) {
+    VDB_FREE(db->postings[d].rows);
+    VDB_FREE(db->postings[d].values);
+  }
+  VDB_FREE(db->postings);
+  for (size_t f = 0; f < db->field_count; f++) {
+    VDB_FREE(db->fields[f].name);
+    VDB_FREE(db->fields[f].data);
+    VDB_FREE(db->fields[f].norms);
+    VDB_FREE(db->fields[f].present);
+  }
+  VDB_FREE(db->fields);
+  for (size_t i = 0; i < db->watch_count; i++)
+    VDB_FREE(db->watches[i].query);
+  VDB_FREE(db->watches);
+  VDB_FREE(db->watch_pivots);
+  vdb_cdc_free_ring(db);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+  pthread_rwlock_destroy(&db->lock);
+  pthread_cond_destroy(&db->scheduler.cond);
+  pthread_mutex_destroy(&db->scheduler.mutex);
+#endif
+
+  VDB_FREE(db);
+}
+
+static inline size_t vdb_count(const vdb_database* db) {
+  if (!db)
+    return 0;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+  size_t count = db->count;
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+  return count;
+#else
+  return db->count;
+#endif
+}
+
+static inline size_t vdb_dimensions(const vdb_database* db) {
+  if (!db)
+    return 0;
+  return db->dimensions;
+}
+
+static inline vdb_error vdb_save(const vdb_database* db, const char* filename) {
+  if (!db || !filename)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+    return VDB_ERROR_OUT_OF_MEMORY;
+  }
+
+  uint32_t magic = 0x56444230;
+  fwrite(&magic, sizeof(uint32_t), 1, f);
+
+  fwrite(&db->dimensions, sizeof(size_t), 1, f);
+  fwrite(&db->count, sizeof(size_t), 1, f);
+  fwrite(&db->metric, sizeof(vdb_metric), 1, f);
+
+  for (size_t i = 0; i < db->count; i++) {
+    fwrite(db->vectors[i].data, sizeof(float), db->dimensions, f);
+
+    uint32_t id_len =
+        db->vectors[i].id ? (uint32_t)strlen(db->vectors[i].id) : 0;
+    fwrite(&id_len, sizeof(uint32_t), 1, f);
+    if (id_len > 0) {
+      fwrite(db->vectors[i].id, sizeof(char), id_len, f);
+    }
+  }
+
+  fclose(f);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return VDB_OK;
+}
+
+static inline vdb_database* vdb_load(const char* filename) {
+  if (!filename)
+    return NULL;
+
+  FILE* f = fopen(filename, "rb");
+  if (!f)
+    return NULL;
+
+  uint32_t magic;
+  if (fread(&magic, sizeof(uint32_t), 1, f) != 1 || magic != 0x56444230) {
+    fclose(f);
+    return NULL;
+  }
+
+  size_t dimensions, count;
+  vdb_metric metric;
+
+  if (fread(&dimensions, sizeof(size_t), 1, f) != 1 ||
+      fread(&count, sizeof(size_t), 1, f) != 1 ||
+      fread(&metric, sizeof(vdb_metric), 1, f) != 1) {
+    fclose(f);
+    return NULL;
+  }
+
+  vdb_database* db = vdb_create(dimensions, metric);
+  if (!db) {
+    fclose(f);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    float* data = (float*)VDB_MALLOC(dimensions * sizeof(float));
+    if (!data || fread(data, sizeof(float), dimensions, f) != dimensions) {
+      VDB_FREE(data);
+      vdb_destroy(db);
+      fclose(f);
+      return NULL;
+    }
+
+    uint32_t id_len;
+    if (fread(&id_len, sizeof(uint32_t), 1, f) != 1) {
+      VDB_FREE(data);
+      vdb_destroy(db);
+      fclose(f);
+      return NULL;
+    }
+
+    char* id = NULL;
+    if (id_len > 0) {
+      id = (char*)VDB_MALLOC(id_len + 1);
+      if (!id || fread(id, sizeof(char), id_len, f) != id_len) {
+        VDB_FREE(data);
+        VDB_FREE(id);
+        vdb_destroy(db);
+        fclose(f);
+        return NULL;
+      }
+      id[id_len] = '\0';
+    }
+
+    vdb_error err = vdb_add_vector(db, data, id, NULL);
+    VDB_FREE(data);
+    VDB_FREE(id);
+
+    if (err != VDB_OK) {
+      vdb_destroy(db);
+      fclose(f);
+      return NULL;
+    }
+  }
+
+  fclose(f);
+  return db;
+}
+
+#ifndef VDB_FILE_BUFFER
+#define VDB_FILE_BUFFER (1u << 20)
+#endif
+
+/* Streams rows into a vdb_save file without building a database. The
+ * count in the header is filled in by vdb_writer_close. */
+typedef struct {
+  FILE* file;
+  char* buffer;
+  size_t dimensions;
+  size_t count;
+  int failed;
+} vdb_writer;
+
+static inline vdb_writer* vdb_writer_open(const char* filename,
+                                          size_t dimensions,
+                                          vdb_metric metric) {
+  if (!filename || dimensions == 0)
+    return NULL;
+
+  vdb_writer* writer = (vdb_writer*)VDB_MALLOC(sizeof(vdb_writer));
+  char* buffer = (char*)VDB_MALLOC(VDB_FILE_BUFFER);
+  FILE* f = writer && buffer ? fopen(filename, "wb") : NULL;
+  if (!f) {
+    VDB_FREE(writer);
+    VDB_FREE(buffer);
+    return NULL;
+  }
+  setvbuf(f, buffer, _IOFBF, VDB_FILE_BUFFER);
+
+  writer->file = f;
+  writer->buffer = buffer;
+  writer->dimensions = dimensions;
+  writer->count = 0;
+  writer->failed = 0;
+
+  uint32_t magic = 0x56444230;
+  fwrite(&magic, sizeof(uint32_t), 1, f);
+  fwrite(&writer->dimensions, sizeof(size_t), 1, f);
+  fwrite(&writer->count, sizeof(size_t), 1, f);
+  fwrite(&metric, sizeof(vdb_metric), 1, f);
+
+  return writer;
+}
+
+static inline vdb_error vdb_writer_add(vdb_writer* writer, const float* data,
+                                       const char* id) {
+  if (!writer || !data)
+    return VDB_ERROR_NULL_POINTER;
+
+  uint32_t id_len = id ? (uint32_t)strlen(id) : 0;
+  if (fwrite(data, sizeof(float), writer->dimensions, writer->file) !=
+          writer->dimensions ||
+      fwrite(&id_len, sizeof(uint32_t), 1, writer->file) != 1 ||
+      (id_len && fwrite(id, sizeof(char), id_len, writer->file) != id_len)) {
+    writer->failed = 1;
+    return VDB_ERROR_IO;
+  }
+
+  writer->count++;
+  return VDB_OK;
+}
+
+/* Writes the final count and closes the file. */
+static inline vdb_error vdb_writer_close(vdb_writer* writer) {
+  if (!writer)
+    return VDB_ERROR_NULL_POINTER;
+
+  FILE* f = writer->file;
+  int failed = writer->failed;
+  if (!failed) {
+    failed = fseek(f, sizeof(uint32_t) + sizeof(size_t), SEEK_SET) != 0 ||
+             fwrite(&writer->count, sizeof(size_t), 1, f) != 1;
+  }
+  failed |= fclose(f) != 0;
+
+  VDB_FREE(writer->buffer);
+  VDB_FREE(writer);
+  return failed ? VDB_ERROR_IO : VDB_OK;
+}
+
+/* Streams the rows of a vdb_save file without loading it. */
+typedef struct {
+  FILE* file;
+  char* buffer;
+  size_t dimensions;
+  size_t count;
+  vdb_metric metric;
+  size_t position; /* rows read so far */
+  uint64_t offset; /* bytes read so far */
+  uint64_t size;   /* file size */
+  float* data;
+  char* id;
+  size_t id_capacity;
+} vdb_reader;
+
+static inline void vdb_reader_close(vdb_reader* reader) {
+  if (!reader)
+    return;
+  if (reader->file)
+    fclose(reader->file);
+  VDB_FREE(reader->buffer);
+  VDB_FREE(reader->data);
+  VDB_FREE(reader->id);
+  VDB_FREE(reader);
+}
+
+static inline vdb_reader* vdb_reader_open(const char* filename) {
+  if (!filename)
+    return NULL;
+
+  vdb_reader* reader = (vdb_reader*)VDB_MALLOC(sizeof(vdb_reader));
+  if (!reader)
+    return NULL;
+  memset(reader, 0, sizeof(vdb_reader));
+
+  reader->file = fopen(filename, "rb");
+  reader->buffer = (char*)VDB_MALLOC(VDB_FILE_BUFFER);
+  if (!reader->file || !reader->buffer) {
+    vdb_reader_close(reader);
+    return NULL;
+  }
+  setvbuf(reader->file, reader->buffer, _IOFBF, VDB_FILE_BUFFER);
+
+  FILE* f = reader->file;
+  uint32_t magic;
+  long size = -1;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    size = ftell(f);
+    rewind(f);
+  }
+  if (size < 0 || fread(&magic, sizeof(uint32_t), 1, f) != 1 ||
+      magic != 0x56444230 ||
+      fread(&reader->dimensions, sizeof(size_t), 1, f) != 1 ||
+      fread(&reader->count, sizeof(size_t), 1, f) != 1 ||
+      fread(&reader->metric, sizeof(vdb_metric), 1, f) != 1 ||
+      reader->dimensions == 0) {
+    vdb_reader_close(reader);
+    return NULL;
+  }
+  reader->size = (uint64_t)size;
+  reader->offset =
+      sizeof(uint32_t) + 2 * sizeof(size_t) + sizeof(vdb_metric);
+
+  reader->data = (float*)VDB_MALLOC(reader->dimensions * sizeof(float));
+  if (!reader->data) {
+    vdb_reader_close(reader);
     return NULL;
+  }
+  return reader;
+}
+
+/* Reads the next row. *data and *id (NULL for none) stay valid until the
+ * next call. Returns VDB_ERROR_NOT_FOUND after the last row and
+ * VDB_ERROR_IO for a truncated or corrupt file. */
+static inline vdb_error vdb_reader_next(vdb_reader* reader,
+                                        const float** data, const char** id) {
+  if (!reader || !data || !id)
+    return VDB_ERROR_NULL_POINTER;
+  if (reader->position == reader->count)
+    return VDB_ERROR_NOT_FOUND;
+
+  size_t dims = reader->dimensions;
+  uint32_t id_len;
+  if (fread(reader->data, sizeof(float), dims, reader->file) != dims ||
+      fread(&id_len, sizeof(uint32_t), 1, reader->file) != 1)
+    return VDB_ERROR_IO;
+  reader->offset += dims * sizeof(float) + sizeof(uint32_t);
+  if (id_len > reader->size - reader->offset)
+    return VDB_ERROR_IO;
+
+  if (id_len + 1 > reader->id_capacity) {
+    char* buf = (char*)VDB_REALLOC(reader->id, id_len + 1);
+    if (!buf)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    reader->id = buf;
+    reader->id_capacity = id_len + 1;
+  }
+  if (fread(reader->id, sizeof(char), id_len, reader->file) != id_len)
+    return VDB_ERROR_IO;
+  reader->id[id_len] = '\0';
+  reader->offset += id_len;
+  reader->position++;
+
+  *data = reader->data;
+  *id = id_len ? reader->id : NULL;
+  return VDB_OK;
+}
+
+#ifndef VDB_MERGE_BUFFER
+#define VDB_MERGE_BUFFER (16u << 20)
+#endif
+
+typedef enum {
+  VDB_MERGE_KEEP_ALL = 0,
+  VDB_MERGE_KEEP_FIRST = 1,
+  VDB_MERGE_KEEP_LAST = 2
+} vdb_merge_policy;
+
+typedef struct {
+  uint64_t hi;
+  uint64_t lo; /* hi | lo is never 0 for a used slot */
+  uint64_t row;
+} vdb_id_slot;
+
+/* Open-addressing set of 128-bit id hashes. 24 bytes per distinct id,
+ * whatever the id length. */
+typedef struct {
+  vdb_id_slot* slots;
+  size_t capacity;
+  size_t count;
+} vdb_id_set;
+
+static inline void vdb_id_hash(const char* id, uint64_t* hi, uint64_t* lo) {
+  uint64_t a = 0xCBF29CE484222325ULL;
+  uint64_t b = 0x84222325CBF29CE4ULL;
+  for (const unsigned char* p = (const unsigned char*)id; *p; p++) {
+    a = (a ^ *p) * 0x100000001B3ULL;
+    b = (b + *p) * 0x9E3779B97F4A7C15ULL;
+    b ^= b >> 29;
+  }
+  *hi = vdb_random(&a);
+  *lo = vdb_random(&b) | 1;
+}
+
+static inline void vdb_id_set_free(vdb_id_set* set) {
+  VDB_FREE(set->slots);
+  set->slots = NULL;
+  set->capacity = 0;
+  set->count = 0;
+}
+
+/* Finds the slot of id, adding it with row if missing. *added tells which
+ * happened. Returns NULL when out of memory. */
+static inline vdb_id_slot* vdb_id_set_insert(vdb_id_set* set, const char* id,
+                                             uint64_t row, int* added) {
+  if (2 * (set->count + 1) > set->capacity) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+    vdb_id_slot* slots =
+        (vdb_id_slot*)VDB_MALLOC(capacity * sizeof(vdb_id_slot));
+    if (!slots)
+      return NULL;
+    memset(slots, 0, capacity * sizeof(vdb_id_slot));
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (!set->slots[i].lo)
+        continue;
+      size_t pos = (size_t)set->slots[i].hi & (capacity - 1);
+      while (slots[pos].lo)
+        pos = (pos + 1) & (capacity - 1);
+      slots[pos] = set->slots[i];
+    }
+    VDB_FREE(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+  }
+
+  uint64_t hi, lo;
+  vdb_id_hash(id, &hi, &lo);
+  size_t pos = (size_t)hi & (set->capacity - 1);
+  while (set->slots[pos].lo) {
+    if (set->slots[pos].hi == hi && set->slots[pos].lo == lo) {
+      *added = 0;
+      return &set->slots[pos];
+    }
+    pos = (pos + 1) & (set->capacity - 1);
+  }
+
+  set->slots[pos].hi = hi;
+  set->slots[pos].lo = lo;
+  set->slots[pos].row = row;
+  set->count++;
+  *added = 1;
+  return &set->slots[pos];
+}
+
+/* Appends the rows of input after its header, in VDB_MERGE_BUFFER sized
+ * reads. */
+static inline vdb_error vdb_merge_copy(FILE* out, const char* input,
+                                       uint64_t offset, uint64_t length,
+                                       char* buffer) {
+  FILE* in = fopen(input, "rb");
+  if (!in)
+    return VDB_ERROR_IO;
+
+  vdb_error err = fseek(in, (long)offset, SEEK_SET) == 0 ? VDB_OK
+                                                         : VDB_ERROR_IO;
+  while (err == VDB_OK && length > 0) {
+    size_t n = length < VDB_MERGE_BUFFER ? (size_t)length : VDB_MERGE_BUFFER;
+    if (fread(buffer, 1, n, in) != n || fwrite(buffer, 1, n, out) != n)
+      err = VDB_ERROR_IO;
+    length -= n;
+  }
+
+  fclose(in);
+  return err;
+}
+
+/* The merge behind vdb_merge_files, written straight to output. */
+static inline vdb_error vdb_merge_write(const char* output,
+                                        const char* const* inputs,
+                                        size_t ninputs,
+                                        vdb_merge_policy policy,
+                                        size_t* out_rows,
+                                        size_t* out_dropped) {
+  size_t dims = 0;
+  size_t total = 0;
+  vdb_metric metric = VDB_METRIC_COSINE;
+  vdb_error err = VDB_OK;
+
+  for (size_t i = 0; i < ninputs && err == VDB_OK; i++) {
+    vdb_reader* reader = vdb_reader_open(inputs[i]);
+    if (!reader)
+      return VDB_ERROR_IO;
+    if (i == 0) {
+      dims = reader->dimensions;
+      metric = reader->metric;
+    }
+    if (reader->dimensions != dims || reader->metric != metric)
+      err = VDB_ERROR_INVALID_DIMENSIONS;
+    else if (reader->size - reader->offset <
+             reader->count * (dims * sizeof(float) + sizeof(uint32_t)))
+      err = VDB_ERROR_IO;
+
+    /* the rows are copied blindly, so they must end exactly at EOF */
+    const float* row_data;
+    const char* row_id;
+    while (err == VDB_OK && policy == VDB_MERGE_KEEP_ALL)
+      err = vdb_reader_next(reader, &row_data, &row_id);
+    if (err == VDB_ERROR_NOT_FOUND)
+      err = reader->offset == reader->size ? VDB_OK : VDB_ERROR_IO;
+    total += reader->count;
+    vdb_reader_close(reader);
+  }
+  if (err != VDB_OK)
+    return err;
+
+  if (policy == VDB_MERGE_KEEP_ALL) {
+    vdb_writer* writer = vdb_writer_open(output, dims, metric);
+    char* buffer = (char*)VDB_MALLOC(VDB_MERGE_BUFFER);
+    if (!writer || !buffer) {
+      VDB_FREE(buffer);
+      if (writer)
+        vdb_writer_close(writer);
+      return writer ? VDB_ERROR_OUT_OF_MEMORY : VDB_ERROR_IO;
+    }
+    for (size_t i = 0; i < ninputs && err == VDB_OK; i++) {
+      vdb_reader* reader = vdb_reader_open(inputs[i]);
+      if (!reader) {
+        err = VDB_ERROR_IO;
+        break;
+      }
+      uint64_t offset = reader->offset;
+      uint64_t length = reader->size - reader->offset;
+      vdb_reader_close(reader);
+      err = vdb_merge_copy(writer->file, inputs[i], offset, length, buffer);
+    }
+    VDB_FREE(buffer);
+    writer->count = total;
+    writer->failed |= err != VDB_OK;
+    vdb_error close_err = vdb_writer_close(writer);
+    if (err == VDB_OK)
+      err = close_err;
+    if (err == VDB_OK && out_rows)
+      *out_rows = total;
+    if (err == VDB_OK && out_dropped)
+      *out_dropped = 0;
+    return err;
+  }
+
+  vdb_id_set set;
+  memset(&set, 0, sizeof(set));
+  const float* data;
+  const char* id;
+  int added;
+
+  /* first pass: the last row of every id */
+  uint64_t row = 0;
+  for (size_t i = 0; policy == VDB_MERGE_KEEP_LAST && i < ninputs; i++) {
+    vdb_reader* reader = vdb_reader_open(inputs[i]);
+    if (!reader)
+      err = VDB_ERROR_IO;
+    while (err == VDB_OK &&
+           (err = vdb_reader_next(reader, &data, &id)) == VDB_OK) {
+      if (id) {
+        vdb_id_slot* slot = vdb_id_set_insert(&set, id, row, &added);
+        if (!slot)
+          err = VDB_ERROR_OUT_OF_MEMORY;
+        else
+          slot->row = row;
+      }
+      row++;
+    }
+    vdb_reader_close(reader);
+    if (err != VDB_ERROR_NOT_FOUND)
+      break;
+    err = VDB_OK;
+  }
+
+  vdb_writer* writer =
+      err == VDB_OK ? vdb_writer_open(output, dims, metric) : NULL;
+  if (err == VDB_OK && !writer)
+    err = VDB_ERROR_IO;
+
+  row = 0;
+  size_t dropped = 0;
+  for (size_t i = 0; err == VDB_OK && i < ninputs; i++) {
+    vdb_reader* reader = vdb_reader_open(inputs[i]);
+    if (!reader)
+      err = VDB_ERROR_IO;
+    while (err == VDB_OK &&
+           (err = vdb_reader_next(reader, &data, &id)) == VDB_OK) {
+      int keep = 1;
+      if (id) {
+        vdb_id_slot* slot = vdb_id_set_insert(&set, id, row, &added);
+        if (!slot)
+          err = VDB_ERROR_OUT_OF_MEMORY;
+        else
+          keep = policy == VDB_MERGE_KEEP_LAST ? slot->row == row : added;
+      }
+      if (err == VDB_OK && keep)
+        err = vdb_writer_add(writer, data, id);
+      dropped += !keep;
+      row++;
+    }
+    vdb_reader_close(reader);
+    if (err == VDB_ERROR_NOT_FOUND)
+      err = VDB_OK;
+  }
+
+  vdb_id_set_free(&set);
+  if (writer) {
+    size_t rows = writer->count;
+    writer->failed |= err != VDB_OK;
+    vdb_error close_err = vdb_writer_close(writer);
+    if (err == VDB_OK)
+      err = close_err;
+    if (err == VDB_OK && out_rows)
+      *out_rows = rows;
+  }
+  if (err == VDB_OK && out_dropped)
+    *out_dropped = dropped;
+  return err;
+}
+
+/* Merges vdb_save files that share dimensions and metric into output, in
+ * input order. VDB_MERGE_KEEP_ALL checks that each input's rows end exactly
+ * at EOF, then copies the row sections byte for byte.
+ * The other policies keep the first or the last row of every id, using
+ * a hash set of the ids (KEEP_LAST reads the inputs twice). Rows without
+ * an id are always kept. The merge is written to output.tmp, which is
+ * renamed over output only once it is complete, so a failed merge leaves
+ * output as it was and output may be one of the inputs. */
+static inline vdb_error vdb_merge_files(const char* output,
+                                        const char* const* inputs,
+                                        size_t ninputs,
+                                        vdb_merge_policy policy,
+                                        size_t* out_rows,
+                                        size_t* out_dropped) {
+  if (!output || !inputs || ninputs == 0)
+    return VDB_ERROR_NULL_POINTER;
+
+  size_t length = strlen(output);
+  char* tmp = (char*)VDB_MALLOC(length + 5);
+  if (!tmp)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  memcpy(tmp, output, length);
+  memcpy(tmp + length, ".tmp", 5);
+
+  size_t rows = 0;
+  size_t dropped = 0;
+  vdb_error err =
+      vdb_merge_write(tmp, inputs, ninputs, policy, &rows, &dropped);
+  if (err == VDB_OK && rename(tmp, output) != 0)
+    err = VDB_ERROR_IO;
+  if (err != VDB_OK)
+    remove(tmp);
+  VDB_FREE(tmp);
+
+  if (err == VDB_OK && out_rows)
+    *out_rows = rows;
+  if (err == VDB_OK && out_dropped)
+    *out_dropped = dropped;
+  return err;
+}
+
+#define VDB_REPL_MAGIC 0x56444252
+
+typedef enum {
+  VDB_REPL_ADD = VDB_CDC_ADD,
+  VDB_REPL_REMOVE = VDB_CDC_REMOVE,
+  VDB_REPL_UPDATE = VDB_CDC_UPDATE,
+  VDB_REPL_SNAPSHOT = 3,
+  VDB_REPL_HEARTBEAT = 4
+} vdb_repl_frame;
+
+typedef struct {
+  uint64_t applied; /* sequence number of the next record to apply */
+  uint64_t leader;  /* leader position from the latest frame */
+} vdb_replica;
+
+/* Frame header: magic, type, sequence number, row index, then an id as in
+ * vdb_save (length 0 for none). Add and update frames carry the vector. */
+static inline vdb_error vdb_repl_write_header(FILE* out, uint32_t type,
+                                              uint64_t seq, uint64_t index,
+                                              const char* id) {
+  uint32_t magic = VDB_REPL_MAGIC;
+  uint32_t id_len = id ? (uint32_t)strlen(id) : 0;
+
+  if (fwrite(&magic, sizeof(uint32_t), 1, out) != 1 ||
+      fwrite(&type, sizeof(uint32_t), 1, out) != 1 ||
+      fwrite(&seq, sizeof(uint64_t), 1, out) != 1 ||
+      fwrite(&index, sizeof(uint64_t), 1, out) != 1 ||
+      fwrite(&id_len, sizeof(uint32_t), 1, out) != 1 ||
+      (id_len && fwrite(id, sizeof(char), id_len, out) != id_len))
+    return VDB_ERROR_IO;
+  return VDB_OK;
+}
+
+/* Writes a snapshot frame: every row of the leader, followed by the
+ * position the follower continues from. Start each new follower with
+ * this. */
+static inline vdb_error vdb_repl_snapshot(const vdb_database* db, FILE* out,
+                                          uint64_t* position) {
+  if (!db || !out || !position)
+    return VDB_ERROR_NULL_POINTER;
 
 #ifdef VDB_MULTITHREADED
   pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
 #endif
 
-  if (db->count == 0) {
+  uint64_t dims = db->dimensions;
+  vdb_error err = vdb_repl_write_header(out, VDB_REPL_SNAPSHOT, db->cdc_head,
+                                        db->count, NULL);
+  if (err == VDB_OK && fwrite(&dims, sizeof(uint64_t), 1, out) != 1)
+    err = VDB_ERROR_IO;
+
+  for (size_t i = 0; i < db->count && err == VDB_OK; i++) {
+    const char* id = db->vectors[i].id;
+    uint32_t id_len = id ? (uint32_t)strlen(id) : 0;
+    if (fwrite(db->vectors[i].data, sizeof(float), db->dimensions, out) !=
+            db->dimensions ||
+        fwrite(&id_len, sizeof(uint32_t), 1, out) != 1 ||
+        (id_len && fwrite(id, sizeof(char), id_len, out) != id_len))
+      err = VDB_ERROR_IO;
+  }
+
+  if (err == VDB_OK)
+    *position = db->cdc_head;
+
 #ifdef VDB_MULTITHREADED
-    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
 #endif
+
+  if (err == VDB_OK && fflush(out) != 0)
+    err = VDB_ERROR_IO;
+  return err;
+}
+
+/* Ships up to max change records from *position, then a heartbeat with the
+ * leader position so idle followers can report lag. A follower that fell
+ * out of the change ring is sent a fresh snapshot instead. Requires
+ * vdb_cdc_enable on the leader; acknowledging shipped records is left to
+ * the caller. */
+static inline vdb_error vdb_repl_ship(const vdb_database* db, FILE* out,
+                                      uint64_t* position, size_t max) {
+  if (!db || !out || !position)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_cdc_batch* batch;
+  vdb_error err = vdb_cdc_read(db, *position, max, &batch);
+  if (err == VDB_ERROR_OVERFLOW)
+    return vdb_repl_snapshot(db, out, position);
+  if (err != VDB_OK)
+    return err;
+
+  for (size_t i = 0; i < batch->count && err == VDB_OK; i++) {
+    const vdb_cdc_record* r = &batch->records[i];
+    err = vdb_repl_write_header(out, (uint32_t)r->op, r->seq, r->index, r->id);
+    if (err == VDB_OK && r->data &&
+        fwrite(r->data, sizeof(float), batch->dimensions, out) !=
+            batch->dimensions)
+      err = VDB_ERROR_IO;
+  }
+
+  if (err == VDB_OK) {
+    *position = batch->next_seq;
+    err = vdb_repl_write_header(out, VDB_REPL_HEARTBEAT,
+                                vdb_cdc_position(db), 0, NULL);
+  }
+  vdb_cdc_free_batch(batch);
+
+  if (err == VDB_OK && fflush(out) != 0)
+    err = VDB_ERROR_IO;
+  return err;
+}
+
+/* Discards n bytes of a frame that cannot be applied, so that the next
+ * frame is still read from its start. */
+static inline vdb_error vdb_repl_skip(FILE* in, uint64_t n) {
+  char buffer[4096];
+
+  while (n > 0) {
+    size_t chunk = n < sizeof(buffer) ? (size_t)n : sizeof(buffer);
+    if (fread(buffer, 1, chunk, in) != chunk)
+      return VDB_ERROR_IO;
+    n -= chunk;
+  }
+  return VDB_OK;
+}
+
+static inline char* vdb_repl_read_id(FILE* in, vdb_error* err) {
+  uint32_t id_len;
+  char* id = NULL;
+
+  *err = VDB_OK;
+  if (fread(&id_len, sizeof(uint32_t), 1, in) != 1) {
+    *err = VDB_ERROR_IO;
     return NULL;
   }
+  if (id_len > 0) {
+    id = (char*)VDB_MALLOC(id_len + 1);
+    if (!id) {
+      *err = vdb_repl_skip(in, id_len) == VDB_OK ? VDB_ERROR_OUT_OF_MEMORY
+                                                 : VDB_ERROR_IO;
+    } else if (fread(id, sizeof(char), id_len, in) != id_len) {
+      VDB_FREE(id);
+      id = NULL;
+      *err = VDB_ERROR_IO;
+    } else {
+      id[id_len] = '\0';
+    }
+  }
+  return id;
+}
 
-  if (k > db->count)
-    k = db->count;
+/* Replaces the follower's contents with a snapshot of count rows. The
+ * payload is read to its end even when it cannot be applied, so the stream
+ * stays aligned on frames unless the error is VDB_ERROR_IO. Clearing the
+ * old rows goes through change data capture and stops at its first error,
+ * e.g. VDB_ERROR_BUSY from a full ring in VDB_CDC_REJECT mode. */
+static inline vdb_error vdb_repl_load_unlocked(vdb_database* db, FILE* in,
+                                               uint64_t count) {
+  uint64_t dims;
+  if (fread(&dims, sizeof(uint64_t), 1, in) != 1)
+    return VDB_ERROR_IO;
+
+  vdb_error err =
+      dims == db->dimensions ? VDB_OK : VDB_ERROR_INVALID_DIMENSIONS;
+  while (err == VDB_OK && db->count > 0)
+    err = vdb_remove_unlocked(db, db->count - 1);
+
+  float* data = NULL;
+  if (err == VDB_OK) {
+    data = (float*)VDB_MALLOC(db->dimensions * sizeof(float));
+    if (!data)
+      err = VDB_ERROR_OUT_OF_MEMORY;
+  }
+
+  for (uint64_t i = 0; i < count; i++) {
+    if (data ? fread(data, sizeof(float), dims, in) != dims
+             : vdb_repl_skip(in, dims * sizeof(float)) != VDB_OK) {
+      err = VDB_ERROR_IO;
+      break;
+    }
+    vdb_error id_err;
+    char* id = vdb_repl_read_id(in, &id_err);
+    if (id_err == VDB_ERROR_IO) {
+      err = VDB_ERROR_IO;
+      break;
+    }
+    if (err == VDB_OK)
+      err = id_err;
+    if (err == VDB_OK)
+      err = vdb_insert_unlocked(db, data, id, NULL);
+    VDB_FREE(id);
+  }
+
+  VDB_FREE(data);
+  return err;
+}
+
+/* Reads and applies one frame from the leader. Records the follower has
+ * already applied are skipped; a gap returns VDB_ERROR_OVERFLOW, and the
+ * leader must send a snapshot. The follower database is made read-only so
+ * that only the leader's changes reach it. */
+static inline vdb_error vdb_repl_apply(vdb_database* db, FILE* in,
+                                       vdb_replica* replica) {
+  if (!db || !in || !replica)
+    return VDB_ERROR_NULL_POINTER;
+
+  uint32_t magic, type;
+  uint64_t seq, index;
+  if (fread(&magic, sizeof(uint32_t), 1, in) != 1 ||
+      fread(&type, sizeof(uint32_t), 1, in) != 1 ||
+      fread(&seq, sizeof(uint64_t), 1, in) != 1 ||
+      fread(&index, sizeof(uint64_t), 1, in) != 1 ||
+      magic != VDB_REPL_MAGIC || type > VDB_REPL_HEARTBEAT)
+    return VDB_ERROR_IO;
+
+  vdb_error err;
+  char* id = vdb_repl_read_id(in, &err);
+  if (err != VDB_OK)
+    return err;
+
+  float* data = NULL;
+  if (type == VDB_REPL_ADD || type == VDB_REPL_UPDATE) {
+    data = (float*)VDB_MALLOC(db->dimensions * sizeof(float));
+    if (!data)
+      err = vdb_repl_skip(in, db->dimensions * sizeof(float)) == VDB_OK
+                ? VDB_ERROR_OUT_OF_MEMORY
+                : VDB_ERROR_IO;
+    else if (fread(data, sizeof(float), db->dimensions, in) != db->dimensions)
+      err = VDB_ERROR_IO;
+  }
 
-  vdb_result* all_results =
-      (vdb_result*)VDB_MALLOC(db->count * sizeof(vdb_result));
-  if (!all_results) {
 #ifdef VDB_MULTITHREADED
-    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+  pthread_rwlock_wrlock(&db->lock);
 #endif
-    return NULL;
+
+  db->read_only = 1;
+
+  if (err == VDB_OK) {
+    switch (type) {
+    case VDB_REPL_SNAPSHOT:
+      err = vdb_repl_load_unlocked(db, in, index);
+      if (err == VDB_OK)
+        replica->applied = seq;
+      break;
+    case VDB_REPL_HEARTBEAT:
+      break;
+    default:
+      if (seq > replica->applied) {
+        err = VDB_ERROR_OVERFLOW;
+      } else if (seq == replica->applied) {
+        if (type == VDB_REPL_ADD && index != db->count)
+          err = VDB_ERROR_INVALID_INDEX;
+        else if (type == VDB_REPL_ADD)
+          err = vdb_insert_unlocked(db, data, id, NULL);
+        else if (type == VDB_REPL_REMOVE)
+          err = vdb_remove_unlocked(db, (size_t)index);
+        else
+          err = vdb_update_unlocked(db, (size_t)index, data);
+        if (err == VDB_OK)
+          replica->applied++;
+      }
+      break;
+    }
   }
 
-  for (size_t i = 0; i < db->count; i++) {
-    all_results[i].index = i;
-    all_results[i].distance = vdb_compute_distance(query, db->vectors[i].data,
-                                                   db->dimensions, db->metric);
-    all_results[i].id = db->vectors[i].id;
-    all_results[i].metadata = db->vectors[i].metadata;
+  if (err == VDB_OK) {
+    uint64_t leader = seq;
+    if (type != VDB_REPL_HEARTBEAT && type != VDB_REPL_SNAPSHOT)
+      leader = seq + 1;
+    if (leader > replica->leader)
+      replica->leader = leader;
   }
 
-  qsort(all_results, db->count, sizeof(vdb_result), vdb_result_compare);
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  VDB_FREE(id);
+  VDB_FREE(data);
+  return err;
+}
+
+/* Rejects (or, with read_only 0, allows again) local adds, removes and
+ * updates, for example to promote a follower. */
+static inline vdb_error vdb_set_read_only(vdb_database* db, int read_only) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_wrlock(&db->lock);
+#endif
+  db->read_only = read_only != 0;
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock(&db->lock);
+#endif
+
+  return VDB_OK;
+}
+
+/* Records the leader has that the follower has not applied yet. */
+static inline uint64_t vdb_repl_lag(const vdb_replica* replica) {
+  if (!replica || replica->leader <= replica->applied)
+    return 0;
+  return replica->leader - replica->applied;
+}
+
+static inline vdb_doc_database* vdb_doc_create(size_t dimensions,
+                                               vdb_metric metric) {
+  if (dimensions == 0)
+    return NULL;
 
-  vdb_result_set* result_set =
-      (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
-  if (!result_set) {
-    VDB_FREE(all_results);
-#ifdef VDB_MULTITHREADED
-    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
-#endif
+  vdb_doc_database* db =
+      (vdb_doc_database*)VDB_MALLOC(sizeof(vdb_doc_database));
+  if (!db)
     return NULL;
-  }
 
-  result_set->results = (vdb_result*)VDB_MALLOC(k * sizeof(vdb_result));
-  if (!result_set->results) {
-    VDB_FREE(all_results);
-    VDB_FREE(result_set);
+  db->tokens = NULL;
+  db->token_norms = NULL;
+  db->token_docs = NULL;
+  db->token_count = 0;
+  db->token_capacity = 0;
+  db->documents = NULL;
+  db->count = 0;
+  db->capacity = 0;
+  db->dimensions = dimensions;
+  db->metric = metric;
+
 #ifdef VDB_MULTITHREADED
-    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
-#endif
+  if (pthread_rwlock_init(&db->lock, NULL) != 0) {
+    VDB_FREE(db);
     return NULL;
   }
+#endif
 
-  memcpy(result_set->results, all_results, k * sizeof(vdb_result));
-  result_set->count = k;
+  return db;
+}
 
-  VDB_FREE(all_results);
+static inline vdb_error vdb_doc_reserve_tokens(vdb_doc_database* db,
+                                               size_t needed) {
+  if (needed <= db->token_capacity)
+    return VDB_OK;
 
-#ifdef VDB_MULTITHREADED
-  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
-#endif
+  size_t capacity = db->token_capacity == 0 ? 64 : db->token_capacity * 2;
+  while (capacity < needed)
+    capacity *= 2;
 
-  return result_set;
+  float* tokens = (float*)VDB_REALLOC(
+      db->tokens, capacity * db->dimensions * sizeof(float));
+  if (!tokens)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  db->tokens = tokens;
+
+  float* norms =
+      (float*)VDB_REALLOC(db->token_norms, capacity * sizeof(float));
+  if (!norms)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  db->token_norms = norms;
+
+  size_t* docs =
+      (size_t*)VDB_REALLOC(db->token_docs, capacity * sizeof(size_t));
+  if (!docs)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  db->token_docs = docs;
+
+  db->token_capacity = capacity;
+  return VDB_OK;
 }
 
-static inline vdb_error vdb_get_vector(const vdb_database* db, size_t index,
-                                       float** out_data, char** out_id,
-                                       void** out_metadata) {
-  if (!db)
+/* Adds a document made of count token vectors stored back to back. The
+ * tokens are copied into one arena so every document stays contiguous. */
+static inline vdb_error vdb_doc_add(vdb_doc_database* db, const float* vectors,
+                                    size_t count, const char* id,
+                                    void* metadata) {
+  if (!db || !vectors)
     return VDB_ERROR_NULL_POINTER;
+  if (count == 0)
+    return VDB_ERROR_INVALID_DIMENSIONS;
 
 #ifdef VDB_MULTITHREADED
-  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+  pthread_rwlock_wrlock(&db->lock);
 #endif
 
-  if (index >= db->count) {
-#ifdef VDB_MULTITHREADED
-    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
-#endif
-    return VDB_ERROR_INVALID_INDEX;
+  vdb_error err = vdb_doc_reserve_tokens(db, db->token_count + count);
+
+  if (err == VDB_OK && db->count >= db->capacity) {
+    size_t new_capacity = db->capacity == 0 ? 16 : db->capacity * 2;
+    vdb_document* new_documents = (vdb_document*)VDB_REALLOC(
+        db->documents, new_capacity * sizeof(vdb_document));
+    if (new_documents) {
+      db->documents = new_documents;
+      db->capacity = new_capacity;
+    } else {
+      err = VDB_ERROR_OUT_OF_MEMORY;
+    }
   }
 
-  if (out_data)
-    *out_data = db->vectors[index].data;
-  if (out_id)
-    *out_id = db->vectors[index].id;
-  if (out_metadata)
-    *out_metadata = db->vectors[index].metadata;
+  char* id_copy = NULL;
+  if (err == VDB_OK && id) {
+    size_t id_len = strlen(id);
+    id_copy = (char*)VDB_MALLOC(id_len + 1);
+    if (id_copy)
+      memcpy(id_copy, id, id_len + 1);
+    else
+      err = VDB_ERROR_OUT_OF_MEMORY;
+  }
+
+  if (err == VDB_OK) {
+    memcpy(db->tokens + db->token_count * db->dimensions, vectors,
+           count * db->dimensions * sizeof(float));
+    for (size_t t = 0; t < count; t++) {
+      db->token_norms[db->token_count + t] =
+          vdb_magnitude(vectors + t * db->dimensions, db->dimensions);
+      db->token_docs[db->token_count + t] = db->count;
+    }
+
+    vdb_document* doc = &db->documents[db->count];
+    doc->offset = db->token_count;
+    doc->count = count;
+    doc->id = id_copy;
+    doc->metadata = metadata;
+    db->token_count += count;
+    db->count++;
+  }
 
 #ifdef VDB_MULTITHREADED
-  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+  pthread_rwlock_unlock(&db->lock);
 #endif
 
-  return VDB_OK;
+  return err;
 }
 
-static inline vdb_error vdb_remove_vector(vdb_database* db, size_t index) {
+static inline vdb_error vdb_doc_remove(vdb_doc_database* db, size_t index) {
   if (!db)
     return VDB_ERROR_NULL_POINTER;
 
@@ -360,17 +5511,31 @@ static inline vdb_error vdb_remove_vector(vdb_database* db, size_t index) {
     return VDB_ERROR_INVALID_INDEX;
   }
 
-  VDB_FREE(db->vectors[index].data);
-  if (db->vectors[index].id) {
-    VDB_FREE(db->vectors[index].id);
-  }
+  vdb_document removed = db->documents[index];
+  size_t tail = db->token_count - removed.offset - removed.count;
 
-  if (index < db->count - 1) {
-    memmove(&db->vectors[index], &db->vectors[index + 1],
-            (db->count - index - 1) * sizeof(vdb_vector));
-  }
+  memmove(db->tokens + removed.offset * db->dimensions,
+          db->tokens + (removed.offset + removed.count) * db->dimensions,
+          tail * db->dimensions * sizeof(float));
+  memmove(db->token_norms + removed.offset,
+          db->token_norms + removed.offset + removed.count,
+          tail * sizeof(float));
+  memmove(db->token_docs + removed.offset,
+          db->token_docs + removed.offset + removed.count,
+          tail * sizeof(size_t));
+  db->token_count -= removed.count;
+
+  for (size_t t = removed.offset; t < db->token_count; t++)
+    db->token_docs[t]--;
 
+  if (removed.id)
+    VDB_FREE(removed.id);
+
+  memmove(&db->documents[index], &db->documents[index + 1],
+          (db->count - index - 1) * sizeof(vdb_document));
   db->count--;
+  for (size_t d = index; d < db->count; d++)
+    db->documents[d].offset -= removed.count;
 
 #ifdef VDB_MULTITHREADED
   pthread_rwlock_unlock(&db->lock);
@@ -379,16 +5544,21 @@ static inline vdb_error vdb_remove_vector(vdb_database* db, size_t index) {
   return VDB_OK;
 }
 
-static inline void vdb_free_result_set(vdb_result_set* result_set) {
-  if (!result_set)
-    return;
-  if (result_set->results) {
-    VDB_FREE(result_set->results);
-  }
-  VDB_FREE(result_set);
+static inline size_t vdb_doc_count(const vdb_doc_database* db) {
+  if (!db)
+    return 0;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+  size_t count = db->count;
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+  return count;
+#else
+  return db->count;
+#endif
 }
 
-static inline void vdb_destroy(vdb_database* db) {
+static inline void vdb_doc_destroy(vdb_doc_database* db) {
   if (!db)
     return;
 
@@ -397,15 +5567,15 @@ static inline void vdb_destroy(vdb_database* db) {
 #endif
 
   for (size_t i = 0; i < db->count; i++) {
-    VDB_FREE(db->vectors[i].data);
-    if (db->vectors[i].id) {
-      VDB_FREE(db->vectors[i].id);
+    if (db->documents[i].id) {
+      VDB_FREE(db->documents[i].id);
     }
   }
 
-  if (db->vectors) {
-    VDB_FREE(db->vectors);
-  }
+  VDB_FREE(db->documents);
+  VDB_FREE(db->tokens);
+  VDB_FREE(db->token_norms);
+  VDB_FREE(db->token_docs);
 
 #ifdef VDB_MULTITHREADED
   pthread_rwlock_unlock(&db->lock);
@@ -415,142 +5585,278 @@ static inline void vdb_destroy(vdb_database* db) {
   VDB_FREE(db);
 }
 
-static inline size_t vdb_count(const vdb_database* db) {
-  if (!db)
-    return 0;
+/* Late-interaction distance: the sum over query tokens of the distance to
+ * the closest document token, i.e. negated MaxSim with sim = -distance.
+ * Document tokens are streamed once against the whole query block, which
+ * stays cache resident, and the inner loops vectorize. */
+static inline float vdb_maxsim_distance(const vdb_doc_database* db,
+                                        const vdb_document* doc,
+                                        const float* query,
+                                        const float* query_norms,
+                                        size_t nquery, float* best) {
+  size_t dims = db->dimensions;
 
-#ifdef VDB_MULTITHREADED
-  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
-  size_t count = db->count;
-  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
-  return count;
-#else
-  return db->count;
-#endif
+  for (size_t q = 0; q < nquery; q++)
+    best[q] = INFINITY;
+
+  for (size_t t = doc->offset; t < doc->offset + doc->count; t++) {
+    const float* token = db->tokens + t * dims;
+    for (size_t q = 0; q < nquery; q++) {
+      float d = vdb_compute_distance_normed(query + q * dims, token,
+                                            query_norms[q],
+                                            db->token_norms[t], dims,
+                                            db->metric);
+      if (d < best[q])
+        best[q] = d;
+    }
+  }
+
+  float total = 0.0f;
+  for (size_t q = 0; q < nquery; q++)
+    total += best[q];
+  return total;
 }
 
-static inline size_t vdb_dimensions(const vdb_database* db) {
-  if (!db)
-    return 0;
-  return db->dimensions;
+static inline void vdb_maxsim_worker(void* arg, size_t worker,
+                                     size_t nworkers) {
+  vdb_maxsim_thread_args* args = (vdb_maxsim_thread_args*)arg;
+  const vdb_doc_database* db = args->db;
+  vdb_result* heap = args->heaps + worker * args->k;
+  size_t start = args->ndocs * worker / nworkers;
+  size_t end = args->ndocs * (worker + 1) / nworkers;
+
+  args->sizes[worker] = 0;
+  args->failed[worker] = 0;
+
+  float* best = (float*)VDB_MALLOC(args->nquery * sizeof(float));
+  if (!best) {
+    args->failed[worker] = 1;
+    return;
+  }
+
+  for (size_t i = start; i < end; i++) {
+    size_t d = args->docs ? args->docs[i] : i;
+    float distance =
+        vdb_maxsim_distance(db, &db->documents[d], args->query,
+                            args->query_norms, args->nquery, best);
+    vdb_heap_push(heap, &args->sizes[worker], args->k, d, distance);
+  }
+
+  VDB_FREE(best);
 }
 
-static inline vdb_error vdb_save(const vdb_database* db, const char* filename) {
-  if (!db || !filename)
-    return VDB_ERROR_NULL_POINTER;
+static inline vdb_result_set* vdb_doc_rank_unlocked(const vdb_doc_database* db,
+                                                    const float* query,
+                                                    size_t nquery, size_t k,
+                                                    const size_t* docs,
+                                                    size_t ndocs) {
+  if (ndocs == 0)
+    return NULL;
 
-#ifdef VDB_MULTITHREADED
-  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
-#endif
+  size_t nworkers = vdb_thread_count();
+  if (nworkers > ndocs)
+    nworkers = ndocs;
+  if (k > ndocs)
+    k = ndocs;
 
-  FILE* f = fopen(filename, "wb");
-  if (!f) {
-#ifdef VDB_MULTITHREADED
-    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
-#endif
-    return VDB_ERROR_OUT_OF_MEMORY;
+  vdb_maxsim_thread_args args;
+  args.db = db;
+  args.query = query;
+  args.nquery = nquery;
+  args.docs = docs;
+  args.ndocs = ndocs;
+  args.k = k;
+
+  float* query_norms = (float*)VDB_MALLOC(nquery * sizeof(float));
+  args.heaps = (vdb_result*)VDB_MALLOC(nworkers * k * sizeof(vdb_result));
+  vdb_result_set* result_set =
+      (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+  vdb_result* results = (vdb_result*)VDB_MALLOC(k * sizeof(vdb_result));
+
+  if (!query_norms || !args.heaps || !result_set || !results) {
+    VDB_FREE(query_norms);
+    VDB_FREE(args.heaps);
+    VDB_FREE(result_set);
+    VDB_FREE(results);
+    return NULL;
   }
 
-  uint32_t magic = 0x56444230;
-  fwrite(&magic, sizeof(uint32_t), 1, f);
+  for (size_t q = 0; q < nquery; q++)
+    query_norms[q] = vdb_magnitude(query + q * db->dimensions, db->dimensions);
+  args.query_norms = query_norms;
 
-  fwrite(&db->dimensions, sizeof(size_t), 1, f);
-  fwrite(&db->count, sizeof(size_t), 1, f);
-  fwrite(&db->metric, sizeof(vdb_metric), 1, f);
+  vdb_run_workers(vdb_maxsim_worker, &args, nworkers);
 
-  for (size_t i = 0; i < db->count; i++) {
-    fwrite(db->vectors[i].data, sizeof(float), db->dimensions, f);
+  int failed = 0;
+  for (size_t w = 0; w < nworkers; w++)
+    failed |= args.failed[w];
+  if (failed) {
+    VDB_FREE(query_norms);
+    VDB_FREE(args.heaps);
+    VDB_FREE(result_set);
+    VDB_FREE(results);
+    return NULL;
+  }
 
-    uint32_t id_len =
-        db->vectors[i].id ? (uint32_t)strlen(db->vectors[i].id) : 0;
-    fwrite(&id_len, sizeof(uint32_t), 1, f);
-    if (id_len > 0) {
-      fwrite(db->vectors[i].id, sizeof(char), id_len, f);
+  size_t size = 0;
+  for (size_t w = 0; w < nworkers; w++) {
+    for (size_t i = 0; i < args.sizes[w]; i++) {
+      const vdb_result* r = &args.heaps[w * k + i];
+      vdb_heap_push(results, &size, k, r->index, r->distance);
     }
   }
 
-  fclose(f);
+  qsort(results, size, sizeof(vdb_result), vdb_result_compare);
+  for (size_t i = 0; i < size; i++) {
+    results[i].id = db->documents[results[i].index].id;
+    results[i].metadata = db->documents[results[i].index].metadata;
+  }
+
+  result_set->results = results;
+  result_set->count = size;
+
+  VDB_FREE(query_norms);
+  VDB_FREE(args.heaps);
+  return result_set;
+}
+
+/* Exact late-interaction search over every document. query holds nquery
+ * token vectors back to back; distances are vdb_maxsim_distance values. */
+static inline vdb_result_set* vdb_doc_search(const vdb_doc_database* db,
+                                             const float* query,
+                                             size_t nquery, size_t k) {
+  if (!db || !query || nquery == 0 || k == 0)
+    return NULL;
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  vdb_result_set* result_set =
+      db->count == 0
+          ? NULL
+          : vdb_doc_rank_unlocked(db, query, nquery, k, NULL, db->count);
 
 #ifdef VDB_MULTITHREADED
   pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
 #endif
 
-  return VDB_OK;
+  return result_set;
 }
 
-static inline vdb_database* vdb_load(const char* filename) {
-  if (!filename)
-    return NULL;
+static inline void vdb_candidate_worker(void* arg, size_t worker,
+                                        size_t nworkers) {
+  vdb_candidate_thread_args* args = (vdb_candidate_thread_args*)arg;
+  const vdb_doc_database* db = args->db;
+  size_t dims = db->dimensions;
+  size_t nquery = args->nquery;
+  size_t ncandidates = args->ncandidates;
+  vdb_result* heaps = args->heaps + worker * nquery * ncandidates;
+  size_t* sizes = args->sizes + worker * nquery;
+  size_t start = db->token_count * worker / nworkers;
+  size_t end = db->token_count * (worker + 1) / nworkers;
+  float query_norms[VDB_TILE];
 
-  FILE* f = fopen(filename, "rb");
-  if (!f)
-    return NULL;
+  memset(sizes, 0, nquery * sizeof(size_t));
+  for (size_t q0 = 0; q0 < nquery; q0 += VDB_TILE) {
+    size_t q1 = q0 + VDB_TILE < nquery ? q0 + VDB_TILE : nquery;
+    for (size_t q = q0; q < q1; q++)
+      query_norms[q - q0] = vdb_magnitude(args->query + q * dims, dims);
+    for (size_t t = start; t < end; t++) {
+      const float* token = db->tokens + t * dims;
+      for (size_t q = q0; q < q1; q++) {
+        float d = vdb_compute_distance_normed(
+            args->query + q * dims, token, query_norms[q - q0],
+            db->token_norms[t], dims, db->metric);
+        vdb_heap_push(heaps + q * ncandidates, &sizes[q], ncandidates, t, d);
+      }
+    }
+  }
+}
 
-  uint32_t magic;
-  if (fread(&magic, sizeof(uint32_t), 1, f) != 1 || magic != 0x56444230) {
-    fclose(f);
+/* Two-stage search: each query token gathers its ncandidates nearest
+ * document tokens, and only the documents owning them are reranked with
+ * exact MaxSim. Without a token index the first stage still scans every
+ * token, so this is not cheaper than vdb_doc_search today. */
+static inline vdb_result_set* vdb_doc_search_rerank(const vdb_doc_database* db,
+                                                    const float* query,
+                                                    size_t nquery, size_t k,
+                                                    size_t ncandidates) {
+  if (!db || !query || nquery == 0 || k == 0 || ncandidates == 0)
     return NULL;
-  }
 
-  size_t dimensions, count;
-  vdb_metric metric;
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_rdlock((pthread_rwlock_t*)&db->lock);
+#endif
 
-  if (fread(&dimensions, sizeof(size_t), 1, f) != 1 ||
-      fread(&count, sizeof(size_t), 1, f) != 1 ||
-      fread(&metric, sizeof(vdb_metric), 1, f) != 1) {
-    fclose(f);
+  if (db->count == 0) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
     return NULL;
   }
 
-  vdb_database* db = vdb_create(dimensions, metric);
-  if (!db) {
-    fclose(f);
-    return NULL;
-  }
+  if (ncandidates > db->token_count)
+    ncandidates = db->token_count;
 
-  for (size_t i = 0; i < count; i++) {
-    float* data = (float*)VDB_MALLOC(dimensions * sizeof(float));
-    if (!data || fread(data, sizeof(float), dimensions, f) != dimensions) {
-      VDB_FREE(data);
-      vdb_destroy(db);
-      fclose(f);
-      return NULL;
-    }
+  size_t nworkers = vdb_thread_count();
+  if (nworkers > db->token_count)
+    nworkers = db->token_count;
+  size_t slots = nquery * ncandidates;
 
-    uint32_t id_len;
-    if (fread(&id_len, sizeof(uint32_t), 1, f) != 1) {
-      VDB_FREE(data);
-      vdb_destroy(db);
-      fclose(f);
-      return NULL;
-    }
+  vdb_candidate_thread_args args;
+  args.db = db;
+  args.query = query;
+  args.nquery = nquery;
+  args.ncandidates = ncandidates;
+  args.heaps = (vdb_result*)VDB_MALLOC(nworkers * slots * sizeof(vdb_result));
+  args.sizes = (size_t*)VDB_MALLOC(nworkers * nquery * sizeof(size_t));
+  vdb_result* heaps = (vdb_result*)VDB_MALLOC(slots * sizeof(vdb_result));
+  size_t* sizes = (size_t*)VDB_MALLOC(nquery * sizeof(size_t));
+  unsigned char* seen = (unsigned char*)VDB_MALLOC(db->count);
+  size_t* docs = (size_t*)VDB_MALLOC(slots * sizeof(size_t));
+  vdb_result_set* result_set = NULL;
 
-    char* id = NULL;
-    if (id_len > 0) {
-      id = (char*)VDB_MALLOC(id_len + 1);
-      if (!id || fread(id, sizeof(char), id_len, f) != id_len) {
-        VDB_FREE(data);
-        VDB_FREE(id);
-        vdb_destroy(db);
-        fclose(f);
-        return NULL;
+  if (args.heaps && args.sizes && heaps && sizes && seen && docs) {
+    vdb_run_workers(vdb_candidate_worker, &args, nworkers);
+
+    memset(sizes, 0, nquery * sizeof(size_t));
+    for (size_t w = 0; w < nworkers; w++) {
+      for (size_t q = 0; q < nquery; q++) {
+        const vdb_result* heap = args.heaps + w * slots + q * ncandidates;
+        for (size_t i = 0; i < args.sizes[w * nquery + q]; i++)
+          vdb_heap_push(heaps + q * ncandidates, &sizes[q], ncandidates,
+                        heap[i].index, heap[i].distance);
       }
-      id[id_len] = '\0';
     }
 
-    vdb_error err = vdb_add_vector(db, data, id, NULL);
-    VDB_FREE(data);
-    VDB_FREE(id);
-
-    if (err != VDB_OK) {
-      vdb_destroy(db);
-      fclose(f);
-      return NULL;
+    size_t ndocs = 0;
+    memset(seen, 0, db->count);
+    for (size_t q = 0; q < nquery; q++) {
+      for (size_t i = 0; i < sizes[q]; i++) {
+        size_t d = db->token_docs[heaps[q * ncandidates + i].index];
+        if (!seen[d]) {
+          seen[d] = 1;
+          docs[ndocs++] = d;
+        }
+      }
     }
+
+    result_set = vdb_doc_rank_unlocked(db, query, nquery, k, docs, ndocs);
   }
 
-  fclose(f);
-  return db;
+  VDB_FREE(args.heaps);
+  VDB_FREE(args.sizes);
+  VDB_FREE(heaps);
+  VDB_FREE(sizes);
+  VDB_FREE(seen);
+  VDB_FREE(docs);
+
+#ifdef VDB_MULTITHREADED
+  pthread_rwlock_unlock((pthread_rwlock_t*)&db->lock);
+#endif
+
+  return result_set;
 }
 
 #endif
@@ -0,0 +1,740 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VDB_HPP
+#define VDB_HPP
+
+/* C++20 interface to vdb.h: owning handles, spans instead of pointer and
+ * length pairs, and searches whose metric is fixed at compile time.
+ *
+ *   g++ -std=c++20 -O2 -DVDB_MULTITHREADED app.cpp -o app -lpthread
+ *
+ * Failed calls throw vdb::error carrying the vdb_error code. */
+
+#include "vdb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <memory_resource>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace vdb {
+
+using result = vdb_result;
+using result_vector = std::pmr::vector<result>;
+
+class error : public std::runtime_error {
+public:
+  explicit error(vdb_error code)
+      : std::runtime_error("vdb error " + std::to_string((int)code)),
+        code_(code) {
+  }
+
+  vdb_error code() const noexcept {
+    return code_;
+  }
+
+private:
+  vdb_error code_;
+};
+
+inline void check(vdb_error code) {
+  if (code != VDB_OK)
+    throw error(code);
+}
+
+/* Holds db->lock for reading; a no-op without VDB_MULTITHREADED. */
+class read_lock {
+public:
+  explicit read_lock(const vdb_database* db) noexcept : db_(db) {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_rdlock((pthread_rwlock_t*)&db_->lock);
+#endif
+  }
+  read_lock(const read_lock&) = delete;
+  read_lock& operator=(const read_lock&) = delete;
+  ~read_lock() {
+#ifdef VDB_MULTITHREADED
+    pthread_rwlock_unlock((pthread_rwlock_t*)&db_->lock);
+#endif
+  }
+
+private:
+  [[maybe_unused]] const vdb_database* db_;
+};
+
+template <class T>
+concept element = std::is_arithmetic_v<T>;
+
+/* Metric policies. Each mirrors one case of vdb_compute_distance_normed;
+ * norms are only computed for policies that use them. */
+struct cosine {
+  static constexpr vdb_metric value = VDB_METRIC_COSINE;
+  static constexpr bool uses_norms = true;
+
+  template <element T>
+  static float distance(const T* a, const T* b, std::size_t n, float norm_a,
+                        float norm_b) noexcept {
+    if (norm_a == 0.0f || norm_b == 0.0f)
+      return 1.0f;
+    float dot = 0.0f;
+    for (std::size_t i = 0; i < n; i++)
+      dot += (float)a[i] * (float)b[i];
+    return 1.0f - dot / (norm_a * norm_b);
+  }
+
+  /* distance() to a row whose norm is not known, accumulated in the same
+   * pass as the dot product instead of a second pass over the row */
+  template <element T>
+  static float row_distance(const T* query, const T* row, std::size_t n,
+                            float query_norm) noexcept {
+    float dot = 0.0f;
+    float sum = 0.0f;
+    for (std::size_t i = 0; i < n; i++) {
+      dot += (float)query[i] * (float)row[i];
+      sum += (float)row[i] * (float)row[i];
+    }
+    float norm = std::sqrt(sum);
+    if (query_norm == 0.0f || norm == 0.0f)
+      return 1.0f;
+    return 1.0f - dot / (query_norm * norm);
+  }
+};
+
+struct euclidean {
+  static constexpr vdb_metric value = VDB_METRIC_EUCLIDEAN;
+  static constexpr bool uses_norms = false;
+
+  template <element T>
+  static float distance(const T* a, const T* b, std::size_t n, float,
+                        float) noexcept {
+    float sum = 0.0f;
+    for (std::size_t i = 0; i < n; i++) {
+      float diff = (float)a[i] - (float)b[i];
+      sum += diff * diff;
+    }
+    return std::sqrt(sum);
+  }
+};
+
+struct dot_product {
+  static constexpr vdb_metric value = VDB_METRIC_DOT_PRODUCT;
+  static constexpr bool uses_norms = false;
+
+  template <element T>
+  static float distance(const T* a, const T* b, std::size_t n, float,
+                        float) noexcept {
+    float dot = 0.0f;
+    for (std::size_t i = 0; i < n; i++)
+      dot += (float)a[i] * (float)b[i];
+    return -dot;
+  }
+};
+
+template <class M>
+concept metric_policy = requires {
+  { M::value } -> std::convertible_to<vdb_metric>;
+  { M::uses_norms } -> std::convertible_to<bool>;
+};
+
+/* A policy that can score a stored row without a precomputed norm. */
+template <class M>
+concept row_distance_policy =
+    requires(const float* v, std::size_t n, float norm) {
+      { M::template row_distance<float>(v, v, n, norm) }
+          -> std::convertible_to<float>;
+    };
+
+template <element T>
+float magnitude(std::span<const T> v) noexcept {
+  float sum = 0.0f;
+  for (T x : v)
+    sum += (float)x * (float)x;
+  return std::sqrt(sum);
+}
+
+template <metric_policy Metric, element T>
+float distance(std::span<const T> a, std::span<const T> b) noexcept {
+  float norm_a = 0.0f;
+  float norm_b = 0.0f;
+  if constexpr (Metric::uses_norms) {
+    norm_a = magnitude(a);
+    norm_b = magnitude(b);
+  }
+  return Metric::template distance<T>(a.data(), b.data(), a.size(), norm_a,
+                                      norm_b);
+}
+
+/* Owns a vdb_result_set and iterates it as a contiguous range. Ids and
+ * metadata point into the database, as with vdb_search. */
+class results {
+public:
+  results() noexcept = default;
+  explicit results(vdb_result_set* set) noexcept : set_(set) {
+  }
+  results(results&& other) noexcept : set_(std::exchange(other.set_, nullptr)) {
+  }
+  results& operator=(results&& other) noexcept {
+    std::swap(set_, other.set_);
+    return *this;
+  }
+  results(const results&) = delete;
+  results& operator=(const results&) = delete;
+  ~results() {
+    vdb_free_result_set(set_);
+  }
+
+  const result* begin() const noexcept {
+    return set_ ? set_->results : nullptr;
+  }
+  const result* end() const noexcept {
+    return begin() + size();
+  }
+  std::size_t size() const noexcept {
+    return set_ ? set_->count : 0;
+  }
+  bool empty() const noexcept {
+    return size() == 0;
+  }
+  const result& operator[](std::size_t i) const noexcept {
+    return set_->results[i];
+  }
+  vdb_result_set* get() const noexcept {
+    return set_;
+  }
+
+private:
+  vdb_result_set* set_ = nullptr;
+};
+
+/* Single-pass range over a vdb_result_stream. Each step selects one more
+ * result, so a consumer that stops early skips the rest of the selection.
+ * Iterating throws vdb::error with VDB_ERROR_STALE once the database is
+ * modified. */
+class result_stream {
+public:
+  class iterator {
+  public:
+    using value_type = result;
+    using difference_type = std::ptrdiff_t;
+
+    iterator() noexcept = default;
+    const result& operator*() const noexcept {
+      return stream_->current_;
+    }
+    const result* operator->() const noexcept {
+      return &stream_->current_;
+    }
+    iterator& operator++() {
+      stream_->advance();
+      return *this;
+    }
+    void operator++(int) {
+      ++*this;
+    }
+    bool operator==(std::default_sentinel_t) const noexcept {
+      return !stream_ || stream_->done_;
+    }
+
+  private:
+    friend class result_stream;
+    explicit iterator(result_stream* stream) noexcept : stream_(stream) {
+    }
+
+    result_stream* stream_ = nullptr;
+  };
+
+  explicit result_stream(vdb_result_stream* stream) : stream_(stream) {
+    if (!stream_)
+      throw error(VDB_ERROR_OUT_OF_MEMORY);
+  }
+  result_stream(result_stream&& other) noexcept
+      : stream_(std::exchange(other.stream_, nullptr)),
+        current_(other.current_), started_(other.started_),
+        done_(other.done_) {
+  }
+  result_stream& operator=(result_stream&& other) noexcept {
+    std::swap(stream_, other.stream_);
+    std::swap(current_, other.current_);
+    std::swap(started_, other.started_);
+    std::swap(done_, other.done_);
+    return *this;
+  }
+  result_stream(const result_stream&) = delete;
+  result_stream& operator=(const result_stream&) = delete;
+  ~result_stream() {
+    vdb_stream_close(stream_);
+  }
+
+  iterator begin() {
+    if (!started_) {
+      started_ = true;
+      advance();
+    }
+    return iterator(this);
+  }
+  std::default_sentinel_t end() const noexcept {
+    return std::default_sentinel;
+  }
+  vdb_result_stream* get() const noexcept {
+    return stream_;
+  }
+
+private:
+  void advance() {
+    vdb_error err = vdb_stream_next(stream_, &current_);
+    if (err == VDB_ERROR_NOT_FOUND)
+      done_ = true;
+    else
+      check(err);
+  }
+
+  vdb_result_stream* stream_;
+  result current_{};
+  bool started_ = false;
+  bool done_ = false;
+};
+
+/* Answers awaited searches on one thread. Every search queued while the
+ * previous scan ran goes into a single vdb_search_batch_unlocked call, which
+ * spreads the scan over vdb_run_workers. Awaiting coroutines resume on this
+ * thread, after the read lock is released. */
+class search_batcher {
+public:
+  struct request {
+    std::span<const float> query;
+    result_vector* out; /* sized to k by the caller, trimmed to the hits */
+    std::exception_ptr error;
+    std::coroutine_handle<> handle;
+  };
+
+  explicit search_batcher(const vdb_database* db) : db_(db) {
+    thread_ = std::thread([this] { run(); });
+  }
+  search_batcher(const search_batcher&) = delete;
+  search_batcher& operator=(const search_batcher&) = delete;
+  /* Answers the searches still queued, then stops. */
+  ~search_batcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_one();
+    thread_.join();
+  }
+
+  void submit(request* r) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(r);
+    }
+    ready_.notify_one();
+  }
+
+  std::uint64_t batches() const noexcept {
+    return batches_.load(std::memory_order_relaxed);
+  }
+
+private:
+  void run() {
+    std::vector<request*> batch;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+        if (pending_.empty())
+          return;
+        batch.swap(pending_);
+      }
+      try {
+        scan(batch);
+      } catch (...) {
+        for (request* r : batch)
+          r->error = std::current_exception();
+      }
+      batches_.fetch_add(1, std::memory_order_relaxed);
+      for (request* r : batch)
+        r->handle.resume();
+      batch.clear();
+    }
+  }
+
+  /* The buffers persist across batches, so a steady load stops
+   * allocating once they have grown. */
+  void scan(const std::vector<request*>& batch) {
+    std::size_t n = batch.size();
+    std::size_t dims = db_->dimensions;
+    std::size_t max_k = 0;
+    queries_.resize(n * dims);
+    for (std::size_t q = 0; q < n; q++) {
+      std::copy(batch[q]->query.begin(), batch[q]->query.end(),
+                queries_.begin() + q * dims);
+      max_k = std::max(max_k, batch[q]->out->size());
+    }
+
+    read_lock lock(db_);
+    std::size_t count = db_->count;
+    std::size_t k = std::min(max_k, count);
+    if (k == 0) {
+      for (request* r : batch)
+        r->out->clear();
+      return;
+    }
+
+    norms_.resize(count);
+    query_norms_.resize(n);
+    sizes_.resize(n);
+    heaps_.resize(n * k);
+    vdb_search_batch_unlocked(db_, queries_.data(), n, k, norms_.data(),
+                              query_norms_.data(), sizes_.data(),
+                              heaps_.data());
+
+    for (std::size_t q = 0; q < n; q++) {
+      result_vector& out = *batch[q]->out;
+      std::size_t m = std::min(out.size(), k);
+      std::copy_n(heaps_.begin() + q * k, m, out.begin());
+      out.resize(m);
+    }
+  }
+
+  const vdb_database* db_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::vector<request*> pending_;
+  bool stop_ = false;
+  std::atomic<std::uint64_t> batches_{0};
+  std::vector<float> queries_;
+  std::vector<float> norms_;
+  std::vector<float> query_norms_;
+  std::vector<std::size_t> sizes_;
+  std::vector<result> heaps_;
+  std::thread thread_;
+};
+
+/* co_await yields the result_vector, nearest first. The query must stay
+ * valid until then. */
+class search_awaitable {
+public:
+  search_awaitable(search_batcher& batcher, std::span<const float> query,
+                   result_vector out)
+      : batcher_(batcher), out_(std::move(out)) {
+    request_.query = query;
+  }
+  search_awaitable(const search_awaitable&) = delete;
+  search_awaitable& operator=(const search_awaitable&) = delete;
+
+  bool await_ready() const noexcept {
+    return out_.empty();
+  }
+  void await_suspend(std::coroutine_handle<> handle) {
+    request_.out = &out_;
+    request_.handle = handle;
+    batcher_.submit(&request_);
+  }
+  result_vector await_resume() {
+    if (request_.error)
+      std::rethrow_exception(request_.error);
+    return std::move(out_);
+  }
+
+private:
+  search_batcher& batcher_;
+  search_batcher::request request_;
+  result_vector out_;
+};
+
+class database {
+public:
+  database(std::size_t dimensions, vdb_metric metric)
+      : db_(vdb_create(dimensions, metric)) {
+    if (!db_)
+      throw error(dimensions == 0 ? VDB_ERROR_INVALID_DIMENSIONS
+                                  : VDB_ERROR_OUT_OF_MEMORY);
+  }
+  /* Takes ownership of db. */
+  explicit database(vdb_database* db) : db_(db) {
+    if (!db_)
+      throw error(VDB_ERROR_NULL_POINTER);
+  }
+  database(database&& other) noexcept
+      : db_(std::exchange(other.db_, nullptr)),
+        batcher_(other.batcher_.exchange(nullptr)) {
+  }
+  database& operator=(database&& other) noexcept {
+    std::swap(db_, other.db_);
+    batcher_.store(other.batcher_.exchange(batcher_.load()));
+    return *this;
+  }
+  database(const database&) = delete;
+  database& operator=(const database&) = delete;
+  /* Must not run on the batcher thread, i.e. not from a coroutine resumed
+   * by search_async. */
+  ~database() {
+    delete batcher_.load();
+    vdb_destroy(db_);
+  }
+
+  static database load(const char* path) {
+    vdb_database* db = vdb_load(path);
+    if (!db)
+      throw error(VDB_ERROR_IO);
+    return database(db);
+  }
+
+  void save(const char* path) const {
+    check(vdb_save(db_, path));
+  }
+
+  void add(std::span<const float> vector, const char* id = nullptr,
+           void* metadata = nullptr) {
+    check_dimensions(vector.size());
+    check(vdb_add_vector(db_, vector.data(), id, metadata));
+  }
+
+  /* Rows stored back to back. ids is empty or holds one id per row. */
+  void add_batch(std::span<const float> rows,
+                 std::span<const char* const> ids = {}) {
+    std::size_t n = rows_in(rows);
+    if (!ids.empty() && ids.size() != n)
+      throw error(VDB_ERROR_INVALID_DIMENSIONS);
+    check(vdb_add_vectors(db_, rows.data(), n,
+                          ids.empty() ? nullptr : ids.data(), nullptr,
+                          nullptr));
+  }
+
+  void update(std::size_t index, std::span<const float> vector) {
+    check_dimensions(vector.size());
+    check(vdb_update_vector(db_, index, vector.data()));
+  }
+
+  void remove(std::size_t index) {
+    check(vdb_remove_vector(db_, index));
+  }
+
+  results search(std::span<const float> query, std::size_t k) const {
+    check_dimensions(query.size());
+    return results(vdb_search(db_, query.data(), k));
+  }
+
+  /* Writes the out.size() nearest rows to out without allocating and
+   * returns the filled prefix. */
+  std::span<result> search_into(std::span<const float> query,
+                                std::span<result> out) const {
+    check_dimensions(query.size());
+    return out.first(
+        vdb_search_into(db_, query.data(), out.size(), out.data()));
+  }
+
+  /* Like search, but the results are allocated from mr, so a per-request
+   * arena frees them with everything else. */
+  result_vector search(std::span<const float> query, std::size_t k,
+                       std::pmr::memory_resource* mr) const {
+    result_vector out(std::min(k, size()), mr);
+    out.resize(search_into(query, out).size());
+    return out;
+  }
+
+  /* Queries stored back to back; see vdb_search_batch for the layout. */
+  results search_batch(std::span<const float> queries, std::size_t k) const {
+    return results(
+        vdb_search_batch(db_, queries.data(), rows_in(queries), k));
+  }
+
+  /* Like search_batch, with the results and the norm buffers taken from mr.
+   * Row q is the out.size() / nqueries results starting at that offset.
+   * With VDB_MULTITHREADED the scan still starts worker threads, whose
+   * stacks the system allocates outside mr; VDB_THREADS=1 avoids them. */
+  result_vector search_batch(std::span<const float> queries, std::size_t k,
+                             std::pmr::memory_resource* mr) const {
+    std::size_t n = rows_in(queries);
+    result_vector out(mr);
+    if (n == 0 || k == 0)
+      return out;
+
+    read_lock lock(db_);
+    std::size_t count = db_->count;
+    if (count == 0)
+      return out;
+    k = std::min(k, count);
+
+    std::pmr::vector<float> norms(count, mr);
+    std::pmr::vector<float> query_norms(n, mr);
+    std::pmr::vector<std::size_t> sizes(n, mr);
+    out.resize(n * k);
+    vdb_search_batch_unlocked(db_, queries.data(), n, k, norms.data(),
+                              query_norms.data(), sizes.data(), out.data());
+    return out;
+  }
+
+  /* Nearest first, selected lazily as the range is walked; k = 0 streams
+   * every row. See vdb_search_stream. */
+  result_stream search_stream(std::span<const float> query,
+                              std::size_t k = 0) const {
+    check_dimensions(query.size());
+    return result_stream(vdb_search_stream(db_, query.data(), k));
+  }
+
+  /* co_await db.search_async(query, k) suspends until a batched scan has
+   * answered the query, without blocking the calling thread. The results
+   * come from mr. Other threads may only modify the database meanwhile
+   * when built with VDB_MULTITHREADED. */
+  search_awaitable search_async(
+      std::span<const float> query, std::size_t k,
+      std::pmr::memory_resource* mr = std::pmr::get_default_resource()) const {
+    check_dimensions(query.size());
+    return search_awaitable(batcher(), query,
+                            result_vector(std::min(k, size()), mr));
+  }
+
+  /* The batcher behind search_async, started by its first call. */
+  search_batcher& batcher() const {
+    search_batcher* current = batcher_.load(std::memory_order_acquire);
+    if (current)
+      return *current;
+    search_batcher* created = new search_batcher(db_);
+    if (batcher_.compare_exchange_strong(current, created,
+                                         std::memory_order_acq_rel))
+      return *created;
+    delete created;
+    return *current;
+  }
+
+  std::size_t size() const noexcept {
+    return vdb_count(db_);
+  }
+  std::size_t dimensions() const noexcept {
+    return vdb_dimensions(db_);
+  }
+  vdb_metric metric() const noexcept {
+    return db_->metric;
+  }
+  vdb_database* get() const noexcept {
+    return db_;
+  }
+  vdb_database* release() noexcept {
+    delete batcher_.exchange(nullptr);
+    return std::exchange(db_, nullptr);
+  }
+
+protected:
+  void check_dimensions(std::size_t n) const {
+    if (n != dimensions())
+      throw error(VDB_ERROR_INVALID_DIMENSIONS);
+  }
+
+  std::size_t rows_in(std::span<const float> rows) const {
+    std::size_t n = rows.size() / dimensions();
+    if (n * dimensions() != rows.size())
+      throw error(VDB_ERROR_INVALID_DIMENSIONS);
+    return n;
+  }
+
+  vdb_database* db_;
+  mutable std::atomic<search_batcher*> batcher_{nullptr};
+};
+
+/* A database whose metric is a type parameter. search_into inlines
+ * Metric::distance instead of switching on db->metric for every row, and
+ * scans on the calling thread so that it never allocates. Rows are always
+ * float; only the free distance() takes other element types. */
+template <metric_policy Metric>
+class basic_database : public database {
+public:
+  explicit basic_database(std::size_t dimensions)
+      : database(dimensions, Metric::value) {
+  }
+  /* Takes ownership of db, which must use Metric. */
+  explicit basic_database(vdb_database* db) : database(db) {
+    if (db->metric != Metric::value) {
+      vdb_destroy(release());
+      throw error(VDB_ERROR_INVALID_DIMENSIONS);
+    }
+  }
+
+  static basic_database load(const char* path) {
+    vdb_database* db = vdb_load(path);
+    if (!db)
+      throw error(VDB_ERROR_IO);
+    return basic_database(db);
+  }
+
+  using database::search;
+
+  result_vector search(std::span<const float> query, std::size_t k,
+                       std::pmr::memory_resource* mr) const {
+    result_vector out(std::min(k, size()), mr);
+    out.resize(search_into(query, out).size());
+    return out;
+  }
+
+  std::span<result> search_into(std::span<const float> query,
+                                std::span<result> out) const {
+    check_dimensions(query.size());
+    if (out.empty())
+      return out;
+
+    read_lock lock(db_);
+    std::size_t dims = db_->dimensions;
+    std::size_t size = 0;
+    float query_norm = 0.0f;
+    if constexpr (Metric::uses_norms)
+      query_norm = magnitude(query);
+
+    for (std::size_t i = 0; i < db_->count; i++) {
+      const float* v = db_->vectors[i].data;
+      float d;
+      if constexpr (row_distance_policy<Metric>) {
+        d = Metric::template row_distance<float>(query.data(), v, dims,
+                                                 query_norm);
+      } else {
+        float norm = 0.0f;
+        if constexpr (Metric::uses_norms)
+          norm = vdb_magnitude(v, dims);
+        d = Metric::template distance<float>(query.data(), v, dims,
+                                             query_norm, norm);
+      }
+      vdb_heap_push(out.data(), &size, out.size(), i, d);
+    }
+
+    qsort(out.data(), size, sizeof(result), vdb_result_compare);
+    for (std::size_t i = 0; i < size; i++) {
+      out[i].id = db_->vectors[out[i].index].id;
+      out[i].metadata = db_->vectors[out[i].index].metadata;
+    }
+    return out.first(size);
+  }
+};
+
+using cosine_database = basic_database<cosine>;
+using euclidean_database = basic_database<euclidean>;
+using dot_product_database = basic_database<dot_product>;
+
+} // namespace vdb
+
+#endif
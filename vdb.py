@@ -2,7 +2,7 @@ import ctypes
 import os
 import tempfile
 import subprocess
-from ctypes import c_void_p, c_char_p, c_size_t, c_float, c_int, POINTER, Structure
+from ctypes import c_void_p, c_char_p, c_char, c_size_t, c_float, c_int, c_uint32, c_uint64, POINTER, Structure
 
 class VDBError:
   OK = 0
@@ -12,12 +12,24 @@ class VDBError:
   NOT_FOUND = -4
   INVALID_INDEX = -5
   THREAD_FAILURE = -6
+  DUPLICATE = -7
+  EXPIRED = -8
+  STALE = -9
+  OVERFLOW = -10
+  BUSY = -11
+  UNSUPPORTED = -12
+  IO = -13
+  READ_ONLY = -14
 
 class VDBMetric:
   COSINE = 0
   EUCLIDEAN = 1
   DOT_PRODUCT = 2
 
+class VDBFusion:
+  WEIGHTED = 0
+  RRF = 1
+
 class VDBResult(Structure):
   _fields_ = [
     ("index", c_size_t),
@@ -32,6 +44,19 @@ class VDBResultSet(Structure):
     ("count", c_size_t)
   ]
 
+class VDBGroup(Structure):
+  _fields_ = [
+    ("key", c_uint64),
+    ("results", POINTER(VDBResult)),
+    ("count", c_size_t)
+  ]
+
+class VDBGroupResultSet(Structure):
+  _fields_ = [
+    ("groups", POINTER(VDBGroup)),
+    ("count", c_size_t)
+  ]
+
 class VectorDatabase:
   _lib = None
   _lib_path = None
@@ -51,6 +76,7 @@ class VectorDatabase:
     wrapper_code = '''
 #define VDB_MULTITHREADED
 #include "vdb.h"
+#include "vdb_ingest.h"
 
 vdb_database* wrap_vdb_create(size_t dims, int metric) {
   return vdb_create(dims, (vdb_metric)metric);
@@ -60,10 +86,45 @@ int wrap_vdb_add_vector(vdb_database* db, float* data, const char* id) {
   return vdb_add_vector(db, data, id, NULL);
 }
 
+int wrap_vdb_add_vector_sparse(vdb_database* db, float* data,
+                               uint32_t* indices, float* values, size_t nnz,
+                               const char* id) {
+  return vdb_add_vector_sparse(db, data, indices, values, nnz, id, NULL);
+}
+
 vdb_result_set* wrap_vdb_search(vdb_database* db, float* query, size_t k) {
   return vdb_search(db, query, k);
 }
 
+vdb_result_set* wrap_vdb_search_sparse(vdb_database* db, uint32_t* indices,
+                                       float* values, size_t nnz, size_t k) {
+  return vdb_search_sparse(db, indices, values, nnz, k);
+}
+
+vdb_result_set* wrap_vdb_search_hybrid(vdb_database* db, float* query,
+                                       uint32_t* indices, float* values,
+                                       size_t nnz, size_t k, int fusion,
+                                       float alpha) {
+  return vdb_search_hybrid(db, query, indices, values, nnz, k,
+                           (vdb_fusion)fusion, alpha);
+}
+
+vdb_result_set* wrap_vdb_search_mmr(vdb_database* db, float* query, size_t k,
+                                    size_t fetch_k, float lambda) {
+  return vdb_search_mmr(db, query, k, fetch_k, lambda);
+}
+
+vdb_group_result_set* wrap_vdb_search_grouped(vdb_database* db, float* query,
+                                              char separator, size_t groups,
+                                              size_t per_group) {
+  return vdb_search_grouped(db, query, vdb_group_by_id_prefix, &separator,
+                            groups, per_group);
+}
+
+void wrap_vdb_free_group_result_set(vdb_group_result_set* rs) {
+  vdb_free_group_result_set(rs);
+}
+
 void wrap_vdb_free_result_set(vdb_result_set* rs) {
   vdb_free_result_set(rs);
 }
@@ -91,6 +152,110 @@ vdb_database* wrap_vdb_load(const char* filename) {
 int wrap_vdb_remove_vector(vdb_database* db, size_t index) {
   return vdb_remove_vector(db, index);
 }
+
+int wrap_vdb_update_vector(vdb_database* db, size_t index, float* data) {
+  return vdb_update_vector(db, index, data);
+}
+
+int wrap_vdb_ingest(vdb_database* db, const char* path, int format,
+                    const char* vector_key, const char* id_key,
+                    int csv_header, int csv_id, size_t* rows,
+                    size_t* skipped, size_t* duplicates) {
+  vdb_ingest_options options;
+  vdb_ingest_stats stats;
+  vdb_ingest_defaults(&options);
+  options.format = (vdb_ingest_format)format;
+  options.vector_key = vector_key;
+  options.id_key = id_key;
+  options.csv_header = csv_header;
+  options.csv_id = csv_id;
+  int err = vdb_ingest_file(db, path, &options, &stats);
+  *rows = stats.rows;
+  *skipped = stats.skipped;
+  *duplicates = stats.duplicates;
+  return err;
+}
+
+typedef struct {
+  const vdb_database* a;
+  const vdb_database* b;
+  size_t k;
+  size_t rows;
+  size_t width;
+  size_t* indices;
+  float* distances;
+  int failed;
+} wrap_join_output;
+
+/* Runs under vdb_join's read locks, so the counts read on the first call
+ * hold for the whole join. */
+static int wrap_join_collect(size_t index, const vdb_result* results,
+                             size_t count, void* user) {
+  wrap_join_output* out = (wrap_join_output*)user;
+  if (!out->indices) {
+    out->rows = out->a->count;
+    out->width = out->k < out->b->count ? out->k : out->b->count;
+    out->indices = (size_t*)malloc(out->rows * out->width * sizeof(size_t));
+    out->distances = (float*)malloc(out->rows * out->width * sizeof(float));
+    if (!out->indices || !out->distances) {
+      out->failed = 1;
+      return 1;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    out->indices[index * out->width + i] = results[i].index;
+    out->distances[index * out->width + i] = results[i].distance;
+  }
+  return 0;
+}
+
+int wrap_vdb_join(vdb_database* a, vdb_database* b, size_t k, size_t* rows,
+                  size_t* width, size_t** indices, float** distances) {
+  wrap_join_output out = {a, b, k, 0, 0, NULL, NULL, 0};
+  int err = vdb_join(a, b, k, wrap_join_collect, &out);
+  if (err == VDB_OK && out.failed)
+    err = VDB_ERROR_OUT_OF_MEMORY;
+  if (err == VDB_OK && !out.indices)
+    out.rows = vdb_count(a); /* b is empty: one empty row per vector */
+  if (err != VDB_OK) {
+    free(out.indices);
+    free(out.distances);
+    out.rows = 0;
+    out.indices = NULL;
+    out.distances = NULL;
+  }
+  *rows = out.rows;
+  *width = out.width;
+  *indices = out.indices;
+  *distances = out.distances;
+  return err;
+}
+
+void wrap_free(void* p) {
+  free(p);
+}
+
+/* Hands over the result's arrays, sized by the row count vdb_kmeans saw
+ * under its lock; release them with wrap_free. */
+int wrap_vdb_kmeans(vdb_database* db, size_t nclusters, size_t iters,
+                    size_t* count, float** centroids, size_t** assignments) {
+  if (!db)
+    return VDB_ERROR_NULL_POINTER;
+  vdb_kmeans_result* result = vdb_kmeans(db, nclusters, iters);
+  if (!result) {
+    /* vdb_kmeans fails only for too few rows or out of memory */
+    if (nclusters == 0 || vdb_count(db) < nclusters)
+      return VDB_ERROR_INVALID_INDEX;
+    return VDB_ERROR_OUT_OF_MEMORY;
+  }
+  *count = result->count;
+  *centroids = result->centroids;
+  *assignments = result->assignments;
+  result->centroids = NULL;
+  result->assignments = NULL;
+  vdb_free_kmeans_result(result);
+  return VDB_OK;
+}
 '''
     
     with open(c_file, 'w') as f:
@@ -122,6 +287,24 @@ int wrap_vdb_remove_vector(vdb_database* db, size_t index) {
     cls._lib.wrap_vdb_search.argtypes = [c_void_p, POINTER(c_float), c_size_t]
     cls._lib.wrap_vdb_search.restype = POINTER(VDBResultSet)
     
+    cls._lib.wrap_vdb_add_vector_sparse.argtypes = [c_void_p, POINTER(c_float), POINTER(c_uint32), POINTER(c_float), c_size_t, c_char_p]
+    cls._lib.wrap_vdb_add_vector_sparse.restype = c_int
+    
+    cls._lib.wrap_vdb_search_sparse.argtypes = [c_void_p, POINTER(c_uint32), POINTER(c_float), c_size_t, c_size_t]
+    cls._lib.wrap_vdb_search_sparse.restype = POINTER(VDBResultSet)
+    
+    cls._lib.wrap_vdb_search_hybrid.argtypes = [c_void_p, POINTER(c_float), POINTER(c_uint32), POINTER(c_float), c_size_t, c_size_t, c_int, c_float]
+    cls._lib.wrap_vdb_search_hybrid.restype = POINTER(VDBResultSet)
+    
+    cls._lib.wrap_vdb_search_mmr.argtypes = [c_void_p, POINTER(c_float), c_size_t, c_size_t, c_float]
+    cls._lib.wrap_vdb_search_mmr.restype = POINTER(VDBResultSet)
+    
+    cls._lib.wrap_vdb_search_grouped.argtypes = [c_void_p, POINTER(c_float), c_char, c_size_t, c_size_t]
+    cls._lib.wrap_vdb_search_grouped.restype = POINTER(VDBGroupResultSet)
+    
+    cls._lib.wrap_vdb_free_group_result_set.argtypes = [POINTER(VDBGroupResultSet)]
+    cls._lib.wrap_vdb_free_group_result_set.restype = None
+    
     cls._lib.wrap_vdb_free_result_set.argtypes = [POINTER(VDBResultSet)]
     cls._lib.wrap_vdb_free_result_set.restype = None
     
@@ -142,6 +325,22 @@ int wrap_vdb_remove_vector(vdb_database* db, size_t index) {
     
     cls._lib.wrap_vdb_remove_vector.argtypes = [c_void_p, c_size_t]
     cls._lib.wrap_vdb_remove_vector.restype = c_int
+
+    cls._lib.wrap_vdb_update_vector.argtypes = [c_void_p, c_size_t, POINTER(c_float)]
+    cls._lib.wrap_vdb_update_vector.restype = c_int
+
+    cls._lib.wrap_vdb_ingest.argtypes = [c_void_p, c_char_p, c_int, c_char_p, c_char_p, c_int, c_int, POINTER(c_size_t), POINTER(c_size_t), POINTER(c_size_t)]
+    cls._lib.wrap_vdb_ingest.restype = c_int
+
+    cls._lib.wrap_vdb_join.argtypes = [c_void_p, c_void_p, c_size_t, POINTER(c_size_t), POINTER(c_size_t), POINTER(POINTER(c_size_t)), POINTER(POINTER(c_float))]
+    cls._lib.wrap_vdb_join.restype = c_int
+
+    cls._lib.wrap_free.argtypes = [c_void_p]
+    cls._lib.wrap_free.restype = None
+
+    cls._lib.wrap_vdb_kmeans.argtypes = [c_void_p, c_size_t, c_size_t, POINTER(c_size_t), POINTER(POINTER(c_float)),
+                                         POINTER(POINTER(c_size_t))]
+    cls._lib.wrap_vdb_kmeans.restype = c_int
   
   def __init__(self, dimensions, metric=VDBMetric.COSINE, multithreaded=True):
     VectorDatabase._compile_library(multithreaded)
@@ -151,14 +350,18 @@ int wrap_vdb_remove_vector(vdb_database* db, size_t index) {
     self.dimensions = dimensions
     self.metric = metric
   
-  def add_vector(self, vector, vector_id=None):
+  def add_vector(self, vector, vector_id=None, sparse=None):
     if len(vector) != self.dimensions:
       raise ValueError(f"Vector dimension mismatch: expected {self.dimensions}, got {len(vector)}")
     
     arr = (c_float * len(vector))(*vector)
     id_bytes = vector_id.encode('utf-8') if vector_id else None
     
-    result = self._lib.wrap_vdb_add_vector(self.db, arr, id_bytes)
+    if sparse is not None:
+      indices, values, nnz = self._sparse_arrays(sparse)
+      result = self._lib.wrap_vdb_add_vector_sparse(self.db, arr, indices, values, nnz, id_bytes)
+    else:
+      result = self._lib.wrap_vdb_add_vector(self.db, arr, id_bytes)
     if result != VDBError.OK:
       raise RuntimeError(f"Failed to add vector: error {result}")
   
@@ -167,30 +370,136 @@ int wrap_vdb_remove_vector(vdb_database* db, size_t index) {
       raise ValueError(f"Query dimension mismatch: expected {self.dimensions}, got {len(query)}")
     
     arr = (c_float * len(query))(*query)
-    result_set_ptr = self._lib.wrap_vdb_search(self.db, arr, k)
+    return self._collect_results(self._lib.wrap_vdb_search(self.db, arr, k))
+  
+  def search_sparse(self, sparse, k=5):
+    indices, values, nnz = self._sparse_arrays(sparse)
+    return self._collect_results(self._lib.wrap_vdb_search_sparse(self.db, indices, values, nnz, k))
+  
+  def search_hybrid(self, query, sparse, k=5, fusion=VDBFusion.WEIGHTED, alpha=0.5):
+    if len(query) != self.dimensions:
+      raise ValueError(f"Query dimension mismatch: expected {self.dimensions}, got {len(query)}")
+    
+    arr = (c_float * len(query))(*query)
+    indices, values, nnz = self._sparse_arrays(sparse)
+    return self._collect_results(self._lib.wrap_vdb_search_hybrid(self.db, arr, indices, values, nnz, k, fusion, alpha))
+  
+  @staticmethod
+  def _sparse_arrays(sparse):
+    items = sorted(sparse.items())
+    indices = (c_uint32 * max(len(items), 1))(*[i for i, _ in items])
+    values = (c_float * max(len(items), 1))(*[v for _, v in items])
+    return indices, values, len(items)
+  
+  def search_mmr(self, query, k=5, fetch_k=20, lambda_mult=0.5):
+    if len(query) != self.dimensions:
+      raise ValueError(f"Query dimension mismatch: expected {self.dimensions}, got {len(query)}")
+    
+    arr = (c_float * len(query))(*query)
+    return self._collect_results(self._lib.wrap_vdb_search_mmr(self.db, arr, k, fetch_k, lambda_mult))
+  
+  def search_grouped(self, query, groups=10, per_group=3, separator='#'):
+    if len(query) != self.dimensions:
+      raise ValueError(f"Query dimension mismatch: expected {self.dimensions}, got {len(query)}")
+    
+    arr = (c_float * len(query))(*query)
+    result_set_ptr = self._lib.wrap_vdb_search_grouped(self.db, arr, separator.encode('utf-8'), groups, per_group)
+    if not result_set_ptr:
+      return []
     
+    result_set = result_set_ptr.contents
+    grouped = [self._convert_results(result_set.groups[g].results, result_set.groups[g].count)
+               for g in range(result_set.count)]
+    self._lib.wrap_vdb_free_group_result_set(result_set_ptr)
+    return grouped
+  
+  def _collect_results(self, result_set_ptr):
     if not result_set_ptr:
       return []
     
     result_set = result_set_ptr.contents
-    results = []
+    results = self._convert_results(result_set.results, result_set.count)
+    self._lib.wrap_vdb_free_result_set(result_set_ptr)
+    return results
+  
+  @staticmethod
+  def _convert_results(results, count):
+    converted = []
     
-    for i in range(result_set.count):
-      res = result_set.results[i]
-      results.append({
+    for i in range(count):
+      res = results[i]
+      converted.append({
         'index': res.index,
         'distance': res.distance,
         'id': res.id.decode('utf-8') if res.id else None
       })
     
-    self._lib.wrap_vdb_free_result_set(result_set_ptr)
-    return results
+    return converted
+  
+  def join(self, other, k=5):
+    rows = c_size_t()
+    width = c_size_t()
+    indices = POINTER(c_size_t)()
+    distances = POINTER(c_float)()
+    result = self._lib.wrap_vdb_join(self.db, other.db, k, ctypes.byref(rows), ctypes.byref(width),
+                                     ctypes.byref(indices), ctypes.byref(distances))
+    if result != VDBError.OK:
+      raise RuntimeError(f"Failed to join databases: error {result}")
+
+    try:
+      n, w = rows.value, width.value
+      return [[{'index': indices[i * w + j], 'distance': distances[i * w + j]}
+               for j in range(w)] for i in range(n)]
+    finally:
+      self._lib.wrap_free(indices)
+      self._lib.wrap_free(distances)
+  
+  def kmeans(self, nclusters, iters=25):
+    count = c_size_t()
+    centroids = POINTER(c_float)()
+    assignments = POINTER(c_size_t)()
+    result = self._lib.wrap_vdb_kmeans(self.db, nclusters, iters, ctypes.byref(count), ctypes.byref(centroids),
+                                       ctypes.byref(assignments))
+    if result != VDBError.OK:
+      raise RuntimeError(f"Failed to cluster database: error {result}")
+
+    try:
+      d = self.dimensions
+      return [centroids[c * d:(c + 1) * d] for c in range(nclusters)], assignments[:count.value]
+    finally:
+      self._lib.wrap_free(centroids)
+      self._lib.wrap_free(assignments)
   
   def remove_vector(self, index):
     result = self._lib.wrap_vdb_remove_vector(self.db, index)
     if result != VDBError.OK:
       raise RuntimeError(f"Failed to remove vector: error {result}")
+
+  def update_vector(self, index, vector):
+    if len(vector) != self.dimensions:
+      raise ValueError(f"Vector dimension mismatch: expected {self.dimensions}, got {len(vector)}")
+    arr = (c_float * len(vector))(*vector)
+    result = self._lib.wrap_vdb_update_vector(self.db, index, arr)
+    if result != VDBError.OK:
+      raise RuntimeError(f"Failed to update vector: error {result}")
   
+  def ingest(self, path, fmt='jsonl', vector_key='embedding', id_key='id', csv_header=False, csv_id=True):
+    formats = {'jsonl': 0, 'csv': 1}
+    if fmt not in formats:
+      raise ValueError(f"Unknown format: {fmt}")
+    rows = c_size_t()
+    skipped = c_size_t()
+    duplicates = c_size_t()
+    result = self._lib.wrap_vdb_ingest(self.db, path.encode('utf-8'), formats[fmt],
+                                       vector_key.encode('utf-8'),
+                                       id_key.encode('utf-8') if id_key else None,
+                                       int(csv_header), int(csv_id),
+                                       ctypes.byref(rows), ctypes.byref(skipped),
+                                       ctypes.byref(duplicates))
+    if result != VDBError.OK:
+      raise RuntimeError(f"Failed to ingest {path}: error {result}")
+    return rows.value, skipped.value, duplicates.value
+
   def count(self):
     return self._lib.wrap_vdb_count(self.db)
   
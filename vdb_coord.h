@@ -0,0 +1,515 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VDB_COORD_H
+#define VDB_COORD_H
+
+#include "vdb_proto.h"
+
+#include <poll.h>
+#include <sys/time.h>
+
+#ifndef VDB_COORD_HEDGE_MS
+#define VDB_COORD_HEDGE_MS 20
+#endif
+
+#ifndef VDB_COORD_TIMEOUT_MS
+#define VDB_COORD_TIMEOUT_MS 1000
+#endif
+
+/* Scatter-gather client over vdb_server shards. Shard s is served by
+ * replicas addresses[s * nreplicas] through
+ * addresses[(s + 1) * nreplicas - 1]. */
+typedef struct {
+  size_t nshards;
+  size_t nreplicas;
+  char** addresses;
+  int* fds;           /* -1 while disconnected */
+  uint64_t* retry_ms; /* no reconnect before this time */
+  size_t dimensions;
+  uint64_t next_request;
+  uint64_t hedge_ms;
+  uint64_t timeout_ms;
+  uint64_t hedges;   /* requests re-sent to another replica */
+  uint64_t partials; /* searches missing at least one shard */
+  uint64_t diverged; /* writes not applied alike by every replica */
+} vdb_coord;
+
+static inline int vdb_coord_conn(vdb_coord* coord, size_t slot) {
+  if (coord->fds[slot] < 0 && vdb_now_ms() >= coord->retry_ms[slot]) {
+    int fd = vdb_client_connect(coord->addresses[slot]);
+    if (fd >= 0) {
+      /* bounds every blocking read, so a hung replica costs one timeout */
+      struct timeval tv;
+      tv.tv_sec = (time_t)(coord->timeout_ms / 1000);
+      tv.tv_usec = (suseconds_t)(coord->timeout_ms % 1000) * 1000;
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    } else {
+      coord->retry_ms[slot] = vdb_now_ms() + coord->timeout_ms;
+    }
+    coord->fds[slot] = fd;
+  }
+  return coord->fds[slot];
+}
+
+static inline void vdb_coord_drop(vdb_coord* coord, size_t slot) {
+  if (coord->fds[slot] >= 0)
+    close(coord->fds[slot]);
+  coord->fds[slot] = -1;
+  coord->retry_ms[slot] = vdb_now_ms() + coord->timeout_ms;
+}
+
+static inline void vdb_coord_destroy(vdb_coord* coord) {
+  if (!coord)
+    return;
+  size_t nslots = coord->nshards * coord->nreplicas;
+  for (size_t i = 0; i < nslots; i++) {
+    if (coord->fds)
+      vdb_coord_drop(coord, i);
+    if (coord->addresses)
+      VDB_FREE(coord->addresses[i]);
+  }
+  VDB_FREE(coord->addresses);
+  VDB_FREE(coord->fds);
+  VDB_FREE(coord->retry_ms);
+  VDB_FREE(coord);
+}
+
+/* Connects lazily; fails only if no replica of any shard answers INFO. */
+static inline vdb_coord* vdb_coord_create(const char* const* addresses,
+                                          size_t nshards, size_t nreplicas) {
+  if (!addresses || nshards == 0 || nreplicas == 0)
+    return NULL;
+
+  size_t nslots = nshards * nreplicas;
+  vdb_coord* coord = (vdb_coord*)VDB_MALLOC(sizeof(vdb_coord));
+  if (!coord)
+    return NULL;
+
+  coord->nshards = nshards;
+  coord->nreplicas = nreplicas;
+  coord->dimensions = 0;
+  coord->next_request = 0;
+  coord->hedge_ms = VDB_COORD_HEDGE_MS;
+  coord->timeout_ms = VDB_COORD_TIMEOUT_MS;
+  coord->hedges = 0;
+  coord->partials = 0;
+  coord->diverged = 0;
+  coord->addresses = (char**)VDB_MALLOC(nslots * sizeof(char*));
+  coord->fds = (int*)VDB_MALLOC(nslots * sizeof(int));
+  coord->retry_ms = (uint64_t*)VDB_MALLOC(nslots * sizeof(uint64_t));
+  if (!coord->addresses || !coord->fds || !coord->retry_ms) {
+    VDB_FREE(coord->addresses);
+    VDB_FREE(coord->fds);
+    VDB_FREE(coord->retry_ms);
+    VDB_FREE(coord);
+    return NULL;
+  }
+
+  int ok = 1;
+  for (size_t i = 0; i < nslots; i++) {
+    coord->fds[i] = -1;
+    coord->retry_ms[i] = 0;
+    coord->addresses[i] = vdb_copy_string(addresses[i]);
+    if (!coord->addresses[i])
+      ok = 0;
+  }
+
+  for (size_t i = 0; i < nslots && ok && coord->dimensions == 0; i++) {
+    vdb_wire_info info;
+    int fd = vdb_coord_conn(coord, i);
+    if (fd >= 0 && vdb_client_info(fd, &info) == VDB_OK)
+      coord->dimensions = (size_t)info.dimensions;
+    else
+      vdb_coord_drop(coord, i);
+  }
+
+  if (!ok || coord->dimensions == 0) {
+    vdb_coord_destroy(coord);
+    return NULL;
+  }
+  return coord;
+}
+
+/* hedge_ms: wait before re-sending a search to the next replica of a shard
+ * that has not answered (0 disables hedging). timeout_ms: give up on a
+ * shard and return partial results. */
+static inline void vdb_coord_set_timeouts(vdb_coord* coord, uint64_t hedge_ms,
+                                          uint64_t timeout_ms) {
+  if (!coord)
+    return;
+  coord->hedge_ms = hedge_ms;
+  coord->timeout_ms = timeout_ms ? timeout_ms : VDB_COORD_TIMEOUT_MS;
+  for (size_t i = 0; i < coord->nshards * coord->nreplicas; i++) {
+    vdb_coord_drop(coord, i);
+    coord->retry_ms[i] = 0;
+  }
+}
+
+/* Sends the search to the next replica of shard s that accepts it. */
+static inline int vdb_coord_send_next(vdb_coord* coord, size_t s,
+                                      size_t* tried, unsigned char* inflight,
+                                      uint64_t request,
+                                      const struct iovec* parts) {
+  while (tried[s] < coord->nreplicas) {
+    size_t slot = s * coord->nreplicas + tried[s]++;
+    int fd = vdb_coord_conn(coord, slot);
+    if (fd >= 0 && vdb_proto_send(fd, VDB_OP_SEARCH, request, parts, 2) == 0) {
+      inflight[slot] = 1;
+      return 1;
+    }
+    vdb_coord_drop(coord, slot);
+  }
+  return 0;
+}
+
+/* Merges the sorted per-shard lists. Result indices are global: shard
+ * index % nshards, local index / nshards. Ids are copied into the results
+ * allocation. */
+static inline vdb_result_set* vdb_coord_merge(const vdb_coord* coord,
+                                              vdb_result_set** parts,
+                                              size_t k) {
+  size_t nshards = coord->nshards;
+  size_t total = 0;
+  size_t ids_len = 0;
+
+  for (size_t s = 0; s < nshards; s++) {
+    if (!parts[s])
+      continue;
+    total += parts[s]->count;
+    for (size_t i = 0; i < parts[s]->count; i++) {
+      if (parts[s]->results[i].id)
+        ids_len += strlen(parts[s]->results[i].id) + 1;
+    }
+  }
+  if (k > total)
+    k = total;
+
+  vdb_result_set* result_set =
+      (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+  char* block = (char*)VDB_MALLOC(k * sizeof(vdb_result) + ids_len + 1);
+  size_t* heads = (size_t*)VDB_MALLOC(nshards * sizeof(size_t));
+  size_t* heap = (size_t*)VDB_MALLOC(nshards * sizeof(size_t));
+  if (!result_set || !block || !heads || !heap) {
+    VDB_FREE(result_set);
+    VDB_FREE(block);
+    VDB_FREE(heads);
+    VDB_FREE(heap);
+    return NULL;
+  }
+
+  /* min-heap of shards keyed by the distance of their next result */
+  size_t size = 0;
+#define VDB_COORD_HEAD(s) (parts[s]->results[heads[s]].distance)
+  for (size_t s = 0; s < nshards; s++) {
+    heads[s] = 0;
+    if (!parts[s] || parts[s]->count == 0)
+      continue;
+    size_t pos = size++;
+    while (pos > 0 && VDB_COORD_HEAD(heap[(pos - 1) / 2]) > VDB_COORD_HEAD(s)) {
+      heap[pos] = heap[(pos - 1) / 2];
+      pos = (pos - 1) / 2;
+    }
+    heap[pos] = s;
+  }
+
+  vdb_result* results = (vdb_result*)block;
+  char* strings = block + k * sizeof(vdb_result);
+
+  for (size_t n = 0; n < k; n++) {
+    size_t s = heap[0];
+    const vdb_result* r = &parts[s]->results[heads[s]++];
+
+    results[n].index = r->index * nshards + s;
+    results[n].distance = r->distance;
+    results[n].metadata = NULL;
+    results[n].id = NULL;
+    if (r->id) {
+      size_t len = strlen(r->id) + 1;
+      memcpy(strings, r->id, len);
+      results[n].id = strings;
+      strings += len;
+    }
+
+    if (heads[s] == parts[s]->count)
+      s = heap[--size];
+    size_t pos = 0;
+    for (;;) {
+      size_t child = 2 * pos + 1;
+      if (child >= size)
+        break;
+      if (child + 1 < size &&
+          VDB_COORD_HEAD(heap[child + 1]) < VDB_COORD_HEAD(heap[child]))
+        child++;
+      if (VDB_COORD_HEAD(heap[child]) >= VDB_COORD_HEAD(s))
+        break;
+      heap[pos] = heap[child];
+      pos = child;
+    }
+    if (size > 0)
+      heap[pos] = s;
+  }
+#undef VDB_COORD_HEAD
+
+  VDB_FREE(heads);
+  VDB_FREE(heap);
+  result_set->results = results;
+  result_set->count = k;
+  return result_set;
+}
+
+/* Fans the query out to one replica of every shard and merges the top k.
+ * A shard that has not answered after hedge_ms gets the request on its
+ * next replica as well; the first answer wins. Shards still silent after
+ * timeout_ms are skipped and *partial is set. */
+static inline vdb_result_set* vdb_coord_search(vdb_coord* coord,
+                                               const float* query, size_t k,
+                                               int* partial) {
+  if (partial)
+    *partial = 0;
+  if (!coord || !query || k == 0 || k > VDB_PROTO_MAX_K)
+    return NULL;
+
+  size_t nshards = coord->nshards;
+  size_t nslots = nshards * coord->nreplicas;
+  uint64_t request = ++coord->next_request;
+
+  vdb_wire_search req;
+  struct iovec parts[2];
+  req.k = (uint32_t)k;
+  req.dimensions = (uint32_t)coord->dimensions;
+  parts[0].iov_base = &req;
+  parts[0].iov_len = sizeof(req);
+  parts[1].iov_base = (void*)query;
+  parts[1].iov_len = coord->dimensions * sizeof(float);
+
+  vdb_result_set** answers =
+      (vdb_result_set**)VDB_MALLOC(nshards * sizeof(vdb_result_set*));
+  size_t* tried = (size_t*)VDB_MALLOC(nshards * sizeof(size_t));
+  unsigned char* inflight = (unsigned char*)VDB_MALLOC(nslots);
+  struct pollfd* pfds =
+      (struct pollfd*)VDB_MALLOC(nslots * sizeof(struct pollfd));
+  size_t* pslots = (size_t*)VDB_MALLOC(nslots * sizeof(size_t));
+  if (!answers || !tried || !inflight || !pfds || !pslots) {
+    VDB_FREE(answers);
+    VDB_FREE(tried);
+    VDB_FREE(inflight);
+    VDB_FREE(pfds);
+    VDB_FREE(pslots);
+    return NULL;
+  }
+
+  memset(inflight, 0, nslots);
+  for (size_t s = 0; s < nshards; s++) {
+    answers[s] = NULL;
+    tried[s] = 0;
+    vdb_coord_send_next(coord, s, tried, inflight, request, parts);
+  }
+
+  uint64_t start = vdb_now_ms();
+  uint64_t deadline = start + coord->timeout_ms;
+  uint64_t next_hedge = coord->hedge_ms ? start + coord->hedge_ms : deadline;
+  size_t answered = 0;
+
+  for (;;) {
+    size_t npfds = 0;
+    for (size_t s = 0; s < nshards; s++) {
+      if (answers[s])
+        continue;
+      for (size_t r = 0; r < coord->nreplicas; r++) {
+        size_t slot = s * coord->nreplicas + r;
+        if (!inflight[slot])
+          continue;
+        pfds[npfds].fd = coord->fds[slot];
+        pfds[npfds].events = POLLIN;
+        pfds[npfds].revents = 0;
+        pslots[npfds++] = slot;
+      }
+    }
+    if (answered == nshards || npfds == 0)
+      break;
+
+    uint64_t now = vdb_now_ms();
+    if (now >= deadline)
+      break;
+    if (now >= next_hedge) {
+      for (size_t s = 0; s < nshards; s++) {
+        if (!answers[s] &&
+            vdb_coord_send_next(coord, s, tried, inflight, request, parts))
+          coord->hedges++;
+      }
+      next_hedge = now + coord->hedge_ms;
+      continue;
+    }
+
+    uint64_t wake = next_hedge < deadline ? next_hedge : deadline;
+    if (poll(pfds, (nfds_t)npfds, (int)(wake - now)) < 0 && errno != EINTR)
+      break;
+
+    for (size_t i = 0; i < npfds; i++) {
+      if (!pfds[i].revents)
+        continue;
+      size_t slot = pslots[i];
+      size_t s = slot / coord->nreplicas;
+      vdb_msg_header header;
+      void* payload;
+
+      if (vdb_proto_recv(coord->fds[slot], &header, &payload) != 0) {
+        inflight[slot] = 0;
+        vdb_coord_drop(coord, slot);
+        if (!answers[s])
+          vdb_coord_send_next(coord, s, tried, inflight, request, parts);
+        continue;
+      }
+      inflight[slot] = 0;
+      if (header.request_id != request) {
+        VDB_FREE(payload);
+        vdb_coord_drop(coord, slot);
+        if (!answers[s])
+          vdb_coord_send_next(coord, s, tried, inflight, request, parts);
+        continue;
+      }
+      if (!answers[s] && header.code == VDB_OK) {
+        answers[s] = vdb_proto_decode_results(payload, header.length);
+        if (answers[s])
+          answered++;
+      }
+      VDB_FREE(payload);
+      if (!answers[s])
+        vdb_coord_send_next(coord, s, tried, inflight, request, parts);
+    }
+  }
+
+  /* a connection still owing an answer would hand it to the next call */
+  for (size_t slot = 0; slot < nslots; slot++) {
+    if (inflight[slot])
+      vdb_coord_drop(coord, slot);
+  }
+
+  vdb_result_set* result_set = NULL;
+  if (answered > 0)
+    result_set = vdb_coord_merge(coord, answers, k);
+  if (answered < nshards) {
+    coord->partials++;
+    if (partial)
+      *partial = 1;
+  }
+
+  for (size_t s = 0; s < nshards; s++)
+    vdb_free_result_set(answers[s]);
+  VDB_FREE(answers);
+  VDB_FREE(tried);
+  VDB_FREE(inflight);
+  VDB_FREE(pfds);
+  VDB_FREE(pslots);
+  return result_set;
+}
+
+static inline size_t vdb_coord_shard(const vdb_coord* coord, const char* id) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (const unsigned char* p = (const unsigned char*)id; *p; p++) {
+    h ^= *p;
+    h *= 0x100000001B3ULL;
+  }
+  return (size_t)(h % coord->nshards);
+}
+
+/* Adds the vector to every replica of the shard its id hashes to. Replicas
+ * must hold identical contents so that indices agree. The result and index
+ * are those of the first replica that answered; VDB_ERROR_IO means none
+ * did. *partial is set when some replica failed or answered differently:
+ * the shard's replicas have then diverged, and global indices on it are
+ * only reliable once the failed replicas are rebuilt from a good one. */
+static inline vdb_error vdb_coord_add(vdb_coord* coord, const float* data,
+                                      const char* id, size_t* out_index,
+                                      int* partial) {
+  if (partial)
+    *partial = 0;
+  if (!coord || !data || !id)
+    return VDB_ERROR_NULL_POINTER;
+
+  size_t s = vdb_coord_shard(coord, id);
+  vdb_error result = VDB_ERROR_IO;
+  size_t first = 0;
+  int diverged = 0;
+
+  for (size_t r = 0; r < coord->nreplicas; r++) {
+    size_t slot = s * coord->nreplicas + r;
+    int fd = vdb_coord_conn(coord, slot);
+    size_t index = 0;
+    vdb_error err = fd >= 0 ? vdb_client_add(fd, data, coord->dimensions, id,
+                                             &index)
+                            : VDB_ERROR_IO;
+    if (err == VDB_ERROR_IO)
+      vdb_coord_drop(coord, slot);
+    if (r == 0 || result == VDB_ERROR_IO) {
+      if (r > 0 && err != VDB_ERROR_IO)
+        diverged = 1;
+      result = err;
+      first = index;
+    } else if (err != result || (err == VDB_OK && index != first)) {
+      diverged = 1;
+    }
+  }
+
+  if (result == VDB_OK && out_index)
+    *out_index = first * coord->nshards + s;
+  if (diverged) {
+    coord->diverged++;
+    if (partial)
+      *partial = 1;
+  }
+  return result;
+}
+
+/* Removes a global index, as returned by vdb_coord_search or
+ * vdb_coord_add, from every replica of its shard. *partial is set as for
+ * vdb_coord_add. */
+static inline vdb_error vdb_coord_remove(vdb_coord* coord, size_t index,
+                                         int* partial) {
+  if (partial)
+    *partial = 0;
+  if (!coord)
+    return VDB_ERROR_NULL_POINTER;
+
+  size_t s = index % coord->nshards;
+  vdb_error result = VDB_ERROR_IO;
+  int diverged = 0;
+
+  for (size_t r = 0; r < coord->nreplicas; r++) {
+    size_t slot = s * coord->nreplicas + r;
+    int fd = vdb_coord_conn(coord, slot);
+    vdb_error err = fd >= 0 ? vdb_client_remove(fd, index / coord->nshards)
+                            : VDB_ERROR_IO;
+    if (err == VDB_ERROR_IO)
+      vdb_coord_drop(coord, slot);
+    if (r == 0 || result == VDB_ERROR_IO) {
+      if (r > 0 && err != VDB_ERROR_IO)
+        diverged = 1;
+      result = err;
+    } else if (err != result) {
+      diverged = 1;
+    }
+  }
+
+  if (diverged) {
+    coord->diverged++;
+    if (partial)
+      *partial = 1;
+  }
+  return result;
+}
+
+#endif
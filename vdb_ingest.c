@@ -0,0 +1,166 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* vdb_ingest: turns JSONL or CSV embedding dumps into a vdb file.
+ *
+ *   gcc -O2 -DVDB_MULTITHREADED vdb_ingest.c -o vdb_ingest -lpthread -lm
+ *   ./vdb_ingest -f jsonl -k embedding -i id -o out.vdb part-*.jsonl
+ *
+ * By default the rows are bulk-inserted into an in-memory database that is
+ * saved at the end. With -s they are streamed straight into the output
+ * file instead, so memory stays bounded by the block size. */
+
+#include "vdb_ingest.h"
+
+#include <stdio.h>
+
+static int parse_metric(const char* name, vdb_metric* out) {
+  if (strcmp(name, "cosine") == 0)
+    *out = VDB_METRIC_COSINE;
+  else if (strcmp(name, "euclidean") == 0)
+    *out = VDB_METRIC_EUCLIDEAN;
+  else if (strcmp(name, "dot") == 0)
+    *out = VDB_METRIC_DOT_PRODUCT;
+  else
+    return -1;
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: vdb_ingest [-f jsonl|csv] [-k vector_key] [-i id_key] "
+          "[-H] [-N] [-d dimensions]\n"
+          "                  [-m cosine|euclidean|dot] [-t threads] "
+          "[-b block_mb] [-s] -o out.vdb input...\n"
+          "  -i \"\" reads no ids, -H skips a CSV header line, -N means the "
+          "CSV has no id column\n"
+          "  -s streams rows to the output instead of building a database\n");
+}
+
+int main(int argc, char** argv) {
+  vdb_ingest_options options;
+  const char* output = NULL;
+  size_t dims = 0;
+  int stream = 0;
+  vdb_metric metric = VDB_METRIC_COSINE;
+  int i = 1;
+
+  vdb_ingest_defaults(&options);
+
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    const char* flag = argv[i];
+    if (strcmp(flag, "-H") == 0) {
+      options.csv_header = 1;
+      continue;
+    }
+    if (strcmp(flag, "-N") == 0) {
+      options.csv_id = 0;
+      continue;
+    }
+    if (strcmp(flag, "-s") == 0) {
+      stream = 1;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (strcmp(flag, "-f") == 0 && strcmp(value, "jsonl") == 0)
+      options.format = VDB_INGEST_JSONL;
+    else if (strcmp(flag, "-f") == 0 && strcmp(value, "csv") == 0)
+      options.format = VDB_INGEST_CSV;
+    else if (strcmp(flag, "-k") == 0)
+      options.vector_key = value;
+    else if (strcmp(flag, "-i") == 0)
+      options.id_key = value[0] ? value : NULL;
+    else if (strcmp(flag, "-d") == 0)
+      dims = (size_t)strtoul(value, NULL, 10);
+    else if (strcmp(flag, "-t") == 0)
+      options.threads = (size_t)strtoul(value, NULL, 10);
+    else if (strcmp(flag, "-b") == 0)
+      options.block_size = (size_t)strtoul(value, NULL, 10) << 20;
+    else if (strcmp(flag, "-o") == 0)
+      output = value;
+    else if (strcmp(flag, "-m") != 0 || parse_metric(value, &metric) != 0) {
+      usage();
+      return 1;
+    }
+  }
+
+  if (!output || i >= argc) {
+    usage();
+    return 1;
+  }
+  if (dims == 0)
+    dims = vdb_ingest_dimensions(argv[i], &options);
+  if (dims == 0) {
+    fprintf(stderr, "vdb_ingest: no row found in %s, pass -d\n", argv[i]);
+    return 1;
+  }
+
+  vdb_database* db = NULL;
+  vdb_writer* writer = NULL;
+  if (stream)
+    writer = vdb_writer_open(output, dims, metric);
+  else
+    db = vdb_create(dims, metric);
+  if (!db && !writer) {
+    fprintf(stderr, "vdb_ingest: cannot create %s\n", output);
+    return 1;
+  }
+
+  vdb_ingest_stats total;
+  memset(&total, 0, sizeof(total));
+  uint64_t start = vdb_now_us();
+  vdb_error err = VDB_OK;
+
+  for (; i < argc && err == VDB_OK; i++) {
+    vdb_ingest_stats stats;
+    if (stream)
+      err = vdb_ingest_run(argv[i], dims, &options, vdb_ingest_writer_sink,
+                           writer, &stats);
+    else
+      err = vdb_ingest_file(db, argv[i], &options, &stats);
+    if (err != VDB_OK) {
+      fprintf(stderr, "vdb_ingest: %s: error %d\n", argv[i], err);
+      break;
+    }
+    total.rows += stats.rows;
+    total.skipped += stats.skipped;
+    total.bytes += stats.bytes;
+  }
+
+  if (stream) {
+    vdb_error close_err = vdb_writer_close(writer);
+    if (err == VDB_OK)
+      err = close_err;
+  } else {
+    if (err == VDB_OK)
+      err = vdb_save(db, output);
+    vdb_destroy(db);
+  }
+  if (err != VDB_OK) {
+    fprintf(stderr, "vdb_ingest: writing %s failed: error %d\n", output, err);
+    return 1;
+  }
+
+  double seconds = (double)(vdb_now_us() - start) / 1e6;
+  fprintf(stderr,
+          "vdb_ingest: %zu rows of %zu dimensions, %zu skipped, %.1f MB in "
+          "%.2f s (%.1f MB/s)\n",
+          total.rows, dims, total.skipped, (double)total.bytes / 1e6, seconds,
+          seconds > 0 ? (double)total.bytes / 1e6 / seconds : 0.0);
+  return 0;
+}
@@ -0,0 +1,906 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VDB_INGEST_H
+#define VDB_INGEST_H
+
+#include "vdb.h"
+
+#ifndef VDB_INGEST_BLOCK
+#define VDB_INGEST_BLOCK (16u << 20)
+#endif
+
+#define VDB_INGEST_MAX_DIMENSIONS 65536
+
+typedef enum { VDB_INGEST_JSONL = 0, VDB_INGEST_CSV = 1 } vdb_ingest_format;
+
+typedef struct {
+  vdb_ingest_format format;
+  const char* vector_key; /* JSONL: array of numbers */
+  const char* id_key;     /* JSONL: string or number, NULL for none */
+  int csv_header;         /* CSV: skip the first line */
+  int csv_id;             /* CSV: the first column is the id */
+  size_t block_size;      /* bytes parsed per pipeline step */
+  size_t threads;         /* 0 for vdb_thread_count() */
+} vdb_ingest_options;
+
+typedef struct {
+  size_t rows;       /* rows stored, merged duplicates included */
+  size_t skipped;    /* malformed lines and wrong dimensions */
+  size_t duplicates; /* rows the database rejected as duplicates */
+  uint64_t bytes;
+} vdb_ingest_stats;
+
+/* Rows parsed by one worker from one block. The buffers are kept across
+ * blocks, so parsing allocates only while they are still growing. */
+typedef struct {
+  float* vectors;
+  size_t* id_offsets; /* into strings, SIZE_MAX for none */
+  const char** ids;
+  char* strings;
+  size_t strings_len;
+  size_t strings_capacity;
+  size_t count;
+  size_t capacity;
+  size_t skipped;
+  vdb_error err;
+} vdb_ingest_chunk;
+
+/* Stores count rows and sets *added to how many it kept. */
+typedef vdb_error (*vdb_ingest_sink)(void* arg, const float* vectors,
+                                     const char* const* ids, size_t count,
+                                     size_t* added);
+
+typedef struct {
+  const vdb_ingest_options* options;
+  size_t dimensions;
+  const char* block;
+  size_t length;
+  int skip_first;
+  vdb_ingest_chunk* chunks;
+} vdb_ingest_thread_args;
+
+typedef struct {
+  vdb_ingest_sink sink;
+  void* arg;
+  vdb_ingest_chunk* chunks;
+  size_t nchunks;
+  size_t rows;
+  size_t duplicates;
+  vdb_error err;
+} vdb_ingest_stage;
+
+/* vdb_ingest_file's sink state. The indices vdb_add_vectors reports go to
+ * a buffer that is reused from chunk to chunk. */
+typedef struct {
+  vdb_database* db;
+  size_t* indices;
+  size_t capacity;
+} vdb_ingest_db_target;
+
+static inline void vdb_ingest_defaults(vdb_ingest_options* options) {
+  options->format = VDB_INGEST_JSONL;
+  options->vector_key = "embedding";
+  options->id_key = "id";
+  options->csv_header = 0;
+  options->csv_id = 1;
+  options->block_size = VDB_INGEST_BLOCK;
+  options->threads = 0;
+}
+
+static inline int vdb_is_digit(char c) {
+  return (unsigned)(c - '0') < 10;
+}
+
+/* Decimal with optional sign, fraction and exponent. The first 19
+ * significant digits are exact; the scaling is one or two double
+ * operations, well inside float precision. Returns the end of the number,
+ * or NULL. */
+static inline const char* vdb_parse_float(const char* p, const char* end,
+                                          float* out) {
+  static const double powers[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  int negative = 0;
+  int any = 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  for (; p < end && vdb_is_digit(*p); p++) {
+    any = 1;
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+      digits += mantissa != 0;
+    } else {
+      exponent++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && vdb_is_digit(*p); p++) {
+      any = 1;
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        digits += mantissa != 0;
+        exponent--;
+      }
+    }
+  }
+  if (!any)
+    return NULL;
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    int exp_negative = 0;
+    int e = 0;
+    if (q < end && (*q == '-' || *q == '+'))
+      exp_negative = *q++ == '-';
+    if (q < end && vdb_is_digit(*q)) {
+      for (; q < end && vdb_is_digit(*q); q++) {
+        if (e < 100000)
+          e = e * 10 + (*q - '0');
+      }
+      exponent += exp_negative ? -e : e;
+      p = q;
+    }
+  }
+
+  double value = (double)mantissa;
+  if (mantissa == 0 || exponent < -400) {
+    value = 0.0;
+  } else if (exponent > 400) {
+    value = HUGE_VAL;
+  } else {
+    for (; exponent > 22; exponent -= 22)
+      value *= 1e22;
+    for (; exponent < -22; exponent += 22)
+      value /= 1e22;
+    value = exponent >= 0 ? value * powers[exponent]
+                          : value / powers[-exponent];
+  }
+
+  *out = (float)(negative ? -value : value);
+  return p;
+}
+
+static inline const char* vdb_json_ws(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+  return p;
+}
+
+static inline const char* vdb_json_skip_string(const char* p,
+                                               const char* end) {
+  for (p++; p < end; p++) {
+    if (*p == '\\')
+      p++;
+    else if (*p == '"')
+      return p + 1;
+  }
+  return NULL;
+}
+
+static inline const char* vdb_json_skip_value(const char* p, const char* end) {
+  if (p < end && *p == '"')
+    return vdb_json_skip_string(p, end);
+
+  size_t depth = 0;
+  while (p < end) {
+    char c = *p;
+    if (c == '"') {
+      p = vdb_json_skip_string(p, end);
+      if (!p)
+        return NULL;
+      continue;
+    }
+    if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (depth == 0)
+        return p;
+      if (--depth == 0)
+        return p + 1;
+    } else if (depth == 0 && (c == ',' || c == ' ' || c == '\t' ||
+                              c == '\r' || c == '\n')) {
+      return p;
+    }
+    p++;
+  }
+  return depth == 0 ? p : NULL;
+}
+
+static inline int vdb_ingest_reserve_strings(vdb_ingest_chunk* chunk,
+                                             size_t len) {
+  if (chunk->strings_len + len <= chunk->strings_capacity)
+    return 0;
+
+  size_t capacity = chunk->strings_capacity ? chunk->strings_capacity : 4096;
+  while (capacity < chunk->strings_len + len)
+    capacity *= 2;
+  char* strings = (char*)VDB_REALLOC(chunk->strings, capacity);
+  if (!strings)
+    return -1;
+  chunk->strings = strings;
+  chunk->strings_capacity = capacity;
+  return 0;
+}
+
+static inline int vdb_ingest_copy_id(vdb_ingest_chunk* chunk, const char* s,
+                                     size_t len, size_t* id_offset) {
+  if (vdb_ingest_reserve_strings(chunk, len + 1) != 0)
+    return -1;
+  *id_offset = chunk->strings_len;
+  memcpy(chunk->strings + chunk->strings_len, s, len);
+  chunk->strings[chunk->strings_len + len] = '\0';
+  chunk->strings_len += len + 1;
+  return 0;
+}
+
+static inline unsigned vdb_json_hex4(const char* p) {
+  unsigned value = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = p[i];
+    value <<= 4;
+    if (vdb_is_digit(c))
+      value |= (unsigned)(c - '0');
+    else if (c >= 'a' && c <= 'f')
+      value |= (unsigned)(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F')
+      value |= (unsigned)(c - 'A' + 10);
+    else
+      return 0x110000;
+  }
+  return value;
+}
+
+/* Decodes the JSON string at p into the chunk's strings. Decoding never
+ * grows a string, so reserving its raw length is enough. */
+static inline const char* vdb_json_string(const char* p, const char* end,
+                                          vdb_ingest_chunk* chunk,
+                                          size_t* id_offset) {
+  const char* close = vdb_json_skip_string(p, end);
+  if (!close ||
+      vdb_ingest_reserve_strings(chunk, (size_t)(close - p)) != 0)
+    return NULL;
+
+  char* out = chunk->strings + chunk->strings_len;
+  char* start = out;
+  for (p++; p < close - 1; p++) {
+    if (*p != '\\') {
+      *out++ = *p;
+      continue;
+    }
+    char c = *++p;
+    switch (c) {
+    case 'b':
+      *out++ = '\b';
+      break;
+    case 'f':
+      *out++ = '\f';
+      break;
+    case 'n':
+      *out++ = '\n';
+      break;
+    case 'r':
+      *out++ = '\r';
+      break;
+    case 't':
+      *out++ = '\t';
+      break;
+    case 'u': {
+      if (close - 1 - p < 5)
+        return NULL;
+      unsigned code = vdb_json_hex4(p + 1);
+      p += 4;
+      if (code >= 0xD800 && code < 0xDC00 && close - 1 - p >= 7 &&
+          p[1] == '\\' && p[2] == 'u') {
+        unsigned low = vdb_json_hex4(p + 3);
+        if (low >= 0xDC00 && low < 0xE000) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          p += 6;
+        }
+      }
+      if (code > 0x10FFFF)
+        return NULL;
+      if (code < 0x80) {
+        *out++ = (char)code;
+      } else if (code < 0x800) {
+        *out++ = (char)(0xC0 | (code >> 6));
+        *out++ = (char)(0x80 | (code & 0x3F));
+      } else if (code < 0x10000) {
+        *out++ = (char)(0xE0 | (code >> 12));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (code & 0x3F));
+      } else {
+        *out++ = (char)(0xF0 | (code >> 18));
+        *out++ = (char)(0x80 | ((code >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (code & 0x3F));
+      }
+      break;
+    }
+    default:
+      *out++ = c;
+      break;
+    }
+  }
+  *out++ = '\0';
+
+  *id_offset = chunk->strings_len;
+  chunk->strings_len += (size_t)(out - start);
+  return close;
+}
+
+/* Parses one JSONL object into vec, up to capacity floats. Returns 1 for a
+ * row, 0 for a blank line and -1 for a malformed one. */
+static inline int vdb_ingest_jsonl(const char* p, const char* end,
+                                   const vdb_ingest_options* options,
+                                   float* vec, size_t capacity, size_t* n,
+                                   vdb_ingest_chunk* chunk,
+                                   size_t* id_offset) {
+  size_t vector_len = strlen(options->vector_key);
+  size_t id_len = options->id_key ? strlen(options->id_key) : 0;
+  int have_vector = 0;
+
+  *n = 0;
+  *id_offset = SIZE_MAX;
+  p = vdb_json_ws(p, end);
+  if (p == end)
+    return 0;
+  if (*p != '{')
+    return -1;
+  p = vdb_json_ws(p + 1, end);
+  if (p < end && *p == '}')
+    return -1;
+
+  for (;;) {
+    if (p >= end || *p != '"')
+      return -1;
+    const char* key = p + 1;
+    p = vdb_json_skip_string(p, end);
+    if (!p)
+      return -1;
+    size_t key_len = (size_t)(p - 1 - key);
+    p = vdb_json_ws(p, end);
+    if (p >= end || *p != ':')
+      return -1;
+    p = vdb_json_ws(p + 1, end);
+    if (p >= end)
+      return -1;
+
+    if (key_len == vector_len &&
+        memcmp(key, options->vector_key, key_len) == 0) {
+      if (*p != '[')
+        return -1;
+      *n = 0;
+      p = vdb_json_ws(p + 1, end);
+      if (p < end && *p == ']') {
+        p++;
+      } else {
+        for (;;) {
+          if (*n == capacity)
+            return -1;
+          p = vdb_parse_float(p, end, &vec[*n]);
+          if (!p)
+            return -1;
+          (*n)++;
+          p = vdb_json_ws(p, end);
+          if (p < end && *p == ',') {
+            p = vdb_json_ws(p + 1, end);
+          } else if (p < end && *p == ']') {
+            p++;
+            break;
+          } else {
+            return -1;
+          }
+        }
+      }
+      have_vector = 1;
+    } else if (id_len && key_len == id_len &&
+               memcmp(key, options->id_key, key_len) == 0) {
+      if (*p == '"') {
+        p = vdb_json_string(p, end, chunk, id_offset);
+      } else {
+        const char* start = p;
+        p = vdb_json_skip_value(p, end);
+        if (p && vdb_ingest_copy_id(chunk, start, (size_t)(p - start),
+                                    id_offset) != 0)
+          p = NULL;
+      }
+    } else {
+      p = vdb_json_skip_value(p, end);
+    }
+    if (!p)
+      return -1;
+
+    p = vdb_json_ws(p, end);
+    if (p < end && *p == ',') {
+      p = vdb_json_ws(p + 1, end);
+      continue;
+    }
+    if (p < end && *p == '}')
+      break;
+    return -1;
+  }
+
+  return have_vector ? 1 : -1;
+}
+
+/* CSV: an optional id column, plain or double-quoted, then the floats. */
+static inline int vdb_ingest_csv(const char* p, const char* end,
+                                 const vdb_ingest_options* options,
+                                 float* vec, size_t capacity, size_t* n,
+                                 vdb_ingest_chunk* chunk, size_t* id_offset) {
+  *n = 0;
+  *id_offset = SIZE_MAX;
+  while (end > p && (end[-1] == '\r' || end[-1] == ' '))
+    end--;
+  if (p == end)
+    return 0;
+
+  if (options->csv_id) {
+    if (*p == '"') {
+      /* the raw field bounds the unescaped one */
+      if (vdb_ingest_reserve_strings(chunk, (size_t)(end - p)) != 0)
+        return -1;
+      char* out = chunk->strings + chunk->strings_len;
+      char* start = out;
+      for (p++;; p++) {
+        if (p >= end)
+          return -1;
+        if (*p == '"') {
+          if (p + 1 < end && p[1] == '"')
+            p++;
+          else
+            break;
+        }
+        *out++ = *p;
+      }
+      p++;
+      *out++ = '\0';
+      *id_offset = chunk->strings_len;
+      chunk->strings_len += (size_t)(out - start);
+    } else {
+      const char* start = p;
+      while (p < end && *p != ',')
+        p++;
+      if (vdb_ingest_copy_id(chunk, start, (size_t)(p - start), id_offset) !=
+          0)
+        return -1;
+    }
+    if (p >= end || *p != ',')
+      return -1;
+    p++;
+  }
+
+  for (;;) {
+    while (p < end && *p == ' ')
+      p++;
+    if (*n == capacity)
+      return -1;
+    p = vdb_parse_float(p, end, &vec[*n]);
+    if (!p)
+      return -1;
+    (*n)++;
+    while (p < end && *p == ' ')
+      p++;
+    if (p == end)
+      return 1;
+    if (*p != ',')
+      return -1;
+    p++;
+  }
+}
+
+static inline int vdb_ingest_line(const char* p, const char* end,
+                                  const vdb_ingest_options* options, float* vec,
+                                  size_t capacity, size_t* n,
+                                  vdb_ingest_chunk* chunk, size_t* id_offset) {
+  if (options->format == VDB_INGEST_CSV)
+    return vdb_ingest_csv(p, end, options, vec, capacity, n, chunk,
+                          id_offset);
+  return vdb_ingest_jsonl(p, end, options, vec, capacity, n, chunk, id_offset);
+}
+
+static inline void vdb_ingest_free_chunk(vdb_ingest_chunk* chunk) {
+  VDB_FREE(chunk->vectors);
+  VDB_FREE(chunk->id_offsets);
+  VDB_FREE(chunk->ids);
+  VDB_FREE(chunk->strings);
+}
+
+static inline vdb_error vdb_ingest_reserve_row(vdb_ingest_chunk* chunk,
+                                               size_t dimensions) {
+  if (chunk->count < chunk->capacity)
+    return VDB_OK;
+
+  size_t capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+  float* vectors = (float*)VDB_REALLOC(
+      chunk->vectors, capacity * dimensions * sizeof(float));
+  if (vectors)
+    chunk->vectors = vectors;
+  size_t* offsets =
+      (size_t*)VDB_REALLOC(chunk->id_offsets, capacity * sizeof(size_t));
+  if (offsets)
+    chunk->id_offsets = offsets;
+  const char** ids =
+      (const char**)VDB_REALLOC((void*)chunk->ids, capacity * sizeof(char*));
+  if (ids)
+    chunk->ids = ids;
+  if (!vectors || !offsets || !ids)
+    return VDB_ERROR_OUT_OF_MEMORY;
+
+  chunk->capacity = capacity;
+  return VDB_OK;
+}
+
+/* Start of the first line that begins at or after pos. */
+static inline size_t vdb_ingest_boundary(const char* block, size_t length,
+                                         size_t pos) {
+  if (pos == 0)
+    return 0;
+  while (pos < length && block[pos - 1] != '\n')
+    pos++;
+  return pos < length ? pos : length;
+}
+
+static inline void vdb_ingest_worker(void* arg, size_t worker,
+                                     size_t nworkers) {
+  vdb_ingest_thread_args* args = (vdb_ingest_thread_args*)arg;
+  vdb_ingest_chunk* chunk = &args->chunks[worker];
+  size_t dims = args->dimensions;
+  size_t start = vdb_ingest_boundary(args->block, args->length,
+                                     args->length / nworkers * worker);
+  size_t stop =
+      worker + 1 == nworkers
+          ? args->length
+          : vdb_ingest_boundary(args->block, args->length,
+                                args->length / nworkers * (worker + 1));
+  const char* p = args->block + start;
+  const char* end = args->block + stop;
+
+  chunk->count = 0;
+  chunk->strings_len = 0;
+  chunk->skipped = 0;
+  chunk->err = VDB_OK;
+
+  int skip = args->skip_first && worker == 0;
+  while (p < end) {
+    const char* eol = (const char*)memchr(p, '\n', (size_t)(end - p));
+    if (!eol)
+      eol = end;
+    if (skip) {
+      skip = 0;
+      p = eol + 1;
+      continue;
+    }
+
+    if (vdb_ingest_reserve_row(chunk, dims) != VDB_OK) {
+      chunk->err = VDB_ERROR_OUT_OF_MEMORY;
+      return;
+    }
+    size_t saved = chunk->strings_len;
+    size_t n;
+    int parsed = vdb_ingest_line(p, eol, args->options,
+                                 chunk->vectors + chunk->count * dims, dims,
+                                 &n, chunk, &chunk->id_offsets[chunk->count]);
+    if (parsed == 1 && n == dims) {
+      chunk->count++;
+    } else {
+      chunk->strings_len = saved;
+      if (parsed != 0)
+        chunk->skipped++;
+    }
+    p = eol + 1;
+  }
+
+  /* the strings buffer is final now */
+  for (size_t i = 0; i < chunk->count; i++) {
+    size_t offset = chunk->id_offsets[i];
+    chunk->ids[i] = offset == SIZE_MAX ? NULL : chunk->strings + offset;
+  }
+}
+
+static inline void* vdb_ingest_stage_main(void* arg) {
+  vdb_ingest_stage* stage = (vdb_ingest_stage*)arg;
+
+  for (size_t i = 0; i < stage->nchunks && stage->err == VDB_OK; i++) {
+    vdb_ingest_chunk* chunk = &stage->chunks[i];
+    stage->err = chunk->err;
+    if (stage->err == VDB_OK && chunk->count > 0) {
+      size_t added = 0;
+      stage->err = stage->sink(stage->arg, chunk->vectors, chunk->ids,
+                               chunk->count, &added);
+      if (stage->err == VDB_OK) {
+        stage->rows += added;
+        stage->duplicates += chunk->count - added;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Reads path in blocks, parses each block with all workers and hands the
+ * rows to sink in file order. The sink runs on its own thread while the
+ * next block is parsed. */
+static inline vdb_error vdb_ingest_run(const char* path, size_t dimensions,
+                                       const vdb_ingest_options* options,
+                                       vdb_ingest_sink sink, void* sink_arg,
+                                       vdb_ingest_stats* stats) {
+  if (stats)
+    memset(stats, 0, sizeof(*stats));
+
+  vdb_ingest_options defaults;
+  if (!options) {
+    vdb_ingest_defaults(&defaults);
+    options = &defaults;
+  }
+  if (options->format == VDB_INGEST_JSONL && !options->vector_key)
+    return VDB_ERROR_NULL_POINTER;
+
+  size_t block_size = options->block_size ? options->block_size
+                                          : VDB_INGEST_BLOCK;
+  size_t nworkers = options->threads ? options->threads : vdb_thread_count();
+  if (nworkers > VDB_MAX_THREADS)
+    nworkers = VDB_MAX_THREADS;
+
+  FILE* f = fopen(path, "rb");
+  if (!f)
+    return VDB_ERROR_IO;
+
+  char* block = (char*)VDB_MALLOC(block_size);
+  vdb_ingest_chunk* chunks = (vdb_ingest_chunk*)VDB_MALLOC(
+      2 * nworkers * sizeof(vdb_ingest_chunk));
+  if (!block || !chunks) {
+    VDB_FREE(block);
+    VDB_FREE(chunks);
+    fclose(f);
+    return VDB_ERROR_OUT_OF_MEMORY;
+  }
+  memset(chunks, 0, 2 * nworkers * sizeof(vdb_ingest_chunk));
+
+  vdb_ingest_stage stage;
+  stage.sink = sink;
+  stage.arg = sink_arg;
+  stage.nchunks = nworkers;
+  stage.rows = 0;
+  stage.duplicates = 0;
+  stage.err = VDB_OK;
+#ifdef VDB_MULTITHREADED
+  pthread_t stage_thread;
+#endif
+  int stage_running = 0;
+
+  vdb_error err = VDB_OK;
+  size_t carry = 0;
+  size_t skipped = 0;
+  uint64_t bytes = 0;
+  int first = 1;
+
+  for (size_t set = 0; err == VDB_OK; set ^= 1) {
+    size_t n = fread(block + carry, 1, block_size - carry, f);
+    size_t length = carry + n;
+    int eof = n < block_size - carry;
+    bytes += n;
+    if (eof && ferror(f)) {
+      err = VDB_ERROR_IO;
+      break;
+    }
+    if (length == 0)
+      break;
+
+    size_t parse_length = length;
+    if (!eof) {
+      while (parse_length > 0 && block[parse_length - 1] != '\n')
+        parse_length--;
+      if (parse_length == 0) {
+        /* a line longer than the block */
+        err = VDB_ERROR_OVERFLOW;
+        break;
+      }
+    }
+
+    vdb_ingest_thread_args args;
+    args.options = options;
+    args.dimensions = dimensions;
+    args.block = block;
+    args.length = parse_length;
+    args.skip_first =
+        first && options->format == VDB_INGEST_CSV && options->csv_header;
+    args.chunks = chunks + set * nworkers;
+    vdb_run_workers(vdb_ingest_worker, &args, nworkers);
+    first = 0;
+    for (size_t i = 0; i < nworkers; i++)
+      skipped += args.chunks[i].skipped;
+
+#ifdef VDB_MULTITHREADED
+    if (stage_running)
+      pthread_join(stage_thread, NULL);
+#endif
+    stage_running = 0;
+    err = stage.err;
+    if (err != VDB_OK)
+      break;
+
+    stage.chunks = args.chunks;
+#ifdef VDB_MULTITHREADED
+    stage_running =
+        pthread_create(&stage_thread, NULL, vdb_ingest_stage_main, &stage) ==
+        0;
+#endif
+    if (!stage_running)
+      vdb_ingest_stage_main(&stage);
+
+    carry = length - parse_length;
+    memmove(block, block + parse_length, carry);
+    if (eof)
+      break;
+  }
+
+#ifdef VDB_MULTITHREADED
+  if (stage_running)
+    pthread_join(stage_thread, NULL);
+#endif
+  if (err == VDB_OK)
+    err = stage.err;
+
+  if (stats) {
+    stats->rows = stage.rows;
+    stats->skipped = skipped;
+    stats->duplicates = stage.duplicates;
+    stats->bytes = bytes;
+  }
+
+  for (size_t i = 0; i < 2 * nworkers; i++)
+    vdb_ingest_free_chunk(&chunks[i]);
+  VDB_FREE(chunks);
+  VDB_FREE(block);
+  fclose(f);
+  return err;
+}
+
+static inline vdb_error vdb_ingest_db_sink(void* arg, const float* vectors,
+                                           const char* const* ids,
+                                           size_t count, size_t* added) {
+  vdb_ingest_db_target* target = (vdb_ingest_db_target*)arg;
+
+  if (count > target->capacity) {
+    size_t* indices =
+        (size_t*)VDB_REALLOC(target->indices, count * sizeof(size_t));
+    if (!indices)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    target->indices = indices;
+    target->capacity = count;
+  }
+
+  vdb_error err = vdb_add_vectors(target->db, vectors, count, ids, NULL,
+                                  target->indices);
+  if (err != VDB_OK && err != VDB_ERROR_DUPLICATE)
+    return err;
+
+  /* a rejected row is reported as SIZE_MAX; the rest of the batch is in */
+  *added = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (target->indices[i] != SIZE_MAX)
+      (*added)++;
+  }
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_ingest_writer_sink(void* arg, const float* vectors,
+                                               const char* const* ids,
+                                               size_t count, size_t* added) {
+  vdb_writer* writer = (vdb_writer*)arg;
+
+  for (size_t i = 0; i < count; i++) {
+    vdb_error err =
+        vdb_writer_add(writer, vectors + i * writer->dimensions, ids[i]);
+    if (err != VDB_OK)
+      return err;
+  }
+  *added = count;
+  return VDB_OK;
+}
+
+/* Bulk-inserts every well-formed row of path into db. Rows rejected as
+ * duplicates are counted in stats->duplicates, not in stats->rows. */
+static inline vdb_error vdb_ingest_file(vdb_database* db, const char* path,
+                                        const vdb_ingest_options* options,
+                                        vdb_ingest_stats* stats) {
+  if (!db || !path)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_ingest_db_target target;
+  target.db = db;
+  target.indices = NULL;
+  target.capacity = 0;
+  vdb_error err = vdb_ingest_run(path, vdb_dimensions(db), options,
+                                 vdb_ingest_db_sink, &target, stats);
+  VDB_FREE(target.indices);
+  return err;
+}
+
+/* Writes the rows of path straight to a vdb_load compatible snapshot,
+ * without holding them in memory. */
+static inline vdb_error vdb_ingest_snapshot(const char* path,
+                                            const char* snapshot,
+                                            size_t dimensions,
+                                            vdb_metric metric,
+                                            const vdb_ingest_options* options,
+                                            vdb_ingest_stats* stats) {
+  if (!path || !snapshot)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_writer* writer = vdb_writer_open(snapshot, dimensions, metric);
+  if (!writer)
+    return VDB_ERROR_IO;
+
+  vdb_error err = vdb_ingest_run(path, dimensions, options,
+                                 vdb_ingest_writer_sink, writer, stats);
+  vdb_error close_err = vdb_writer_close(writer);
+  return err != VDB_OK ? err : close_err;
+}
+
+/* Dimensions of the first row of path, or 0. */
+static inline size_t vdb_ingest_dimensions(const char* path,
+                                           const vdb_ingest_options* options) {
+  vdb_ingest_options defaults;
+  if (!options) {
+    vdb_ingest_defaults(&defaults);
+    options = &defaults;
+  }
+  if (!path || (options->format == VDB_INGEST_JSONL && !options->vector_key))
+    return 0;
+
+  FILE* f = fopen(path, "rb");
+  if (!f)
+    return 0;
+
+  size_t block_size = options->block_size ? options->block_size
+                                          : VDB_INGEST_BLOCK;
+  char* block = (char*)VDB_MALLOC(block_size);
+  float* vec =
+      (float*)VDB_MALLOC(VDB_INGEST_MAX_DIMENSIONS * sizeof(float));
+  size_t length = block && vec ? fread(block, 1, block_size, f) : 0;
+  fclose(f);
+
+  vdb_ingest_chunk chunk;
+  memset(&chunk, 0, sizeof(chunk));
+  size_t dimensions = 0;
+  int skip = options->format == VDB_INGEST_CSV && options->csv_header;
+  const char* p = block;
+  const char* end = block + length;
+
+  while (p < end && dimensions == 0) {
+    const char* eol = (const char*)memchr(p, '\n', (size_t)(end - p));
+    if (!eol)
+      eol = end;
+    size_t n, id_offset;
+    if (skip)
+      skip = 0;
+    else if (vdb_ingest_line(p, eol, options, vec, VDB_INGEST_MAX_DIMENSIONS,
+                             &n, &chunk, &id_offset) == 1)
+      dimensions = n;
+    p = eol + 1;
+  }
+
+  vdb_ingest_free_chunk(&chunk);
+  VDB_FREE(vec);
+  VDB_FREE(block);
+  return dimensions;
+}
+
+#endif
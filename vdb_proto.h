@@ -0,0 +1,405 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VDB_PROTO_H
+#define VDB_PROTO_H
+
+#include "vdb.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the vdb wire protocol is little-endian"
+#endif
+
+/* Writes to a peer that has gone away fail with EPIPE instead of raising
+ * SIGPIPE, so clients need no signal handling. */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define VDB_PROTO_MAGIC 0x56444250
+#define VDB_PROTO_MAX_PAYLOAD (64u << 20)
+#define VDB_PROTO_MAX_K 1000
+
+typedef enum {
+  VDB_OP_INFO = 1,
+  VDB_OP_SEARCH = 2,
+  VDB_OP_ADD = 3,
+  VDB_OP_REMOVE = 4
+} vdb_op;
+
+/* Every message is a header followed by length payload bytes. Requests put
+ * a vdb_op in code, responses a vdb_error. Responses carry the request_id of
+ * their request, so clients may pipeline. */
+typedef struct {
+  uint32_t magic;
+  int32_t code;
+  uint64_t request_id;
+  uint64_t length;
+} vdb_msg_header;
+
+/* INFO response */
+typedef struct {
+  uint64_t dimensions;
+  uint64_t count;
+  uint32_t metric;
+  uint32_t reserved;
+} vdb_wire_info;
+
+/* SEARCH request, followed by the query floats */
+typedef struct {
+  uint32_t k;
+  uint32_t dimensions;
+} vdb_wire_search;
+
+/* SEARCH response: count, then count vdb_wire_result, then the ids back to
+ * back */
+typedef struct {
+  uint32_t count;
+  uint32_t reserved;
+} vdb_wire_results;
+
+typedef struct {
+  uint64_t index;
+  float distance;
+  uint32_t id_len;
+} vdb_wire_result;
+
+/* ADD request, followed by the vector floats and the id bytes. The
+ * response holds the uint64_t index. REMOVE requests hold a uint64_t
+ * index and get an empty response. */
+typedef struct {
+  uint32_t dimensions;
+  uint32_t id_len;
+} vdb_wire_add;
+
+static inline int vdb_proto_write_all(int fd, struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+  return 0;
+}
+
+static inline int vdb_proto_read_all(int fd, void* buf, size_t len) {
+  char* p = (char*)buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Sends one message whose payload is the concatenation of parts. */
+static inline int vdb_proto_send(int fd, int32_t code, uint64_t request_id,
+                                 const struct iovec* parts, int nparts) {
+  struct iovec iov[8];
+  vdb_msg_header header;
+
+  if (nparts > 7)
+    return -1;
+
+  header.magic = VDB_PROTO_MAGIC;
+  header.code = code;
+  header.request_id = request_id;
+  header.length = 0;
+  for (int i = 0; i < nparts; i++) {
+    iov[i + 1] = parts[i];
+    header.length += parts[i].iov_len;
+  }
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+
+  return vdb_proto_write_all(fd, iov, nparts + 1);
+}
+
+/* Receives one message. *payload is allocated with VDB_MALLOC and must be
+ * released with VDB_FREE. */
+static inline int vdb_proto_recv(int fd, vdb_msg_header* header,
+                                 void** payload) {
+  *payload = NULL;
+  if (vdb_proto_read_all(fd, header, sizeof(*header)) != 0 ||
+      header->magic != VDB_PROTO_MAGIC ||
+      header->length > VDB_PROTO_MAX_PAYLOAD)
+    return -1;
+
+  void* buf = VDB_MALLOC(header->length ? header->length : 1);
+  if (!buf)
+    return -1;
+  if (vdb_proto_read_all(fd, buf, header->length) != 0) {
+    VDB_FREE(buf);
+    return -1;
+  }
+
+  *payload = buf;
+  return 0;
+}
+
+/* Decodes a SEARCH response. The ids are copied into the same allocation
+ * as the results, so vdb_free_result_set releases everything. */
+static inline vdb_result_set* vdb_proto_decode_results(const void* payload,
+                                                       size_t length) {
+  const char* p = (const char*)payload;
+  vdb_wire_results head;
+
+  if (length < sizeof(head))
+    return NULL;
+  memcpy(&head, p, sizeof(head));
+
+  size_t entries = (size_t)head.count * sizeof(vdb_wire_result);
+  if (length - sizeof(head) < entries)
+    return NULL;
+
+  const char* ids = p + sizeof(head) + entries;
+  size_t ids_len = length - sizeof(head) - entries;
+  size_t results_size = (size_t)head.count * sizeof(vdb_result);
+
+  vdb_result_set* result_set =
+      (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+  char* block = (char*)VDB_MALLOC(results_size + ids_len + head.count + 1);
+  if (!result_set || !block) {
+    VDB_FREE(result_set);
+    VDB_FREE(block);
+    return NULL;
+  }
+
+  vdb_result* results = (vdb_result*)block;
+  char* strings = block + results_size;
+  size_t offset = 0;
+
+  for (uint32_t i = 0; i < head.count; i++) {
+    vdb_wire_result wire;
+    memcpy(&wire, p + sizeof(head) + i * sizeof(wire), sizeof(wire));
+    if (wire.id_len > ids_len - offset) {
+      VDB_FREE(block);
+      VDB_FREE(result_set);
+      return NULL;
+    }
+    results[i].index = (size_t)wire.index;
+    results[i].distance = wire.distance;
+    results[i].metadata = NULL;
+    results[i].id = NULL;
+    if (wire.id_len > 0) {
+      results[i].id = strings;
+      memcpy(strings, ids + offset, wire.id_len);
+      strings[wire.id_len] = '\0';
+      strings += wire.id_len + 1;
+      offset += wire.id_len;
+    }
+  }
+
+  result_set->results = results;
+  result_set->count = head.count;
+  return result_set;
+}
+
+/* Connects to "unix:/path/to/socket" or "host:port". Returns a blocking
+ * socket, or -1. */
+static inline int vdb_client_connect(const char* address) {
+  if (!address)
+    return -1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(address + 5) >= sizeof(addr.sun_path))
+      return -1;
+    strcpy(addr.sun_path, address + 5);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  const char* colon = strrchr(address, ':');
+  if (!colon || colon == address || (size_t)(colon - address) >= 256)
+    return -1;
+
+  char host[256];
+  memcpy(host, address, (size_t)(colon - address));
+  host[colon - address] = '\0';
+
+  struct addrinfo hints;
+  struct addrinfo* res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+    return -1;
+
+  int fd = -1;
+  for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+/* Sends a request and waits for its response. */
+static inline vdb_error vdb_client_call(int fd, vdb_op op,
+                                        const struct iovec* parts, int nparts,
+                                        void** payload, size_t* length) {
+  vdb_msg_header header;
+
+  *payload = NULL;
+  *length = 0;
+  if (vdb_proto_send(fd, op, 0, parts, nparts) != 0 ||
+      vdb_proto_recv(fd, &header, payload) != 0)
+    return VDB_ERROR_IO;
+  *length = (size_t)header.length;
+  if (header.code != VDB_OK) {
+    VDB_FREE(*payload);
+    *payload = NULL;
+  }
+  return (vdb_error)header.code;
+}
+
+static inline vdb_error vdb_client_info(int fd, vdb_wire_info* out) {
+  void* payload;
+  size_t length;
+
+  vdb_error err = vdb_client_call(fd, VDB_OP_INFO, NULL, 0, &payload, &length);
+  if (err != VDB_OK)
+    return err;
+  if (length == sizeof(*out))
+    memcpy(out, payload, sizeof(*out));
+  else
+    err = VDB_ERROR_IO;
+  VDB_FREE(payload);
+  return err;
+}
+
+static inline vdb_result_set* vdb_client_search(int fd, const float* query,
+                                                size_t dimensions, size_t k,
+                                                vdb_error* out_err) {
+  vdb_wire_search req;
+  struct iovec parts[2];
+  void* payload;
+  size_t length;
+
+  req.k = (uint32_t)k;
+  req.dimensions = (uint32_t)dimensions;
+  parts[0].iov_base = &req;
+  parts[0].iov_len = sizeof(req);
+  parts[1].iov_base = (void*)query;
+  parts[1].iov_len = dimensions * sizeof(float);
+
+  vdb_result_set* result_set = NULL;
+  vdb_error err =
+      vdb_client_call(fd, VDB_OP_SEARCH, parts, 2, &payload, &length);
+  if (err == VDB_OK) {
+    result_set = vdb_proto_decode_results(payload, length);
+    if (!result_set)
+      err = VDB_ERROR_IO;
+    VDB_FREE(payload);
+  }
+
+  if (out_err)
+    *out_err = err;
+  return result_set;
+}
+
+static inline vdb_error vdb_client_add(int fd, const float* data,
+                                       size_t dimensions, const char* id,
+                                       size_t* out_index) {
+  vdb_wire_add req;
+  struct iovec parts[3];
+  void* payload;
+  size_t length;
+
+  req.dimensions = (uint32_t)dimensions;
+  req.id_len = id ? (uint32_t)strlen(id) : 0;
+  parts[0].iov_base = &req;
+  parts[0].iov_len = sizeof(req);
+  parts[1].iov_base = (void*)data;
+  parts[1].iov_len = dimensions * sizeof(float);
+  parts[2].iov_base = (void*)id;
+  parts[2].iov_len = req.id_len;
+
+  vdb_error err = vdb_client_call(fd, VDB_OP_ADD, parts, 3, &payload, &length);
+  if (err != VDB_OK)
+    return err;
+  uint64_t index;
+  if (length == sizeof(index)) {
+    memcpy(&index, payload, sizeof(index));
+    if (out_index)
+      *out_index = (size_t)index;
+  } else {
+    err = VDB_ERROR_IO;
+  }
+  VDB_FREE(payload);
+  return err;
+}
+
+static inline vdb_error vdb_client_remove(int fd, size_t index) {
+  uint64_t wire_index = index;
+  struct iovec part;
+  void* payload;
+  size_t length;
+
+  part.iov_base = &wire_index;
+  part.iov_len = sizeof(wire_index);
+
+  vdb_error err =
+      vdb_client_call(fd, VDB_OP_REMOVE, &part, 1, &payload, &length);
+  VDB_FREE(payload);
+  return err;
+}
+
+#endif
@@ -0,0 +1,731 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* vdb_server: serves one in-memory database over TCP and Unix sockets.
+ *
+ *   gcc -O2 -DVDB_MULTITHREADED vdb_server.c -o vdb_server -lpthread -lm
+ *   ./vdb_server -d 128 -m cosine -p 7070 -u /tmp/vdb.sock -f data.vdb
+ *
+ * A single epoll loop owns the database. All requests that arrive in one
+ * loop iteration are handled together, and runs of consecutive searches
+ * are answered by one vdb_search_batch call.
+ *
+ * Define VDB_SERVER_NO_MAIN to include the server in another program, as
+ * test.c does. */
+
+#define _GNU_SOURCE
+#include "vdb_proto.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#define VDB_SERVER_MAX_EVENTS 256
+#define VDB_SERVER_READ_SIZE 65536
+#define VDB_SERVER_READ_CHUNKS 16
+
+/* a connection whose unsent replies exceed this is not read from until the
+ * client catches up */
+#ifndef VDB_SERVER_MAX_BACKLOG
+#define VDB_SERVER_MAX_BACKLOG (4u << 20)
+#endif
+
+typedef struct vdb_conn {
+  struct vdb_conn* prev;
+  struct vdb_conn* next;
+  int fd;
+  int listening;
+  int closing;
+  uint32_t events; /* epoll events currently registered */
+  char* in;
+  size_t in_len;
+  size_t in_cap;
+  size_t in_parsed;
+  char* out; /* bytes the socket did not take yet */
+  size_t out_len;
+  size_t out_pos;
+  size_t out_cap;
+} vdb_conn;
+
+typedef struct {
+  vdb_conn* conn;
+  vdb_msg_header header;
+  size_t offset; /* payload position in conn->in */
+} vdb_request;
+
+typedef struct {
+  vdb_database* db;
+  int epfd;
+  vdb_conn* conns;
+  vdb_request* pending;
+  size_t npending;
+  size_t pending_cap;
+  vdb_conn** closing;
+  size_t nclosing;
+  size_t closing_cap;
+  size_t* batch; /* indices into pending of the current search run */
+  size_t batch_cap;
+  float* queries;
+  size_t queries_cap;
+  vdb_wire_result* entries;
+  struct iovec* iov;
+  uint64_t searches;
+  uint64_t batches;
+} vdb_server;
+
+static int grow(void** buf, size_t* cap, size_t need, size_t elem) {
+  if (need <= *cap)
+    return 0;
+  size_t new_cap = *cap ? *cap : 16;
+  while (new_cap < need)
+    new_cap *= 2;
+  void* grown = VDB_REALLOC(*buf, new_cap * elem);
+  if (!grown)
+    return -1;
+  *buf = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+static void mark_closing(vdb_server* server, vdb_conn* conn) {
+  if (conn->closing)
+    return;
+  if (grow((void**)&server->closing, &server->closing_cap,
+           server->nclosing + 1, sizeof(vdb_conn*)) != 0) {
+    fprintf(stderr, "vdb_server: out of memory\n");
+    exit(1);
+  }
+  conn->closing = 1;
+  server->closing[server->nclosing++] = conn;
+}
+
+static void close_conn(vdb_server* server, vdb_conn* conn) {
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    server->conns = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  VDB_FREE(conn->in);
+  VDB_FREE(conn->out);
+  VDB_FREE(conn);
+}
+
+static vdb_conn* add_conn(vdb_server* server, int fd, int listening) {
+  vdb_conn* conn = (vdb_conn*)VDB_MALLOC(sizeof(vdb_conn));
+  if (!conn) {
+    close(fd);
+    return NULL;
+  }
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = fd;
+  conn->listening = listening;
+  conn->events = EPOLLIN;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = conn;
+  if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    close(fd);
+    VDB_FREE(conn);
+    return NULL;
+  }
+  conn->next = server->conns;
+  if (server->conns)
+    server->conns->prev = conn;
+  server->conns = conn;
+  return conn;
+}
+
+/* Waits for writability while replies are queued, and stops reading while
+ * the queue is over VDB_SERVER_MAX_BACKLOG. */
+static void update_events(vdb_server* server, vdb_conn* conn) {
+  size_t backlog = conn->out_len - conn->out_pos;
+  uint32_t events = backlog > VDB_SERVER_MAX_BACKLOG ? 0 : EPOLLIN;
+  if (backlog > 0)
+    events |= EPOLLOUT;
+  if (events == conn->events)
+    return;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = conn;
+  epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+  conn->events = events;
+}
+
+/* Writes straight from the caller's buffers; only what the socket does not
+ * take right away is copied into the connection's output buffer. */
+static void send_iov(vdb_server* server, vdb_conn* conn, struct iovec* iov,
+                     int iovcnt) {
+  if (conn->closing)
+    return;
+
+  size_t skip = 0;
+  if (conn->out_len == conn->out_pos) {
+    ssize_t n = writev(conn->fd, iov, iovcnt);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      mark_closing(server, conn);
+      return;
+    }
+    skip = n > 0 ? (size_t)n : 0;
+  }
+
+  for (int i = 0; i < iovcnt; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    size_t len = iov[i].iov_len - skip;
+    if (grow((void**)&conn->out, &conn->out_cap, conn->out_len + len, 1) !=
+        0) {
+      mark_closing(server, conn);
+      return;
+    }
+    memcpy(conn->out + conn->out_len, (char*)iov[i].iov_base + skip, len);
+    conn->out_len += len;
+    skip = 0;
+  }
+
+  update_events(server, conn);
+}
+
+static void respond(vdb_server* server, vdb_conn* conn, uint64_t request_id,
+                    vdb_error code, const void* payload, size_t length) {
+  vdb_msg_header header;
+  struct iovec iov[2];
+
+  header.magic = VDB_PROTO_MAGIC;
+  header.code = code;
+  header.request_id = request_id;
+  header.length = length;
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = (void*)payload;
+  iov[1].iov_len = length;
+  send_iov(server, conn, iov, length ? 2 : 1);
+}
+
+static void flush_out(vdb_server* server, vdb_conn* conn) {
+  while (conn->out_pos < conn->out_len) {
+    ssize_t n = write(conn->fd, conn->out + conn->out_pos,
+                      conn->out_len - conn->out_pos);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR)
+        continue;
+      mark_closing(server, conn);
+      return;
+    }
+    conn->out_pos += (size_t)n;
+  }
+
+  /* keep the unsent tail at the front so the buffer stays bounded */
+  if (conn->out_pos > 0) {
+    memmove(conn->out, conn->out + conn->out_pos,
+            conn->out_len - conn->out_pos);
+    conn->out_len -= conn->out_pos;
+    conn->out_pos = 0;
+  }
+  update_events(server, conn);
+}
+
+static void accept_conns(vdb_server* server, vdb_conn* listener) {
+  for (;;) {
+    int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    add_conn(server, fd, 0);
+  }
+}
+
+/* Reads what is available and queues every complete request. */
+static void read_conn(vdb_server* server, vdb_conn* conn) {
+  if (!(conn->events & EPOLLIN))
+    return;
+  if (conn->in_parsed > 0) {
+    memmove(conn->in, conn->in + conn->in_parsed,
+            conn->in_len - conn->in_parsed);
+    conn->in_len -= conn->in_parsed;
+    conn->in_parsed = 0;
+  }
+
+  /* bounded per wakeup so one busy client cannot starve the others */
+  for (int chunk = 0; chunk < VDB_SERVER_READ_CHUNKS; chunk++) {
+    if (grow((void**)&conn->in, &conn->in_cap,
+             conn->in_len + VDB_SERVER_READ_SIZE, 1) != 0) {
+      mark_closing(server, conn);
+      return;
+    }
+    ssize_t n = read(conn->fd, conn->in + conn->in_len, VDB_SERVER_READ_SIZE);
+    if (n > 0) {
+      conn->in_len += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      mark_closing(server, conn);
+    break;
+  }
+
+  while (conn->in_len - conn->in_parsed >= sizeof(vdb_msg_header)) {
+    vdb_msg_header header;
+    memcpy(&header, conn->in + conn->in_parsed, sizeof(header));
+    if (header.magic != VDB_PROTO_MAGIC ||
+        header.length > VDB_PROTO_MAX_PAYLOAD) {
+      mark_closing(server, conn);
+      return;
+    }
+    size_t size = sizeof(header) + (size_t)header.length;
+    if (conn->in_len - conn->in_parsed < size)
+      break;
+
+    if (grow((void**)&server->pending, &server->pending_cap,
+             server->npending + 1, sizeof(vdb_request)) != 0) {
+      mark_closing(server, conn);
+      return;
+    }
+    vdb_request* req = &server->pending[server->npending++];
+    req->conn = conn;
+    req->header = header;
+    req->offset = conn->in_parsed + sizeof(header);
+    conn->in_parsed += size;
+  }
+}
+
+static int valid_search(const vdb_server* server, const vdb_request* req,
+                        vdb_wire_search* out) {
+  if (req->header.length < sizeof(*out))
+    return 0;
+  memcpy(out, req->conn->in + req->offset, sizeof(*out));
+  return out->dimensions == vdb_dimensions(server->db) && out->k > 0 &&
+         out->k <= VDB_PROTO_MAX_K &&
+         req->header.length ==
+             sizeof(*out) + (size_t)out->dimensions * sizeof(float);
+}
+
+/* Answers pending[first, last), all searches, with one batch call. */
+static void run_searches(vdb_server* server, size_t first, size_t last) {
+  size_t dims = vdb_dimensions(server->db);
+  size_t nqueries = 0;
+  size_t kmax = 0;
+
+  for (size_t i = first; i < last; i++) {
+    vdb_request* req = &server->pending[i];
+    vdb_wire_search search;
+    if (!valid_search(server, req, &search)) {
+      respond(server, req->conn, req->header.request_id,
+              VDB_ERROR_INVALID_DIMENSIONS, NULL, 0);
+      continue;
+    }
+    memcpy(server->queries + nqueries * dims,
+           req->conn->in + req->offset + sizeof(search), dims * sizeof(float));
+    server->batch[nqueries++] = i;
+    if (search.k > kmax)
+      kmax = search.k;
+  }
+
+  if (nqueries == 0)
+    return;
+
+  vdb_result_set* rs =
+      vdb_search_batch(server->db, server->queries, nqueries, kmax);
+  size_t row = rs ? rs->count / nqueries : 0;
+  vdb_error err = rs || vdb_count(server->db) == 0 ? VDB_OK
+                                                   : VDB_ERROR_OUT_OF_MEMORY;
+
+  server->searches += nqueries;
+  server->batches++;
+
+  for (size_t q = 0; q < nqueries; q++) {
+    vdb_request* req = &server->pending[server->batch[q]];
+    vdb_wire_search search;
+    memcpy(&search, req->conn->in + req->offset, sizeof(search));
+
+    size_t n = search.k < row ? search.k : row;
+    vdb_wire_results head;
+    vdb_msg_header header;
+    vdb_wire_result* entries = server->entries;
+    struct iovec* iov = server->iov;
+    int iovcnt = 3;
+    uint64_t length = sizeof(head) + n * sizeof(vdb_wire_result);
+
+    if (err != VDB_OK) {
+      respond(server, req->conn, req->header.request_id, err, NULL, 0);
+      continue;
+    }
+
+    head.count = (uint32_t)n;
+    head.reserved = 0;
+    for (size_t i = 0; i < n; i++) {
+      const vdb_result* r = &rs->results[q * row + i];
+      entries[i].index = r->index;
+      entries[i].distance = r->distance;
+      entries[i].id_len = r->id ? (uint32_t)strlen(r->id) : 0;
+      if (entries[i].id_len > 0) {
+        iov[iovcnt].iov_base = r->id;
+        iov[iovcnt].iov_len = entries[i].id_len;
+        iovcnt++;
+        length += entries[i].id_len;
+      }
+    }
+
+    header.magic = VDB_PROTO_MAGIC;
+    header.code = VDB_OK;
+    header.request_id = req->header.request_id;
+    header.length = length;
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = &head;
+    iov[1].iov_len = sizeof(head);
+    iov[2].iov_base = entries;
+    iov[2].iov_len = n * sizeof(vdb_wire_result);
+    send_iov(server, req->conn, iov, iovcnt);
+  }
+
+  vdb_free_result_set(rs);
+}
+
+static void run_request(vdb_server* server, vdb_request* req) {
+  const char* payload = req->conn->in + req->offset;
+  size_t length = (size_t)req->header.length;
+  size_t dims = vdb_dimensions(server->db);
+  uint64_t id = req->header.request_id;
+
+  switch (req->header.code) {
+  case VDB_OP_INFO: {
+    vdb_wire_info info;
+    info.dimensions = dims;
+    info.count = vdb_count(server->db);
+    info.metric = (uint32_t)server->db->metric;
+    info.reserved = 0;
+    respond(server, req->conn, id, VDB_OK, &info, sizeof(info));
+    break;
+  }
+  case VDB_OP_ADD: {
+    vdb_wire_add add;
+    if (length < sizeof(add)) {
+      respond(server, req->conn, id, VDB_ERROR_INVALID_DIMENSIONS, NULL, 0);
+      break;
+    }
+    memcpy(&add, payload, sizeof(add));
+    if (add.dimensions != dims ||
+        length != sizeof(add) + dims * sizeof(float) + add.id_len) {
+      respond(server, req->conn, id, VDB_ERROR_INVALID_DIMENSIONS, NULL, 0);
+      break;
+    }
+
+    float* data = (float*)VDB_MALLOC(dims * sizeof(float));
+    char* vec_id = (char*)VDB_MALLOC((size_t)add.id_len + 1);
+    vdb_error err = VDB_ERROR_OUT_OF_MEMORY;
+    uint64_t index = 0;
+    if (data && vec_id) {
+      memcpy(data, payload + sizeof(add), dims * sizeof(float));
+      memcpy(vec_id, payload + sizeof(add) + dims * sizeof(float),
+             add.id_len);
+      vec_id[add.id_len] = '\0';
+      size_t stored = 0;
+      err = vdb_add_vector_ex(server->db, data, add.id_len ? vec_id : NULL,
+                              NULL, &stored);
+      index = stored;
+    }
+    VDB_FREE(data);
+    VDB_FREE(vec_id);
+    respond(server, req->conn, id, err, &index,
+            err == VDB_OK ? sizeof(index) : 0);
+    break;
+  }
+  case VDB_OP_REMOVE: {
+    uint64_t index;
+    vdb_error err = VDB_ERROR_INVALID_INDEX;
+    if (length == sizeof(index)) {
+      memcpy(&index, payload, sizeof(index));
+      err = vdb_remove_vector(server->db, (size_t)index);
+    }
+    respond(server, req->conn, id, err, NULL, 0);
+    break;
+  }
+  default:
+    mark_closing(server, req->conn);
+    break;
+  }
+}
+
+/* Handles the queued requests in arrival order. Consecutive searches are
+ * coalesced; any other request ends the run so mutations stay ordered
+ * against the searches around them. */
+static void run_pending(vdb_server* server) {
+  size_t n = server->npending;
+  size_t dims = vdb_dimensions(server->db);
+
+  if (n == 0)
+    return;
+
+  if (grow((void**)&server->batch, &server->batch_cap, n, sizeof(size_t)) !=
+          0 ||
+      grow((void**)&server->queries, &server->queries_cap, n * dims,
+           sizeof(float)) != 0) {
+    fprintf(stderr, "vdb_server: out of memory\n");
+    exit(1);
+  }
+
+  size_t i = 0;
+  while (i < server->npending) {
+    if (server->pending[i].header.code != VDB_OP_SEARCH) {
+      run_request(server, &server->pending[i]);
+      i++;
+      continue;
+    }
+    size_t end = i;
+    while (end < server->npending &&
+           server->pending[end].header.code == VDB_OP_SEARCH)
+      end++;
+    run_searches(server, i, end);
+    i = end;
+  }
+
+  server->npending = 0;
+}
+
+static int server_init(vdb_server* server) {
+  server->entries =
+      (vdb_wire_result*)VDB_MALLOC(VDB_PROTO_MAX_K * sizeof(vdb_wire_result));
+  server->iov = (struct iovec*)VDB_MALLOC((VDB_PROTO_MAX_K + 3) *
+                                          sizeof(struct iovec));
+  server->epfd = epoll_create1(EPOLL_CLOEXEC);
+  return server->entries && server->iov && server->epfd >= 0 ? 0 : -1;
+}
+
+/* One loop iteration: waits up to timeout_ms for events, then answers
+ * everything that arrived. Returns -1 if epoll_wait fails. */
+static int server_poll(vdb_server* server, int timeout_ms) {
+  struct epoll_event events[VDB_SERVER_MAX_EVENTS];
+  int n = epoll_wait(server->epfd, events, VDB_SERVER_MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR)
+      return 0;
+    perror("epoll_wait");
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    vdb_conn* conn = (vdb_conn*)events[i].data.ptr;
+    if (conn->listening) {
+      accept_conns(server, conn);
+      continue;
+    }
+    if (events[i].events & EPOLLOUT)
+      flush_out(server, conn);
+    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      read_conn(server, conn);
+  }
+
+  run_pending(server);
+
+  for (size_t i = 0; i < server->nclosing; i++)
+    close_conn(server, server->closing[i]);
+  server->nclosing = 0;
+  return 0;
+}
+
+static void server_free(vdb_server* server) {
+  while (server->conns)
+    close_conn(server, server->conns);
+  if (server->epfd >= 0)
+    close(server->epfd);
+  VDB_FREE(server->pending);
+  VDB_FREE(server->closing);
+  VDB_FREE(server->batch);
+  VDB_FREE(server->queries);
+  VDB_FREE(server->entries);
+  VDB_FREE(server->iov);
+  vdb_destroy(server->db);
+}
+
+static int listen_unix(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 128) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+#ifndef VDB_SERVER_NO_MAIN
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static int listen_tcp(const char* port) {
+  struct addrinfo hints;
+  struct addrinfo* res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(NULL, port, &hints, &res) != 0)
+    return -1;
+
+  int fd = -1;
+  for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+      continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 128) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+static int parse_metric(const char* name, vdb_metric* out) {
+  if (strcmp(name, "cosine") == 0)
+    *out = VDB_METRIC_COSINE;
+  else if (strcmp(name, "euclidean") == 0)
+    *out = VDB_METRIC_EUCLIDEAN;
+  else if (strcmp(name, "dot") == 0)
+    *out = VDB_METRIC_DOT_PRODUCT;
+  else
+    return -1;
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: vdb_server [-p port] [-u socket] [-d dimensions] "
+          "[-m cosine|euclidean|dot] [-f file]\n"
+          "  -f loads the file at startup if it exists and saves to it on "
+          "SIGINT/SIGTERM\n");
+}
+
+int main(int argc, char** argv) {
+  const char* port = NULL;
+  const char* unix_path = NULL;
+  const char* file = NULL;
+  size_t dims = 0;
+  vdb_metric metric = VDB_METRIC_COSINE;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    if (strcmp(argv[i], "-p") == 0)
+      port = argv[++i];
+    else if (strcmp(argv[i], "-u") == 0)
+      unix_path = argv[++i];
+    else if (strcmp(argv[i], "-f") == 0)
+      file = argv[++i];
+    else if (strcmp(argv[i], "-d") == 0)
+      dims = (size_t)strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "-m") == 0 &&
+             parse_metric(argv[i + 1], &metric) == 0)
+      i++;
+    else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (!port && !unix_path) {
+    usage();
+    return 1;
+  }
+
+  vdb_server server;
+  memset(&server, 0, sizeof(server));
+  server.db = file ? vdb_load(file) : NULL;
+  if (!server.db && dims > 0)
+    server.db = vdb_create(dims, metric);
+  if (!server.db) {
+    fprintf(stderr, "vdb_server: need -d, or a loadable -f file\n");
+    return 1;
+  }
+
+  if (server_init(&server) != 0) {
+    fprintf(stderr, "vdb_server: startup failed\n");
+    return 1;
+  }
+
+  if (port) {
+    int fd = listen_tcp(port);
+    if (fd < 0 || !add_conn(&server, fd, 1)) {
+      fprintf(stderr, "vdb_server: cannot listen on port %s\n", port);
+      return 1;
+    }
+  }
+  if (unix_path) {
+    int fd = listen_unix(unix_path);
+    if (fd < 0 || !add_conn(&server, fd, 1)) {
+      fprintf(stderr, "vdb_server: cannot listen on %s\n", unix_path);
+      return 1;
+    }
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "vdb_server: serving %zu vectors of %zu dimensions\n",
+          vdb_count(server.db), vdb_dimensions(server.db));
+
+  while (!stop_requested && server_poll(&server, -1) == 0)
+    ;
+
+  fprintf(stderr, "vdb_server: %llu searches in %llu batches\n",
+          (unsigned long long)server.searches,
+          (unsigned long long)server.batches);
+
+  int status = 0;
+  if (file && vdb_save(server.db, file) != VDB_OK) {
+    fprintf(stderr, "vdb_server: cannot save %s\n", file);
+    status = 1;
+  }
+  if (unix_path)
+    unlink(unix_path);
+
+  server_free(&server);
+  return status;
+}
+
+#endif
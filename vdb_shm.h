@@ -0,0 +1,504 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VDB_SHM_H
+#define VDB_SHM_H
+
+#include "vdb.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define VDB_SHM_MAGIC 0x56444253
+#define VDB_SHM_FORMAT 1
+
+#ifndef VDB_SHM_INITIAL_ROWS
+#define VDB_SHM_INITIAL_ROWS 1024
+#endif
+
+#ifndef VDB_SHM_INITIAL_ARENA
+#define VDB_SHM_INITIAL_ARENA 65536
+#endif
+
+/* Lives in the segment named by the caller and is never remapped, so the
+ * process-shared lock stays put. The rows live in a second segment, name
+ * plus ".data", laid out as vectors, norms, id offsets and the id arena.
+ * Every reference inside it is an offset, so each process may map it at a
+ * different address. POSIX has no robust rwlock: a process that dies while
+ * holding the lock blocks every other process until the segments are
+ * unlinked and recreated. */
+typedef struct {
+  uint32_t magic;
+  uint32_t format;
+  pthread_rwlock_t lock;
+  uint64_t dimensions;
+  uint32_t metric;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t norms_offset;
+  uint64_t ids_offset; /* one arena offset per row, 0 for no id */
+  uint64_t arena_offset;
+  uint64_t arena_used;
+  uint64_t arena_capacity;
+  uint64_t data_size;
+  uint64_t version;
+} vdb_shm_header;
+
+/* One handle per thread: remapping after another process grew the data
+ * segment replaces the handle's mapping. */
+typedef struct {
+  vdb_shm_header* header;
+  char* data;
+  size_t mapped;
+  int data_fd;
+} vdb_shm;
+
+static inline char* vdb_shm_data_name(const char* name) {
+  size_t len = strlen(name);
+  char* data_name = (char*)VDB_MALLOC(len + 6);
+  if (data_name) {
+    memcpy(data_name, name, len);
+    memcpy(data_name + len, ".data", 6);
+  }
+  return data_name;
+}
+
+static inline void vdb_shm_layout(vdb_shm_header* header, uint64_t capacity,
+                                  uint64_t arena_capacity) {
+  uint64_t norms = capacity * header->dimensions * sizeof(float);
+  uint64_t ids = (norms + capacity * sizeof(float) + 7) & ~(uint64_t)7;
+
+  header->capacity = capacity;
+  header->norms_offset = norms;
+  header->ids_offset = ids;
+  header->arena_offset = ids + capacity * sizeof(uint64_t);
+  header->arena_capacity = arena_capacity;
+  header->data_size = header->arena_offset + arena_capacity;
+}
+
+/* Brings the mapping up to the current segment size. Requires the lock. */
+static inline vdb_error vdb_shm_map(vdb_shm* shm) {
+  size_t size = (size_t)shm->header->data_size;
+  if (shm->data && shm->mapped == size)
+    return VDB_OK;
+
+  /* touching pages past the end of the segment raises SIGBUS */
+  struct stat st;
+  if (fstat(shm->data_fd, &st) != 0 || (uint64_t)st.st_size < size)
+    return VDB_ERROR_IO;
+
+  if (shm->data)
+    munmap(shm->data, shm->mapped);
+  void* data =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->data_fd, 0);
+  if (data == MAP_FAILED) {
+    shm->data = NULL;
+    shm->mapped = 0;
+    return VDB_ERROR_IO;
+  }
+  shm->data = (char*)data;
+  shm->mapped = size;
+  return VDB_OK;
+}
+
+static inline float* vdb_shm_norms(const vdb_shm* shm) {
+  return (float*)(shm->data + shm->header->norms_offset);
+}
+
+static inline uint64_t* vdb_shm_ids(const vdb_shm* shm) {
+  return (uint64_t*)(shm->data + shm->header->ids_offset);
+}
+
+static inline const char* vdb_shm_id(const vdb_shm* shm, size_t index) {
+  uint64_t offset = vdb_shm_ids(shm)[index];
+  return offset ? shm->data + shm->header->arena_offset + offset : NULL;
+}
+
+static inline void vdb_shm_close(vdb_shm* shm) {
+  if (!shm)
+    return;
+  if (shm->data)
+    munmap(shm->data, shm->mapped);
+  if (shm->header)
+    munmap(shm->header, sizeof(vdb_shm_header));
+  if (shm->data_fd >= 0)
+    close(shm->data_fd);
+  VDB_FREE(shm);
+}
+
+static inline vdb_shm* vdb_shm_attach(const char* name, int create) {
+  char* data_name = vdb_shm_data_name(name);
+  vdb_shm* shm = (vdb_shm*)VDB_MALLOC(sizeof(vdb_shm));
+  if (!data_name || !shm) {
+    VDB_FREE(data_name);
+    VDB_FREE(shm);
+    return NULL;
+  }
+  shm->header = NULL;
+  shm->data = NULL;
+  shm->mapped = 0;
+
+  /* an opener can race the creator's ftruncate and see a short segment */
+  int flags = create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR;
+  int fd = shm_open(name, flags, 0600);
+  shm->data_fd = shm_open(data_name, flags, 0600);
+  struct stat st;
+  int sized = 0;
+  if (fd >= 0 && create)
+    sized = ftruncate(fd, sizeof(vdb_shm_header)) == 0;
+  else if (fd >= 0)
+    sized = fstat(fd, &st) == 0 &&
+            (uint64_t)st.st_size >= sizeof(vdb_shm_header);
+  if (sized && shm->data_fd >= 0) {
+    void* header = mmap(NULL, sizeof(vdb_shm_header), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    if (header != MAP_FAILED)
+      shm->header = (vdb_shm_header*)header;
+  }
+  if (fd >= 0)
+    close(fd);
+  if (create && !shm->header) {
+    if (fd >= 0)
+      shm_unlink(name);
+    if (shm->data_fd >= 0)
+      shm_unlink(data_name);
+  }
+  VDB_FREE(data_name);
+
+  if (!shm->header) {
+    vdb_shm_close(shm);
+    return NULL;
+  }
+  return shm;
+}
+
+/* Removes the names; processes that have the database open keep using it. */
+static inline vdb_error vdb_shm_unlink(const char* name) {
+  if (!name)
+    return VDB_ERROR_NULL_POINTER;
+
+  char* data_name = vdb_shm_data_name(name);
+  if (!data_name)
+    return VDB_ERROR_OUT_OF_MEMORY;
+  int a = shm_unlink(name);
+  int b = shm_unlink(data_name);
+  VDB_FREE(data_name);
+  return a == 0 && b == 0 ? VDB_OK : VDB_ERROR_NOT_FOUND;
+}
+
+/* Creates the segments; fails if name (which starts with '/') exists. */
+static inline vdb_shm* vdb_shm_create(const char* name, size_t dimensions,
+                                      vdb_metric metric) {
+  if (!name || dimensions == 0)
+    return NULL;
+
+  vdb_shm* shm = vdb_shm_attach(name, 1);
+  if (!shm)
+    return NULL;
+
+  vdb_shm_header* header = shm->header;
+  pthread_rwlockattr_t attr;
+  int ok = pthread_rwlockattr_init(&attr) == 0;
+  ok = ok &&
+       pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+       pthread_rwlock_init(&header->lock, &attr) == 0;
+  pthread_rwlockattr_destroy(&attr);
+
+  header->format = VDB_SHM_FORMAT;
+  header->dimensions = dimensions;
+  header->metric = (uint32_t)metric;
+  header->reserved = 0;
+  header->count = 0;
+  header->arena_used = 1; /* offset 0 means no id */
+  header->version = 0;
+  vdb_shm_layout(header, VDB_SHM_INITIAL_ROWS, VDB_SHM_INITIAL_ARENA);
+
+  if (!ok || ftruncate(shm->data_fd, (off_t)header->data_size) != 0 ||
+      vdb_shm_map(shm) != VDB_OK) {
+    vdb_shm_close(shm);
+    vdb_shm_unlink(name);
+    return NULL;
+  }
+
+  /* openers check the magic last */
+  __atomic_store_n(&header->magic, VDB_SHM_MAGIC, __ATOMIC_RELEASE);
+  return shm;
+}
+
+static inline vdb_shm* vdb_shm_open(const char* name) {
+  if (!name)
+    return NULL;
+
+  vdb_shm* shm = vdb_shm_attach(name, 0);
+  if (!shm)
+    return NULL;
+  if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE) !=
+          VDB_SHM_MAGIC ||
+      shm->header->format != VDB_SHM_FORMAT) {
+    vdb_shm_close(shm);
+    return NULL;
+  }
+  return shm;
+}
+
+/* Makes room for rows more rows and id_bytes more id bytes, doubling the
+ * full regions and moving the later ones up. Growing the arena first
+ * compacts away the ids of removed rows. Requires the write lock. */
+static inline vdb_error vdb_shm_reserve(vdb_shm* shm, size_t rows,
+                                        size_t id_bytes) {
+  vdb_shm_header* header = shm->header;
+  uint64_t capacity = header->capacity;
+  uint64_t arena_capacity = header->arena_capacity;
+  int compact = header->arena_used + id_bytes > arena_capacity;
+
+  if (header->count + rows <= capacity && !compact)
+    return VDB_OK;
+
+  while (header->count + rows > capacity)
+    capacity *= 2;
+
+  char* packed = NULL;
+  uint64_t live = 1;
+  if (compact) {
+    const uint64_t* ids = vdb_shm_ids(shm);
+    for (size_t i = 0; i < header->count; i++) {
+      if (ids[i])
+        live += strlen(vdb_shm_id(shm, i)) + 1;
+    }
+    while (arena_capacity < 2 * (live + id_bytes))
+      arena_capacity *= 2;
+
+    packed = (char*)VDB_MALLOC(live);
+    if (!packed)
+      return VDB_ERROR_OUT_OF_MEMORY;
+    char* p = packed + 1;
+    for (size_t i = 0; i < header->count; i++) {
+      if (ids[i]) {
+        size_t len = strlen(vdb_shm_id(shm, i)) + 1;
+        memcpy(p, vdb_shm_id(shm, i), len);
+        p += len;
+      }
+    }
+  }
+
+  vdb_shm_header old = *header;
+  vdb_shm_header next = *header;
+  vdb_shm_layout(&next, capacity, arena_capacity);
+
+  if (ftruncate(shm->data_fd, (off_t)next.data_size) != 0) {
+    VDB_FREE(packed);
+    return VDB_ERROR_OUT_OF_MEMORY;
+  }
+  header->data_size = next.data_size;
+  if (vdb_shm_map(shm) != VDB_OK) {
+    VDB_FREE(packed);
+    return VDB_ERROR_IO;
+  }
+
+  /* every region moves up, so the highest one goes first */
+  char* data = shm->data;
+  if (!compact) {
+    memmove(data + next.arena_offset, data + old.arena_offset,
+            (size_t)old.arena_used);
+  }
+  memmove(data + next.ids_offset, data + old.ids_offset,
+          (size_t)old.count * sizeof(uint64_t));
+  memmove(data + next.norms_offset, data + old.norms_offset,
+          (size_t)old.count * sizeof(float));
+
+  header->capacity = next.capacity;
+  header->norms_offset = next.norms_offset;
+  header->ids_offset = next.ids_offset;
+  header->arena_offset = next.arena_offset;
+  header->arena_capacity = next.arena_capacity;
+
+  if (compact) {
+    uint64_t* ids = vdb_shm_ids(shm);
+    char* arena = data + next.arena_offset;
+    uint64_t offset = 1;
+    for (size_t i = 0; i < header->count; i++) {
+      if (ids[i]) {
+        size_t len = strlen(packed + offset) + 1;
+        memcpy(arena + offset, packed + offset, len);
+        ids[i] = offset;
+        offset += len;
+      }
+    }
+    header->arena_used = offset;
+    VDB_FREE(packed);
+  }
+
+  return VDB_OK;
+}
+
+static inline vdb_error vdb_shm_add(vdb_shm* shm, const float* data,
+                                    const char* id, size_t* out_index) {
+  if (!shm || !data)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_shm_header* header = shm->header;
+  size_t id_bytes = id ? strlen(id) + 1 : 0;
+
+  pthread_rwlock_wrlock(&header->lock);
+
+  vdb_error err = vdb_shm_map(shm);
+  if (err == VDB_OK)
+    err = vdb_shm_reserve(shm, 1, id_bytes);
+  if (err == VDB_OK) {
+    size_t dims = (size_t)header->dimensions;
+    size_t row = (size_t)header->count;
+    float* vector = (float*)shm->data + row * dims;
+
+    memcpy(vector, data, dims * sizeof(float));
+    vdb_shm_norms(shm)[row] = header->metric == VDB_METRIC_COSINE
+                                  ? vdb_magnitude(vector, dims)
+                                  : 0.0f;
+    vdb_shm_ids(shm)[row] = id ? header->arena_used : 0;
+    if (id) {
+      memcpy(shm->data + header->arena_offset + header->arena_used, id,
+             id_bytes);
+      header->arena_used += id_bytes;
+    }
+    header->count++;
+    header->version++;
+    if (out_index)
+      *out_index = row;
+  }
+
+  pthread_rwlock_unlock(&header->lock);
+  return err;
+}
+
+static inline vdb_error vdb_shm_remove(vdb_shm* shm, size_t index) {
+  if (!shm)
+    return VDB_ERROR_NULL_POINTER;
+
+  vdb_shm_header* header = shm->header;
+
+  pthread_rwlock_wrlock(&header->lock);
+
+  vdb_error err = vdb_shm_map(shm);
+  if (err == VDB_OK && index >= header->count)
+    err = VDB_ERROR_INVALID_INDEX;
+  if (err == VDB_OK) {
+    size_t dims = (size_t)header->dimensions;
+    size_t tail = (size_t)header->count - index - 1;
+    float* vectors = (float*)shm->data;
+
+    memmove(vectors + index * dims, vectors + (index + 1) * dims,
+            tail * dims * sizeof(float));
+    memmove(vdb_shm_norms(shm) + index, vdb_shm_norms(shm) + index + 1,
+            tail * sizeof(float));
+    memmove(vdb_shm_ids(shm) + index, vdb_shm_ids(shm) + index + 1,
+            tail * sizeof(uint64_t));
+    header->count--;
+    header->version++;
+  }
+
+  pthread_rwlock_unlock(&header->lock);
+  return err;
+}
+
+/* Ids are copied into the results allocation, so the result set stays valid
+ * after the lock is released. */
+static inline vdb_result_set* vdb_shm_search(vdb_shm* shm, const float* query,
+                                             size_t k) {
+  if (!shm || !query || k == 0)
+    return NULL;
+
+  vdb_shm_header* header = shm->header;
+  vdb_result_set* result_set = NULL;
+
+  pthread_rwlock_rdlock(&header->lock);
+
+  if (vdb_shm_map(shm) == VDB_OK) {
+    size_t dims = (size_t)header->dimensions;
+    size_t count = (size_t)header->count;
+    vdb_metric metric = (vdb_metric)header->metric;
+    const float* vectors = (const float*)shm->data;
+    const float* norms = vdb_shm_norms(shm);
+    float query_norm =
+        metric == VDB_METRIC_COSINE ? vdb_magnitude(query, dims) : 0.0f;
+
+    if (k > count)
+      k = count;
+    vdb_result* heap =
+        (vdb_result*)VDB_MALLOC((k ? k : 1) * sizeof(vdb_result));
+    if (heap) {
+      size_t size = 0;
+      for (size_t i = 0; i < count; i++) {
+        vdb_heap_push(heap, &size, k, i,
+                      vdb_compute_distance_normed(query, vectors + i * dims,
+                                                  query_norm, norms[i], dims,
+                                                  metric));
+      }
+      qsort(heap, size, sizeof(vdb_result), vdb_result_compare);
+
+      size_t ids_len = 0;
+      for (size_t i = 0; i < size; i++) {
+        const char* id = vdb_shm_id(shm, heap[i].index);
+        if (id)
+          ids_len += strlen(id) + 1;
+      }
+
+      result_set = (vdb_result_set*)VDB_MALLOC(sizeof(vdb_result_set));
+      char* block = (char*)VDB_MALLOC(size * sizeof(vdb_result) + ids_len + 1);
+      if (result_set && block) {
+        vdb_result* results = (vdb_result*)block;
+        char* strings = block + size * sizeof(vdb_result);
+        for (size_t i = 0; i < size; i++) {
+          const char* id = vdb_shm_id(shm, heap[i].index);
+          results[i] = heap[i];
+          if (id) {
+            size_t len = strlen(id) + 1;
+            memcpy(strings, id, len);
+            results[i].id = strings;
+            strings += len;
+          }
+        }
+        result_set->results = results;
+        result_set->count = size;
+      } else {
+        VDB_FREE(result_set);
+        VDB_FREE(block);
+        result_set = NULL;
+      }
+      VDB_FREE(heap);
+    }
+  }
+
+  pthread_rwlock_unlock(&header->lock);
+  return result_set;
+}
+
+static inline size_t vdb_shm_count(const vdb_shm* shm) {
+  if (!shm)
+    return 0;
+
+  pthread_rwlock_rdlock(&shm->header->lock);
+  size_t count = (size_t)shm->header->count;
+  pthread_rwlock_unlock(&shm->header->lock);
+
+  return count;
+}
+
+static inline size_t vdb_shm_dimensions(const vdb_shm* shm) {
+  return shm ? (size_t)shm->header->dimensions : 0;
+}
+
+#endif
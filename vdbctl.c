@@ -0,0 +1,341 @@
+// Copyright 2026 Abdi Moalim
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* vdbctl: inspects and rewrites vdb_save files.
+ *
+ *   gcc -O2 -DVDB_MULTITHREADED vdbctl.c -o vdbctl -lpthread -lm
+ *   ./vdbctl verify data.vdb
+ *
+ * Every command except bench streams rows through vdb_reader and
+ * vdb_writer, so memory use does not depend on the file size. */
+
+#include "vdb.h"
+
+#include <stdio.h>
+
+static const char* metric_name(vdb_metric metric) {
+  switch (metric) {
+  case VDB_METRIC_COSINE:
+    return "cosine";
+  case VDB_METRIC_EUCLIDEAN:
+    return "euclidean";
+  case VDB_METRIC_DOT_PRODUCT:
+    return "dot";
+  default:
+    return "unknown";
+  }
+}
+
+static int finite_row(const float* data, size_t dims) {
+  for (size_t i = 0; i < dims; i++) {
+    if (!isfinite(data[i]))
+      return 0;
+  }
+  return 1;
+}
+
+static vdb_reader* open_reader(const char* file) {
+  vdb_reader* reader = vdb_reader_open(file);
+  if (!reader)
+    fprintf(stderr, "vdbctl: %s is not a readable vdb file\n", file);
+  return reader;
+}
+
+static int cmd_info(const char* file) {
+  vdb_reader* reader = open_reader(file);
+  if (!reader)
+    return 1;
+
+  uint64_t header = reader->offset;
+  uint64_t fixed = (uint64_t)reader->count *
+                   (reader->dimensions * sizeof(float) + sizeof(uint32_t));
+  printf("file        %s\n", file);
+  printf("size        %llu bytes\n", (unsigned long long)reader->size);
+  printf("dimensions  %zu\n", reader->dimensions);
+  printf("count       %zu\n", reader->count);
+  printf("metric      %s\n", metric_name(reader->metric));
+  if (header + fixed > reader->size) {
+    printf("truncated   %llu bytes missing\n",
+           (unsigned long long)(header + fixed - reader->size));
+  } else {
+    printf("vectors     %llu bytes\n",
+           (unsigned long long)(reader->count * reader->dimensions *
+                                sizeof(float)));
+    printf("ids         %llu bytes\n",
+           (unsigned long long)(reader->size - header - fixed));
+  }
+
+  vdb_reader_close(reader);
+  return 0;
+}
+
+static int cmd_verify(const char* file) {
+  vdb_reader* reader = open_reader(file);
+  if (!reader)
+    return 1;
+
+  size_t dims = reader->dimensions;
+  size_t nonfinite = 0;
+  size_t zero = 0;
+  size_t unnamed = 0;
+  size_t longest = 0;
+  const float* data;
+  const char* id;
+  vdb_error err;
+
+  while ((err = vdb_reader_next(reader, &data, &id)) == VDB_OK) {
+    if (!finite_row(data, dims))
+      nonfinite++;
+    else if (vdb_magnitude(data, dims) == 0.0f)
+      zero++;
+    if (!id)
+      unnamed++;
+    else if (strlen(id) > longest)
+      longest = strlen(id);
+  }
+
+  int status = 0;
+  if (err != VDB_ERROR_NOT_FOUND) {
+    printf("corrupt     row %zu of %zu is truncated or malformed\n",
+           reader->position, reader->count);
+    status = 1;
+  } else if (reader->offset != reader->size) {
+    printf("corrupt     %llu trailing bytes\n",
+           (unsigned long long)(reader->size - reader->offset));
+    status = 1;
+  }
+  printf("rows        %zu\n", reader->position);
+  printf("non-finite  %zu\n", nonfinite);
+  printf("zero        %zu%s\n", zero,
+         zero && reader->metric == VDB_METRIC_COSINE
+             ? " (no cosine distance)"
+             : "");
+  printf("no id       %zu\n", unnamed);
+  printf("longest id  %zu\n", longest);
+  printf("%s\n", status ? "FAILED" : "OK");
+
+  vdb_reader_close(reader);
+  return status;
+}
+
+static void print_json_string(const char* s) {
+  putchar('"');
+  for (const unsigned char* p = (const unsigned char*)s; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      printf("\\%c", *p);
+    else if (*p < 0x20)
+      printf("\\u%04x", *p);
+    else
+      putchar(*p);
+  }
+  putchar('"');
+}
+
+/* One JSONL object per row, the format vdb_ingest reads by default. */
+static int cmd_dump(const char* file, size_t limit) {
+  vdb_reader* reader = open_reader(file);
+  if (!reader)
+    return 1;
+
+  const float* data;
+  const char* id;
+  vdb_error err = VDB_OK;
+
+  for (size_t n = 0; n < limit; n++) {
+    err = vdb_reader_next(reader, &data, &id);
+    if (err != VDB_OK)
+      break;
+    printf("{\"id\": ");
+    if (id)
+      print_json_string(id);
+    else
+      printf("null");
+    printf(", \"embedding\": [");
+    for (size_t i = 0; i < reader->dimensions; i++)
+      printf(i ? ", %.9g" : "%.9g", data[i]);
+    printf("]}\n");
+  }
+
+  vdb_reader_close(reader);
+  if (err != VDB_OK && err != VDB_ERROR_NOT_FOUND) {
+    fprintf(stderr, "vdbctl: %s is corrupt\n", file);
+    return 1;
+  }
+  return 0;
+}
+
+/* Rewrites in to out without the rows that contain NaN or infinity. */
+static int cmd_compact(const char* in, const char* out) {
+  vdb_reader* reader = open_reader(in);
+  if (!reader)
+    return 1;
+  vdb_writer* writer =
+      vdb_writer_open(out, reader->dimensions, reader->metric);
+  if (!writer) {
+    fprintf(stderr, "vdbctl: cannot create %s\n", out);
+    vdb_reader_close(reader);
+    return 1;
+  }
+
+  const float* data;
+  const char* id;
+  size_t dropped = 0;
+  vdb_error err;
+
+  while ((err = vdb_reader_next(reader, &data, &id)) == VDB_OK) {
+    if (!finite_row(data, reader->dimensions)) {
+      dropped++;
+      continue;
+    }
+    err = vdb_writer_add(writer, data, id);
+    if (err != VDB_OK)
+      break;
+  }
+
+  size_t kept = writer->count;
+  vdb_error close_err = vdb_writer_close(writer);
+  vdb_reader_close(reader);
+  if (err != VDB_ERROR_NOT_FOUND || close_err != VDB_OK) {
+    fprintf(stderr, "vdbctl: compacting %s failed: error %d\n", in,
+            err != VDB_ERROR_NOT_FOUND ? err : close_err);
+    return 1;
+  }
+  printf("%zu rows kept, %zu dropped\n", kept, dropped);
+  return 0;
+}
+
+/* Merges files that share dimensions and metric; see vdb_merge_files. */
+static int cmd_merge(const char* out, char** inputs, int ninputs,
+                     vdb_merge_policy policy) {
+  size_t rows = 0;
+  size_t dropped = 0;
+  uint64_t start = vdb_now_us();
+
+  vdb_error err = vdb_merge_files(out, (const char* const*)inputs,
+                                  (size_t)ninputs, policy, &rows, &dropped);
+  if (err == VDB_ERROR_INVALID_DIMENSIONS) {
+    fprintf(stderr, "vdbctl: inputs differ in dimensions or metric\n");
+    return 1;
+  }
+  if (err != VDB_OK) {
+    fprintf(stderr, "vdbctl: merge failed: error %d\n", err);
+    return 1;
+  }
+  printf("%zu rows from %d files, %zu duplicates dropped, %.2f s\n", rows,
+         ninputs, dropped, (double)(vdb_now_us() - start) / 1e6);
+  return 0;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Loads the file and times vdb_search with stored rows as queries. */
+static int cmd_bench(const char* file, size_t nqueries, size_t k) {
+  vdb_database* db = vdb_load(file);
+  if (!db || vdb_count(db) == 0) {
+    fprintf(stderr, "vdbctl: cannot load %s, or it is empty\n", file);
+    vdb_destroy(db);
+    return 1;
+  }
+
+  uint64_t* times = (uint64_t*)VDB_MALLOC(nqueries * sizeof(uint64_t));
+  if (!times) {
+    vdb_destroy(db);
+    return 1;
+  }
+
+  uint64_t seed = 42;
+  uint64_t total = 0;
+  for (size_t q = 0; q < nqueries; q++) {
+    float* query = NULL;
+    vdb_get_vector(db, vdb_random(&seed) % vdb_count(db), &query, NULL, NULL);
+    uint64_t start = vdb_now_us();
+    vdb_result_set* results = vdb_search(db, query, k);
+    times[q] = vdb_now_us() - start;
+    total += times[q];
+    vdb_free_result_set(results);
+  }
+  qsort(times, nqueries, sizeof(uint64_t), compare_u64);
+
+  printf("rows        %zu x %zu, %s\n", vdb_count(db), vdb_dimensions(db),
+         metric_name(db->metric));
+  printf("queries     %zu, k %zu, %zu threads\n", nqueries, k,
+         vdb_thread_count());
+  printf("mean        %.1f us\n", (double)total / (double)nqueries);
+  printf("p50         %llu us\n", (unsigned long long)times[nqueries / 2]);
+  printf("p99         %llu us\n",
+         (unsigned long long)times[nqueries * 99 / 100]);
+  printf("throughput  %.1f queries/s\n",
+         total ? (double)nqueries * 1e6 / (double)total : 0.0);
+
+  VDB_FREE(times);
+  vdb_destroy(db);
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: vdbctl info FILE\n"
+          "       vdbctl verify FILE\n"
+          "       vdbctl dump FILE [rows]\n"
+          "       vdbctl compact IN OUT\n"
+          "       vdbctl merge [-k all|first|last] OUT IN...\n"
+          "       vdbctl bench FILE [queries] [k]\n");
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+
+  const char* cmd = argv[1];
+  if (strcmp(cmd, "info") == 0 && argc == 3)
+    return cmd_info(argv[2]);
+  if (strcmp(cmd, "verify") == 0 && argc == 3)
+    return cmd_verify(argv[2]);
+  if (strcmp(cmd, "dump") == 0 && argc <= 4)
+    return cmd_dump(argv[2],
+                    argc == 4 ? (size_t)strtoul(argv[3], NULL, 10) : SIZE_MAX);
+  if (strcmp(cmd, "compact") == 0 && argc == 4)
+    return cmd_compact(argv[2], argv[3]);
+  if (strcmp(cmd, "merge") == 0) {
+    vdb_merge_policy policy = VDB_MERGE_KEEP_ALL;
+    int first = 2;
+    if (argc > 3 && strcmp(argv[2], "-k") == 0) {
+      if (strcmp(argv[3], "first") == 0)
+        policy = VDB_MERGE_KEEP_FIRST;
+      else if (strcmp(argv[3], "last") == 0)
+        policy = VDB_MERGE_KEEP_LAST;
+      else if (strcmp(argv[3], "all") != 0)
+        first = argc;
+      first += 2;
+    }
+    if (argc - first >= 2)
+      return cmd_merge(argv[first], argv + first + 1, argc - first - 1,
+                       policy);
+  }
+  if (strcmp(cmd, "bench") == 0 && argc <= 5) {
+    size_t nqueries = argc >= 4 ? (size_t)strtoul(argv[3], NULL, 10) : 1000;
+    size_t k = argc == 5 ? (size_t)strtoul(argv[4], NULL, 10) : 10;
+    if (nqueries > 0 && k > 0)
+      return cmd_bench(argv[2], nqueries, k);
+  }
+
+  usage();
+  return 1;
+}